@@ -0,0 +1,148 @@
+#include <winsock2.h>
+#include <windows.h>
+#ifdef _DEBUG
+#include <crtdbg.h>
+#endif
+
+#include "Common.h"
+#include "BufferPool.h"
+#include "Arena.h"
+
+// A buffer chained to an arena for allocations that didn't fit
+struct ArenaBlock
+{
+    ArenaBlock* next;
+    size_t size;
+};
+
+// Lives at the start of the arena's buffer
+struct Arena
+{
+    char* next;
+    char* limit;
+    ArenaBlock* blocks; // the chained buffers, the newest first
+    Arena* nextFree;
+};
+
+#define ARENA_ALIGN(size) (((size) + 7) & ~(size_t)7)
+#define ARENA_DATA(arena) ((char*)(arena) + ARENA_ALIGN(sizeof(Arena)))
+
+static __declspec(thread) Arena* freeArenas = NULL;
+static __declspec(thread) UINT freeArenaCount = 0;
+
+Arena* ArenaAcquire()
+{
+    Arena* arena = freeArenas;
+    if(arena)
+    {
+        freeArenas = arena->nextFree;
+        freeArenaCount--;
+        return arena;
+    }
+    arena = (Arena*)BufferPoolAlloc(ARENA_SIZE);
+    if(!arena)
+    {
+        return NULL;
+    }
+    arena->next = ARENA_DATA(arena);
+    arena->limit = (char*)arena + ARENA_SIZE;
+    arena->blocks = NULL;
+    return arena;
+}
+
+void* ArenaAlloc(Arena* arena, size_t size)
+{
+    size = ARENA_ALIGN(size);
+    if(size > (size_t)(arena->limit - arena->next))
+    {
+        size_t blockSize = BufferPoolRoundSize(ARENA_ALIGN(sizeof(ArenaBlock)) + size);
+        if(blockSize == 0)
+        {
+            return NULL; // larger than the largest buffer pool size
+        }
+        ArenaBlock* block = (ArenaBlock*)BufferPoolAlloc(blockSize);
+        if(!block)
+        {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->size = blockSize;
+        arena->blocks = block;
+        arena->next = (char*)block + ARENA_ALIGN(sizeof(ArenaBlock));
+        arena->limit = (char*)block + blockSize;
+    }
+    void* memory = arena->next;
+    arena->next += size;
+    return memory;
+}
+
+void ArenaRelease(Arena* arena)
+{
+    while(arena->blocks)
+    {
+        ArenaBlock* block = arena->blocks;
+        arena->blocks = block->next;
+        BufferPoolFree((char*)block, block->size);
+    }
+    if(freeArenaCount >= ARENA_THREAD_CACHE)
+    {
+        BufferPoolFree((char*)arena, ARENA_SIZE);
+        return;
+    }
+    arena->next = ARENA_DATA(arena);
+    arena->limit = (char*)arena + ARENA_SIZE;
+    arena->nextFree = freeArenas;
+    freeArenas = arena;
+    freeArenaCount++;
+}
+
+#ifdef _DEBUG
+
+static __declspec(thread) UINT requestDepth = 0;
+static volatile LONG64 requestHeapCalls = 0;
+
+static int __cdecl CountRequestHeapCalls(int allocType, void* userData, size_t size, int blockType,
+    long requestNumber, const unsigned char* filename, int lineNumber)
+{
+    // Blocks the CRT allocates for itself (stdio buffers and such) aren't ours
+    if(requestDepth && blockType != _CRT_BLOCK)
+    {
+        InterlockedIncrement64(&requestHeapCalls);
+    }
+    return TRUE;
+}
+
+void ArenaInit()
+{
+    _CrtSetAllocHook(&CountRequestHeapCalls);
+}
+void ArenaRequestBegin()
+{
+    requestDepth++;
+}
+void ArenaRequestEnd()
+{
+    requestDepth--;
+}
+UINT64 ArenaHeapCalls()
+{
+    return (UINT64)requestHeapCalls;
+}
+
+#else
+
+void ArenaInit()
+{
+}
+void ArenaRequestBegin()
+{
+}
+void ArenaRequestEnd()
+{
+}
+UINT64 ArenaHeapCalls()
+{
+    return ARENA_HEAP_CALLS_UNKNOWN;
+}
+
+#endif
@@ -0,0 +1,75 @@
+#pragma once
+
+//
+// Request Arenas
+// --------------------------------------------------------
+// Memory a call needs until its reply is sent (deferred replies, and
+// anything else a handler builds for one call) comes from an arena attached
+// to the call.  An arena is a bump pointer over a buffer pool buffer, an
+// allocation that doesn't fit chains another buffer, and the whole arena is
+// reset at once when the reply is sent.
+//
+// Every thread keeps a free list of up to ARENA_THREAD_CACHE reset arenas,
+// an arena that is released past that goes back to the buffer pool, which
+// moves it to the threads that need it.  So the request path takes no locks
+// for its memory and never calls malloc or free.
+//
+// State that outlives a call (handles, directory snapshots, gathered writes)
+// is still allocated from the heap when it is first created.  Debug builds
+// (build.cmd debug) count every heap call made while a thread is handling a
+// call, the test checks that repeated calls make none.
+//
+
+// Application can override the size of an arena, a buffer pool size
+#ifndef ARENA_SIZE
+#define ARENA_SIZE (8*1024)
+#endif
+
+// Application can override how many free arenas each thread keeps
+#ifndef ARENA_THREAD_CACHE
+#define ARENA_THREAD_CACHE 16
+#endif
+
+// Returned by ArenaHeapCalls when the build can't count heap calls
+#define ARENA_HEAP_CALLS_UNKNOWN 0xFFFFFFFFFFFFFFFFULL
+
+struct Arena;
+
+// Installs the heap call counter in debug builds
+// Note: BufferPoolInit must have been called
+void ArenaInit();
+
+// Returns: a reset arena, NULL if out of memory
+Arena* ArenaAcquire();
+
+// Returns: size bytes aligned to 8 that live until the arena is released,
+//          NULL if out of memory or size doesn't fit in the largest buffer
+//          pool size
+void* ArenaAlloc(Arena* arena, size_t size);
+
+// Resets the arena and puts it on the calling thread's free list, it can be
+// released by any thread
+void ArenaRelease(Arena* arena);
+
+// Heap calls made by a thread between ArenaRequestBegin and ArenaRequestEnd
+// are counted in debug builds
+void ArenaRequestBegin();
+void ArenaRequestEnd();
+
+// Marks the calling thread as handling a call while it is in scope
+class ArenaRequestScope
+{
+public:
+    ArenaRequestScope()
+    {
+        ArenaRequestBegin();
+    }
+    ~ArenaRequestScope()
+    {
+        ArenaRequestEnd();
+    }
+};
+
+// Returns: the heap calls made while handling calls, ARENA_HEAP_CALLS_UNKNOWN
+//          if this build doesn't count them
+UINT64 ArenaHeapCalls();
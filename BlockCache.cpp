@@ -0,0 +1,405 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Common.h"
+#include "Rpc.h"
+#include "BufferPool.h"
+#include "BlockCache.h"
+
+enum BlockList : BYTE
+{
+    LIST_T1 = 0, // cached, read once recently
+    LIST_T2 = 1, // cached, read more than once recently
+    LIST_B1 = 2, // evicted from T1, only the key is kept
+    LIST_B2 = 3, // evicted from T2, only the key is kept
+    LIST_COUNT = 4,
+};
+
+struct CacheBlock
+{
+    UINT handle;
+    UINT64 blockIndex;
+    UINT64 changeTime;
+    char* data; // NULL for B1 and B2
+    UINT length;
+    BlockList list;
+    CacheBlock* lessRecent;
+    CacheBlock* moreRecent;
+    CacheBlock* hashNext;
+};
+
+// The change time of a block that has to be read again, no file has it
+#define BLOCK_CHANGE_TIME_INVALID ((UINT64)-1)
+
+struct CacheList
+{
+    CacheBlock* leastRecent;
+    CacheBlock* mostRecent;
+    UINT count;
+};
+
+static CacheList lists[LIST_COUNT];
+static UINT capacity; // the number of blocks that can be cached (c in the ARC paper)
+static UINT target;   // the target size of T1 (p in the ARC paper)
+
+// Every block (cached or not) is one of these entries, there are never more
+// than 2c entries
+static CacheBlock* entries;
+static CacheBlock* freeEntries;
+static CacheBlock** buckets;
+static UINT bucketMask;
+
+BlockCacheStats blockCacheStats;
+
+static UINT HashKey(UINT handle, UINT64 blockIndex)
+{
+    UINT64 hash = ((UINT64)handle << 32 ^ blockIndex) * 0x9E3779B97F4A7C15ULL;
+    return (UINT)(hash >> 32) & bucketMask;
+}
+
+static CacheBlock* Find(UINT handle, UINT64 blockIndex)
+{
+    for(CacheBlock* block = buckets[HashKey(handle, blockIndex)]; block; block = block->hashNext)
+    {
+        if(block->handle == handle && block->blockIndex == blockIndex)
+        {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static void Unlink(CacheBlock* block)
+{
+    CacheList* list = &lists[block->list];
+    if(block->lessRecent)
+    {
+        block->lessRecent->moreRecent = block->moreRecent;
+    }
+    else
+    {
+        list->leastRecent = block->moreRecent;
+    }
+    if(block->moreRecent)
+    {
+        block->moreRecent->lessRecent = block->lessRecent;
+    }
+    else
+    {
+        list->mostRecent = block->lessRecent;
+    }
+    list->count--;
+}
+
+static void PushMostRecent(BlockList listIndex, CacheBlock* block)
+{
+    CacheList* list = &lists[listIndex];
+    block->list = listIndex;
+    block->lessRecent = list->mostRecent;
+    block->moreRecent = NULL;
+    if(list->mostRecent)
+    {
+        list->mostRecent->moreRecent = block;
+    }
+    else
+    {
+        list->leastRecent = block;
+    }
+    list->mostRecent = block;
+    list->count++;
+}
+
+static void FreeData(CacheBlock* block)
+{
+    if(block->data)
+    {
+        BufferPoolFree(block->data, BLOCK_CACHE_BLOCK_SIZE);
+        block->data = NULL;
+    }
+}
+
+// Removes the block from the cache completely
+static void Delete(CacheBlock* block)
+{
+    Unlink(block);
+    FreeData(block);
+    CacheBlock** link = &buckets[HashKey(block->handle, block->blockIndex)];
+    while(*link != block)
+    {
+        link = &(*link)->hashNext;
+    }
+    *link = block->hashNext;
+    block->hashNext = freeEntries;
+    freeEntries = block;
+}
+
+// Evicts the least recent block of a cached list, only its key is kept
+static void Evict(BlockList from, BlockList to)
+{
+    CacheBlock* block = lists[from].leastRecent;
+    Unlink(block);
+    FreeData(block);
+    PushMostRecent(to, block);
+}
+
+// REPLACE from the ARC paper, evicts a block from T1 or T2 depending on
+// the target size of T1
+static void Replace(bool requestInB2)
+{
+    UINT t1Count = lists[LIST_T1].count;
+    if(t1Count > 0 && ((requestInB2 && t1Count == target) || t1Count > target || lists[LIST_T2].count == 0))
+    {
+        Evict(LIST_T1, LIST_B1);
+    }
+    else if(lists[LIST_T2].count > 0)
+    {
+        Evict(LIST_T2, LIST_B2);
+    }
+}
+
+// Returns: non-zero on error
+static DWORD ReadBlock(CacheBlock* block, HANDLE file)
+{
+    if(!block->data)
+    {
+        block->data = BufferPoolAlloc(BLOCK_CACHE_BLOCK_SIZE);
+        if(!block->data)
+        {
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+    UINT64 offset = block->blockIndex << BLOCK_CACHE_BLOCK_SHIFT;
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset     = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD read;
+    if(!ReadFile(file, block->data, BLOCK_CACHE_BLOCK_SIZE, &read, &overlapped))
+    {
+        DWORD error = GetLastError();
+        if(error != ERROR_HANDLE_EOF)
+        {
+            return error;
+        }
+        read = 0;
+    }
+    block->length = read;
+    return 0;
+}
+
+int BlockCacheInit(UINT memoryLimit)
+{
+    capacity = memoryLimit >> BLOCK_CACHE_BLOCK_SHIFT;
+    if(capacity == 0)
+    {
+        LOG_ERROR("[CACHE] a memory limit of %u bytes can't hold a single %u byte block",
+            memoryLimit, BLOCK_CACHE_BLOCK_SIZE);
+        return 1;
+    }
+    target = 0;
+    memset(lists, 0, sizeof(lists));
+
+    entries = (CacheBlock*)malloc(2 * capacity * sizeof(CacheBlock));
+    UINT bucketCount = 1;
+    while(bucketCount < 2 * capacity)
+    {
+        bucketCount <<= 1;
+    }
+    buckets = (CacheBlock**)malloc(bucketCount * sizeof(CacheBlock*));
+    if(!entries || !buckets)
+    {
+        LOG_ERROR("[CACHE] out of memory for %u blocks", capacity);
+        return 1;
+    }
+    memset(buckets, 0, bucketCount * sizeof(CacheBlock*));
+    bucketMask = bucketCount - 1;
+
+    freeEntries = NULL;
+    for(UINT i = 2 * capacity; i > 0; i--)
+    {
+        entries[i - 1].data = NULL;
+        entries[i - 1].hashNext = freeEntries;
+        freeEntries = &entries[i - 1];
+    }
+    LOG("[CACHE] %u blocks of %u bytes", capacity, BLOCK_CACHE_BLOCK_SIZE);
+    return 0;
+}
+
+char* BlockCacheLookup(UINT handle, UINT64 blockIndex, UINT64 changeTime, UINT* outLength)
+{
+    CacheBlock* block = Find(handle, blockIndex);
+    if(!block || (block->list != LIST_T1 && block->list != LIST_T2) || block->changeTime != changeTime)
+    {
+        return NULL;
+    }
+    // Case I: the block is cached
+    blockCacheStats.hits++;
+    Unlink(block);
+    PushMostRecent(LIST_T2, block);
+    *outLength = block->length;
+    return block->data;
+}
+
+// Makes room for a block that missed and links it into the list it goes in,
+// a cached block whose file changed stays where it is
+// Returns: the block, its data has to be filled in
+static CacheBlock* Admit(UINT handle, UINT64 blockIndex)
+{
+    CacheBlock* block = Find(handle, blockIndex);
+    if(block && (block->list == LIST_T1 || block->list == LIST_T2))
+    {
+        // Case I: the block is cached, but its file has changed
+        blockCacheStats.staleHits++;
+        Unlink(block);
+        PushMostRecent(LIST_T2, block);
+        return block;
+    }
+
+    blockCacheStats.misses++;
+    BlockList list;
+    if(block)
+    {
+        // Case II and III: the block was evicted recently, grow the list it
+        // was evicted from
+        blockCacheStats.ghostHits++;
+        UINT b1Count = lists[LIST_B1].count;
+        UINT b2Count = lists[LIST_B2].count;
+        bool inB2 = (block->list == LIST_B2);
+        if(inB2)
+        {
+            UINT delta = (b1Count > b2Count) ? b1Count / b2Count : 1;
+            target = (target > delta) ? target - delta : 0;
+        }
+        else
+        {
+            UINT delta = (b2Count > b1Count) ? b2Count / b1Count : 1;
+            target = (target + delta < capacity) ? target + delta : capacity;
+        }
+        Unlink(block);
+        if(lists[LIST_T1].count + lists[LIST_T2].count >= capacity)
+        {
+            Replace(inB2);
+        }
+        list = LIST_T2;
+    }
+    else
+    {
+        // Case IV: the block is new
+        UINT l1Count = lists[LIST_T1].count + lists[LIST_B1].count;
+        UINT total = l1Count + lists[LIST_T2].count + lists[LIST_B2].count;
+        if(l1Count >= capacity)
+        {
+            if(lists[LIST_T1].count < capacity)
+            {
+                Delete(lists[LIST_B1].leastRecent);
+                Replace(false);
+            }
+            else
+            {
+                Delete(lists[LIST_T1].leastRecent);
+            }
+        }
+        else if(total >= capacity)
+        {
+            if(total >= 2 * capacity)
+            {
+                Delete(lists[LIST_B2].leastRecent);
+            }
+            if(lists[LIST_T1].count + lists[LIST_T2].count >= capacity)
+            {
+                Replace(false);
+            }
+        }
+
+        block = freeEntries;
+        freeEntries = block->hashNext;
+        block->handle = handle;
+        block->blockIndex = blockIndex;
+        block->data = NULL;
+        UINT bucket = HashKey(handle, blockIndex);
+        block->hashNext = buckets[bucket];
+        buckets[bucket] = block;
+        list = LIST_T1;
+    }
+
+    PushMostRecent(list, block);
+    return block;
+}
+
+char* BlockCacheGet(UINT handle, HANDLE file, UINT64 blockIndex, UINT64 changeTime,
+                    UINT* outLength, DWORD* outError)
+{
+    char* data = BlockCacheLookup(handle, blockIndex, changeTime, outLength);
+    if(data)
+    {
+        return data;
+    }
+    CacheBlock* block = Admit(handle, blockIndex);
+    DWORD error = ReadBlock(block, file);
+    if(error)
+    {
+        Delete(block);
+        *outError = error;
+        return NULL;
+    }
+    block->changeTime = changeTime;
+    *outLength = block->length;
+    return block->data;
+}
+
+void BlockCachePut(UINT handle, UINT64 blockIndex, UINT64 changeTime, char* data, UINT length)
+{
+    CacheBlock* block = Find(handle, blockIndex);
+    if(block && (block->list == LIST_T1 || block->list == LIST_T2) && block->changeTime == changeTime)
+    {
+        return; // another READ cached it first
+    }
+    block = Admit(handle, blockIndex);
+    if(!block->data)
+    {
+        block->data = BufferPoolAlloc(BLOCK_CACHE_BLOCK_SIZE);
+        if(!block->data)
+        {
+            Delete(block);
+            return;
+        }
+    }
+    memcpy(block->data, data, length);
+    block->length = length;
+    block->changeTime = changeTime;
+}
+
+void BlockCacheInvalidate(UINT handle, UINT64 offset, UINT64 length)
+{
+    if(length == 0)
+    {
+        return;
+    }
+    UINT64 lastIndex = (offset + length - 1) >> BLOCK_CACHE_BLOCK_SHIFT;
+    for(UINT64 blockIndex = offset >> BLOCK_CACHE_BLOCK_SHIFT; blockIndex <= lastIndex; blockIndex++)
+    {
+        CacheBlock* block = Find(handle, blockIndex);
+        if(block && (block->list == LIST_T1 || block->list == LIST_T2))
+        {
+            block->changeTime = BLOCK_CHANGE_TIME_INVALID;
+        }
+    }
+}
+
+UINT BlockCacheEncode(char* buffer, UINT maxLength)
+{
+    UINT length = 4 + 4 * 8;
+    if(length > maxLength)
+    {
+        return 0;
+    }
+    AppendUint  (buffer +  0, capacity);
+    AppendUint64(buffer +  4, blockCacheStats.hits);
+    AppendUint64(buffer + 12, blockCacheStats.misses);
+    AppendUint64(buffer + 20, blockCacheStats.staleHits);
+    AppendUint64(buffer + 28, blockCacheStats.ghostHits);
+    return length;
+}
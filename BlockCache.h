@@ -0,0 +1,66 @@
+#pragma once
+
+//
+// Block Cache
+// --------------------------------------------------------
+// An optional cache of file data for READ, made of fixed size blocks keyed
+// by (file handle, block index).  Every block remembers the change time of
+// the file when it was read, a block whose file has changed since is read
+// again.
+//
+// Blocks are replaced with ARC (Adaptive Replacement Cache).  Blocks that
+// were read once (T1) and blocks that were read more than once (T2) are kept
+// in separate lists, and the split between them adapts using the keys of
+// recently evicted blocks (B1 and B2).  A large file that is streamed once
+// only passes through T1, so it can't push out small files that are read
+// over and over.
+//
+// The stats are served by the BLOCK_CACHE procedure of the stats program,
+// which returns the blocks the cache can hold (uint, 0 when it is off), then
+// hits, misses, stale hits and ghost hits (uint64s).
+//
+// NOTE: the functions in this file are only called from the select thread
+//
+
+// Application can override the block size, it must be a buffer pool size
+#ifndef BLOCK_CACHE_BLOCK_SHIFT
+#define BLOCK_CACHE_BLOCK_SHIFT 16 // 64 KB
+#endif
+#define BLOCK_CACHE_BLOCK_SIZE ((UINT)1 << BLOCK_CACHE_BLOCK_SHIFT)
+
+struct BlockCacheStats
+{
+    UINT64 hits;
+    UINT64 misses;
+    UINT64 staleHits;  // the block was cached but its file had changed
+    UINT64 ghostHits;  // the block was recently evicted
+};
+extern BlockCacheStats blockCacheStats;
+
+// memoryLimit is rounded down to a whole number of blocks
+// Returns: non-zero on error
+int BlockCacheInit(UINT memoryLimit);
+
+// Returns: the data of the block (outLength bytes, less than a full block
+//          only at the end of the file), NULL if it couldn't be read
+//          (outError is set)
+// Note: the data is only valid until the next call
+char* BlockCacheGet(UINT handle, HANDLE file, UINT64 blockIndex, UINT64 changeTime,
+                    UINT* outLength, DWORD* outError);
+
+// Same as BlockCacheGet, but a block that isn't cached isn't read
+// Returns: the data of the block, NULL if it isn't cached with changeTime
+char* BlockCacheLookup(UINT handle, UINT64 blockIndex, UINT64 changeTime, UINT* outLength);
+
+// Caches a block that was read without the cache (by a file system worker),
+// length is less than a full block only at the end of the file
+void BlockCachePut(UINT handle, UINT64 blockIndex, UINT64 changeTime, char* data, UINT length);
+
+// Makes the cached blocks of the handle that overlap length bytes at offset
+// be read again the next time they are used, for writes the change time of
+// the file doesn't show yet
+void BlockCacheInvalidate(UINT handle, UINT64 offset, UINT64 length);
+
+// Writes the stats in the format of the BLOCK_CACHE procedure
+// Returns: the length written, 0 if they don't fit in maxLength
+UINT BlockCacheEncode(char* buffer, UINT maxLength);
@@ -0,0 +1,270 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+
+#include "Common.h"
+#include "BufferPool.h"
+
+// Slabs are never smaller than this, large pages are usually 2 MB
+#define BUFFER_POOL_MIN_SLAB_SIZE (2*1024*1024)
+
+// Free buffers are linked through their first bytes
+struct FreeBuffer
+{
+    FreeBuffer* next;
+};
+
+struct SizeClass
+{
+    // NOTE: only read/modify the free list inside the critical section
+    CRITICAL_SECTION criticalSection;
+    FreeBuffer* freeList;
+    size_t freeCount;
+    size_t slabCount;
+};
+
+struct ThreadCache
+{
+    FreeBuffer* list[BUFFER_POOL_CLASS_COUNT];
+    UINT count[BUFFER_POOL_CLASS_COUNT];
+};
+
+static SizeClass sizeClasses[BUFFER_POOL_CLASS_COUNT];
+static __declspec(thread) ThreadCache threadCache;
+
+static bool largePagesEnabled = false;
+static size_t slabGranularity = BUFFER_POOL_MIN_SLAB_SIZE;
+
+// Returns: the size class index for size, -1 if size is too large
+static int SizeClassIndex(size_t size)
+{
+    if(size > BUFFER_POOL_MAX_BUFFER_SIZE)
+    {
+        return -1;
+    }
+    int shift = BUFFER_POOL_MIN_SHIFT;
+    while(((size_t)1 << shift) < size)
+    {
+        shift++;
+    }
+    return shift - BUFFER_POOL_MIN_SHIFT;
+}
+
+static UINT ThreadCacheLimit(int index)
+{
+    UINT limit = (UINT)(BUFFER_POOL_THREAD_CACHE_BYTES >> (index + BUFFER_POOL_MIN_SHIFT));
+    return limit ? limit : 1;
+}
+
+// Large pages can only be allocated by a process that has SeLockMemoryPrivilege
+// enabled in its token (the account must be granted "Lock pages in memory")
+static bool EnableLockMemoryPrivilege()
+{
+    HANDLE token;
+    if(!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+    {
+        LOG_ERROR("OpenProcessToken failed (e=%d)", GetLastError());
+        return false;
+    }
+
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    bool enabled = false;
+    if(!LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid))
+    {
+        LOG_ERROR("LookupPrivilegeValue failed (e=%d)", GetLastError());
+    }
+    else if(!AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL))
+    {
+        LOG_ERROR("AdjustTokenPrivileges failed (e=%d)", GetLastError());
+    }
+    else
+    {
+        // AdjustTokenPrivileges succeeds even if the privilege was not assigned
+        enabled = (GetLastError() == ERROR_SUCCESS);
+    }
+    CloseHandle(token);
+    return enabled;
+}
+
+int BufferPoolInit(bool useLargePages)
+{
+    for(int i = 0; i < BUFFER_POOL_CLASS_COUNT; i++)
+    {
+        InitializeCriticalSection(&sizeClasses[i].criticalSection);
+        sizeClasses[i].freeList = NULL;
+        sizeClasses[i].freeCount = 0;
+        sizeClasses[i].slabCount = 0;
+    }
+
+    if(useLargePages)
+    {
+        size_t largePageSize = GetLargePageMinimum();
+        if(largePageSize == 0)
+        {
+            LOG("[POOL] large pages are not supported on this system");
+        }
+        else if(!EnableLockMemoryPrivilege())
+        {
+            LOG("[POOL] large pages disabled, account does not have the 'Lock pages in memory' privilege");
+        }
+        else
+        {
+            largePagesEnabled = true;
+            slabGranularity = (BUFFER_POOL_MIN_SLAB_SIZE + largePageSize - 1) / largePageSize * largePageSize;
+        }
+    }
+    LOG("[POOL] buffer sizes %u to %u bytes, slab size %u bytes, large pages %s",
+        (UINT)BUFFER_POOL_MIN_BUFFER_SIZE, (UINT)BUFFER_POOL_MAX_BUFFER_SIZE,
+        (UINT)slabGranularity, largePagesEnabled ? "on" : "off");
+    return 0;
+}
+
+size_t BufferPoolRoundSize(size_t size)
+{
+    int index = SizeClassIndex(size);
+    return (index < 0) ? 0 : (BUFFER_POOL_MIN_BUFFER_SIZE << index);
+}
+
+static char* AllocateSlab(size_t size)
+{
+    if(largePagesEnabled)
+    {
+        char* slab = (char*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if(slab)
+        {
+            return slab;
+        }
+        // Physical memory gets fragmented over time, so large pages can
+        // run out even when there is plenty of memory
+        LOG_ERROR("[POOL] large page allocation of %u bytes failed (e=%d), using regular pages",
+            (UINT)size, GetLastError());
+    }
+    return (char*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+// Assumption: inside the size class critical section
+// Returns: non-zero if out of memory
+static int GrowSizeClass(int index)
+{
+    SizeClass* sizeClass = &sizeClasses[index];
+    size_t bufferSize = BUFFER_POOL_MIN_BUFFER_SIZE << index;
+    size_t slabSize = (bufferSize + slabGranularity - 1) / slabGranularity * slabGranularity;
+
+    char* slab = AllocateSlab(slabSize);
+    if(!slab)
+    {
+        LOG_ERROR("[POOL] VirtualAlloc(%u) failed (e=%d)", (UINT)slabSize, GetLastError());
+        return 1;
+    }
+    for(size_t offset = 0; offset + bufferSize <= slabSize; offset += bufferSize)
+    {
+        FreeBuffer* buffer = (FreeBuffer*)(slab + offset);
+        buffer->next = sizeClass->freeList;
+        sizeClass->freeList = buffer;
+        sizeClass->freeCount++;
+    }
+    sizeClass->slabCount++;
+    LOG_DEBUG("[POOL] added %u byte slab for %u byte buffers (%u slabs)",
+        (UINT)slabSize, (UINT)bufferSize, (UINT)sizeClass->slabCount);
+    return 0;
+}
+
+// Moves a batch of buffers from the global free list to the thread cache
+// Returns: non-zero if out of memory
+static int RefillThreadCache(int index)
+{
+    SizeClass* sizeClass = &sizeClasses[index];
+    UINT batch = ThreadCacheLimit(index) / 2;
+    if(batch == 0)
+    {
+        batch = 1;
+    }
+
+    EnterCriticalSection(&sizeClass->criticalSection);
+    if(sizeClass->freeCount == 0 && GrowSizeClass(index))
+    {
+        LeaveCriticalSection(&sizeClass->criticalSection);
+        return 1;
+    }
+    UINT moved = 0;
+    while(moved < batch && sizeClass->freeList)
+    {
+        FreeBuffer* buffer = sizeClass->freeList;
+        sizeClass->freeList = buffer->next;
+        buffer->next = threadCache.list[index];
+        threadCache.list[index] = buffer;
+        moved++;
+    }
+    sizeClass->freeCount -= moved;
+    LeaveCriticalSection(&sizeClass->criticalSection);
+
+    threadCache.count[index] += moved;
+    return 0;
+}
+
+// Moves count buffers from the thread cache back to the global free list
+static void DrainThreadCache(int index, UINT count)
+{
+    if(count == 0)
+    {
+        return;
+    }
+    FreeBuffer* first = threadCache.list[index];
+    FreeBuffer* last = first;
+    for(UINT i = 1; i < count; i++)
+    {
+        last = last->next;
+    }
+    threadCache.list[index] = last->next;
+    threadCache.count[index] -= count;
+
+    SizeClass* sizeClass = &sizeClasses[index];
+    EnterCriticalSection(&sizeClass->criticalSection);
+    last->next = sizeClass->freeList;
+    sizeClass->freeList = first;
+    sizeClass->freeCount += count;
+    LeaveCriticalSection(&sizeClass->criticalSection);
+}
+
+char* BufferPoolAlloc(size_t size)
+{
+    int index = SizeClassIndex(size);
+    if(index < 0)
+    {
+        LOG_ERROR("[POOL] buffer of %u bytes is larger than the largest size class", (UINT)size);
+        return NULL;
+    }
+    if(threadCache.list[index] == NULL && RefillThreadCache(index))
+    {
+        return NULL;
+    }
+    FreeBuffer* buffer = threadCache.list[index];
+    threadCache.list[index] = buffer->next;
+    threadCache.count[index]--;
+    return (char*)buffer;
+}
+
+void BufferPoolFree(char* buffer, size_t size)
+{
+    int index = SizeClassIndex(size);
+    FreeBuffer* freeBuffer = (FreeBuffer*)buffer;
+    freeBuffer->next = threadCache.list[index];
+    threadCache.list[index] = freeBuffer;
+    threadCache.count[index]++;
+
+    if(threadCache.count[index] > ThreadCacheLimit(index))
+    {
+        DrainThreadCache(index, threadCache.count[index] / 2);
+    }
+}
+
+void BufferPoolFlushThreadCache()
+{
+    for(int i = 0; i < BUFFER_POOL_CLASS_COUNT; i++)
+    {
+        DrainThreadCache(i, threadCache.count[i]);
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+//
+// Buffer Pool
+// --------------------------------------------------------
+// Hands out buffers in power-of-two size classes from 4 KB up to
+// BUFFER_POOL_MAX_BUFFER_SIZE.  Buffers are carved out of large slabs that
+// are never returned to the OS, so steady state allocation never touches
+// the heap.  Slabs are backed by large pages when they are enabled and the
+// process holds SeLockMemoryPrivilege, otherwise by regular pages.
+//
+// Every thread keeps a small cache of free buffers per size class, the
+// global free lists (and their lock) are only touched when a thread cache
+// runs empty or overflows.
+//
+// Buffers are always aligned to at least 4 KB, so they can be used for
+// unbuffered file I/O.
+//
+#define BUFFER_POOL_MIN_SHIFT 12 // 4 KB
+#define BUFFER_POOL_MAX_SHIFT 22 // 4 MB
+#define BUFFER_POOL_CLASS_COUNT (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_MIN_BUFFER_SIZE ((size_t)1 << BUFFER_POOL_MIN_SHIFT)
+#define BUFFER_POOL_MAX_BUFFER_SIZE ((size_t)1 << BUFFER_POOL_MAX_SHIFT)
+
+// Application can override how many bytes each thread may cache per size class
+#ifndef BUFFER_POOL_THREAD_CACHE_BYTES
+#define BUFFER_POOL_THREAD_CACHE_BYTES (4*1024*1024)
+#endif
+
+// Returns: non-zero on error
+// Note: must be called before any other BufferPool function
+int BufferPoolInit(bool useLargePages);
+
+// Returns: the size of the buffer that BufferPoolAlloc would return for size
+size_t BufferPoolRoundSize(size_t size);
+
+// Returns: a buffer of at least size bytes, NULL if size is too large
+//          or the system is out of memory
+char* BufferPoolAlloc(size_t size);
+
+// size must be the size that was passed to BufferPoolAlloc (or any size
+// that rounds to the same size class)
+void BufferPoolFree(char* buffer, size_t size);
+
+// Moves the calling thread's cached buffers back to the global free lists,
+// threads that use the pool should call this before they exit
+void BufferPoolFlushThreadCache();
@@ -1,42 +1,40 @@
-#pragma once
-
-#define LOG_ERROR(fmt,...) printf("Error: " fmt "\r\n",##__VA_ARGS__)
-#define LOG_DEBUG(fmt,...) printf("Debug: " fmt "\r\n",##__VA_ARGS__)
-#define LOG(fmt,...)       printf(fmt "\r\n",##__VA_ARGS__)
-
-#define LOG_NET(fmt,...)   //printf("[NET] " fmt "\r\n",##__VA_ARGS__)
-#define LOG_RPC(fmt,...)   //printf("[RPC] " fmt "\r\n",##__VA_ARGS__)
-
-class Wsa
-{
-  public:
-    int error;
-    Wsa()
-    {
-        WSADATA data;
-        error = WSAStartup(MAKEWORD(2, 2), &data);
-    }
-    ~Wsa()
-    {
-        if(error == 0) {
-            WSACleanup();
-        }
-    }
-};
-
-struct String
-{
-    char* ptr;
-    UINT length;
-    String() : ptr(NULL), length(0)
-    {
-    }
-    String(char* ptr, UINT length) : ptr(ptr), length(length)
-    {
-    }
-    bool Equals(String other)
-    {
-        return this->length == other.length &&
-          memcmp(this->ptr, other.ptr, other.length) == 0;
-    }
+#pragma once
+
+#include "Log.h"
+
+#define LITERAL_LENGTH(str) (sizeof(str)-1)
+#define STATIC_ARRAY_LENGTH(arr) (sizeof(arr)/sizeof(arr[0]))
+
+class Wsa
+{
+  public:
+    int error;
+    Wsa()
+    {
+        WSADATA data;
+        error = WSAStartup(MAKEWORD(2, 2), &data);
+    }
+    ~Wsa()
+    {
+        if(error == 0) {
+            WSACleanup();
+        }
+    }
+};
+
+struct String
+{
+    char* ptr;
+    UINT length;
+    String() : ptr(NULL), length(0)
+    {
+    }
+    String(char* ptr, UINT length) : ptr(ptr), length(length)
+    {
+    }
+    bool Equals(String other)
+    {
+        return this->length == other.length &&
+          memcmp(this->ptr, other.ptr, other.length) == 0;
+    }
 };
\ No newline at end of file
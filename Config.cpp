@@ -0,0 +1,608 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Common.h"
+#include "Rpc.h"
+#include "BufferPool.h"
+#include "Config.h"
+
+#define DEFAULT_MAX_TRANSFER_SIZE       (1024*1024)
+#define DEFAULT_PREFERRED_TRANSFER_SIZE (64*1024)
+#define DEFAULT_DIR_ENUM_THREADS        2
+#define MAX_DIR_ENUM_THREADS            64
+#define DEFAULT_IO_THREADS              4
+#define MAX_IO_THREADS                  64
+#define DEFAULT_WRITE_GATHER_SIZE       (1024*1024)
+#define DEFAULT_WRITE_GATHER_MEMORY     (64*1024*1024)
+#define DEFAULT_WRITE_GATHER_DELAY      50 // milliseconds
+#define MAX_WRITE_GATHER_DELAY          10000
+#define DEFAULT_BLOCK_CACHE_VALIDATE    1000 // milliseconds
+#define MAX_BLOCK_CACHE_VALIDATE        60000
+#define DEFAULT_READ_AHEAD_MIN          (128*1024)
+#define DEFAULT_READ_AHEAD_MAX          (4*1024*1024)
+#define DEFAULT_READ_AHEAD_THREADS      2
+#define MAX_READ_AHEAD_THREADS          64
+#define DEFAULT_DIRECT_IO_MIN_SIZE      (256*1024)
+#define DEFAULT_STREAM_WRITE_CHUNK      (256*1024)
+#define DEFAULT_STALL_THRESHOLD         100 // milliseconds
+#define MAX_STALL_THRESHOLD             60000
+#define DEFAULT_SPAN_SAMPLE             100
+#define MAX_SPAN_SAMPLE                 1000000
+#define DEFAULT_METADATA_WEIGHT         8
+#define DEFAULT_DIRECTORY_WEIGHT        2
+#define DEFAULT_BULK_WEIGHT             1
+#define MAX_SCHEDULER_WEIGHT            1000
+#define DEFAULT_SCHEDULER_MAX_WAIT      100 // milliseconds
+#define MAX_SCHEDULER_MAX_WAIT          60000
+#define DEFAULT_OVERLOAD_QUEUED         4096
+#define MAX_OVERLOAD_QUEUED             1000000
+#define DEFAULT_OVERLOAD_DELAY          50 // milliseconds
+#define MAX_OVERLOAD_DELAY              60000
+#define DEFAULT_CALL_DEADLINE           60000 // milliseconds
+#define MAX_CALL_DEADLINE               600000
+#define DEFAULT_CLIENT_QUANTUM          (64*1024)
+#define MIN_CLIENT_QUANTUM              4096
+#define DEFAULT_CLIENT_MAX_IN_FLIGHT    64
+#define MAX_CLIENT_MAX_IN_FLIGHT        65536
+
+// A record carrying a max size payload must still fit in the largest pool buffer
+#define MAX_TRANSFER_SIZE_LIMIT ((UINT)(BUFFER_POOL_MAX_BUFFER_SIZE - RPC_MAX_CALL_OVERHEAD) & ~(UINT)(BUFFER_POOL_MIN_BUFFER_SIZE - 1))
+
+#define MAX_CONFIG_LINE 1024
+#define MAX_CONFIG_ARGS 8
+
+Config config = {
+    DEFAULT_MAX_TRANSFER_SIZE,
+    DEFAULT_PREFERRED_TRANSFER_SIZE,
+    false, // largePages
+    DEFAULT_DIR_ENUM_THREADS,
+    DEFAULT_IO_THREADS,
+    DEFAULT_WRITE_GATHER_SIZE,
+    DEFAULT_WRITE_GATHER_MEMORY,
+    DEFAULT_WRITE_GATHER_DELAY,
+    0, // blockCacheSize
+    DEFAULT_BLOCK_CACHE_VALIDATE,
+    DEFAULT_READ_AHEAD_MIN,
+    DEFAULT_READ_AHEAD_MAX,
+    DEFAULT_READ_AHEAD_THREADS,
+    true, // sparseReads
+    {}, // directIoExports
+    0, // directIoExportCount
+    DEFAULT_DIRECT_IO_MIN_SIZE,
+    DEFAULT_STREAM_WRITE_CHUNK,
+    NULL, // traceFile
+    DEFAULT_STALL_THRESHOLD,
+    NULL, // spanFile
+    DEFAULT_SPAN_SAMPLE,
+    {DEFAULT_METADATA_WEIGHT, DEFAULT_DIRECTORY_WEIGHT, DEFAULT_BULK_WEIGHT},
+    DEFAULT_SCHEDULER_MAX_WAIT,
+    DEFAULT_OVERLOAD_QUEUED,
+    DEFAULT_OVERLOAD_DELAY,
+    DEFAULT_CALL_DEADLINE,
+    DEFAULT_CLIENT_QUANTUM,
+    DEFAULT_CLIENT_MAX_IN_FLIGHT,
+    {}, // clientLimits
+    0, // clientLimitCount
+};
+
+struct ConfigLine
+{
+    const char* filename;
+    UINT lineNumber;
+    char* args[MAX_CONFIG_ARGS];
+    UINT argCount;
+};
+
+#define CONFIG_ERROR(line, fmt, ...) LOG_ERROR("%s(%u): " fmt, (line)->filename, (line)->lineNumber,##__VA_ARGS__)
+
+// Parses a byte count with an optional K or M suffix
+// Returns: non-zero on error
+static int ParseSize(ConfigLine* line, char* arg, UINT* outSize)
+{
+    char* end;
+    unsigned long value = strtoul(arg, &end, 10);
+    if(end == arg)
+    {
+        CONFIG_ERROR(line, "expected a size but got '%s'", arg);
+        return 1;
+    }
+    unsigned long multiplier = 1;
+    if(*end == 'K' || *end == 'k')
+    {
+        multiplier = 1024;
+        end++;
+    }
+    else if(*end == 'M' || *end == 'm')
+    {
+        multiplier = 1024*1024;
+        end++;
+    }
+    if(*end != '\0')
+    {
+        CONFIG_ERROR(line, "invalid size '%s'", arg);
+        return 1;
+    }
+    if(value > ULONG_MAX / multiplier)
+    {
+        CONFIG_ERROR(line, "%s '%s' is too large", line->args[0], arg);
+        return 1;
+    }
+    value *= multiplier;
+    *outSize = (UINT)value;
+    return 0;
+}
+
+// Returns: non-zero on error
+static int ParseCount(ConfigLine* line, char* arg, UINT min, UINT max, UINT* outCount)
+{
+    char* end;
+    unsigned long value = strtoul(arg, &end, 10);
+    if(end == arg || *end != '\0')
+    {
+        CONFIG_ERROR(line, "expected a number but got '%s'", arg);
+        return 1;
+    }
+    if(value < min || value > max)
+    {
+        CONFIG_ERROR(line, "%s must be between %u and %u", line->args[0], min, max);
+        return 1;
+    }
+    *outCount = (UINT)value;
+    return 0;
+}
+
+// Returns: non-zero on error
+static int ParseOnOff(ConfigLine* line, char* arg, bool* outValue)
+{
+    if(strcmp(arg, "on") == 0)
+    {
+        *outValue = true;
+        return 0;
+    }
+    if(strcmp(arg, "off") == 0)
+    {
+        *outValue = false;
+        return 0;
+    }
+    CONFIG_ERROR(line, "expected 'on' or 'off' but got '%s'", arg);
+    return 1;
+}
+
+static int MaxTransferSizeSetting(ConfigLine* line)
+{
+    return ParseSize(line, line->args[1], &config.maxTransferSize);
+}
+static int PreferredTransferSizeSetting(ConfigLine* line)
+{
+    return ParseSize(line, line->args[1], &config.preferredTransferSize);
+}
+static int LargePagesSetting(ConfigLine* line)
+{
+    return ParseOnOff(line, line->args[1], &config.largePages);
+}
+static int DirEnumThreadsSetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 1, MAX_DIR_ENUM_THREADS, &config.dirEnumThreads);
+}
+static int IoThreadsSetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 0, MAX_IO_THREADS, &config.ioThreads);
+}
+static int WriteGatherSizeSetting(ConfigLine* line)
+{
+    return ParseSize(line, line->args[1], &config.writeGatherSize);
+}
+static int WriteGatherMemorySetting(ConfigLine* line)
+{
+    return ParseSize(line, line->args[1], &config.writeGatherMemory);
+}
+static int WriteGatherDelaySetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 1, MAX_WRITE_GATHER_DELAY, &config.writeGatherDelay);
+}
+static int BlockCacheSizeSetting(ConfigLine* line)
+{
+    return ParseSize(line, line->args[1], &config.blockCacheSize);
+}
+static int BlockCacheValidateSetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 0, MAX_BLOCK_CACHE_VALIDATE, &config.blockCacheValidate);
+}
+static int ReadAheadMinSetting(ConfigLine* line)
+{
+    return ParseSize(line, line->args[1], &config.readAheadMin);
+}
+static int ReadAheadMaxSetting(ConfigLine* line)
+{
+    return ParseSize(line, line->args[1], &config.readAheadMax);
+}
+static int ReadAheadThreadsSetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 1, MAX_READ_AHEAD_THREADS, &config.readAheadThreads);
+}
+static int SparseReadsSetting(ConfigLine* line)
+{
+    return ParseOnOff(line, line->args[1], &config.sparseReads);
+}
+static int DirectIoExportSetting(ConfigLine* line)
+{
+    if(config.directIoExportCount == MAX_DIRECT_IO_EXPORTS)
+    {
+        CONFIG_ERROR(line, "more than %u DirectIoExport lines", MAX_DIRECT_IO_EXPORTS);
+        return 1;
+    }
+    char* name = _strdup(line->args[1]);
+    if(!name)
+    {
+        CONFIG_ERROR(line, "out of memory");
+        return 1;
+    }
+    config.directIoExports[config.directIoExportCount++] = name;
+    return 0;
+}
+static int DirectIoMinSizeSetting(ConfigLine* line)
+{
+    return ParseSize(line, line->args[1], &config.directIoMinSize);
+}
+static int StreamWriteChunkSetting(ConfigLine* line)
+{
+    return ParseSize(line, line->args[1], &config.streamWriteChunk);
+}
+static int TraceFileSetting(ConfigLine* line)
+{
+    free(config.traceFile);
+    config.traceFile = _strdup(line->args[1]);
+    if(!config.traceFile)
+    {
+        CONFIG_ERROR(line, "out of memory");
+        return 1;
+    }
+    return 0;
+}
+static int StallThresholdSetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 0, MAX_STALL_THRESHOLD, &config.stallThreshold);
+}
+static int SpanFileSetting(ConfigLine* line)
+{
+    free(config.spanFile);
+    config.spanFile = _strdup(line->args[1]);
+    if(!config.spanFile)
+    {
+        CONFIG_ERROR(line, "out of memory");
+        return 1;
+    }
+    return 0;
+}
+static int SpanSampleSetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 1, MAX_SPAN_SAMPLE, &config.spanSample);
+}
+static int SchedulerWeightsSetting(ConfigLine* line)
+{
+    for(UINT i = 0; i < 3; i++)
+    {
+        if(ParseCount(line, line->args[1 + i], 1, MAX_SCHEDULER_WEIGHT, &config.schedulerWeights[i]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+static int SchedulerMaxWaitSetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 1, MAX_SCHEDULER_MAX_WAIT, &config.schedulerMaxWait);
+}
+static int OverloadQueuedSetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 0, MAX_OVERLOAD_QUEUED, &config.overloadQueued);
+}
+static int OverloadDelaySetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 0, MAX_OVERLOAD_DELAY, &config.overloadDelay);
+}
+static int CallDeadlineSetting(ConfigLine* line)
+{
+    return ParseCount(line, line->args[1], 0, MAX_CALL_DEADLINE, &config.callDeadline);
+}
+// ClientLimit <address>[/<bits>] <quantum> <max in flight>
+static int ClientLimitSetting(ConfigLine* line)
+{
+    if(config.clientLimitCount == MAX_CLIENT_LIMITS)
+    {
+        CONFIG_ERROR(line, "more than %u ClientLimit lines", MAX_CLIENT_LIMITS);
+        return 1;
+    }
+    ClientLimit* limit = &config.clientLimits[config.clientLimitCount];
+
+    char* address = line->args[1];
+    UINT bits = 32;
+    char* slash = strchr(address, '/');
+    if(slash)
+    {
+        *slash = '\0';
+        if(ParseCount(line, slash + 1, 0, 32, &bits))
+        {
+            return 1;
+        }
+    }
+    ULONG network = inet_addr(address);
+    if(network == INADDR_NONE && strcmp(address, "255.255.255.255") != 0)
+    {
+        CONFIG_ERROR(line, "invalid IPv4 address '%s'", address);
+        return 1;
+    }
+    limit->mask = bits ? (0xFFFFFFFF << (32 - bits)) : 0;
+    limit->network = ntohl(network) & limit->mask;
+
+    if(ParseSize(line, line->args[2], &limit->quantum))
+    {
+        return 1;
+    }
+    if(limit->quantum < MIN_CLIENT_QUANTUM)
+    {
+        CONFIG_ERROR(line, "the quantum must be at least %u", MIN_CLIENT_QUANTUM);
+        return 1;
+    }
+    if(ParseCount(line, line->args[3], 1, MAX_CLIENT_MAX_IN_FLIGHT, &limit->maxInFlight))
+    {
+        return 1;
+    }
+    config.clientLimitCount++;
+    return 0;
+}
+static int LogLevelSetting(ConfigLine* line)
+{
+    if(LogSetLevel(line->args[1], line->args[2]))
+    {
+        CONFIG_ERROR(line, "unknown log component '%s' or level '%s'", line->args[1], line->args[2]);
+        return 1;
+    }
+    return 0;
+}
+
+typedef int (*SettingHandler)(ConfigLine* line);
+struct Setting
+{
+    const char* name;
+    UINT argCount; // not including the name
+    SettingHandler handler; // NULL if the setting is not implemented yet
+};
+
+static Setting settings[] = {
+    {"MaxTransferSize"      , 1, &MaxTransferSizeSetting},
+    {"PreferredTransferSize", 1, &PreferredTransferSizeSetting},
+    {"LargePages"           , 1, &LargePagesSetting},
+    {"DirEnumThreads"       , 1, &DirEnumThreadsSetting},
+    {"IoThreads"            , 1, &IoThreadsSetting},
+    {"WriteGatherSize"      , 1, &WriteGatherSizeSetting},
+    {"WriteGatherMemory"    , 1, &WriteGatherMemorySetting},
+    {"WriteGatherDelay"     , 1, &WriteGatherDelaySetting},
+    {"BlockCacheSize"       , 1, &BlockCacheSizeSetting},
+    {"BlockCacheValidate"   , 1, &BlockCacheValidateSetting},
+    {"ReadAheadMin"         , 1, &ReadAheadMinSetting},
+    {"ReadAheadMax"         , 1, &ReadAheadMaxSetting},
+    {"ReadAheadThreads"     , 1, &ReadAheadThreadsSetting},
+    {"SparseReads"          , 1, &SparseReadsSetting},
+    {"DirectIoExport"       , 1, &DirectIoExportSetting},
+    {"DirectIoMinSize"      , 1, &DirectIoMinSizeSetting},
+    {"StreamWriteChunk"     , 1, &StreamWriteChunkSetting},
+    {"TraceFile"            , 1, &TraceFileSetting},
+    {"StallThreshold"       , 1, &StallThresholdSetting},
+    {"SpanFile"             , 1, &SpanFileSetting},
+    {"SpanSample"           , 1, &SpanSampleSetting},
+    {"SchedulerWeights"     , 3, &SchedulerWeightsSetting},
+    {"SchedulerMaxWait"     , 1, &SchedulerMaxWaitSetting},
+    {"OverloadQueued"       , 1, &OverloadQueuedSetting},
+    {"OverloadDelay"        , 1, &OverloadDelaySetting},
+    {"CallDeadline"         , 1, &CallDeadlineSetting},
+    {"ClientLimit"          , 3, &ClientLimitSetting},
+    {"ListenPort"           , 1, NULL},
+    {"SharePath"            , 2, NULL},
+    {"LogLevel"             , 2, &LogLevelSetting},
+};
+
+// Returns: non-zero on error
+static int ValidateConfig()
+{
+    UINT maxTransferSize = config.maxTransferSize & ~(UINT)(BUFFER_POOL_MIN_BUFFER_SIZE - 1);
+    if(maxTransferSize < BUFFER_POOL_MIN_BUFFER_SIZE || maxTransferSize > MAX_TRANSFER_SIZE_LIMIT)
+    {
+        LOG_ERROR("MaxTransferSize %u must be between %u and %u",
+            config.maxTransferSize, (UINT)BUFFER_POOL_MIN_BUFFER_SIZE, MAX_TRANSFER_SIZE_LIMIT);
+        return 1;
+    }
+    if(maxTransferSize != config.maxTransferSize)
+    {
+        LOG("MaxTransferSize %u rounded down to %u", config.maxTransferSize, maxTransferSize);
+        config.maxTransferSize = maxTransferSize;
+    }
+
+    // The preferred size is rounded down to a buffer pool size so that
+    // transfers of the preferred size don't waste any pool memory
+    UINT preferredTransferSize = (UINT)BufferPoolRoundSize(config.preferredTransferSize);
+    if(preferredTransferSize > config.preferredTransferSize)
+    {
+        preferredTransferSize >>= 1;
+    }
+    if(preferredTransferSize > config.maxTransferSize)
+    {
+        preferredTransferSize = (UINT)BufferPoolRoundSize(config.maxTransferSize);
+        if(preferredTransferSize > config.maxTransferSize)
+        {
+            preferredTransferSize >>= 1;
+        }
+    }
+    if(preferredTransferSize < BUFFER_POOL_MIN_BUFFER_SIZE)
+    {
+        preferredTransferSize = BUFFER_POOL_MIN_BUFFER_SIZE;
+    }
+    if(preferredTransferSize != config.preferredTransferSize)
+    {
+        LOG("PreferredTransferSize %u adjusted to %u", config.preferredTransferSize, preferredTransferSize);
+        config.preferredTransferSize = preferredTransferSize;
+    }
+
+    // Gather buffers are whole pool buffers
+    if(config.writeGatherSize)
+    {
+        UINT writeGatherSize = (UINT)BufferPoolRoundSize(config.writeGatherSize);
+        if(writeGatherSize > config.writeGatherSize)
+        {
+            writeGatherSize >>= 1;
+        }
+        if(writeGatherSize < BUFFER_POOL_MIN_BUFFER_SIZE || config.writeGatherSize > BUFFER_POOL_MAX_BUFFER_SIZE)
+        {
+            LOG_ERROR("WriteGatherSize %u must be 0 or between %u and %u",
+                config.writeGatherSize, (UINT)BUFFER_POOL_MIN_BUFFER_SIZE, (UINT)BUFFER_POOL_MAX_BUFFER_SIZE);
+            return 1;
+        }
+        if(writeGatherSize != config.writeGatherSize)
+        {
+            LOG("WriteGatherSize %u rounded down to %u", config.writeGatherSize, writeGatherSize);
+            config.writeGatherSize = writeGatherSize;
+        }
+        if(config.writeGatherMemory < config.writeGatherSize)
+        {
+            LOG_ERROR("WriteGatherMemory %u is less than WriteGatherSize %u",
+                config.writeGatherMemory, config.writeGatherSize);
+            return 1;
+        }
+    }
+
+    if(config.readAheadMax && (config.readAheadMin == 0 || config.readAheadMin > config.readAheadMax))
+    {
+        LOG_ERROR("ReadAheadMin %u must be between 1 and ReadAheadMax %u", config.readAheadMin, config.readAheadMax);
+        return 1;
+    }
+
+    // The aligned part of a transfer is copied through one pool buffer
+    if(config.directIoMinSize == 0 || config.directIoMinSize > BUFFER_POOL_MAX_BUFFER_SIZE)
+    {
+        LOG_ERROR("DirectIoMinSize %u must be between 1 and %u", config.directIoMinSize, (UINT)BUFFER_POOL_MAX_BUFFER_SIZE);
+        return 1;
+    }
+
+    // Chunks are whole pool buffers
+    if(config.streamWriteChunk)
+    {
+        UINT streamWriteChunk = (UINT)BufferPoolRoundSize(config.streamWriteChunk);
+        if(streamWriteChunk > config.streamWriteChunk)
+        {
+            streamWriteChunk >>= 1;
+        }
+        if(streamWriteChunk < BUFFER_POOL_MIN_BUFFER_SIZE || config.streamWriteChunk > BUFFER_POOL_MAX_BUFFER_SIZE)
+        {
+            LOG_ERROR("StreamWriteChunk %u must be 0 or between %u and %u",
+                config.streamWriteChunk, (UINT)BUFFER_POOL_MIN_BUFFER_SIZE, (UINT)BUFFER_POOL_MAX_BUFFER_SIZE);
+            return 1;
+        }
+        if(streamWriteChunk != config.streamWriteChunk)
+        {
+            LOG("StreamWriteChunk %u rounded down to %u", config.streamWriteChunk, streamWriteChunk);
+            config.streamWriteChunk = streamWriteChunk;
+        }
+    }
+    return 0;
+}
+
+int LoadConfig(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    if(!file)
+    {
+        LOG_ERROR("failed to open config file '%s'", filename);
+        return 1;
+    }
+
+    int result = 0;
+    char buffer[MAX_CONFIG_LINE];
+    ConfigLine line;
+    line.filename = filename;
+    line.lineNumber = 0;
+    while(fgets(buffer, sizeof(buffer), file))
+    {
+        line.lineNumber++;
+
+        char* comment = strchr(buffer, '#');
+        if(comment)
+        {
+            *comment = '\0';
+        }
+        line.argCount = 0;
+        for(char* arg = strtok(buffer, " \t\r\n"); arg; arg = strtok(NULL, " \t\r\n"))
+        {
+            if(line.argCount == MAX_CONFIG_ARGS)
+            {
+                CONFIG_ERROR(&line, "too many arguments");
+                result = 1;
+                break;
+            }
+            line.args[line.argCount++] = arg;
+        }
+        if(line.argCount == 0)
+        {
+            continue;
+        }
+
+        Setting* setting = NULL;
+        for(UINT i = 0; i < STATIC_ARRAY_LENGTH(settings); i++)
+        {
+            if(strcmp(line.args[0], settings[i].name) == 0)
+            {
+                setting = &settings[i];
+                break;
+            }
+        }
+        if(!setting)
+        {
+            CONFIG_ERROR(&line, "unknown setting '%s'", line.args[0]);
+            result = 1;
+        }
+        else if(line.argCount - 1 != setting->argCount)
+        {
+            CONFIG_ERROR(&line, "%s expects %u argument(s) but got %u",
+                setting->name, setting->argCount, line.argCount - 1);
+            result = 1;
+        }
+        else if(!setting->handler)
+        {
+            LOG("%s(%u): %s is not implemented yet, ignoring", filename, line.lineNumber, setting->name);
+        }
+        else if(setting->handler(&line))
+        {
+            result = 1;
+        }
+    }
+    fclose(file);
+
+    if(result == 0)
+    {
+        result = ValidateConfig();
+    }
+    return result;
+}
+
+ClientLimit FindClientLimit(ULONG address)
+{
+    ClientLimit found;
+    found.network = 0;
+    found.mask = 0;
+    found.quantum = config.clientQuantum;
+    found.maxInFlight = config.clientMaxInFlight;
+    bool matched = false;
+    for(UINT i = 0; i < config.clientLimitCount; i++)
+    {
+        ClientLimit* limit = &config.clientLimits[i];
+        if((address & limit->mask) == limit->network && (!matched || limit->mask > found.mask))
+        {
+            found = *limit;
+            matched = true;
+        }
+    }
+    return found;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+// Application can override how many ClientLimit lines a config can have
+#ifndef MAX_CLIENT_LIMITS
+#define MAX_CLIENT_LIMITS 32
+#endif
+
+// Application can override how many DirectIoExport lines a config can have
+#ifndef MAX_DIRECT_IO_EXPORTS
+#define MAX_DIRECT_IO_EXPORTS 16
+#endif
+
+// The scheduler limits of the clients in a subnet (see Scheduler.h)
+struct ClientLimit
+{
+    ULONG network; // host order
+    ULONG mask;    // host order
+    // Bytes of calls a client gets every turn
+    UINT quantum;
+    // Calls a client can have in flight before it stops being read from
+    UINT maxInFlight;
+};
+
+// Runtime settings, see the Configuration section in README.md
+struct Config
+{
+    // Largest READ/WRITE payload, advertised as rtmax/wtmax by FSINFO
+    UINT maxTransferSize;
+    // Advertised as rtpref/wtpref/dtpref by FSINFO, always a buffer pool size
+    UINT preferredTransferSize;
+    // Back the buffer pool with large pages
+    bool largePages;
+    // Number of threads that read directories for READDIRPLUS
+    UINT dirEnumThreads;
+    // Number of threads that make file system calls for handlers, 0 leaves
+    // them on the select thread
+    UINT ioThreads;
+    // Size of the buffer UNSTABLE writes to a file are gathered in, 0 disables
+    // write gathering, always a buffer pool size
+    UINT writeGatherSize;
+    // Most memory held by gathered writes for all files
+    UINT writeGatherMemory;
+    // Longest time in milliseconds a gathered write is held in memory
+    UINT writeGatherDelay;
+    // Memory for cached READ data, 0 disables the block cache
+    UINT blockCacheSize;
+    // Milliseconds the attributes of a file are trusted by READ before they
+    // are checked again (when the block cache is enabled)
+    UINT blockCacheValidate;
+    // Smallest and largest read-ahead window, a max of 0 disables read-ahead
+    UINT readAheadMin;
+    UINT readAheadMax;
+    // Number of threads that read ahead
+    UINT readAheadThreads;
+    // READ skips the holes of sparse files
+    bool sparseReads;
+    // Exports whose large READs and WRITEs skip the system cache
+    char* directIoExports[MAX_DIRECT_IO_EXPORTS];
+    UINT directIoExportCount;
+    // Smallest aligned part of a READ or WRITE that skips the system cache
+    UINT directIoMinSize;
+    // Size of the chunks the data of a larger WRITE is written to the file in
+    // as it is received, 0 receives every WRITE whole, always a buffer pool size
+    UINT streamWriteChunk;
+    // File every received record is traced to, NULL if tracing is off
+    char* traceFile;
+    // Milliseconds a handler can run before the watchdog logs it as a stall,
+    // 0 disables the watchdog
+    UINT stallThreshold;
+    // File sampled request spans are dumped to, NULL if spans are off
+    char* spanFile;
+    // 1 in every spanSample calls records its spans
+    UINT spanSample;
+    // Calls of each scheduler class in one round (see Scheduler.h)
+    UINT schedulerWeights[3];
+    // Milliseconds a queued call can wait before it runs ahead of the weights
+    UINT schedulerMaxWait;
+    // Queued calls that overload the server, 0 for no limit
+    UINT overloadQueued;
+    // Milliseconds every queued call has to wait to overload the server, 0
+    // for no limit
+    UINT overloadDelay;
+    // Milliseconds after a call is received that it is dropped instead of
+    // handled, 0 for no deadline
+    UINT callDeadline;
+    // Limits of the clients that don't match any clientLimits
+    UINT clientQuantum;
+    UINT clientMaxInFlight;
+    ClientLimit clientLimits[MAX_CLIENT_LIMITS];
+    UINT clientLimitCount;
+};
+
+extern Config config;
+
+// Returns: non-zero on error
+int LoadConfig(const char* filename);
+
+// address: IPv4 in host order
+// Returns: the limits of the longest ClientLimit subnet that has address,
+//          the default limits if none do
+ClientLimit FindClientLimit(ULONG address);
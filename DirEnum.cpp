@@ -0,0 +1,341 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <malloc.h>
+#include <stdio.h>
+
+#include "Common.h"
+#include "BufferPool.h"
+#include "DirEnum.h"
+
+#define NAME_BLOCK_SIZE (64*1024)
+
+// NOTE: only read/modify the queue inside the critical section
+static CRITICAL_SECTION queueCriticalSection;
+static CONDITION_VARIABLE queueNotEmpty;
+static DirSnapshot* queueHead = NULL;
+static DirSnapshot* queueTail = NULL;
+
+static UINT64 nextVerifier;
+
+DirSnapshot::DirSnapshot(String path) :
+    refCount(1), cancelled(0), count(0), complete(false), error(0), waiters(NULL),
+    added(0), chunkCount(0), nameBlock(NULL), nameBlockUsed(NAME_BLOCK_SIZE), queueNext(NULL), path(path)
+{
+    InitializeCriticalSection(&criticalSection);
+    InitializeConditionVariable(&entriesAdded);
+    // Only the select thread creates snapshots
+    verifier = nextVerifier++;
+}
+
+DirSnapshot::~DirSnapshot()
+{
+    for(UINT i = 0; i < chunkCount; i++)
+    {
+        free(chunks[i]);
+    }
+    while(nameBlock)
+    {
+        char* previous = *(char**)nameBlock;
+        BufferPoolFree(nameBlock, NAME_BLOCK_SIZE);
+        nameBlock = previous;
+    }
+    free(path.ptr);
+    DeleteCriticalSection(&criticalSection);
+}
+
+void DirSnapshot::Release()
+{
+    if(InterlockedDecrement(&refCount) == 0)
+    {
+        delete this;
+    }
+}
+
+// Only called by the worker thread, the entry isn't visible to readers until
+// it is published
+int DirSnapshot::AddEntry(FILE_ID_BOTH_DIR_INFO* info)
+{
+    UINT chunkIndex = added >> DIR_SNAPSHOT_CHUNK_SHIFT;
+    if(chunkIndex == chunkCount)
+    {
+        if(chunkCount == DIR_SNAPSHOT_MAX_CHUNKS)
+        {
+            LOG_ERROR("[DIRENUM] '%s' has more than %u entries", path.ptr,
+                DIR_SNAPSHOT_MAX_CHUNKS * DIR_SNAPSHOT_CHUNK_SIZE);
+            return 1;
+        }
+        DirEntry* chunk = (DirEntry*)malloc(sizeof(DirEntry) * DIR_SNAPSHOT_CHUNK_SIZE);
+        if(!chunk)
+        {
+            return 1;
+        }
+        chunks[chunkCount++] = chunk;
+    }
+
+    // A UTF-16 character is at most 2 bytes in an ANSI code page
+    UINT maxNameLength = info->FileNameLength + 1;
+    if(nameBlockUsed + maxNameLength > NAME_BLOCK_SIZE)
+    {
+        char* newBlock = BufferPoolAlloc(NAME_BLOCK_SIZE);
+        if(!newBlock)
+        {
+            return 1;
+        }
+        *(char**)newBlock = nameBlock;
+        nameBlock = newBlock;
+        nameBlockUsed = sizeof(char*);
+    }
+
+    DirEntry* entry = Entry(added);
+    entry->name = nameBlock + nameBlockUsed;
+    int nameLength = WideCharToMultiByte(CP_ACP, 0, info->FileName, info->FileNameLength / sizeof(WCHAR),
+        entry->name, maxNameLength - 1, NULL, NULL);
+    if(nameLength <= 0 && info->FileNameLength > 0)
+    {
+        LOG_ERROR("[DIRENUM] WideCharToMultiByte failed (e=%d)", GetLastError());
+        return 1;
+    }
+    entry->name[nameLength] = '\0';
+    entry->nameLength = nameLength;
+    nameBlockUsed += nameLength + 1;
+
+    entry->attributes     = info->FileAttributes;
+    entry->fileId         = info->FileId.QuadPart;
+    entry->size           = info->EndOfFile.QuadPart;
+    entry->allocationSize = info->AllocationSize.QuadPart;
+    entry->creationTime   = info->CreationTime.QuadPart;
+    entry->accessTime     = info->LastAccessTime.QuadPart;
+    entry->writeTime      = info->LastWriteTime.QuadPart;
+    entry->changeTime     = info->ChangeTime.QuadPart;
+    added++;
+    return 0;
+}
+
+DirWaiter* DirSnapshot::TakeReadyWaiters()
+{
+    DirWaiter* ready = NULL;
+    DirWaiter** link = &waiters;
+    while(*link)
+    {
+        DirWaiter* waiter = *link;
+        if(complete || waiter->index < count)
+        {
+            *link = waiter->next;
+            waiter->next = ready;
+            ready = waiter;
+        }
+        else
+        {
+            link = &waiter->next;
+        }
+    }
+    return ready;
+}
+
+// A waiter can be freed as soon as it is called, so next is read first
+static void CallWaiters(DirWaiter* waiter)
+{
+    while(waiter)
+    {
+        DirWaiter* next = waiter->next;
+        waiter->ready(waiter);
+        waiter = next;
+    }
+}
+
+void DirSnapshot::Publish(UINT newCount)
+{
+    EnterCriticalSection(&criticalSection);
+    count = newCount;
+    DirWaiter* ready = TakeReadyWaiters();
+    LeaveCriticalSection(&criticalSection);
+    WakeAllConditionVariable(&entriesAdded);
+    CallWaiters(ready);
+}
+
+void DirSnapshot::Finish(DWORD error)
+{
+    EnterCriticalSection(&criticalSection);
+    count = added;
+    complete = true;
+    this->error = error;
+    DirWaiter* ready = TakeReadyWaiters();
+    LeaveCriticalSection(&criticalSection);
+    WakeAllConditionVariable(&entriesAdded);
+    CallWaiters(ready);
+}
+
+UINT DirSnapshot::WaitForEntries(UINT index, bool* outComplete, DWORD* outError)
+{
+    EnterCriticalSection(&criticalSection);
+    while(count <= index && !complete)
+    {
+        SleepConditionVariableCS(&entriesAdded, &criticalSection, INFINITE);
+    }
+    UINT available = count;
+    *outComplete = complete;
+    *outError = error;
+    LeaveCriticalSection(&criticalSection);
+    return available;
+}
+
+bool DirSnapshot::GetEntries(UINT index, DirWaiter* waiter, UINT* outAvailable, bool* outComplete, DWORD* outError)
+{
+    EnterCriticalSection(&criticalSection);
+    bool ready = (count > index || complete);
+    if(ready)
+    {
+        *outAvailable = count;
+        *outComplete = complete;
+        *outError = error;
+    }
+    else
+    {
+        waiter->index = index;
+        waiter->next = waiters;
+        waiters = waiter;
+    }
+    LeaveCriticalSection(&criticalSection);
+    return ready;
+}
+
+void EnumerateDirectory(DirSnapshot* snapshot, char* buffer)
+{
+    HANDLE dir = CreateFile(snapshot->path.ptr, FILE_LIST_DIRECTORY,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if(dir == INVALID_HANDLE_VALUE)
+    {
+        DWORD error = GetLastError();
+        LOG_ERROR("[DIRENUM] failed to open '%s' (e=%d)", snapshot->path.ptr, error);
+        snapshot->Finish(error);
+        return;
+    }
+
+    DWORD error = 0;
+    FILE_INFO_BY_HANDLE_CLASS infoClass = FileIdBothDirectoryRestartInfo;
+    while(!snapshot->cancelled)
+    {
+        if(!GetFileInformationByHandleEx(dir, infoClass, buffer, DIR_ENUM_BUFFER_SIZE))
+        {
+            error = GetLastError();
+            if(error == ERROR_NO_MORE_FILES)
+            {
+                error = 0;
+            }
+            else
+            {
+                LOG_ERROR("[DIRENUM] GetFileInformationByHandleEx on '%s' failed (e=%d)", snapshot->path.ptr, error);
+            }
+            break;
+        }
+        infoClass = FileIdBothDirectoryInfo;
+
+        FILE_ID_BOTH_DIR_INFO* info = (FILE_ID_BOTH_DIR_INFO*)buffer;
+        while(true)
+        {
+            if(snapshot->AddEntry(info))
+            {
+                error = ERROR_NOT_ENOUGH_MEMORY;
+                break;
+            }
+            if(info->NextEntryOffset == 0)
+            {
+                break;
+            }
+            info = (FILE_ID_BOTH_DIR_INFO*)((char*)info + info->NextEntryOffset);
+        }
+        if(error)
+        {
+            break;
+        }
+        snapshot->Publish(snapshot->added);
+    }
+    CloseHandle(dir);
+    if(!error && snapshot->cancelled)
+    {
+        // A listing that was stopped early is not the whole directory
+        error = ERROR_OPERATION_ABORTED;
+    }
+
+    LOG_DEBUG("[DIRENUM] '%s' %u entries (e=%d)%s", snapshot->path.ptr, snapshot->added, error,
+        snapshot->cancelled ? " cancelled" : "");
+    snapshot->Finish(error);
+}
+
+DWORD WINAPI DirEnumThread(LPVOID param)
+{
+    char* buffer = BufferPoolAlloc(DIR_ENUM_BUFFER_SIZE);
+    if(!buffer)
+    {
+        LOG_ERROR("[DIRENUM] failed to allocate %u byte buffer", DIR_ENUM_BUFFER_SIZE);
+        return 1;
+    }
+
+    while(true)
+    {
+        EnterCriticalSection(&queueCriticalSection);
+        while(queueHead == NULL)
+        {
+            SleepConditionVariableCS(&queueNotEmpty, &queueCriticalSection, INFINITE);
+        }
+        DirSnapshot* snapshot = queueHead;
+        queueHead = snapshot->queueNext;
+        if(queueHead == NULL)
+        {
+            queueTail = NULL;
+        }
+        LeaveCriticalSection(&queueCriticalSection);
+
+        EnumerateDirectory(snapshot, buffer);
+        snapshot->Release();
+    }
+}
+
+int DirEnumInit(UINT threadCount)
+{
+    InitializeCriticalSection(&queueCriticalSection);
+    InitializeConditionVariable(&queueNotEmpty);
+    nextVerifier = ((UINT64)GetTickCount() << 32) | 1;
+
+    for(UINT i = 0; i < threadCount; i++)
+    {
+        HANDLE thread = CreateThread(NULL, 0, &DirEnumThread, NULL, 0, NULL);
+        if(thread == NULL)
+        {
+            LOG_ERROR("[DIRENUM] CreateThread failed (e=%d)", GetLastError());
+            return 1;
+        }
+        CloseHandle(thread);
+    }
+    LOG("[DIRENUM] %u enumeration threads, %u byte batches", threadCount, DIR_ENUM_BUFFER_SIZE);
+    return 0;
+}
+
+DirSnapshot* StartDirEnum(String path)
+{
+    char* pathCopy = (char*)malloc(path.length + 1);
+    if(!pathCopy)
+    {
+        return NULL;
+    }
+    memcpy(pathCopy, path.ptr, path.length);
+    pathCopy[path.length] = '\0';
+
+    DirSnapshot* snapshot = new DirSnapshot(String(pathCopy, path.length));
+    snapshot->AddRef(); // reference for the worker
+
+    EnterCriticalSection(&queueCriticalSection);
+    if(queueTail)
+    {
+        queueTail->queueNext = snapshot;
+    }
+    else
+    {
+        queueHead = snapshot;
+    }
+    queueTail = snapshot;
+    LeaveCriticalSection(&queueCriticalSection);
+    WakeConditionVariable(&queueNotEmpty);
+    return snapshot;
+}
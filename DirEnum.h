@@ -0,0 +1,141 @@
+#pragma once
+
+//
+// Directory Enumeration
+// --------------------------------------------------------
+// Directories are listed by a pool of worker threads.  Each worker reads
+// entries in large batches with GetFileInformationByHandleEx, which returns
+// the file id, size, times and attributes of every entry along with its
+// name, so no extra call per entry is needed to get its attributes.
+//
+// A listing is written into a DirSnapshot as each batch is read.  Readers
+// can use the entries that are already in the snapshot while the worker is
+// still reading the rest of the directory, so the first page of a huge
+// directory can be returned long before the listing is complete.  A reader
+// that must not block (the select thread) registers a DirWaiter instead of
+// waiting, the worker calls it once the entries it needs are published.
+//
+
+// Application can override the size of the buffer each worker reads entries into
+#ifndef DIR_ENUM_BUFFER_SIZE
+#define DIR_ENUM_BUFFER_SIZE (256*1024)
+#endif
+
+#define DIR_SNAPSHOT_CHUNK_SHIFT 10
+#define DIR_SNAPSHOT_CHUNK_SIZE  (1 << DIR_SNAPSHOT_CHUNK_SHIFT)
+#define DIR_SNAPSHOT_MAX_CHUNKS  4096 // limits a snapshot to 4M entries
+
+// Times are in FILETIME units (100 nanoseconds since 1601)
+struct DirEntry
+{
+    char* name; // ANSI code page, '\0' terminated
+    UINT nameLength;
+    DWORD attributes;
+    UINT64 fileId;
+    UINT64 size;
+    UINT64 allocationSize;
+    UINT64 creationTime;
+    UINT64 accessTime;
+    UINT64 writeTime;
+    UINT64 changeTime;
+};
+
+struct DirWaiter;
+
+// Called on the worker thread once the snapshot has more than the waiter's
+// index entries or the listing is complete
+typedef void (*DirWaiterReady)(DirWaiter* waiter);
+
+// Embedded in the state of a reader that waits for entries without blocking
+struct DirWaiter
+{
+    DirWaiter* next;
+    UINT index;
+    DirWaiterReady ready;
+};
+
+class DirSnapshot
+{
+    friend DWORD WINAPI DirEnumThread(LPVOID param);
+    friend void EnumerateDirectory(DirSnapshot* snapshot, char* buffer);
+    friend DirSnapshot* StartDirEnum(String path);
+  private:
+    CRITICAL_SECTION criticalSection;
+    CONDITION_VARIABLE entriesAdded;
+
+    volatile LONG refCount;
+    volatile LONG cancelled;
+
+    // NOTE: only read/modify count, complete, error and waiters inside the
+    // critical section.  Entries below count never move or change once they
+    // are added.
+    UINT count;
+    bool complete;
+    DWORD error;
+    DirWaiter* waiters;
+
+    // Entries written by the worker, they are visible to readers once they
+    // are published by updating count
+    UINT added;
+    DirEntry* chunks[DIR_SNAPSHOT_MAX_CHUNKS];
+    UINT chunkCount;
+
+    // Entry names are packed into blocks from the buffer pool, each block
+    // starts with a pointer to the block before it
+    char* nameBlock;
+    UINT nameBlockUsed;
+
+    DirSnapshot* queueNext;
+
+    DirSnapshot(String path);
+    ~DirSnapshot();
+
+    // Returns: non-zero if out of memory
+    int AddEntry(FILE_ID_BOTH_DIR_INFO* info);
+    void Publish(UINT newCount);
+    void Finish(DWORD error);
+    // Assumption: called inside the critical section
+    // Returns: the waiters whose entries are ready, removed from waiters
+    DirWaiter* TakeReadyWaiters();
+  public:
+    // The path of the directory ('\0' terminated)
+    String path;
+    // Changes for every snapshot, returned to clients as the cookie verifier
+    UINT64 verifier;
+
+    // Waits until the snapshot has more than index entries or the listing is
+    // complete.
+    // Returns: the number of entries that can be read
+    UINT WaitForEntries(UINT index, bool* outComplete, DWORD* outError);
+
+    // Returns: true if the snapshot has more than index entries or the
+    //          listing is complete, outAvailable is the number of entries that
+    //          can be read.  Otherwise false, and waiter->ready is called on
+    //          the worker once it does.
+    // Assumption: waiter stays valid until it is called
+    bool GetEntries(UINT index, DirWaiter* waiter, UINT* outAvailable, bool* outComplete, DWORD* outError);
+
+    // Assumption: index is less than a count returned by WaitForEntries
+    DirEntry* Entry(UINT index)
+    {
+        return &chunks[index >> DIR_SNAPSHOT_CHUNK_SHIFT][index & (DIR_SNAPSHOT_CHUNK_SIZE - 1)];
+    }
+
+    // Stops the worker from reading any more of the directory
+    void Cancel()
+    {
+        InterlockedExchange(&cancelled, 1);
+    }
+    void AddRef()
+    {
+        InterlockedIncrement(&refCount);
+    }
+    void Release();
+};
+
+// Returns: non-zero on error
+int DirEnumInit(UINT threadCount);
+
+// Starts listing the directory at path on a worker thread
+// Returns: a snapshot with one reference for the caller, NULL on error
+DirSnapshot* StartDirEnum(String path);
@@ -0,0 +1,209 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Common.h"
+#include "GroupCommit.h"
+
+// NOTE: only read/modify the queue inside the critical section
+static CRITICAL_SECTION queueCriticalSection;
+static CONDITION_VARIABLE queueNotEmpty;
+static SyncRequest* queueHead = NULL;
+static SyncRequest* queueTail = NULL;
+
+// Only used by the sync thread
+static UINT64 totalRequests = 0;
+static UINT64 totalFlushes = 0;
+
+// A file that is flushed by the current batch
+struct BatchFile
+{
+    HANDLE file;
+    HANDLE volume;
+    DWORD error;
+    bool flushed;
+};
+
+// Flushes every file in the batch once
+// Returns: the number of flush calls made
+static UINT FlushBatch(BatchFile* files, UINT fileCount)
+{
+    UINT flushCount = 0;
+    for(UINT i = 0; i < fileCount; i++)
+    {
+        if(files[i].flushed)
+        {
+            continue;
+        }
+
+        // Count how many other files in the batch are on the same volume
+        UINT sameVolume = 1;
+        if(files[i].volume)
+        {
+            for(UINT j = i + 1; j < fileCount; j++)
+            {
+                if(files[j].volume == files[i].volume && !files[j].flushed)
+                {
+                    sameVolume++;
+                }
+            }
+        }
+
+        if(sameVolume >= GROUP_COMMIT_VOLUME_THRESHOLD)
+        {
+            DWORD error = 0;
+            if(!FlushFileBuffers(files[i].volume))
+            {
+                error = GetLastError();
+                LOG_ERROR("[COMMIT] FlushFileBuffers on volume failed (e=%d)", error);
+            }
+            flushCount++;
+            HANDLE volume = files[i].volume;
+            for(UINT j = i; j < fileCount; j++)
+            {
+                if(files[j].volume == volume && !files[j].flushed)
+                {
+                    files[j].error = error;
+                    files[j].flushed = true;
+                }
+            }
+        }
+        else
+        {
+            if(!FlushFileBuffers(files[i].file))
+            {
+                files[i].error = GetLastError();
+                LOG_ERROR("[COMMIT] FlushFileBuffers failed (e=%d)", files[i].error);
+            }
+            flushCount++;
+            files[i].flushed = true;
+        }
+    }
+    return flushCount;
+}
+
+DWORD WINAPI SyncThread(LPVOID param)
+{
+    UINT filesCapacity = 64;
+    BatchFile* files = (BatchFile*)malloc(filesCapacity * sizeof(BatchFile));
+    if(!files)
+    {
+        LOG_ERROR("[COMMIT] out of memory");
+        return 1;
+    }
+
+    while(true)
+    {
+        // Take every request that is waiting, requests that are queued
+        // while this batch is flushed go in the next batch since their
+        // writes may not be covered by these flushes
+        EnterCriticalSection(&queueCriticalSection);
+        while(queueHead == NULL)
+        {
+            SleepConditionVariableCS(&queueNotEmpty, &queueCriticalSection, INFINITE);
+        }
+        SyncRequest* batch = queueHead;
+        queueHead = NULL;
+        queueTail = NULL;
+        LeaveCriticalSection(&queueCriticalSection);
+
+        // Merge requests for the same file
+        UINT requestCount = 0;
+        UINT fileCount = 0;
+        for(SyncRequest* request = batch; request; request = request->next)
+        {
+            requestCount++;
+            UINT i;
+            for(i = 0; i < fileCount; i++)
+            {
+                if(files[i].file == request->file)
+                {
+                    break;
+                }
+            }
+            if(i == fileCount)
+            {
+                if(fileCount == filesCapacity)
+                {
+                    BatchFile* newFiles = (BatchFile*)realloc(files, 2 * filesCapacity * sizeof(BatchFile));
+                    if(!newFiles)
+                    {
+                        continue; // the file is flushed on its own when the request completes
+                    }
+                    files = newFiles;
+                    filesCapacity *= 2;
+                }
+                files[i].file = request->file;
+                files[i].volume = request->volume;
+                files[i].error = 0;
+                files[i].flushed = false;
+                fileCount = i + 1;
+            }
+        }
+
+        UINT flushCount = FlushBatch(files, fileCount);
+        totalRequests += requestCount;
+        totalFlushes += flushCount;
+        LOG_DEBUG("[COMMIT] %u requests for %u files took %u flushes (%llu requests, %llu flushes total)",
+            requestCount, fileCount, flushCount, totalRequests, totalFlushes);
+
+        // Complete every request in the batch
+        for(SyncRequest* request = batch; request; )
+        {
+            SyncRequest* next = request->next;
+            UINT i;
+            for(i = 0; i < fileCount; i++)
+            {
+                if(files[i].file == request->file)
+                {
+                    break;
+                }
+            }
+            DWORD error;
+            if(i < fileCount)
+            {
+                error = files[i].error;
+            }
+            else
+            {
+                error = FlushFileBuffers(request->file) ? 0 : GetLastError();
+                totalFlushes++;
+            }
+            request->complete(request, error);
+            request = next;
+        }
+    }
+}
+
+int GroupCommitInit()
+{
+    InitializeCriticalSection(&queueCriticalSection);
+    InitializeConditionVariable(&queueNotEmpty);
+
+    HANDLE thread = CreateThread(NULL, 0, &SyncThread, NULL, 0, NULL);
+    if(thread == NULL)
+    {
+        LOG_ERROR("[COMMIT] CreateThread failed (e=%d)", GetLastError());
+        return 1;
+    }
+    CloseHandle(thread);
+    return 0;
+}
+
+void QueueSync(SyncRequest* request)
+{
+    request->next = NULL;
+    EnterCriticalSection(&queueCriticalSection);
+    if(queueTail)
+    {
+        queueTail->next = request;
+    }
+    else
+    {
+        queueHead = request;
+    }
+    queueTail = request;
+    LeaveCriticalSection(&queueCriticalSection);
+    WakeConditionVariable(&queueNotEmpty);
+}
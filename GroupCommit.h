@@ -0,0 +1,45 @@
+#pragma once
+
+//
+// Group Commit
+// --------------------------------------------------------
+// Flushing a file to disk takes far longer than writing to it, so flushes
+// are done by a dedicated sync thread instead of the select thread.
+// Requests that are queued while the sync thread is busy are handled as
+// one batch: every file in the batch is flushed once no matter how many
+// requests are waiting on it, and when enough files in the batch are on the
+// same volume the whole volume is flushed with a single call instead.  Once
+// the flushes are done every request in the batch is completed at once.
+//
+// Many clients writing at the same time share flushes instead of each one
+// waiting for its own.
+//
+
+// Application can override how many files in a batch must be on the same
+// volume before the volume is flushed instead of each file
+#ifndef GROUP_COMMIT_VOLUME_THRESHOLD
+#define GROUP_COMMIT_VOLUME_THRESHOLD 8
+#endif
+
+struct SyncRequest;
+
+// Called on the sync thread once the request's data is on disk (or the
+// flush failed).  error is 0 on success.
+typedef void (*SyncCompleteHandler)(SyncRequest* request, DWORD error);
+
+struct SyncRequest
+{
+    // Assumption: file stays open until the request is completed
+    HANDLE file;
+    // An open handle to the volume the file is on, NULL if the volume
+    // can't be flushed (opening a volume requires administrator rights)
+    HANDLE volume;
+    SyncCompleteHandler complete;
+    SyncRequest* next; // only used by the sync thread queue
+};
+
+// Returns: non-zero on error
+int GroupCommitInit();
+
+// Queues the request to be flushed by the sync thread
+void QueueSync(SyncRequest* request);
@@ -0,0 +1,189 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+
+#include "Common.h"
+#include "IoPool.h"
+
+// NOTE: only read/modify the queues and the counts inside the critical section
+static CRITICAL_SECTION queueCriticalSection;
+static CONDITION_VARIABLE queueNotEmpty;
+static CONDITION_VARIABLE requestDone;
+static IoRequest* workHead = NULL;
+static IoRequest* workTail = NULL;
+static IoRequest* doneHead = NULL;
+static IoRequest* doneTail = NULL;
+static UINT inProgress = 0; // submitted or external but not in the done queue yet, wraps
+                             // while an external request completes before it is counted
+
+static UINT ioThreads = 0;
+static SOCKET wakeSocket = INVALID_SOCKET;
+static sockaddr_in wakeAddress;
+
+DWORD WINAPI IoThread(LPVOID param)
+{
+    while(true)
+    {
+        EnterCriticalSection(&queueCriticalSection);
+        while(workHead == NULL)
+        {
+            SleepConditionVariableCS(&queueNotEmpty, &queueCriticalSection, INFINITE);
+        }
+        IoRequest* request = workHead;
+        workHead = request->next;
+        if(workHead == NULL)
+        {
+            workTail = NULL;
+        }
+        LeaveCriticalSection(&queueCriticalSection);
+
+        request->work(request);
+        IoPoolComplete(request);
+    }
+}
+
+void IoPoolComplete(IoRequest* request)
+{
+    request->next = NULL;
+    EnterCriticalSection(&queueCriticalSection);
+    // Only the first completion of a batch wakes the select thread, it
+    // takes the whole done queue
+    bool wake = (doneHead == NULL);
+    if(doneTail)
+    {
+        doneTail->next = request;
+    }
+    else
+    {
+        doneHead = request;
+    }
+    doneTail = request;
+    inProgress--;
+    LeaveCriticalSection(&queueCriticalSection);
+    WakeAllConditionVariable(&requestDone);
+    if(wake)
+    {
+        char byte = 0;
+        if(SOCKET_ERROR == sendto(wakeSocket, &byte, 1, 0, (sockaddr*)&wakeAddress, sizeof(wakeAddress)))
+        {
+            LOG_ERROR("[IO] sendto failed (e=%d)", GetLastError());
+        }
+    }
+}
+
+int IoPoolInit(UINT threadCount)
+{
+    InitializeCriticalSection(&queueCriticalSection);
+    InitializeConditionVariable(&queueNotEmpty);
+    InitializeConditionVariable(&requestDone);
+
+    wakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(wakeSocket == INVALID_SOCKET)
+    {
+        LOG_ERROR("[IO] socket failed (e=%d)", GetLastError());
+        return 1;
+    }
+    int addressSize = sizeof(wakeAddress);
+    wakeAddress.sin_family      = AF_INET;
+    wakeAddress.sin_port        = 0;
+    wakeAddress.sin_addr.s_addr = htonl(0x7F000001);
+    if(SOCKET_ERROR == bind(wakeSocket, (sockaddr*)&wakeAddress, sizeof(wakeAddress)) ||
+       SOCKET_ERROR == getsockname(wakeSocket, (sockaddr*)&wakeAddress, &addressSize))
+    {
+        LOG_ERROR("[IO] failed to bind the wake socket (e=%d)", GetLastError());
+        return 1;
+    }
+    // The select thread reads every wake byte that is waiting without blocking
+    u_long nonBlocking = 1;
+    if(SOCKET_ERROR == ioctlsocket(wakeSocket, FIONBIO, &nonBlocking))
+    {
+        LOG_ERROR("[IO] ioctlsocket failed (e=%d)", GetLastError());
+        return 1;
+    }
+
+    if(threadCount == 0)
+    {
+        LOG("[IO] no file system workers, handlers make their own file system calls");
+        return 0;
+    }
+    for(UINT i = 0; i < threadCount; i++)
+    {
+        HANDLE thread = CreateThread(NULL, 0, &IoThread, NULL, 0, NULL);
+        if(thread == NULL)
+        {
+            LOG_ERROR("[IO] CreateThread failed (e=%d)", GetLastError());
+            return 1;
+        }
+        CloseHandle(thread);
+    }
+    ioThreads = threadCount;
+    LOG("[IO] %u file system workers", threadCount);
+    return 0;
+}
+
+UINT IoPoolThreads()
+{
+    return ioThreads;
+}
+
+SOCKET IoPoolWakeSocket()
+{
+    return wakeSocket;
+}
+
+void IoPoolSubmit(IoRequest* request)
+{
+    request->next = NULL;
+    EnterCriticalSection(&queueCriticalSection);
+    if(workTail)
+    {
+        workTail->next = request;
+    }
+    else
+    {
+        workHead = request;
+    }
+    workTail = request;
+    inProgress++;
+    LeaveCriticalSection(&queueCriticalSection);
+    WakeConditionVariable(&queueNotEmpty);
+}
+
+void IoPoolExternal(IoRequest* request)
+{
+    EnterCriticalSection(&queueCriticalSection);
+    inProgress++;
+    LeaveCriticalSection(&queueCriticalSection);
+}
+
+void IoPoolRunCompletions(char* sharedBuffer)
+{
+    // The wake bytes are read before the queue is taken, a completion that
+    // is added after this sends a byte of its own
+    char bytes[64];
+    while(recv(wakeSocket, bytes, sizeof(bytes), 0) > 0)
+    {
+    }
+    EnterCriticalSection(&queueCriticalSection);
+    IoRequest* request = doneHead;
+    doneHead = NULL;
+    doneTail = NULL;
+    LeaveCriticalSection(&queueCriticalSection);
+    while(request)
+    {
+        IoRequest* next = request->next;
+        request->complete(request, sharedBuffer);
+        request = next;
+    }
+}
+
+void IoPoolWait(char* sharedBuffer)
+{
+    EnterCriticalSection(&queueCriticalSection);
+    while(inProgress)
+    {
+        SleepConditionVariableCS(&requestDone, &queueCriticalSection, INFINITE);
+    }
+    LeaveCriticalSection(&queueCriticalSection);
+    IoPoolRunCompletions(sharedBuffer);
+}
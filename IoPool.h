@@ -0,0 +1,85 @@
+#pragma once
+
+//
+// File System Workers
+// --------------------------------------------------------
+// A handler runs on the select thread, so while a file system call it
+// makes waits on a cold directory or a busy disk every other connection
+// waits with it.  Windows has no asynchronous CreateFile or
+// GetFileInformationByHandle, so the procedures that call the file system
+// (GETATTR of a file that isn't open, READ that misses the block cache and
+// WRITE that isn't gathered) hand those calls to a pool of IoThreads worker
+// threads instead and return without a reply.  The call is split at its
+// file system calls:
+//
+//   issue     the handler copies what the calls need, including arguments
+//             like WRITE's data, into an IoRequest that lives in the call's
+//             arena, along with the call itself, and submits it
+//   work      a worker makes the calls, it only touches its request
+//   complete  the select thread applies the results to the server's state
+//             (open files, attributes, the block cache), sets up the reply
+//             in the shared buffer and sends it
+//
+// Records are received into their own buffer, so a call's arguments never
+// overlap the reply in the shared buffer.  Slow operations in flight cost a
+// queued request each, not a thread each, and the select thread keeps
+// handling other connections while they wait.  A connection's replies are
+// still sent in the order its calls were handled, a reply that is ready
+// before the ones ahead of it is held until they are sent.
+//
+// A worker that completes a request while no completions are waiting sends
+// a byte to a loopback UDP socket, which the select thread selects on along
+// with the connections.  Other threads that finish work for a call, like the
+// directory enumeration workers and the sync thread, complete requests the
+// same way.
+//
+// NOTE: IoPoolSubmit, IoPoolExternal and IoPoolRunCompletions are only called
+//       from the select thread
+//
+
+struct IoRequest;
+
+// Runs the file system operation of a request on a worker
+typedef void (*IoWork)(IoRequest* request);
+// Finishes a request on the select thread, the request isn't used again
+typedef void (*IoComplete)(IoRequest* request, char* sharedBuffer);
+
+// Embedded at the start of the state of an operation
+struct IoRequest
+{
+    IoRequest* next;
+    IoWork work;
+    IoComplete complete;
+};
+
+// Starts the worker threads and creates the socket that wakes the select
+// thread, no threads leaves every operation on the select thread (requests
+// can still be completed by other threads with IoPoolComplete)
+// Returns: non-zero on error
+int IoPoolInit(UINT threadCount);
+
+// Returns: the worker threads, 0 if handlers make their file system calls
+//          themselves
+UINT IoPoolThreads();
+
+// Returns: the socket the select thread selects on for reading, its handler
+//          calls IoPoolRunCompletions
+SOCKET IoPoolWakeSocket();
+
+void IoPoolSubmit(IoRequest* request);
+
+// Counts a request that another thread completes with IoPoolComplete instead
+// of a worker running it, so IoPoolWait waits for it too
+// Note: may be called after the other thread has completed the request, as
+//       long as it is called before the select thread runs completions again
+void IoPoolExternal(IoRequest* request);
+
+// Queues a request whose work is done to be completed on the select thread,
+// can be called from any thread
+void IoPoolComplete(IoRequest* request);
+
+// Completes every request the workers have finished
+void IoPoolRunCompletions(char* sharedBuffer);
+
+// Waits for every request that was submitted and completes them
+void IoPoolWait(char* sharedBuffer);
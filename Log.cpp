@@ -0,0 +1,680 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Common.h"
+
+// Largest record, longer string arguments are truncated
+#define LOG_MAX_RECORD 1024
+// Largest formatted line
+#define LOG_MAX_LINE   2048
+// Size of the buffer the log thread formats lines into before writing them
+#define LOG_OUTPUT_BUFFER_SIZE (64*1024)
+
+// Every component logs info and above until it is configured
+#define LOG_INFO_MASK (LOG_BIT(0, LOG_LEVEL_ERROR) | LOG_BIT(0, LOG_LEVEL_WARNING) | LOG_BIT(0, LOG_LEVEL_INFO))
+UINT logMask =
+    (LOG_INFO_MASK << (LOG_COMPONENT_SERVER  * LOG_LEVEL_COUNT)) |
+    (LOG_INFO_MASK << (LOG_COMPONENT_NET     * LOG_LEVEL_COUNT)) |
+    (LOG_INFO_MASK << (LOG_COMPONENT_RPC     * LOG_LEVEL_COUNT)) |
+    (LOG_INFO_MASK << (LOG_COMPONENT_NFS     * LOG_LEVEL_COUNT)) |
+    (LOG_INFO_MASK << (LOG_COMPONENT_MOUNT   * LOG_LEVEL_COUNT)) |
+    (LOG_INFO_MASK << (LOG_COMPONENT_PORTMAP * LOG_LEVEL_COUNT)) |
+    (LOG_INFO_MASK << (LOG_COMPONENT_SELECT  * LOG_LEVEL_COUNT));
+
+static const char* componentNames[LOG_COMPONENT_COUNT] = {
+    "server", "net", "rpc", "nfs", "mount", "portmap", "select",
+};
+static const char* levelNames[LOG_LEVEL_COUNT] = {
+    "error", "warning", "info", "debug",
+};
+static const char* levelPrefixes[LOG_LEVEL_COUNT] = {
+    "Error: ", "Warning: ", "", "Debug: ",
+};
+
+// A record in a ring is this header followed by the arguments in the order
+// the format string uses them.  Numbers take 8 bytes, strings are an 8 byte
+// length followed by the string and its terminating NUL, padded to 8 bytes.
+// A record with a NULL format (or a gap too small for a header) at the end of
+// a ring means the next record is at the start of the ring.
+struct LogRecord
+{
+    UINT size; // including the header, always a multiple of 8
+    USHORT component;
+    USHORT level;
+    INT64 time;
+    const char* format;
+};
+
+// Written by one thread and read by the log thread
+struct LogRing
+{
+    char* buffer;
+    // Total bytes written and read, the ring is empty when they are equal
+    volatile UINT head; // only modified by the thread that owns the ring
+    volatile UINT tail; // only modified by the log thread
+    volatile LONG dropped;
+    UINT drainHead; // the head when the log thread started draining the ring
+    LogRing* next;
+};
+
+static __declspec(thread) LogRing* threadRing = NULL;
+
+// NOTE: rings are only added to the list (never removed), the list is only
+//       modified inside the critical section
+static CRITICAL_SECTION ringsLock;
+static LogRing* volatile allRings = NULL;
+
+static HANDLE logThread = NULL;
+static HANDLE logEvent;
+static volatile bool logRunning = false;
+static volatile bool logStopping = false;
+
+// One conversion specification of a format string
+struct LogConversion
+{
+    const char* start; // the '%'
+    const char* end;   // just after the conversion character
+    UINT starCount;    // number of '*' widths/precisions it takes
+    bool starPrecision;
+    int precision;     // -1 if there isn't a literal precision
+    char length;       // 0, 'L' (long long), 'l' (long) or 'z' (pointer sized)
+    char type;         // the conversion character, '%' for "%%"
+};
+
+// Returns: the first conversion in format, NULL if there are none left
+static const char* NextConversion(const char* format, LogConversion* conversion)
+{
+    const char* next = strchr(format, '%');
+    if(!next)
+    {
+        return NULL;
+    }
+    conversion->start = next;
+    conversion->starCount = 0;
+    conversion->starPrecision = false;
+    conversion->precision = -1;
+    conversion->length = 0;
+    next++;
+    while(*next && strchr("-+ #0", *next))
+    {
+        next++;
+    }
+    if(*next == '*')
+    {
+        conversion->starCount++;
+        next++;
+    }
+    while(*next >= '0' && *next <= '9')
+    {
+        next++;
+    }
+    if(*next == '.')
+    {
+        next++;
+        if(*next == '*')
+        {
+            conversion->starCount++;
+            conversion->starPrecision = true;
+            next++;
+        }
+        else
+        {
+            conversion->precision = atoi(next);
+        }
+        while(*next >= '0' && *next <= '9')
+        {
+            next++;
+        }
+    }
+    if(next[0] == 'l' && next[1] == 'l')
+    {
+        conversion->length = 'L';
+        next += 2;
+    }
+    else if(next[0] == 'I' && next[1] == '6' && next[2] == '4')
+    {
+        conversion->length = 'L';
+        next += 3;
+    }
+    else if(next[0] == 'I' && next[1] == '3' && next[2] == '2')
+    {
+        next += 3;
+    }
+    else if(*next == 'j')
+    {
+        conversion->length = 'L';
+        next++;
+    }
+    else if(*next == 'l')
+    {
+        conversion->length = 'l';
+        next++;
+    }
+    else if(*next == 'z' || *next == 't' || *next == 'I')
+    {
+        conversion->length = 'z';
+        next++;
+    }
+    else
+    {
+        while(*next == 'h')
+        {
+            next++;
+        }
+    }
+    conversion->type = *next;
+    if(*next)
+    {
+        next++;
+    }
+    conversion->end = next;
+    return next;
+}
+
+static bool IsSigned(char type)
+{
+    return type == 'd' || type == 'i';
+}
+static bool IsFloat(char type)
+{
+    return strchr("fFeEgGaA", type) != NULL;
+}
+
+static INT64 QpcNow()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+// Copies the arguments format uses into a record
+// Returns: the size of the record
+static UINT EncodeRecord(char* record, UINT component, UINT level, const char* format, va_list args)
+{
+    LogRecord* header = (LogRecord*)record;
+    header->component = (USHORT)component;
+    header->level = (USHORT)level;
+    header->time = QpcNow();
+    header->format = format;
+
+    char* next = record + sizeof(LogRecord);
+    char* limit = record + LOG_MAX_RECORD;
+    LogConversion conversion;
+    for(const char* p = format; (p = NextConversion(p, &conversion)) != NULL; )
+    {
+        if(conversion.type == '%' || conversion.type == '\0')
+        {
+            continue;
+        }
+        int precision = conversion.precision;
+        for(UINT i = 0; i < conversion.starCount; i++)
+        {
+            // a '*' precision always comes after a '*' width
+            int star = va_arg(args, int);
+            if(conversion.starPrecision && i == conversion.starCount - 1)
+            {
+                precision = star;
+            }
+            if(next + 8 <= limit)
+            {
+                *(INT64*)next = star;
+                next += 8;
+            }
+        }
+
+        INT64 value;
+        if(conversion.type == 's')
+        {
+            const char* string = va_arg(args, const char*);
+            if(!string)
+            {
+                string = "(null)";
+            }
+            size_t length;
+            if(precision >= 0)
+            {
+                const char* end = (const char*)memchr(string, '\0', precision);
+                length = end ? (size_t)(end - string) : (size_t)precision;
+            }
+            else
+            {
+                length = strlen(string);
+            }
+            if(next + 16 > limit)
+            {
+                break;
+            }
+            if(length > (size_t)(limit - next - 9))
+            {
+                length = limit - next - 9;
+            }
+            *(INT64*)next = (INT64)length;
+            memcpy(next + 8, string, length);
+            next[8 + length] = '\0';
+            next += 8 + ((length + 1 + 7) & ~(size_t)7);
+            continue;
+        }
+        if(IsFloat(conversion.type))
+        {
+            double d = va_arg(args, double);
+            memcpy(&value, &d, 8);
+        }
+        else if(conversion.type == 'p' || conversion.type == 'n')
+        {
+            value = (INT64)(UINT_PTR)va_arg(args, void*);
+        }
+        else if(conversion.length == 'L')
+        {
+            value = va_arg(args, long long);
+        }
+        else if(conversion.length == 'l')
+        {
+            value = IsSigned(conversion.type) ? (INT64)va_arg(args, long) : (INT64)va_arg(args, unsigned long);
+        }
+        else if(conversion.length == 'z')
+        {
+            value = (INT64)va_arg(args, size_t);
+        }
+        else
+        {
+            value = IsSigned(conversion.type) ? (INT64)va_arg(args, int) : (INT64)va_arg(args, unsigned int);
+        }
+        if(next + 8 > limit)
+        {
+            break;
+        }
+        *(INT64*)next = value;
+        next += 8;
+    }
+    header->size = (UINT)(next - record);
+    return header->size;
+}
+
+// Formats one conversion into line
+// Returns: the length written
+static int FormatConversion(char* line, size_t size, const char* spec, int* stars, UINT starCount, LogConversion* conversion, char** next)
+{
+    #define LOG_FORMAT(value) \
+        ((starCount == 0) ? snprintf(line, size, spec, value) : \
+         (starCount == 1) ? snprintf(line, size, spec, stars[0], value) : \
+                            snprintf(line, size, spec, stars[0], stars[1], value))
+    int length;
+    if(conversion->type == 's')
+    {
+        length = LOG_FORMAT(*next + 8);
+        *next += 8 + ((*(INT64*)*next + 1 + 7) & ~7);
+        return length;
+    }
+    INT64 value = *(INT64*)*next;
+    *next += 8;
+    if(IsFloat(conversion->type))
+    {
+        double d;
+        memcpy(&d, &value, 8);
+        length = LOG_FORMAT(d);
+    }
+    else if(conversion->type == 'p')
+    {
+        length = LOG_FORMAT((void*)(UINT_PTR)value);
+    }
+    else if(conversion->type == 'n')
+    {
+        length = 0;
+    }
+    else if(conversion->length == 'L')
+    {
+        length = LOG_FORMAT((long long)value);
+    }
+    else if(conversion->length == 'l')
+    {
+        length = LOG_FORMAT((long)value);
+    }
+    else if(conversion->length == 'z')
+    {
+        length = LOG_FORMAT((size_t)value);
+    }
+    else
+    {
+        length = LOG_FORMAT((int)value);
+    }
+    #undef LOG_FORMAT
+    return length;
+}
+
+// Formats a record into line, followed by "\r\n"
+// Returns: the length of the line
+static UINT FormatRecord(char* record, char* line)
+{
+    LogRecord* header = (LogRecord*)record;
+    char* recordLimit = record + header->size;
+    char* next = record + sizeof(LogRecord);
+    char* out = line;
+    char* outLimit = line + LOG_MAX_LINE - 2;
+
+    const char* prefix = levelPrefixes[header->level];
+    size_t prefixLength = strlen(prefix);
+    memcpy(out, prefix, prefixLength);
+    out += prefixLength;
+
+    const char* text = header->format;
+    LogConversion conversion;
+    for(const char* p; (p = NextConversion(text, &conversion)) != NULL; text = p)
+    {
+        // text is set to "" when the rest of the format can't be written
+        size_t literalLength = conversion.start - text;
+        if(literalLength > (size_t)(outLimit - out))
+        {
+            literalLength = outLimit - out;
+        }
+        memcpy(out, text, literalLength);
+        out += literalLength;
+        if(conversion.type == '%')
+        {
+            if(out < outLimit)
+            {
+                *out++ = '%';
+            }
+            continue;
+        }
+        int stars[2];
+        UINT valueSize = 8 * conversion.starCount + 8;
+        if(conversion.type == '\0' || next + valueSize > recordLimit)
+        {
+            text = ""; // a bad format or the record was truncated
+            break;
+        }
+        for(UINT i = 0; i < conversion.starCount; i++)
+        {
+            stars[i] = (int)*(INT64*)next;
+            next += 8;
+        }
+        char spec[32];
+        size_t specLength = conversion.end - conversion.start;
+        if(specLength >= sizeof(spec))
+        {
+            text = "";
+            break;
+        }
+        memcpy(spec, conversion.start, specLength);
+        spec[specLength] = '\0';
+        int length = FormatConversion(out, outLimit - out + 1, spec, stars, conversion.starCount, &conversion, &next);
+        if(length > 0)
+        {
+            out += ((size_t)length > (size_t)(outLimit - out)) ? outLimit - out : length;
+        }
+    }
+    size_t literalLength = strlen(text);
+    if(literalLength > (size_t)(outLimit - out))
+    {
+        literalLength = outLimit - out;
+    }
+    memcpy(out, text, literalLength);
+    out += literalLength;
+    out[0] = '\r';
+    out[1] = '\n';
+    return (UINT)(out + 2 - line);
+}
+
+// Returns: the calling thread's ring, NULL if out of memory
+static LogRing* GetThreadRing()
+{
+    if(threadRing == NULL)
+    {
+        LogRing* ring = (LogRing*)calloc(1, sizeof(LogRing));
+        if(!ring)
+        {
+            return NULL;
+        }
+        ring->buffer = (char*)malloc(LOG_RING_SIZE);
+        if(!ring->buffer)
+        {
+            free(ring);
+            return NULL;
+        }
+        EnterCriticalSection(&ringsLock);
+        ring->next = allRings;
+        allRings = ring;
+        LeaveCriticalSection(&ringsLock);
+        threadRing = ring;
+    }
+    return threadRing;
+}
+
+// Copies a record into the ring
+// Returns: false if the ring doesn't have room for it
+static bool RingWrite(LogRing* ring, char* record, UINT size)
+{
+    UINT head = ring->head;
+    UINT used = head - ring->tail;
+    UINT offset = head & (LOG_RING_SIZE - 1);
+    UINT gap = LOG_RING_SIZE - offset;
+    UINT needed = (gap < size) ? gap + size : size;
+    if(used + needed > LOG_RING_SIZE)
+    {
+        return false;
+    }
+    if(gap < size)
+    {
+        if(gap >= sizeof(LogRecord))
+        {
+            LogRecord* wrap = (LogRecord*)(ring->buffer + offset);
+            wrap->size = gap;
+            wrap->format = NULL;
+        }
+        offset = 0;
+    }
+    memcpy(ring->buffer + offset, record, size);
+    MemoryBarrier();
+    ring->head = head + needed;
+
+    // Wake the log thread early when the ring gets half full
+    if(used <= LOG_RING_SIZE / 2 && used + needed > LOG_RING_SIZE / 2)
+    {
+        SetEvent(logEvent);
+    }
+    return true;
+}
+
+void LogWrite(UINT component, UINT level, const char* format, ...)
+{
+    // 8 byte aligned, the numbers in a record are read in place
+    INT64 record[LOG_MAX_RECORD / 8];
+    va_list args;
+    va_start(args, format);
+    UINT size = EncodeRecord((char*)record, component, level, format, args);
+    va_end(args);
+
+    if(logRunning)
+    {
+        LogRing* ring = GetThreadRing();
+        if(ring)
+        {
+            if(!RingWrite(ring, (char*)record, size))
+            {
+                InterlockedIncrement(&ring->dropped);
+            }
+            return;
+        }
+    }
+    char line[LOG_MAX_LINE];
+    UINT length = FormatRecord((char*)record, line);
+    fwrite(line, 1, length, stdout);
+}
+
+// Skips a wrap record at the tail of the ring
+// Returns: the record at the tail
+static LogRecord* RingPeek(LogRing* ring)
+{
+    UINT offset = ring->tail & (LOG_RING_SIZE - 1);
+    UINT gap = LOG_RING_SIZE - offset;
+    if(gap < sizeof(LogRecord) || ((LogRecord*)(ring->buffer + offset))->format == NULL)
+    {
+        ring->tail += gap;
+        offset = 0;
+    }
+    return (LogRecord*)(ring->buffer + offset);
+}
+
+static void WriteOutput(char* output, UINT* outputLength)
+{
+    fwrite(output, 1, *outputLength, stdout);
+    *outputLength = 0;
+}
+
+// Formats and writes out the records in every ring, oldest first
+static void DrainRings(char* output)
+{
+    // Rings added after this are drained the next time
+    LogRing* firstRing = allRings;
+    UINT outputLength = 0;
+    for(LogRing* ring = firstRing; ring; ring = ring->next)
+    {
+        LONG dropped = InterlockedExchange(&ring->dropped, 0);
+        if(dropped)
+        {
+            if(outputLength + LOG_MAX_LINE > LOG_OUTPUT_BUFFER_SIZE)
+            {
+                WriteOutput(output, &outputLength);
+            }
+            outputLength += sprintf(output + outputLength, "Warning: the log ring of a thread was full, %d records were dropped\r\n", dropped);
+        }
+        ring->drainHead = ring->head;
+    }
+    MemoryBarrier();
+
+    while(true)
+    {
+        LogRecord* oldest = NULL;
+        LogRing* oldestRing = NULL;
+        for(LogRing* ring = firstRing; ring; ring = ring->next)
+        {
+            if(ring->tail == ring->drainHead)
+            {
+                continue;
+            }
+            LogRecord* record = RingPeek(ring);
+            if(!oldest || record->time < oldest->time)
+            {
+                oldest = record;
+                oldestRing = ring;
+            }
+        }
+        if(!oldest)
+        {
+            break;
+        }
+        if(outputLength + LOG_MAX_LINE > LOG_OUTPUT_BUFFER_SIZE)
+        {
+            WriteOutput(output, &outputLength);
+        }
+        outputLength += FormatRecord((char*)oldest, output + outputLength);
+        UINT size = oldest->size;
+        MemoryBarrier();
+        oldestRing->tail += size;
+    }
+    if(outputLength)
+    {
+        WriteOutput(output, &outputLength);
+    }
+    fflush(stdout);
+}
+
+static DWORD WINAPI LogThread(LPVOID param)
+{
+    char* output = (char*)malloc(LOG_OUTPUT_BUFFER_SIZE);
+    if(!output)
+    {
+        logRunning = false;
+        return 1;
+    }
+    while(true)
+    {
+        WaitForSingleObject(logEvent, LOG_FLUSH_INTERVAL);
+        bool stopping = logStopping;
+        DrainRings(output);
+        if(stopping)
+        {
+            break;
+        }
+    }
+    free(output);
+    return 0;
+}
+
+int LogSetLevel(const char* component, const char* level)
+{
+    UINT levelIndex;
+    if(strcmp(level, "off") == 0)
+    {
+        levelIndex = LOG_LEVEL_COUNT; // means none
+    }
+    else
+    {
+        for(levelIndex = 0; levelIndex < LOG_LEVEL_COUNT; levelIndex++)
+        {
+            if(strcmp(level, levelNames[levelIndex]) == 0)
+            {
+                break;
+            }
+        }
+        if(levelIndex == LOG_LEVEL_COUNT)
+        {
+            return 1;
+        }
+    }
+    UINT levelBits = (levelIndex == LOG_LEVEL_COUNT) ? 0 : (1U << (levelIndex + 1)) - 1;
+
+    bool all = (strcmp(component, "all") == 0);
+    bool found = false;
+    for(UINT i = 0; i < LOG_COMPONENT_COUNT; i++)
+    {
+        if(all || strcmp(component, componentNames[i]) == 0)
+        {
+            UINT componentMask = ((1U << LOG_LEVEL_COUNT) - 1) << (i * LOG_LEVEL_COUNT);
+            logMask = (logMask & ~componentMask) | (levelBits << (i * LOG_LEVEL_COUNT));
+            found = true;
+        }
+    }
+    return found ? 0 : 1;
+}
+
+int LogStart()
+{
+    InitializeCriticalSection(&ringsLock);
+    logEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(logEvent == NULL)
+    {
+        LOG_ERROR("[LOG] CreateEvent failed (e=%d)", GetLastError());
+        return 1;
+    }
+    logRunning = true;
+    logThread = CreateThread(NULL, 0, &LogThread, NULL, 0, NULL);
+    if(logThread == NULL)
+    {
+        logRunning = false;
+        LOG_ERROR("[LOG] CreateThread failed (e=%d)", GetLastError());
+        return 1;
+    }
+    return 0;
+}
+
+void LogStop()
+{
+    if(logThread == NULL)
+    {
+        return;
+    }
+    // Records written between here and the last drain are lost, the
+    // program is about to exit anyway
+    logStopping = true;
+    SetEvent(logEvent);
+    WaitForSingleObject(logThread, INFINITE);
+    CloseHandle(logThread);
+    logThread = NULL;
+    logRunning = false;
+    fflush(stdout);
+}
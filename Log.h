@@ -0,0 +1,84 @@
+#pragma once
+
+//
+// Log
+// --------------------------------------------------------
+// Every log call belongs to a component and has a level.  Whether a
+// (component, level) pair is enabled is one bit of logMask, so a disabled
+// call costs a single test and branch and its arguments are never evaluated.
+//
+// An enabled call doesn't format anything.  The format string pointer and
+// the raw arguments (strings are copied) are written as a binary record into
+// a ring owned by the calling thread, so logging takes no locks and makes no
+// system calls.  The log thread takes the records out of every ring in time
+// order, formats them and writes them to stdout.  When a ring is full the
+// record is dropped and the log thread reports how many were dropped.
+//
+// Before LogStart (and in programs that never call it) records are formatted
+// and written by the calling thread.
+//
+// NOTE: only the pointer to the format string is kept, it must be a literal
+//
+// Levels are set per component with the LogLevel setting, a component logs
+// its level and every level above it:
+//
+//   error, warning, info, debug
+//
+
+#define LOG_COMPONENT_SERVER  0 // anything that doesn't belong to another component
+#define LOG_COMPONENT_NET     1 // tcp connections, sends and receives
+#define LOG_COMPONENT_RPC     2
+#define LOG_COMPONENT_NFS     3
+#define LOG_COMPONENT_MOUNT   4
+#define LOG_COMPONENT_PORTMAP 5
+#define LOG_COMPONENT_SELECT  6 // the select server
+#define LOG_COMPONENT_COUNT   7
+
+#define LOG_LEVEL_ERROR   0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO    2
+#define LOG_LEVEL_DEBUG   3
+#define LOG_LEVEL_COUNT   4
+
+// Application can override the size of each thread's ring, must be a power of 2
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE (256*1024)
+#endif
+
+// Application can override how often (in milliseconds) the log thread
+// writes out records when the rings aren't filling up
+#ifndef LOG_FLUSH_INTERVAL
+#define LOG_FLUSH_INTERVAL 50
+#endif
+
+#define LOG_BIT(component, level) (1U << ((component) * LOG_LEVEL_COUNT + (level)))
+
+// The enabled (component, level) pairs, see LOG_BIT
+extern UINT logMask;
+
+#define LOG_AT(component, level, fmt, ...) do { \
+    if(logMask & LOG_BIT(LOG_COMPONENT_##component, LOG_LEVEL_##level)) \
+        LogWrite(LOG_COMPONENT_##component, LOG_LEVEL_##level, fmt,##__VA_ARGS__); \
+    } while(0)
+
+#define LOG_ERROR(fmt,...) LOG_AT(SERVER, ERROR, fmt,##__VA_ARGS__)
+#define LOG_DEBUG(fmt,...) LOG_AT(SERVER, DEBUG, fmt,##__VA_ARGS__)
+#define LOG(fmt,...)       LOG_AT(SERVER, INFO , fmt,##__VA_ARGS__)
+
+#define LOG_NET(fmt,...)   LOG_AT(NET, DEBUG, "[NET] " fmt,##__VA_ARGS__)
+#define LOG_RPC(fmt,...)   LOG_AT(RPC, DEBUG, "[RPC] " fmt,##__VA_ARGS__)
+
+// Note: use the LOG macros instead, they skip the call when the level is disabled
+void LogWrite(UINT component, UINT level, const char* format, ...);
+
+// Sets the level of a component ("all" sets every component)
+// level: off, error, warning, info or debug
+// Returns: non-zero if the component or level is unknown
+int LogSetLevel(const char* component, const char* level);
+
+// Starts the log thread, records are written to the rings from now on
+// Returns: non-zero on error
+int LogStart();
+
+// Writes out every record and stops the log thread
+void LogStop();
@@ -0,0 +1,254 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <string.h>
+
+#include "Common.h"
+#include "Rpc.h"
+#include "Stats.h"
+#include "LoopMonitor.h"
+
+#define LOOP_HISTOGRAM_SELECT  0
+#define LOOP_HISTOGRAM_HANDLER 1
+#define LOOP_HISTOGRAM_BUSY    2
+#define LOOP_HISTOGRAM_READY   3
+#define LOOP_HISTOGRAM_COUNT   4
+
+struct LoopWindow
+{
+    DWORD startTickCount;
+    DWORD length; // milliseconds, only set once the window is complete
+    UINT64 iterations;
+    UINT64 handlerCalls;
+    UINT64 socksAdded;
+    UINT64 socksRemoved;
+    UINT64 stalls;
+    UINT64 histograms[LOOP_HISTOGRAM_COUNT][STATS_BUCKET_COUNT];
+};
+
+struct LoopStall
+{
+    UINT64 time; // milliseconds since the server started
+    UINT socket;
+    UINT program;
+    UINT procedure;
+    UINT running; // milliseconds
+};
+
+// Only used by the select thread
+static LoopWindow windows[2]; // the last complete window and the current one
+static LoopWindow* lastWindow = &windows[0];
+static LoopWindow* currentWindow = &windows[1];
+static INT64 selectStart;
+static INT64 selectEnd;
+static UINT stallThresholdMicros;
+static LONG nextHandlerCall = 0;
+
+// The handler that is running, read by the watchdog thread.  call is set
+// last when a handler begins, and cleared when it ends, the watchdog checks
+// it again after reading the rest to know they belong to the same call.
+static volatile LONG handlerCall = 0;
+static volatile INT64 handlerStart;
+static volatile UINT handlerSocket;
+static volatile UINT handlerProgram;
+static volatile UINT handlerProcedure;
+
+// Written by the watchdog thread, read by LoopMonitorEncode
+static CRITICAL_SECTION stallLock;
+static LoopStall stalls[LOOP_MONITOR_STALL_HISTORY];
+static UINT stallCount = 0; // every stall that was detected
+static INT64 monitorStartTime;
+
+static DWORD WINAPI WatchdogThread(LPVOID param)
+{
+    UINT threshold = (UINT)(UINT_PTR)param; // milliseconds
+    DWORD interval = (threshold >= 4) ? threshold / 4 : 1;
+    LONG reportedCall = 0;
+    while(true)
+    {
+        Sleep(interval);
+
+        LONG call = handlerCall;
+        if(call == 0 || call == reportedCall)
+        {
+            continue;
+        }
+        MemoryBarrier();
+        INT64 start    = handlerStart;
+        UINT socket    = handlerSocket;
+        UINT program   = handlerProgram;
+        UINT procedure = handlerProcedure;
+        MemoryBarrier();
+        if(handlerCall != call)
+        {
+            continue; // the handler finished while we were reading it
+        }
+        INT64 now = StatsNow();
+        UINT running = (UINT)(StatsTicksToMicros(now - start) / 1000);
+        if(running < threshold)
+        {
+            continue;
+        }
+        reportedCall = call;
+
+        LOG_AT(SELECT, WARNING, "[LOOP] stall: handler for s=%u has been running for %u ms (program %u procedure %u)",
+            socket, running, program, procedure);
+        EnterCriticalSection(&stallLock);
+        LoopStall* stall = &stalls[stallCount % LOOP_MONITOR_STALL_HISTORY];
+        stall->time      = StatsTicksToMicros(now - monitorStartTime) / 1000;
+        stall->socket    = socket;
+        stall->program   = program;
+        stall->procedure = procedure;
+        stall->running   = running;
+        stallCount++;
+        LeaveCriticalSection(&stallLock);
+    }
+}
+
+int LoopMonitorStart(UINT stallThreshold)
+{
+    InitializeCriticalSection(&stallLock);
+    monitorStartTime = StatsNow();
+    currentWindow->startTickCount = GetTickCount();
+    stallThresholdMicros = stallThreshold * 1000;
+    if(stallThreshold == 0)
+    {
+        return 0;
+    }
+    HANDLE thread = CreateThread(NULL, 0, &WatchdogThread, (LPVOID)(UINT_PTR)stallThreshold, 0, NULL);
+    if(thread == NULL)
+    {
+        LOG_ERROR("[LOOP] CreateThread failed (e=%d)", GetLastError());
+        return 1;
+    }
+    CloseHandle(thread);
+    LOG("[LOOP] watching for handlers that run longer than %u ms", stallThreshold);
+    return 0;
+}
+
+static inline void Record(UINT histogram, UINT64 value)
+{
+    currentWindow->histograms[histogram][StatsBucketIndex(value)]++;
+}
+
+void LoopMonitorSelectBegin()
+{
+    selectStart = StatsNow();
+    if(selectEnd)
+    {
+        Record(LOOP_HISTOGRAM_BUSY, StatsTicksToMicros(selectStart - selectEnd));
+    }
+
+    DWORD now = GetTickCount();
+    if(now - currentWindow->startTickCount >= LOOP_MONITOR_WINDOW * 1000)
+    {
+        LoopWindow* completed = currentWindow;
+        completed->length = now - completed->startTickCount;
+        currentWindow = lastWindow;
+        lastWindow = completed;
+        memset(currentWindow, 0, sizeof(LoopWindow));
+        currentWindow->startTickCount = now;
+    }
+}
+
+void LoopMonitorSelectEnd(int readyCount)
+{
+    selectEnd = StatsNow();
+    currentWindow->iterations++;
+    Record(LOOP_HISTOGRAM_SELECT, StatsTicksToMicros(selectEnd - selectStart));
+    if(readyCount >= 0)
+    {
+        Record(LOOP_HISTOGRAM_READY, (UINT64)readyCount);
+    }
+}
+
+void LoopMonitorHandlerBegin(UINT socket)
+{
+    handlerStart     = StatsNow();
+    handlerSocket    = socket;
+    handlerProgram   = LOOP_MONITOR_UNKNOWN;
+    handlerProcedure = LOOP_MONITOR_UNKNOWN;
+    if(++nextHandlerCall == 0)
+    {
+        nextHandlerCall = 1;
+    }
+    MemoryBarrier();
+    handlerCall = nextHandlerCall;
+}
+
+void LoopMonitorHandlerEnd()
+{
+    handlerCall = 0;
+    UINT64 micros = StatsTicksToMicros(StatsNow() - handlerStart);
+    currentWindow->handlerCalls++;
+    Record(LOOP_HISTOGRAM_HANDLER, micros);
+    if(stallThresholdMicros && micros >= stallThresholdMicros)
+    {
+        currentWindow->stalls++;
+        LOG_AT(SELECT, WARNING, "[LOOP] stall: handler for s=%u took %u ms (program %u procedure %u)",
+            handlerSocket, (UINT)(micros / 1000), handlerProgram, handlerProcedure);
+    }
+}
+
+void LoopMonitorSocksChanged(UINT added, UINT removed)
+{
+    currentWindow->socksAdded   += added;
+    currentWindow->socksRemoved += removed;
+}
+
+void LoopMonitorSetCall(UINT program, UINT procedure)
+{
+    handlerProgram   = program;
+    handlerProcedure = procedure;
+}
+
+#define LOOP_WINDOW_ENCODED_SIZE (4 + 5 * 8 + LOOP_HISTOGRAM_COUNT * STATS_BUCKET_COUNT * 8)
+#define LOOP_STALL_ENCODED_SIZE  (8 + 4 * 4)
+
+UINT LoopMonitorEncode(char* buffer, UINT maxLength)
+{
+    if(maxLength < 16 + 2 * LOOP_WINDOW_ENCODED_SIZE + 4 + LOOP_MONITOR_STALL_HISTORY * LOOP_STALL_ENCODED_SIZE)
+    {
+        return 0;
+    }
+    AppendUint(buffer +  0, 0);
+    AppendUint(buffer +  4, STATS_SUB_BUCKET_BITS);
+    AppendUint(buffer +  8, STATS_BUCKET_COUNT);
+    AppendUint(buffer + 12, LOOP_MONITOR_WINDOW);
+    char* next = buffer + 16;
+    for(UINT w = 0; w < 2; w++)
+    {
+        LoopWindow* window = (w == 0) ? lastWindow : currentWindow;
+        AppendUint  (next +  0, (w == 0) ? window->length : GetTickCount() - window->startTickCount);
+        AppendUint64(next +  4, window->iterations);
+        AppendUint64(next + 12, window->handlerCalls);
+        AppendUint64(next + 20, window->socksAdded);
+        AppendUint64(next + 28, window->socksRemoved);
+        AppendUint64(next + 36, window->stalls);
+        next += 44;
+        for(UINT h = 0; h < LOOP_HISTOGRAM_COUNT; h++)
+        {
+            for(UINT i = 0; i < STATS_BUCKET_COUNT; i++)
+            {
+                AppendUint64(next, window->histograms[h][i]);
+                next += 8;
+            }
+        }
+    }
+
+    EnterCriticalSection(&stallLock);
+    UINT count = (stallCount < LOOP_MONITOR_STALL_HISTORY) ? stallCount : LOOP_MONITOR_STALL_HISTORY;
+    AppendUint(next, count);
+    next += 4;
+    for(UINT i = stallCount - count; i < stallCount; i++)
+    {
+        LoopStall* stall = &stalls[i % LOOP_MONITOR_STALL_HISTORY];
+        AppendUint64(next +  0, stall->time);
+        AppendUint  (next +  8, stall->socket);
+        AppendUint  (next + 12, stall->program);
+        AppendUint  (next + 16, stall->procedure);
+        AppendUint  (next + 20, stall->running);
+        next += LOOP_STALL_ENCODED_SIZE;
+    }
+    LeaveCriticalSection(&stallLock);
+    return (UINT)(next - buffer);
+}
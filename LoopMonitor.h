@@ -0,0 +1,70 @@
+#pragma once
+
+//
+// Loop Monitor
+// --------------------------------------------------------
+// Every handler runs on the select thread, so one slow handler holds up
+// every other connection.  The select server calls the loop monitor around
+// every select call and every handler call (see the SELECT_SERVER_ hooks in
+// SelectServerParams.h), which records into histograms:
+//
+//   select wait  microseconds spent in select
+//   handler      microseconds spent in each handler call
+//   busy         microseconds from select returning to the next select call,
+//                the time it takes to handle everything one select popped
+//   ready        sockets select returned
+//
+// along with counts of iterations, handler calls, and sockets added and
+// removed.  The histograms are bucketed like the call stats (see Stats.h)
+// and roll over every LOOP_MONITOR_WINDOW seconds, the last complete window
+// and the current one are kept.
+//
+// With a StallThreshold a watchdog thread checks the running handler every
+// quarter of the threshold.  A handler that has been running for longer is
+// logged as a stall with its socket and the program and procedure of the
+// call it is handling, while it is still stuck, and the most recent stalls
+// are kept for the stats.
+//
+// The stats are served by the LOOP procedure of the stats program, which
+// returns
+//   0, the sub bucket bits, the bucket count and the window seconds (uints),
+//   the last complete window then the current window, each one is
+//     the milliseconds it covers (uint), then iterations, handler calls,
+//     sockets added, sockets removed and stalls (uint64s), then the select
+//     wait, handler, busy and ready buckets (uint64s)
+//   the stall count (uint), then oldest first for each stall
+//     milliseconds since the server started (uint64), socket, program and
+//     procedure (0xFFFFFFFF if not known yet), milliseconds it had been
+//     running when it was detected (uints)
+//
+
+// Application can override the length of a histogram window in seconds
+#ifndef LOOP_MONITOR_WINDOW
+#define LOOP_MONITOR_WINDOW 60
+#endif
+
+// Application can override how many stalls are kept for the stats
+#ifndef LOOP_MONITOR_STALL_HISTORY
+#define LOOP_MONITOR_STALL_HISTORY 16
+#endif
+
+#define LOOP_MONITOR_UNKNOWN 0xFFFFFFFF
+
+// Starts the watchdog thread, a stallThreshold of 0 doesn't start it
+// Note: StatsInit must have been called
+// Returns: non-zero on error
+int LoopMonitorStart(UINT stallThreshold);
+
+// Note: the rest are only called from the select thread
+void LoopMonitorSelectBegin();
+void LoopMonitorSelectEnd(int readyCount);
+void LoopMonitorHandlerBegin(UINT socket);
+void LoopMonitorHandlerEnd();
+void LoopMonitorSocksChanged(UINT added, UINT removed);
+
+// Records the call the running handler is handling
+void LoopMonitorSetCall(UINT program, UINT procedure);
+
+// Writes the loop stats in the format of the LOOP procedure
+// Returns: the length written, 0 if they don't fit in maxLength
+UINT LoopMonitorEncode(char* buffer, UINT maxLength);
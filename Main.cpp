@@ -1,17 +1,38 @@
-#include <winsock2.h>
-#include <stdio.h>
-
-#include "Common.h"
-#include "NfsServer.h"
-
-int main(int argc, char* argv[])
-{
-    Wsa wsa;
-    if(wsa.error)
-    {
-        LOG_ERROR("WSAStartup failed (returned %d)", wsa.error);
-        return 1;
-    }
-
-    return RunNfsServer();
+#include <winsock2.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Common.h"
+#include "Config.h"
+#include "NfsServer.h"
+
+int main(int argc, char* argv[])
+{
+    // WindowsNfsServer <config-file> replay <trace-file> [fast]
+    bool replay = (argc == 4 || argc == 5) && strcmp(argv[2], "replay") == 0 &&
+        (argc == 4 || strcmp(argv[4], "fast") == 0);
+    if(argc > 2 && !replay)
+    {
+        LOG_ERROR("Usage: WindowsNfsServer [<config-file> [replay <trace-file> [fast]]]");
+        return 1;
+    }
+    if(argc >= 2 && LoadConfig(argv[1]))
+    {
+        return 1;
+    }
+
+    Wsa wsa;
+    if(wsa.error)
+    {
+        LOG_ERROR("WSAStartup failed (returned %d)", wsa.error);
+        return 1;
+    }
+
+    if(LogStart())
+    {
+        return 1;
+    }
+    int result = replay ? ReplayTrace(argv[3], argc == 5) : RunNfsServer();
+    LogStop();
+    return result;
 }
\ No newline at end of file
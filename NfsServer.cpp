@@ -1,968 +1,4261 @@
-#include <malloc.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <windows.h>
-#include <stdio.h>
-
-#include "Common.h"
-#include "SelectServer.h"
-#include "Rpc.h"
-
-// TODO: log settings
-// --------------------------------------------------------
-//
-// Categories
-// --------------------------------------------------------
-// socket (select server log)
-// network (tcp connections, and tcp/udp sends/receives)
-// rpc
-// nfs
-// portmap
-//
-// Levels
-// --------------------------------------------------------
-// error
-// debug
-// info
-//
-
-#define SHARED_BUFFER_SIZE 8192
-
-#define MAX_IP_STRING   39 // A full IPv6 string like 2001:0db8:85a3:0000:0000:8a2e:0370:7334
-#define MAX_PORT_STRING  5 // 65535
-#define MAX_ADDR_STRING (MAX_IP_STRING + 1 + MAX_PORT_STRING)
-
-#define LITERAL_LENGTH(str) (sizeof(str)-1)
-#define STATIC_ARRAY_LENGTH(arr) (sizeof(arr)/sizeof(arr[0]))
-
-void AddrToString(char dest[], sockaddr* addr)
-{
-    if(addr->sa_family == AF_INET)
-    {
-        unsigned short port = htons(((sockaddr_in*)addr)->sin_port);
-        u_long ipv4 = htonl(((sockaddr_in*)addr)->sin_addr.s_addr);
-        sprintf(dest, "%u.%u.%u.%u:%u",
-            ipv4 >> 24, (ipv4 >> 16) & 0xFF, (ipv4 >> 8) & 0xFF,
-            ipv4 & 0xFF, port);
-    }
-    else if(addr->sa_family == AF_INET6)
-    {
-        unsigned short port = htons(((sockaddr_in6*)addr)->sin6_port);
-        sprintf(dest, "<ipv6-addr>:%u", port);
-    }
-    else
-    {
-        sprintf(dest, "<address-family:%d>", addr->sa_family);
-    }
-}
-
-
-// All the data from the Rpc call that the handler
-// will need for the response
-struct RpcCallInfo
-{
-    UINT xid;
-    UINT rpcVersion;
-    UINT program;
-    UINT programVersion;
-    UINT procedure;
-};
-
-// Length is 20 bytes
-void SetupReply(char* buffer, UINT xid)
-{
-    AppendUint(buffer +  0, xid);
-    SET_UINT  (buffer +  4, RPC_MESSAGE_TYPE_REPLY_NETWORK_ORDER);
-    SET_UINT  (buffer +  8, RPC_REPLY_ACCEPTED_NETWORK_ORDER);
-    SET_UINT  (buffer + 12, RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER);
-    SET_UINT  (buffer + 16, 0); // Auth is length 0
-}
-
-typedef UINT (*ProgramCallHandler)(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit);
-
-class RpcProgramSet
-{
-  public:
-    const char* name;
-    const UINT program;
-    const UINT minVersion;
-    const UINT maxVersion;
-    ProgramCallHandler* handlers;
-    RpcProgramSet(const char* name, UINT program, UINT minVersion, UINT maxVersion, ProgramCallHandler* handlers)
-        : name(name), program(program), minVersion(minVersion), maxVersion(maxVersion), handlers(handlers)
-    {
-    }
-};
-
-
-int sendWithLog(const char* context, SOCKET so, char* buffer, UINT length)
-{
-    int sent = send(so, buffer, length, 0);
-    if(sent != length)
-    {
-        if(sent < 0)
-        {
-            LOG_ERROR("%s(s=%u) send %u bytes failed (returned %d, e=%d)", context, so, length, sent, GetLastError());
-        }
-        else
-        {
-            LOG_ERROR("%s(s=%u) send %u bytes returned %d (e=%d)", context, so, length, sent, GetLastError());
-        }
-    }
-    return sent;
-}
-
-// The offset of an rpc reply for the handle call
-#define REPLY_OFFSET 24
-
-// Note: it is very likely that sharedBuffer will overlap with command.  Only use
-//       the shared buffer if you are done with the command.
-UINT Portmap2Handler(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit)
-{
-    switch(callInfo->procedure)
-    {
-      case PROC_NULL: // 0
-        LOG("[PORTMAP] NULL(s=%u)", sock->so);
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return 4;
-      case PORTMAP_PROC_GETPORT: // 3
-      {
-        // for now, I'm just going to return port 111 for every
-        // GETPORT request.  One technique would be to just return
-        // whichever port the current socket has connected to, so that
-        // way, you are basically guaranteed that it can connect to this
-        // port again.  In most cases, that's going to be port 111 so that's
-        // what I'll use for now.
-        LOG("[PORTMAP] GETPORT(s=%u) > %u", sock->so, 111);
-        SET_UINT  (sharedBuffer + REPLY_OFFSET + 0, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        AppendUint(sharedBuffer + REPLY_OFFSET + 4, 111); // port 111
-        return 8;
-      }
-      default:
-        LOG("[PORTMAP] unhandled procedure %u", callInfo->procedure);
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
-        return 4;
-    }
-}
-
-UINT Align4(UINT x)
-{
-    UINT mod = x&3;
-    return mod ? x+4-mod : x;
-}
-
-//
-// This implementation is temporary
-//
-struct NameHandle
-{
-    String localName;
-};
-static NameHandle nameHandles[100]; // TODO: size will not be hardcoded in final solution
-static UINT nameHandleCount = 0;
-UINT GetOrCreateHandle(String localName)
-{
-    for(UINT i = 0; i < nameHandleCount; i++)
-    {
-        if(localName.Equals(nameHandles[i].localName))
-        {
-            return i; // index is the handle for now
-        }
-    }
-    UINT handle = nameHandleCount++;
-    char* buffer = (char*)malloc(localName.length+1); // add 1 for '\0'
-    memcpy(buffer, localName.ptr, localName.length);
-    buffer[localName.length] = '\0';
-    nameHandles[handle].localName = String(buffer, localName.length);
-    LOG("Added path(handle=%u, length=%u, value='%s')",
-        handle, localName.length, nameHandles[handle].localName.ptr);
-    return handle;
-}
-struct Export
-{
-    String exportName;
-    String localName;
-};
-
-// TODO: make this configuration loaded at runtim
-Export exports[] = {
-    {String("/share", LITERAL_LENGTH("/share")),
-     String("C:\\", LITERAL_LENGTH("C:\\"))},
-};
-
-// Returns: response length
-UINT MNT(String pathString, char* buffer)
-{
-    // Find the export
-    UINT match = 0xFFFFFFFF;
-    for(UINT i = 0; i < STATIC_ARRAY_LENGTH(exports); i++)
-    {
-        if(pathString.Equals(exports[i].exportName))
-        {
-            match = i;
-            break;
-        }
-    }
-    if(match == 0xFFFFFFFF)
-    {
-        LOG("[MOUNT] MNT: path '%.*s' is not exported", pathString.length, pathString.ptr);
-        SET_UINT(buffer, MOUNT3_ERROR_NOENT_NETWORK_ORDER);
-        return 4;
-    }
-    LOG("[MOUNT] path(length=%u, value=\"%.*s\") matched '%s'",
-        pathString.length, pathString.length, pathString.ptr, exports[match].localName.ptr);
-
-    // TODO: check if it is a valid mount point
-    UINT handle = GetOrCreateHandle(exports[match].localName);
-
-    // Send reply
-    SET_UINT         (buffer +  0, MOUNT3_STATUS_OK_NETWORK_ORDER);
-    SET_UINT         (buffer +  4, _4_NETWORK_ORDER);
-    AppendUint       (buffer +  8, handle);
-    SET_UINT         (buffer + 12, RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER);
-    return 16;
-}
-
-// Constants taken from RFC1813
-#define MOUNT3_MAX_PATH        1024
-#define MOUNT3_MAX_NAME        255
-#define MOUNT3_MAX_FILE_HANDLE 64
-// Note: it is very likely that sharedBuffer will overlap with command.  Only use
-//       the shared buffer if you are done with the command.
-UINT Mount3Handler(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit)
-{
-    switch(callInfo->procedure)
-    {
-      case PROC_NULL: // 0
-        LOG("[MOUNT] NULL(s=%u)", sock->so);
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return 4;
-      case MOUNT3_PROC_MNT: // 1
-      {
-        String pathString;
-        pathString.length = ParseUint(command);
-        pathString.ptr = command + 4;
-        if(pathString.ptr + Align4(pathString.length) != limit)
-        {
-            LOG_ERROR("[MOUNT] MNT has a bad path length %u (actualSize is %u)", pathString.length, limit-pathString.ptr);
-            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
-            return 4;
-        }
-        LOG("[MOUNT] MNT(s=%u) '%.*s'", sock->so, pathString.length, pathString.ptr);
-        UINT length = MNT(pathString, sharedBuffer + REPLY_OFFSET + 4);
-        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return length + 4;
-      }
-      case MOUNT3_PROC_UMNT: // 3
-      {
-        String pathString;
-        pathString.length = ParseUint(command);
-        pathString.ptr = command + 4;
-        if(pathString.ptr + Align4(pathString.length) != limit)
-        {
-            LOG_ERROR("[MOUNT] UMNT has a bad path length %u (actualSize is %u)", pathString.length, limit-pathString.ptr);
-            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
-            return 4;
-        }
-        LOG("[MOUNT] UMNT(s=%u) '%.*s'", sock->so, pathString.length, pathString.ptr);
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return 4;
-      }
-      default:
-        LOG("[MOUNT] unhandled procedure %u", callInfo->procedure);
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
-        return 4;
-    }
-}
-
-String TryLookupHandle(char* handleBuffer, UINT handleLength)
-{
-    if(handleLength != 4)
-    {
-        LOG_ERROR("handle length of %u is not supported", handleLength);
-        return String(); // indicate error
-    }
-    UINT handle = ParseUint(handleBuffer);
-    if(handle >= nameHandleCount)
-    {
-        LOG_ERROR("handle %u is out of range", handle);
-        return String(); // indicate error
-    }
-    return nameHandles[handle].localName;
-}
-
-// MODE BITS
-#define MODE_OWNER_READ   0x0100
-#define MODE_OWNER_WRITE  0x0080
-#define MODE_OWNER_EXEC   0x0040
-#define MODE_GROUP_READ   0x0020
-#define MODE_GROUP_WRITE  0x0010
-#define MODE_GROUP_EXEC   0x0008
-#define MODE_OTHER_READ   0x0004
-#define MODE_OTHER_WRITE  0x0002
-#define MODE_OTHER_EXEC   0x0001
-
-// TODO: get a performance test on test
-UINT ToNfsSeconds(FILETIME filetime)
-{
-    // 100-nanoseconds = milliseconds * 10000
-    static const DWORD64 adjust = ((DWORD64)11644473600000 * (DWORD64)10000);
-
-    LARGE_INTEGER date;
-    date.HighPart = filetime.dwHighDateTime;
-    date.LowPart = filetime.dwLowDateTime;
-
-    // remove the diff between 1970 and 1601
-    date.QuadPart -= adjust;
-
-    // convert back to 100-nanoseconds to seconds
-    return date.QuadPart / 10000000;
-}
-
-// Returns: response length
-UINT GETATTR(char* handle, UINT handleLength, char* buffer)
-{
-    String localName = TryLookupHandle(handle, handleLength);
-    if(localName.ptr == NULL)
-    {
-        LOG("[NFS] GETATTR: bad handle");
-        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
-        SET_UINT(buffer + 4, 0); // no post_op_attr
-        return 8;
-    }
-
-    WIN32_FILE_ATTRIBUTE_DATA info;
-    if(!GetFileAttributesEx(localName.ptr, GetFileExInfoStandard, &info))
-    {
-        LOG_ERROR("[NFS] GETATTR: GetFileAttributesEx failed (e=%d)", GetLastError());
-        SET_UINT(buffer    , NFS3_ERROR_SERVERFAULT_NETWORK_ORDER);
-        SET_UINT(buffer + 4, 0); // no post_op_attr
-        return 8;
-    }
-
-    SET_UINT(buffer, NFS3_STATUS_OK_NETWORK_ORDER);
-    if(info.dwFileAttributes | FILE_ATTRIBUTE_DIRECTORY)
-    {
-        SET_UINT(buffer + 4, NFS3_FILE_TYPE_DIR_NETWORK_ORDER);
-        info.nFileSizeHigh = 0;
-        info.nFileSizeLow = 0;
-    }
-    else
-    {
-        SET_UINT(buffer + 4, NFS3_FILE_TYPE_REG_NETWORK_ORDER);
-    }
-    AppendUint(buffer + 8,
-        // Grant all permissions for now
-        MODE_OWNER_READ | MODE_OWNER_WRITE | MODE_OWNER_EXEC |
-        MODE_GROUP_READ | MODE_GROUP_WRITE | MODE_GROUP_EXEC |
-        MODE_OTHER_READ | MODE_OTHER_WRITE | MODE_OTHER_EXEC);
-    SET_UINT  (buffer + 12, _1_NETWORK_ORDER); // nlinks (number of hard links to file)
-    SET_UINT  (buffer + 16, 0); // uid
-    SET_UINT  (buffer + 20, 0); // gid
-    AppendUint(buffer + 24, info.nFileSizeHigh); // size
-    AppendUint(buffer + 28, info.nFileSizeLow);
-    AppendUint(buffer + 32, info.nFileSizeHigh); // used
-    AppendUint(buffer + 36, info.nFileSizeLow);
-    SET_UINT  (buffer + 40, 0); // rdev
-    SET_UINT  (buffer + 44, 0);
-    SET_UINT  (buffer + 48, 0); // fsid
-    SET_UINT  (buffer + 52, 0);
-    SET_UINT  (buffer + 56, 0); // fileid (just set handle for now)
-    SET_UINT  (buffer + 60, *(UINT*)handle);
-    AppendUint(buffer + 64, ToNfsSeconds(info.ftLastAccessTime));
-    SET_UINT  (buffer + 68, 0); // nanoseconds
-    AppendUint(buffer + 72, ToNfsSeconds(info.ftLastWriteTime));
-    SET_UINT  (buffer + 76, 0); // nanoseconds
-    AppendUint(buffer + 80, ToNfsSeconds(info.ftCreationTime));
-    SET_UINT  (buffer + 84, 0); // nanoseconds
-    LOG("[NFS] GETATTR \"%s\"", localName.ptr);
-    return 88;
-}
-
-// Returns: response length
-UINT ACCESS(char* handle, UINT handleLength, UINT flags, char* buffer)
-{
-    String localName = TryLookupHandle(handle, handleLength);
-    if(localName.ptr == NULL)
-    {
-        LOG("[NFS] ACCESS: bad handle");
-        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
-        SET_UINT(buffer + 4, 0); // no post_op_attr
-        return 8;
-    }
-
-    SET_UINT  (buffer + 0 , NFS3_STATUS_OK_NETWORK_ORDER);
-    SET_UINT  (buffer + 4, 0);     // no post-op_attr
-    AppendUint(buffer + 8, flags); // Just return all the flags for now
-    return 12;
-}
-
-// This single function call goes in it's own function because it's using alloca
-HANDLE FindFirstFileAt(String dir, WIN32_FIND_DATA* data)
-{
-    // alloca should be fine here, max path is a few hundred characters
-    char *findString = (char*)alloca(dir.length + 3);
-    if (!findString)
-    {
-        LOG("[NFS] out of memory");
-        SET_UINT(buffer    , NFS3_ERROR_SERVERFAULT_NETWORK_ORDER);
-        SET_UINT(buffer + 4, 0); // no post_op_attr
-        return 8;
-    }
-    memcpy(findString, dir.ptr, dir.length);
-    findString[dir.length + 0] = '\\';
-    findString[dir.length + 1] = '*';
-    findString[dir.length + 2] = '\0';
-    return FindFirstFileA(findString, data);
-}
-
-// Returns: response length
-UINT READDIRPLUS(char* handle, UINT handleLength, char* buffer, UINT64 cookie)
-{
-    String localName = TryLookupHandle(handle, handleLength);
-    if(localName.ptr == NULL)
-    {
-        LOG("[NFS] READDIRPLUS: bad handle");
-        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
-        SET_UINT(buffer + 4, 0); // no post_op_attr
-        return 8;
-    }
-
-    LOG("[NFS] READDIRPLUS \"%s\" cookie=%llu", localName.ptr, (unsigned long long)cookie);
-    if (cookie != 0)
-    {
-        LOG("[NFS] READDIRPLUS non-zero cookie not implemented");
-        SET_UINT(buffer    , NFS3_ERROR_NOT_SUPPORTED_NETWORK_ORDER);
-        SET_UINT(buffer + 4, 0); // no post_op_attr
-        return 8;
-    }
-
-    SET_UINT  (buffer     , NFS3_STATUS_OK_NETWORK_ORDER);
-    SET_UINT  (buffer +  4, 0); // no post_op_attr
-    SET_UINT64(buffer +  8, 0); // cookieverf
-
-    // TODO: read the directory contents into memory
-    //       send as many entries as we can, if there is any left
-    //       over then save it in a cookie and give it a cookie verifier
-    //       on the next request, see that the cookie is non-zero.
-    //       in this case check that the saved directory is still the same as what was
-    //       read before.
-
-    {
-        WIN32_FIND_DATA findData;
-        HANDLE findHandle = FindFirstFileAt(localName, &findData);
-        if(findHandle  == INVALID_HANDLE_VALUE)
-        {
-            LOG("[NFS] READDIRPLUS: FindFirstFile failed (e=%d)", GetLastError());
-            SET_UINT(buffer    , NFS3_ERROR_SERVERFAULT_NETWORK_ORDER);
-            SET_UINT(buffer + 4, 0); // no post_op_attr
-            return 8;
-        }
-        size_t offset = 16;
-        do
-        {
-            // Send back phony file
-            SET_UINT  (buffer + offset +  0, _1_NETWORK_ORDER); // more entries?
-            SET_UINT  (buffer + offset +  4, 0);  // fileid (just set handle for now)
-            AppendUint(buffer + offset +  8, 42);
-            AppendUint(buffer + offset + 12, 5);
-            buffer[32] = 'p';
-            buffer[33] = 'h';
-            buffer[34] = 'o';
-            buffer[35] = 'n';
-            buffer[36] = 'y';
-            SET_UINT  (buffer + 40, 0); // cookie
-            SET_UINT  (buffer + 44, 0);
-            SET_UINT  (buffer + 48, 0); // no post_op_attr
-            SET_UINT  (buffer + 52, 0); // no handle
-            //UINT phonyHandle = GetOrCreateHandle(String("phony", LITERAL_LENGTH("phony")));
-            //AppendUint(buffer + 52, 4); // file handle
-            //AppendUint(buffer + 56, phonyHandle);
-        }
-    }
-    // Send back phony file
-    SET_UINT  (buffer + 16, _1_NETWORK_ORDER); // more entries?
-    SET_UINT  (buffer + 20, 0);  // fileid (just set handle for now)
-    AppendUint(buffer + 24, 42);
-    AppendUint(buffer + 28, 5);
-    buffer[32] = 'p';
-    buffer[33] = 'h';
-    buffer[34] = 'o';
-    buffer[35] = 'n';
-    buffer[36] = 'y';
-    SET_UINT  (buffer + 40, 0); // cookie
-    SET_UINT  (buffer + 44, 0);
-    SET_UINT  (buffer + 48, 0); // no post_op_attr
-    SET_UINT  (buffer + 52, 0); // no handle
-    //UINT phonyHandle = GetOrCreateHandle(String("phony", LITERAL_LENGTH("phony")));
-    //AppendUint(buffer + 52, 4); // file handle
-    //AppendUint(buffer + 56, phonyHandle);
-    SET_UINT  (buffer + 56, 0); // more entries?
-    SET_UINT  (buffer + 60, _1_NETWORK_ORDER); // eof
-    return 64;
-}
-
-// Returns: response length
-UINT FSINFO(char* handle, UINT handleLength, char* buffer)
-{
-    String localName = TryLookupHandle(handle, handleLength);
-    if(localName.ptr == NULL)
-    {
-        LOG("[NFS] FSINFO: bad handle");
-        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
-        SET_UINT(buffer + 4, 0); // no post_op_attr
-        return 8;
-    }
-
-    SET_UINT  (buffer +  0, NFS3_STATUS_OK_NETWORK_ORDER);
-    SET_UINT  (buffer +  4, 0);          // no post-op_attr
-    SET_UINT  (buffer +  8, 0xFFFFFFFF); // rtmax, no limit
-    SET_UINT  (buffer + 12, 0xFFFFFFFF); // rtpref, no limit
-    SET_UINT  (buffer + 16, 0);          // rtmult, no preference
-    SET_UINT  (buffer + 20, 0xFFFFFFFF); // wtmax, no limit
-    SET_UINT  (buffer + 24, 0xFFFFFFFF); // wtpref, no limit
-    SET_UINT  (buffer + 28, 0);          // wtmult, no preference
-    SET_UINT  (buffer + 32, 0xFFFFFFFF); // dtpref, preferred size of a READDIR request
-    SET_UINT  (buffer + 36, 0xFFFFFFFF); // maxfilesize HIGH_DWORD (no limit)
-    SET_UINT  (buffer + 40, 0xFFFFFFFF); // maxfilesize LOW_DWORD  (no limit)
-    SET_UINT  (buffer + 44, 0);          // time_delta (seconds)
-    AppendUint(buffer + 48, 1000000);    // time_delta (nanoseconds) set to 1 millsecond for now
-    SET_UINT  (buffer + 52, 0);          // properties (all off for now)
-                                         // TODO: should probably set value for symbolic/hard links
-    return 56;
-}
-// Returns: response length
-UINT PATHCONF(char* handle, UINT handleLength, char* buffer)
-{
-    String localName = TryLookupHandle(handle, handleLength);
-    if(localName.ptr == NULL)
-    {
-        LOG("[NFS] PATHCONF: bad handle");
-        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
-        SET_UINT(buffer + 4, 0); // no post_op_attr
-        return 8;
-    }
-
-    SET_UINT  (buffer +  0, NFS3_STATUS_OK_NETWORK_ORDER);
-    SET_UINT  (buffer +  4, 0);                // no post-op_attr
-    SET_UINT  (buffer +  8, 0xFFFFFFFF);       // linkmax, no limit
-    AppendUint(buffer + 12, MAX_PATH);         // name_max, no limit
-    SET_UINT  (buffer + 16, _1_NETWORK_ORDER); // no-trunc (TRUE, server does not truncate names that are too large)
-    SET_UINT  (buffer + 20, 0);                // chown_restricted (FALSE)
-    SET_UINT  (buffer + 24, _1_NETWORK_ORDER); // case_insensitive (TRUE)
-    SET_UINT  (buffer + 28, 0);                // case_preserving (FALSE)
-    return 32;
-}
-
-#define NFS3_RESPONSE_OK 0
-#define NFS3_RESPONSE_OK 0
-#define NFS3_PROCEDURE_NULL 0
-// Note: it is very likely that sharedBuffer will overlap with command.  Only use
-//       the shared buffer if you are done with the command.
-UINT Nfs3Handler(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit)
-{
-    switch(callInfo->procedure)
-    {
-      case PROC_NULL: // 0
-        LOG("[NFS] NULL(s=%u)", sock->so);
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return 4;
-      case NFS3_PROC_GETATTR: // 1
-      {
-        UINT handleLength = ParseUint(command);
-        char* handle = command + 4;
-        if(handle + Align4(handleLength) != limit)
-        {
-            LOG_ERROR("[NFS] GETATTR has a bad handle length %u (actualSize is %u)", handleLength, limit-handle);
-            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
-            return 4;
-        }
-        LOG_DEBUG("[NFS] GETATTR handle is %u bytes", handleLength);
-        UINT length = GETATTR(handle, handleLength, sharedBuffer + REPLY_OFFSET + 4);
-        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return length + 4;
-      }
-      case NFS3_PROC_LOOKUP: // 3
-      {
-        LOG("[NFS] LOOKUP(procedure 3) not implemented");
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
-        return 4;
-      }
-      case NFS3_PROC_ACCESS: // 4
-      {
-        UINT handleLength = ParseUint(command);
-        char* handle = command + 4;
-        UINT accessFlags;
-        {
-            char* endOfHandle = handle + Align4(handleLength);
-            if(endOfHandle + 4 != limit)
-            {
-                LOG_ERROR("[NFS] ACCESS has invalid arguments");
-                SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
-                return 4;
-            }
-            accessFlags = ParseUint(endOfHandle);
-        }
-        LOG_DEBUG("[NFS] ACCESS handle is %u bytes, flags = 0x%08x", handleLength, accessFlags);
-        UINT length = ACCESS(handle, handleLength, accessFlags, sharedBuffer + REPLY_OFFSET + 4);
-        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return length + 4;
-      }
-      case NFS3_PROC_READDIRPLUS: // 17
-      {
-        UINT handleLength = ParseUint(command);
-        char* handle = command + 4;
-        char* endOfHandle = handle + Align4(handleLength);
-        if(endOfHandle + 24 != limit)
-        {
-            LOG_ERROR("[NFS] READDIRPLUS has invalid arguments");
-            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
-            return 4;
-        }
-        LOG_DEBUG("[NFS] READDIRPLUS handle is %u bytes", handleLength);
-        UINT64 cookie = ParseUint64(endOfHandle);
-        UINT length = READDIRPLUS(handle, handleLength, sharedBuffer + REPLY_OFFSET + 4, cookie);
-        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return length + 4;
-      }
-      case NFS3_PROC_FSINFO: // 19
-      {
-        UINT handleLength = ParseUint(command);
-        char* handle = command + 4;
-        if(handle + Align4(handleLength) != limit)
-        {
-            LOG_ERROR("[NFS] FSINFO has a bad handle length %u (actualSize is %u)", handleLength, limit-handle);
-            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
-            return 4;
-        }
-        LOG("[NFS] FSINFO handle is %u bytes", handleLength);
-        UINT length = FSINFO(handle, handleLength, sharedBuffer + REPLY_OFFSET + 4);
-        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return length + 4;
-      }
-      case NFS3_PROC_PATHCONF: // 20
-      {
-        UINT handleLength = ParseUint(command);
-        char* handle = command + 4;
-        if(handle + Align4(handleLength) != limit)
-        {
-            LOG_ERROR("[NFS] PATHCONF has a bad handle length %u (actualSize is %u)", handleLength, limit-handle);
-            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
-            return 4;
-        }
-        LOG_DEBUG("[NFS] PATHCONF handle is %u bytes", handleLength);
-        UINT length = PATHCONF(handle, handleLength, sharedBuffer + REPLY_OFFSET + 4);
-        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return length + 4;
-      }
-      default:
-        LOG("[NFS] unhandled procedure %u", callInfo->procedure);
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
-        return 4;
-    }
-}
-UINT Nfs4Handler(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit)
-{
-    switch(callInfo->procedure)
-    {
-      case PROC_NULL: // 0
-        LOG("[NFSv4] NULL(s=%u)", sock->so);
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
-        return 4;
-      default:
-        LOG("[NFSv4] unhandled procedure %u", callInfo->procedure);
-        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
-        return 4;
-    }
-}
-
-ProgramCallHandler portmapHandlers[] = {&Portmap2Handler};
-ProgramCallHandler nfsHandlers[]     = {&Nfs3Handler, &Nfs4Handler};
-ProgramCallHandler mountHandlers[]   = {&Mount3Handler};
-
-RpcProgramSet Programs[] = {
-    RpcProgramSet("Portmap", RPC_PROGRAM_PORTMAP, 2, 2, portmapHandlers),
-    RpcProgramSet("Nfs"    , RPC_PROGRAM_NFS    , 3, 4, nfsHandlers),
-    RpcProgramSet("Mount"  , RPC_PROGRAM_MOUNT  , 3, 3, mountHandlers),
-};
-
-// Return: 1 on error
-// Note: it is very likely that sharedBuffer will overlap with command.  Only use
-//       the shared buffer if you are done with the command.
-int HandleRpcCommand(SelectSock* sock, char* sharedBuffer, char* command, char* limit)
-{
-    if(command + 8 > limit)
-    {
-        LOG_ERROR("Invalid RPC command, header not long enough");
-        return 1; // error
-    }
-
-    RpcCallInfo callInfo;
-    callInfo.xid = ParseUint(command +  0);
-    UINT messageType  = ParseUint(command +  4);
-    if(messageType == RPC_MESSAGE_TYPE_CALL)
-    {
-        command += 8;
-        if(command + 28 > limit)
-        {
-            LOG_RPC("Invalid RPC command, header not long enough");
-            return 1; // error
-        }
-        callInfo.rpcVersion     = ParseUint(command +  0);
-        if(callInfo.rpcVersion != 2)
-        {
-            LOG_RPC("unsupported rpc version %u", callInfo.rpcVersion);
-            return 1; // error
-        }
-        // TODO: check rpc version and send error if not matched
-
-        callInfo.program        = ParseUint(command +  4);
-        callInfo.programVersion = ParseUint(command +  8);
-        callInfo.procedure      = ParseUint(command + 12);
-
-        UINT credentialsAuthFlavor = ParseUint(command + 16);
-        UINT credentialsLength     = ParseUint(command + 20);
-        if(credentialsLength > 400)
-        {
-            LOG_RPC("Invalid RPC command, credentials length %u is too long", credentialsLength);
-            return 1; // error
-        }
-        command += 24 + credentialsLength;
-        if(command + 8 > limit)
-        {
-            LOG_RPC("Invalid RPC command, header not long enough");
-            return 1; // error
-        }
-        UINT verifierAuthFlavor = ParseUint(command + 0);
-        UINT verifierLength     = ParseUint(command + 4);
-        if(verifierLength > 400)
-        {
-            LOG_RPC("Invalid RPC command, verifier length %u is too long", verifierLength);
-            return 1; // error
-        }
-        command += 8 + verifierLength;
-        if(command > limit)
-        {
-            LOG_RPC("Invalid RPC command, header not long enough");
-            return 1; // error
-        }
-
-        LOG_RPC("HandleRpcCommand(s=%d) xid 0x%08x, type %u, rpcv %u, prog %u, progv %u, proc %u, cred %u, verf %u, data_length %u",
-            sock->so, callInfo.xid, messageType, callInfo.rpcVersion, callInfo.program, callInfo.programVersion, callInfo.procedure,
-            credentialsAuthFlavor, verifierAuthFlavor, limit - command);
-
-        bool foundProgram = false;
-        UINT replySize;
-        for(unsigned i = 0; i < STATIC_ARRAY_LENGTH(Programs); i++)
-        {
-            if(Programs[i].program == callInfo.program)
-            {
-                foundProgram = true;
-
-                if(callInfo.programVersion < Programs[i].minVersion ||
-                   callInfo.programVersion > Programs[i].maxVersion)
-                {
-                    LOG_RPC("Program %s(%u) does not support version %u", Programs[i].name, callInfo.program, callInfo.programVersion);
-                    SET_UINT  (sharedBuffer + 24, RPC_REPLY_ACCEPT_STATUS_PROG_MISMATCH_NETWORK_ORDER);
-                    AppendUint(sharedBuffer + 28, Programs[i].minVersion);
-                    AppendUint(sharedBuffer + 32, Programs[i].maxVersion);
-                    replySize = 12;
-                }
-                else
-                {
-                    replySize = Programs[i].handlers[callInfo.programVersion - Programs[i].minVersion]
-                        (sock, &callInfo, sharedBuffer, command, limit);
-                }
-                break;
-            }
-        }
-
-        if(!foundProgram)
-        {
-            LOG_RPC("program %u unavailable", callInfo.program);
-            SET_UINT(sharedBuffer + 24, RPC_REPLY_ACCEPT_STATUS_PROG_UNAVAIL_NETWORK_ORDER);
-            replySize = 4;
-        }
-
-        if(replySize)
-        {
-            AppendUint(sharedBuffer +  0, RPC_LAST_FRAGMENT_FLAG | (REPLY_OFFSET - 4 + replySize));
-            SetupReply(sharedBuffer +  4, callInfo.xid);
-            sendWithLog("[RPC]", sock->so, (char*)sharedBuffer, REPLY_OFFSET + replySize);
-        }
-
-        return 0;
-    }
-    else
-    {
-        LOG_ERROR("Unhandled rpc message type %d", messageType);
-        return 1; // error
-    }
-}
-
-
-void RpcTcpRecvHandler(SynchronizedSelectServer server, SelectSock* sock, PopReason reason, char* sharedBuffer)
-{
-    // TODO: check if sock has an existing buffer, use that instead
-    int size = recv(sock->so, (char*)sharedBuffer, SHARED_BUFFER_SIZE, 0);
-    if(size <= 0)
-    {
-        if(size == 0)
-        {
-            LOG_NET("RpcTcpRecvHandler(s=%d) client closed", sock->so);
-        }
-        else
-        {
-            LOG_NET("RpcTcpRecvHandler(s=%d) recv returned error (return=%d, e=%d)", sock->so, size, GetLastError());
-        }
-        goto ERROR_EXIT;
-    }
-    LOG_NET("RpcTcpRecvHandler(s=%d) Got %u bytes", sock->so, size);
-    char* data = sharedBuffer;
-
-    bool lastFragment = (unsigned char)data[0] >> 7;
-    UINT fragmentLength =
-        ((unsigned char)data[0] & 0x7F) << 24 |
-        (unsigned char)data[1] << 16 |
-        (unsigned char)data[2] <<  8 |
-        (unsigned char)data[3]       ;
-    if(!lastFragment)
-    {
-        LOG_ERROR("multiple fragments not implemented");
-        goto ERROR_EXIT;
-    }
-    LOG_RPC("RpcTcpRecvHandler(s=%d) fragment length is %u", sock->so, fragmentLength);
-    if(4 + fragmentLength != size)
-    {
-        LOG_ERROR("multiple recvs per fragment not implemented (received %u, 4+fragmentLength %u)",
-            size, 4+fragmentLength);
-        goto ERROR_EXIT;
-    }
-
-    if(HandleRpcCommand(sock, sharedBuffer, sharedBuffer + 4, sharedBuffer + size))
-    {
-        goto ERROR_EXIT;
-    }
-
-    return;
-
-  ERROR_EXIT:
-    LOG_NET("RpcTcpRecvHandler(s=%u) closing", sock->so);
-    if(sock->user)
-    {
-        delete sock->user;
-        sock->user = NULL;
-    }
-    shutdown(sock->so, SD_BOTH);
-    closesocket(sock->so);
-    sock->UpdateEventFlags(SelectSock::NONE);
-}
-void TcpAcceptHandler(SynchronizedSelectServer server, SelectSock* sock, PopReason reason, char* sharedBuffer)
-{
-    sockaddr_in addr;
-    int addrSize = sizeof(addr);
-    SOCKET newSock = accept(sock->so, (sockaddr*)&addr, &addrSize);
-    if(INVALID_SOCKET == newSock)
-    {
-        LOG_NET("TcpAcceptHandler(s=%d) accept failed (e=%d)", sock->so, GetLastError());
-    }
-    char addrString[MAX_ADDR_STRING+1];
-    AddrToString(addrString, (sockaddr*)&addr);
-
-    if(server.TryAddSock(SelectSock(newSock, NULL, &RpcTcpRecvHandler, SelectSock::READ, SelectSock::INF)))
-    {
-        LOG_NET("TcpAcceptHandler(s=%d) server full, rejected socket (s=%d) from '%s'", sock->so, newSock, addrString);
-        shutdown(newSock, SD_BOTH);
-        closesocket(newSock);
-        return;
-    }
-    LOG_NET("TcpAcceptHandler(s=%d) accepted new connection (s=%d) from '%s'", sock->so, newSock, addrString);
-}
-
-bool nfs2Enabled = false;
-bool nfs3Enabled = true;
-
-#define PORTMAP_PORT 111
-#define NFS_PORT     2049
-#define LISTEN_BACKLOG 8
-
-
-// Design Note:
-// This server will support any rpc program on any of the ports.
-// It uses the RPC program number to determine which program is actually being called.
-
-int RunNfsServer()
-{
-    SelectServer server;
-    {
-        // TODO: I don't like that I have to lock the server
-        //       because it hasn't started yet.
-        LockedSelectServer locked(&server);
-        {
-            sockaddr_in addr;
-            addr.sin_family = AF_INET;
-
-            // If NFSv2 or NVSv3 is enabled, then most clients
-            // will expect the PORTMAP service to be listening on port 111
-            if(nfs2Enabled || nfs3Enabled)
-            {
-                SOCKET so = socket(addr.sin_family, SOCK_STREAM, IPPROTO_TCP);
-                if(so == INVALID_SOCKET)
-                {
-                    LOG_ERROR("socket function failed (e=%d)", GetLastError());
-                    return 1; // error
-                }
-                addr.sin_port = htons(PORTMAP_PORT);
-                addr.sin_addr.s_addr = 0;
-                LOG("(s=%d) Adding TCP Listener on port %u", so, PORTMAP_PORT);
-                if(SOCKET_ERROR == bind(so, (sockaddr*)&addr, sizeof(addr)))
-                {
-                    LOG_ERROR("bind failed (e=%d)", GetLastError());
-                    return 1; // error
-                }
-                if(SOCKET_ERROR == listen(so, LISTEN_BACKLOG))
-                {
-                    LOG_ERROR("listen failed (e=%d)", GetLastError());
-                    return 1; // error
-                }
-                locked.TryAddSock(SelectSock(so, NULL, &TcpAcceptHandler, SelectSock::READ, SelectSock::INF));
-            }
-
-            {
-                SOCKET so = socket(addr.sin_family, SOCK_STREAM, IPPROTO_TCP);
-                if(so == INVALID_SOCKET)
-                {
-                    LOG_ERROR("socket function failed (e=%d)", GetLastError());
-                    return 1; // error
-                }
-                addr.sin_port = htons(NFS_PORT);
-                addr.sin_addr.s_addr = 0;
-                LOG("(s=%d) Adding TCP Listener on port %u", so, NFS_PORT);
-                if(SOCKET_ERROR == bind(so, (sockaddr*)&addr, sizeof(addr)))
-                {
-                    LOG_ERROR("bind failed (e=%d)", GetLastError());
-                    return 1; // error
-                }
-                if(SOCKET_ERROR == listen(so, LISTEN_BACKLOG))
-                {
-                    LOG_ERROR("listen failed (e=%d)", GetLastError());
-                    return 1; // error
-                }
-                locked.TryAddSock(SelectSock(so, NULL, &TcpAcceptHandler, SelectSock::READ, SelectSock::INF));
-            }
-        }
-    }
-    char* buffer = (char*)malloc(SHARED_BUFFER_SIZE);
-    if(!buffer) {
-        LOG_ERROR("malloc(%d) failed", SHARED_BUFFER_SIZE);
-    }
-    LOG("Starting Server...");
-    return server.Run(buffer, SHARED_BUFFER_SIZE);
-}
-
+#include <malloc.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <stdio.h>
+
+#include "Common.h"
+#include "SelectServer.h"
+#include "Rpc.h"
+#include "BufferPool.h"
+#include "Config.h"
+#include "DirEnum.h"
+#include "GroupCommit.h"
+#include "WriteGather.h"
+#include "BlockCache.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "LoopMonitor.h"
+#include "Span.h"
+#include "Arena.h"
+#include "Scheduler.h"
+#include "ReadAhead.h"
+#include "SparseMap.h"
+#include "IoPool.h"
+
+// The shared buffer holds the largest reply, it is allocated from the buffer
+// pool once the configured transfer size is known.  Records are received
+// into a buffer of the same size, so a call's arguments never overlap its
+// reply.
+static UINT sharedBufferSize;
+static char* receiveBuffer;
+
+// Largest record fragment accepted from a client (not including the record marker)
+static UINT maxFragmentLength;
+
+#define MAX_IP_STRING   39 // A full IPv6 string like 2001:0db8:85a3:0000:0000:8a2e:0370:7334
+#define MAX_PORT_STRING  5 // 65535
+#define MAX_ADDR_STRING (MAX_IP_STRING + 1 + MAX_PORT_STRING)
+
+void AddrToString(char dest[], sockaddr* addr)
+{
+    if(addr->sa_family == AF_INET)
+    {
+        unsigned short port = htons(((sockaddr_in*)addr)->sin_port);
+        u_long ipv4 = htonl(((sockaddr_in*)addr)->sin_addr.s_addr);
+        sprintf(dest, "%u.%u.%u.%u:%u",
+            ipv4 >> 24, (ipv4 >> 16) & 0xFF, (ipv4 >> 8) & 0xFF,
+            ipv4 & 0xFF, port);
+    }
+    else if(addr->sa_family == AF_INET6)
+    {
+        unsigned short port = htons(((sockaddr_in6*)addr)->sin6_port);
+        sprintf(dest, "<ipv6-addr>:%u", port);
+    }
+    else
+    {
+        sprintf(dest, "<address-family:%d>", addr->sa_family);
+    }
+}
+
+
+// All the data from the Rpc call that the handler
+// will need for the response
+struct RpcCallInfo
+{
+    UINT xid;
+    UINT rpcVersion;
+    UINT program;
+    UINT programVersion;
+    UINT procedure;
+    // For the stats
+    UINT recordLength; // including the record marker
+    INT64 receiveTime;
+    INT64 startTime;
+    // For the spans
+    UINT connection;
+    bool sampled;
+    INT64 lastSpanEnd; // where the next span starts
+    // Memory that lives until the reply is sent, acquired by the first
+    // CallAlloc, NULL until then
+    Arena* arena;
+    // The call's arguments are in the arena (the call was queued), otherwise
+    // they are only valid until the handler returns
+    bool argsInArena;
+    // The order the connection's calls were handled in, their replies are
+    // sent in the same order
+    UINT sequence;
+};
+
+// Returns: size bytes that live until the call's reply is sent, NULL if out of memory
+void* CallAlloc(RpcCallInfo* callInfo, size_t size)
+{
+    if(callInfo->arena == NULL)
+    {
+        callInfo->arena = ArenaAcquire();
+        if(callInfo->arena == NULL)
+        {
+            return NULL;
+        }
+    }
+    return ArenaAlloc(callInfo->arena, size);
+}
+
+// Length is 20 bytes
+void SetupReply(char* buffer, UINT xid)
+{
+    AppendUint(buffer +  0, xid);
+    SET_UINT  (buffer +  4, RPC_MESSAGE_TYPE_REPLY_NETWORK_ORDER);
+    SET_UINT  (buffer +  8, RPC_REPLY_ACCEPTED_NETWORK_ORDER);
+    SET_UINT  (buffer + 12, RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER);
+    SET_UINT  (buffer + 16, 0); // Auth is length 0
+}
+
+// Sets up the reply at sharedBuffer + REPLY_OFFSET.  command is only valid
+// until the handler returns, a handler that finishes the call later (see
+// AsyncCall) copies what it needs into the call's arena first.
+// Returns: the reply size, 0 if the call is finished later
+typedef UINT (*ProgramCallHandler)(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit);
+
+class RpcProgramSet
+{
+  public:
+    const char* name;
+    const UINT program;
+    const UINT minVersion;
+    const UINT maxVersion;
+    ProgramCallHandler* handlers;
+    RpcProgramSet(const char* name, UINT program, UINT minVersion, UINT maxVersion, ProgramCallHandler* handlers)
+        : name(name), program(program), minVersion(minVersion), maxVersion(maxVersion), handlers(handlers)
+    {
+    }
+};
+
+
+int sendWithLog(const char* context, SOCKET so, char* buffer, UINT length)
+{
+    int sent = send(so, buffer, length, 0);
+    if(sent != length)
+    {
+        if(sent < 0)
+        {
+            LOG_ERROR("%s(s=%u) send %u bytes failed (returned %d, e=%d)", context, so, length, sent, GetLastError());
+        }
+        else
+        {
+            LOG_ERROR("%s(s=%u) send %u bytes returned %d (e=%d)", context, so, length, sent, GetLastError());
+        }
+    }
+    return sent;
+}
+
+// The offset of an rpc reply for the handle call
+#define REPLY_OFFSET 24
+
+struct StreamWrite;
+
+// State for a tcp connection, stored in SelectSock::user
+struct TcpConnection
+{
+    // Bytes that have been received but not handled yet.  The buffer is only
+    // taken from the buffer pool while a record is partially received, so
+    // idle connections don't hold any buffer memory.
+    // Note: only used by the select thread
+    char* pending;
+    UINT pendingCapacity;
+    UINT pendingLength;
+    INT64 receiveTime; // when the last bytes were added to pending
+    // When the last recv started and when the first recv of the pending
+    // record started, only set while spans are enabled
+    INT64 recvStart;
+    INT64 recordStart;
+    // The WRITE whose data is being received, the connection's next bytes
+    // are its data instead of records, NULL if there is none
+    // Note: only used by the select thread
+    StreamWrite* stream;
+
+    // Sends are serialized with Close, the socket is only closed inside the
+    // send lock.
+    // NOTE: only read/modify closed inside the send lock
+    CRITICAL_SECTION sendLock;
+    SOCKET so;
+    bool closed;
+
+    // One reference for the select thread and one for every call that is
+    // waiting on a worker or a flush
+    volatile LONG refCount;
+
+    UINT id; // identifies the connection in a trace
+    SchedulerClient* client; // the client address the connection is from
+
+    // Calls finished by a worker can be ready before calls that were handled
+    // earlier, their replies are held until the replies before them are sent.
+    // Note: only used by the select thread
+    UINT nextSequence;  // given to the next call that is handled
+    UINT replySequence; // the call whose reply is sent next
+    struct HeldReply* held; // sorted by sequence
+    bool unordered; // replies are sent as soon as they're ready (out of memory or closed)
+
+    // so: INVALID_SOCKET for a connection that is replaying a trace, its
+    //     replies are dropped
+    TcpConnection(SOCKET so, UINT id, SchedulerClient* client) : pending(NULL), pendingCapacity(0), pendingLength(0),
+        receiveTime(0), recvStart(0), recordStart(0), stream(NULL), so(so), closed(false), refCount(1), id(id), client(client),
+        nextSequence(0), replySequence(0), held(NULL), unordered(false)
+    {
+        InitializeCriticalSection(&sendLock);
+    }
+    ~TcpConnection()
+    {
+        ReleasePending();
+        DeleteCriticalSection(&sendLock);
+    }
+    void AddRef()
+    {
+        InterlockedIncrement(&refCount);
+    }
+    void Release()
+    {
+        if(InterlockedDecrement(&refCount) == 0)
+        {
+            delete this;
+        }
+    }
+    // Returns: what send returned, -1 if the connection is closed
+    int Send(const char* context, char* buffer, UINT length)
+    {
+        if(so == INVALID_SOCKET)
+        {
+            return length;
+        }
+        EnterCriticalSection(&sendLock);
+        int sent = closed ? -1 : sendWithLog(context, so, buffer, length);
+        LeaveCriticalSection(&sendLock);
+        return sent;
+    }
+    bool IsClosed()
+    {
+        EnterCriticalSection(&sendLock);
+        bool result = closed;
+        LeaveCriticalSection(&sendLock);
+        return result;
+    }
+    void Close()
+    {
+        EnterCriticalSection(&sendLock);
+        closed = true;
+        shutdown(so, SD_BOTH);
+        closesocket(so);
+        LeaveCriticalSection(&sendLock);
+    }
+    // Returns: non-zero if out of memory
+    int ReservePending(UINT capacity)
+    {
+        if(capacity <= pendingCapacity)
+        {
+            return 0;
+        }
+        capacity = (UINT)BufferPoolRoundSize(capacity);
+        char* newPending = BufferPoolAlloc(capacity);
+        if(!newPending)
+        {
+            return 1;
+        }
+        if(pending)
+        {
+            memcpy(newPending, pending, pendingLength);
+            BufferPoolFree(pending, pendingCapacity);
+        }
+        pending = newPending;
+        pendingCapacity = capacity;
+        return 0;
+    }
+    void ReleasePending()
+    {
+        if(pending)
+        {
+            BufferPoolFree(pending, pendingCapacity);
+            pending = NULL;
+            pendingCapacity = 0;
+        }
+        pendingLength = 0;
+    }
+};
+
+struct AsyncCall;
+
+// Finishes a call on the select thread once its file system calls are done,
+// like a handler it sets up the response in buffer
+// outSync: file is set if the reply must wait until the file is flushed
+// Returns: response length
+typedef UINT (*AsyncFinish)(AsyncCall* call, char* buffer, SyncRequest* outSync);
+
+// The start of the state of a call whose file system calls are made by a
+// worker (see IoPool.h), it lives in the call's arena and holds everything
+// the worker needs
+struct AsyncCall
+{
+    IoRequest request; // must be first
+    AsyncFinish finish;
+    TcpConnection* conn;
+    RpcCallInfo callInfo;
+    bool submit; // false makes the file system calls on the select thread
+};
+
+void AsyncCallComplete(IoRequest* request, char* sharedBuffer);
+
+// Returns: size bytes of call state in the call's arena if there are file
+//          system workers, otherwise (or if out of memory) local, whose file
+//          system calls are made on the select thread
+AsyncCall* AllocAsyncCall(RpcCallInfo* callInfo, size_t size, AsyncCall* local)
+{
+    AsyncCall* call = IoPoolThreads() ? (AsyncCall*)CallAlloc(callInfo, size) : NULL;
+    if(!call)
+    {
+        call = local;
+    }
+    call->submit = (call != local);
+    return call;
+}
+
+// Moves the call into its state, it is finished by AsyncCallComplete
+void TakeAsyncCall(SelectSock* sock, RpcCallInfo* callInfo, AsyncCall* call, AsyncFinish finish)
+{
+    call->request.complete = &AsyncCallComplete;
+    call->finish = finish;
+    call->conn = (TcpConnection*)sock->user;
+    call->conn->AddRef();
+    call->callInfo = *callInfo;
+    callInfo->arena = NULL; // released once the reply is sent
+}
+
+// Runs work on a file system worker and finishes the call on the select
+// thread, or both right away if the call isn't submitted
+// buffer, outSync: for finish if it runs right away
+// Returns: response length, 0 if the call went to a worker
+UINT RunAsyncCall(SelectSock* sock, RpcCallInfo* callInfo, AsyncCall* call, IoWork work, AsyncFinish finish,
+                  char* buffer, SyncRequest* outSync)
+{
+    if(!call->submit)
+    {
+        work(&call->request);
+        return finish(call, buffer, outSync);
+    }
+    call->request.work = work;
+    TakeAsyncCall(sock, callInfo, call, finish);
+    IoPoolSubmit(&call->request);
+    return 0;
+}
+
+// Finishes the call once another thread completes its request with
+// IoPoolComplete
+void WaitAsyncCall(SelectSock* sock, RpcCallInfo* callInfo, AsyncCall* call, AsyncFinish finish)
+{
+    call->request.work = NULL;
+    TakeAsyncCall(sock, callInfo, call, finish);
+    IoPoolExternal(&call->request);
+}
+
+UINT Portmap2Handler(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit)
+{
+    switch(callInfo->procedure)
+    {
+      case PROC_NULL: // 0
+        LOG_AT(PORTMAP, DEBUG, "[PORTMAP] NULL(s=%u)", sock->so);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4;
+      case PORTMAP_PROC_GETPORT: // 3
+      {
+        // for now, I'm just going to return port 111 for every
+        // GETPORT request.  One technique would be to just return
+        // whichever port the current socket has connected to, so that
+        // way, you are basically guaranteed that it can connect to this
+        // port again.  In most cases, that's going to be port 111 so that's
+        // what I'll use for now.
+        LOG_AT(PORTMAP, DEBUG, "[PORTMAP] GETPORT(s=%u) > %u", sock->so, 111);
+        SET_UINT  (sharedBuffer + REPLY_OFFSET + 0, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        AppendUint(sharedBuffer + REPLY_OFFSET + 4, 111); // port 111
+        return 8;
+      }
+      default:
+        LOG_AT(PORTMAP, INFO, "[PORTMAP] unhandled procedure %u", callInfo->procedure);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
+        return 4;
+    }
+}
+
+//
+// This implementation is temporary
+//
+#define NO_HANDLE 0xFFFFFFFF
+struct NameHandle
+{
+    String localName;
+    UINT hashNext; // the next handle in the same hash bucket
+    // The listing READDIRPLUS is returning for this directory, NULL if none
+    DirSnapshot* dirSnapshot;
+    // Opened by the first WRITE and kept open so COMMIT can flush it, NULL
+    // if nothing has been written through this handle
+    HANDLE file;
+    // The volume of the export the file is in (see SyncRequest::volume)
+    HANDLE volume;
+    // Holds UNSTABLE writes to file, NULL if write gathering is disabled
+    WriteGather* gather;
+    // Opened without buffering by the first large READ or WRITE in a direct
+    // I/O export, NULL until then, INVALID_HANDLE_VALUE if it can't be
+    HANDLE directFile;
+    // Created by the first READ
+    struct ReadState* read;
+    // Counts the writes that made cached reads stale, a READ made by a worker
+    // only keeps what it read if no write happened in the meantime
+    UINT writeCount;
+    // Created the first time attributes are returned for this handle
+    struct EncodedAttributes* attributes;
+};
+// Handles are looked up by name through a hash table with one bucket per
+// handle slot, so READDIRPLUS on a huge directory doesn't scan every handle
+// for every entry
+static NameHandle* nameHandles = NULL;
+static UINT* nameHandleBuckets = NULL;
+static UINT nameHandleCount = 0;
+static UINT nameHandleCapacity = 0; // always a power of 2
+
+UINT HashName(String name)
+{
+    UINT hash = 2166136261; // FNV-1a
+    for(UINT i = 0; i < name.length; i++)
+    {
+        hash = (hash ^ (unsigned char)name.ptr[i]) * 16777619;
+    }
+    return hash;
+}
+
+// Returns: non-zero if out of memory
+int GrowHandles()
+{
+    UINT newCapacity = nameHandleCapacity ? nameHandleCapacity * 2 : 256;
+    NameHandle* newHandles = (NameHandle*)realloc(nameHandles, newCapacity * sizeof(NameHandle));
+    if(!newHandles)
+    {
+        return 1;
+    }
+    nameHandles = newHandles;
+    UINT* newBuckets = (UINT*)malloc(newCapacity * sizeof(UINT));
+    if(!newBuckets)
+    {
+        return 1;
+    }
+    free(nameHandleBuckets);
+    nameHandleBuckets = newBuckets;
+    nameHandleCapacity = newCapacity;
+
+    memset(nameHandleBuckets, 0xFF, newCapacity * sizeof(UINT)); // NO_HANDLE
+    for(UINT i = 0; i < nameHandleCount; i++)
+    {
+        UINT bucket = HashName(nameHandles[i].localName) & (newCapacity - 1);
+        nameHandles[i].hashNext = nameHandleBuckets[bucket];
+        nameHandleBuckets[bucket] = i;
+    }
+    return 0;
+}
+
+// Returns: the handle, NO_HANDLE if out of memory
+UINT GetOrCreateHandle(String localName)
+{
+    UINT hash = HashName(localName);
+    if(nameHandleCapacity)
+    {
+        for(UINT i = nameHandleBuckets[hash & (nameHandleCapacity - 1)]; i != NO_HANDLE; i = nameHandles[i].hashNext)
+        {
+            if(localName.Equals(nameHandles[i].localName))
+            {
+                return i; // index is the handle for now
+            }
+        }
+    }
+    if(nameHandleCount == nameHandleCapacity && GrowHandles())
+    {
+        LOG_ERROR("out of memory for handle %u", nameHandleCount);
+        return NO_HANDLE;
+    }
+    char* buffer = (char*)malloc(localName.length+1); // add 1 for '\0'
+    if(!buffer)
+    {
+        LOG_ERROR("out of memory for handle %u", nameHandleCount);
+        return NO_HANDLE;
+    }
+    memcpy(buffer, localName.ptr, localName.length);
+    buffer[localName.length] = '\0';
+
+    UINT handle = nameHandleCount++;
+    UINT bucket = hash & (nameHandleCapacity - 1);
+    nameHandles[handle].localName = String(buffer, localName.length);
+    nameHandles[handle].hashNext = nameHandleBuckets[bucket];
+    nameHandles[handle].dirSnapshot = NULL;
+    nameHandles[handle].file = NULL;
+    nameHandles[handle].volume = NULL;
+    nameHandles[handle].gather = NULL;
+    nameHandles[handle].directFile = NULL;
+    nameHandles[handle].read = NULL;
+    nameHandles[handle].writeCount = 0;
+    nameHandles[handle].attributes = NULL;
+    nameHandleBuckets[bucket] = handle;
+    LOG_AT(NFS, DEBUG, "[NFS] added path(handle=%u, length=%u, value='%s')",
+        handle, localName.length, nameHandles[handle].localName.ptr);
+    return handle;
+}
+struct Export
+{
+    String exportName;
+    String localName;
+    // Opened by OpenExportVolumes, NULL if the volume can't be flushed
+    HANDLE volume;
+    // The fsid of every file in the export, set by OpenExportVolumes
+    DWORD volumeSerial;
+    // Large READs and WRITEs skip the system cache, set by ConfigureDirectIo
+    bool directIo;
+};
+
+// TODO: make this configuration loaded at runtim
+Export exports[] = {
+    {String("/share", LITERAL_LENGTH("/share")),
+     String("C:\\", LITERAL_LENGTH("C:\\")), NULL, 0, false},
+};
+
+// Opens the volume of every export so a batch of commits for many files on
+// the same volume can be flushed with one call
+void OpenExportVolumes()
+{
+    for(UINT i = 0; i < STATIC_ARRAY_LENGTH(exports); i++)
+    {
+        String localName = exports[i].localName;
+        if(!GetVolumeInformation(localName.ptr, NULL, 0, &exports[i].volumeSerial, NULL, NULL, NULL, 0))
+        {
+            LOG_AT(NFS, ERROR, "[NFS] can't get the volume serial number of '%s' (e=%d)", localName.ptr, GetLastError());
+        }
+        if(localName.length < 2 || localName.ptr[1] != ':')
+        {
+            continue;
+        }
+        char volumePath[] = "\\\\.\\?:";
+        volumePath[4] = localName.ptr[0];
+        HANDLE volume = CreateFile(volumePath, GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        if(volume == INVALID_HANDLE_VALUE)
+        {
+            LOG("[COMMIT] can't open volume '%s' (e=%d), files on it will be flushed one at a time",
+                volumePath, GetLastError());
+            continue;
+        }
+        exports[i].volume = volume;
+    }
+}
+// Marks the exports named by DirectIoExport lines
+// Returns: non-zero if one of them isn't exported
+int ConfigureDirectIo()
+{
+    for(UINT i = 0; i < config.directIoExportCount; i++)
+    {
+        String name(config.directIoExports[i], strlen(config.directIoExports[i]));
+        UINT match = 0;
+        while(match < STATIC_ARRAY_LENGTH(exports) && !name.Equals(exports[match].exportName))
+        {
+            match++;
+        }
+        if(match == STATIC_ARRAY_LENGTH(exports))
+        {
+            LOG_ERROR("DirectIoExport '%s' is not exported", name.ptr);
+            return 1;
+        }
+        exports[match].directIo = true;
+        LOG("[NFS] '%s' reads and writes %u bytes or more without the system cache", name.ptr, config.directIoMinSize);
+    }
+    return 0;
+}
+// Returns: the export localName is in, NULL if none
+Export* FindExport(String localName)
+{
+    for(UINT i = 0; i < STATIC_ARRAY_LENGTH(exports); i++)
+    {
+        if(localName.length >= exports[i].localName.length &&
+           memcmp(localName.ptr, exports[i].localName.ptr, exports[i].localName.length) == 0)
+        {
+            return &exports[i];
+        }
+    }
+    return NULL;
+}
+HANDLE FindExportVolume(String localName)
+{
+    Export* match = FindExport(localName);
+    return match ? match->volume : NULL;
+}
+
+// Returns: response length
+UINT MNT(String pathString, char* buffer)
+{
+    // Find the export
+    UINT match = 0xFFFFFFFF;
+    for(UINT i = 0; i < STATIC_ARRAY_LENGTH(exports); i++)
+    {
+        if(pathString.Equals(exports[i].exportName))
+        {
+            match = i;
+            break;
+        }
+    }
+    if(match == 0xFFFFFFFF)
+    {
+        LOG_AT(MOUNT, INFO, "[MOUNT] MNT: path '%.*s' is not exported", pathString.length, pathString.ptr);
+        SET_UINT(buffer, MOUNT3_ERROR_NOENT_NETWORK_ORDER);
+        return 4;
+    }
+    LOG_AT(MOUNT, DEBUG, "[MOUNT] path(length=%u, value=\"%.*s\") matched '%s'",
+        pathString.length, pathString.length, pathString.ptr, exports[match].localName.ptr);
+
+    // TODO: check if it is a valid mount point
+    UINT handle = GetOrCreateHandle(exports[match].localName);
+    if(handle == NO_HANDLE)
+    {
+        SET_UINT(buffer, MOUNT3_ERROR_SERVERFAULT_NETWORK_ORDER);
+        return 4;
+    }
+
+    // Send reply
+    SET_UINT         (buffer +  0, MOUNT3_STATUS_OK_NETWORK_ORDER);
+    SET_UINT         (buffer +  4, _4_NETWORK_ORDER);
+    AppendUint       (buffer +  8, handle);
+    SET_UINT         (buffer + 12, RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER);
+    return 16;
+}
+
+// Constants taken from RFC1813
+#define MOUNT3_MAX_PATH        1024
+#define MOUNT3_MAX_NAME        255
+#define MOUNT3_MAX_FILE_HANDLE 64
+UINT Mount3Handler(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit)
+{
+    switch(callInfo->procedure)
+    {
+      case PROC_NULL: // 0
+        LOG_AT(MOUNT, DEBUG, "[MOUNT] NULL(s=%u)", sock->so);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4;
+      case MOUNT3_PROC_MNT: // 1
+      {
+        String pathString;
+        pathString.length = ParseUint(command);
+        pathString.ptr = command + 4;
+        if(pathString.ptr + Align4(pathString.length) != limit)
+        {
+            LOG_AT(MOUNT, ERROR, "[MOUNT] MNT has a bad path length %u (actualSize is %u)", pathString.length, limit-pathString.ptr);
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        LOG_AT(MOUNT, DEBUG, "[MOUNT] MNT(s=%u) '%.*s'", sock->so, pathString.length, pathString.ptr);
+        UINT length = MNT(pathString, sharedBuffer + REPLY_OFFSET + 4);
+        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return length + 4;
+      }
+      case MOUNT3_PROC_UMNT: // 3
+      {
+        String pathString;
+        pathString.length = ParseUint(command);
+        pathString.ptr = command + 4;
+        if(pathString.ptr + Align4(pathString.length) != limit)
+        {
+            LOG_AT(MOUNT, ERROR, "[MOUNT] UMNT has a bad path length %u (actualSize is %u)", pathString.length, limit-pathString.ptr);
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        LOG_AT(MOUNT, DEBUG, "[MOUNT] UMNT(s=%u) '%.*s'", sock->so, pathString.length, pathString.ptr);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4;
+      }
+      default:
+        LOG_AT(MOUNT, INFO, "[MOUNT] unhandled procedure %u", callInfo->procedure);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
+        return 4;
+    }
+}
+
+// Returns: the handle, NO_HANDLE if it is invalid
+UINT TryParseHandle(char* handleBuffer, UINT handleLength)
+{
+    if(handleLength != 4)
+    {
+        LOG_ERROR("handle length of %u is not supported", handleLength);
+        return NO_HANDLE;
+    }
+    UINT handle = ParseUint(handleBuffer);
+    if(handle >= nameHandleCount)
+    {
+        LOG_ERROR("handle %u is out of range", handle);
+        return NO_HANDLE;
+    }
+    return handle;
+}
+String TryLookupHandle(char* handleBuffer, UINT handleLength)
+{
+    UINT handle = TryParseHandle(handleBuffer, handleLength);
+    if(handle == NO_HANDLE)
+    {
+        return String(); // indicate error
+    }
+    return nameHandles[handle].localName;
+}
+
+// MODE BITS
+#define MODE_OWNER_READ   0x0100
+#define MODE_OWNER_WRITE  0x0080
+#define MODE_OWNER_EXEC   0x0040
+#define MODE_GROUP_READ   0x0020
+#define MODE_GROUP_WRITE  0x0010
+#define MODE_GROUP_EXEC   0x0008
+#define MODE_OTHER_READ   0x0004
+#define MODE_OTHER_WRITE  0x0002
+#define MODE_OTHER_EXEC   0x0001
+
+// Sets an nfstime3 (seconds and nanoseconds since 1970)
+// filetime is in 100-nanoseconds since 1601
+void SetNfsTime(char* buffer, UINT64 filetime)
+{
+    // 100-nanoseconds = milliseconds * 10000
+    static const DWORD64 adjust = ((DWORD64)11644473600000 * (DWORD64)10000);
+
+    // remove the diff between 1970 and 1601, times before 1970 are sent as 1970
+    UINT64 time = (filetime > adjust) ? filetime - adjust : 0;
+    AppendUint(buffer    , (UINT)(time / 10000000));
+    AppendUint(buffer + 4, (UINT)(time % 10000000) * 100);
+}
+
+// The attributes of a file as they are returned to clients, times are in
+// 100-nanoseconds since 1601
+// Note: there is no padding, so two FileStats can be compared with memcmp
+struct FileStat
+{
+    DWORD attributes;
+    DWORD volumeSerial; // the fsid, the same for every file in an export
+    UINT64 fileid;      // the file's index on its volume, survives renames and restarts
+    UINT64 size;
+    UINT64 accessTime;
+    UINT64 writeTime;
+    UINT64 changeTime;  // changes with the data and the metadata (unlike the creation time)
+};
+
+// Returns: 0 on success, otherwise the error
+DWORD GetFileStat(HANDLE file, FileStat* stat)
+{
+    BY_HANDLE_FILE_INFORMATION info;
+    FILE_BASIC_INFO basicInfo; // the only way to get the change time
+    if(!GetFileInformationByHandle(file, &info) ||
+       !GetFileInformationByHandleEx(file, FileBasicInfo, &basicInfo, sizeof(basicInfo)))
+    {
+        return GetLastError();
+    }
+    stat->attributes   = basicInfo.FileAttributes;
+    stat->volumeSerial = info.dwVolumeSerialNumber;
+    stat->fileid       = (UINT64)info.nFileIndexHigh << 32 | info.nFileIndexLow;
+    stat->size         = (UINT64)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+    stat->accessTime   = basicInfo.LastAccessTime.QuadPart;
+    stat->writeTime    = basicInfo.LastWriteTime.QuadPart;
+    stat->changeTime   = basicInfo.ChangeTime.QuadPart;
+    return 0;
+}
+
+UINT64 FileTimeToUint64(FILETIME filetime)
+{
+    return (UINT64)filetime.dwHighDateTime << 32 | filetime.dwLowDateTime;
+}
+
+#define FATTR3_SIZE 84
+
+void SetFattr3(char* buffer, FileStat* stat)
+{
+    UINT64 size = stat->size;
+    if(stat->attributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        SET_UINT(buffer, NFS3_FILE_TYPE_DIR_NETWORK_ORDER);
+        size = 0;
+    }
+    else
+    {
+        SET_UINT(buffer, NFS3_FILE_TYPE_REG_NETWORK_ORDER);
+    }
+    AppendUint(buffer + 4,
+        // Grant all permissions for now
+        MODE_OWNER_READ | MODE_OWNER_WRITE | MODE_OWNER_EXEC |
+        MODE_GROUP_READ | MODE_GROUP_WRITE | MODE_GROUP_EXEC |
+        MODE_OTHER_READ | MODE_OTHER_WRITE | MODE_OTHER_EXEC);
+    SET_UINT    (buffer +  8, _1_NETWORK_ORDER); // nlinks (number of hard links to file)
+    SET_UINT    (buffer + 12, 0); // uid
+    SET_UINT    (buffer + 16, 0); // gid
+    AppendUint64(buffer + 20, size); // size
+    AppendUint64(buffer + 28, size); // used
+    SET_UINT    (buffer + 36, 0); // rdev
+    SET_UINT    (buffer + 40, 0);
+    SET_UINT    (buffer + 44, 0); // fsid
+    AppendUint  (buffer + 48, stat->volumeSerial);
+    AppendUint64(buffer + 52, stat->fileid);
+    SetNfsTime  (buffer + 60, stat->accessTime);
+    SetNfsTime  (buffer + 68, stat->writeTime);
+    SetNfsTime  (buffer + 76, stat->changeTime);
+}
+
+// The fattr3 last returned for a handle, kept in its encoded form.  The
+// attributes of a file rarely change between calls, so replies copy these
+// bytes as they are and they're only encoded again when the attributes they
+// were made from change.
+struct EncodedAttributes
+{
+    FileStat stat;
+    UINT version; // incremented every time fattr3 is encoded again
+    char fattr3[FATTR3_SIZE];
+};
+
+// Served by the ATTRIBUTES procedure of the stats program
+struct EncodedAttributesStats
+{
+    UINT64 copies;   // replies that copied the encoded attributes
+    UINT64 encodes;  // times the attributes had changed and were encoded again
+};
+static EncodedAttributesStats encodedAttributesStats;
+
+// Same as SetFattr3, but the encoding is kept with the handle and reused
+// while the attributes stay the same
+void CopyFattr3(char* buffer, UINT handle, FileStat* stat)
+{
+    EncodedAttributes* encoded = nameHandles[handle].attributes;
+    if(encoded == NULL)
+    {
+        encoded = (EncodedAttributes*)malloc(sizeof(EncodedAttributes));
+        if(!encoded)
+        {
+            SetFattr3(buffer, stat);
+            return;
+        }
+        encoded->version = 0;
+        nameHandles[handle].attributes = encoded;
+    }
+    else if(memcmp(&encoded->stat, stat, sizeof(FileStat)) == 0)
+    {
+        encodedAttributesStats.copies++;
+        memcpy(buffer, encoded->fattr3, FATTR3_SIZE);
+        return;
+    }
+
+    encoded->stat = *stat;
+    encoded->version++;
+    SetFattr3(encoded->fattr3, stat);
+    encodedAttributesStats.encodes++;
+    memcpy(buffer, encoded->fattr3, FATTR3_SIZE);
+}
+
+UINT Nfs3ErrorFromWin32(DWORD error)
+{
+    switch(error)
+    {
+      case ERROR_FILE_NOT_FOUND:
+      case ERROR_PATH_NOT_FOUND:
+        return NFS3_ERROR_NOENT_NETWORK_ORDER;
+      case ERROR_ACCESS_DENIED:
+      case ERROR_SHARING_VIOLATION:
+        return NFS3_ERROR_ACCES_NETWORK_ORDER;
+      case ERROR_DISK_FULL:
+      case ERROR_HANDLE_DISK_FULL:
+        return NFS3_ERROR_NOSPC_NETWORK_ORDER;
+      default:
+        return NFS3_ERROR_IO_NETWORK_ORDER;
+    }
+}
+
+// The file and attributes READ uses.  When the block cache is enabled the
+// attributes are only refreshed every BlockCacheValidate milliseconds (or
+// after a write through this server), so cache hits don't make any calls
+// to the file system.
+struct ReadState
+{
+    HANDLE file;
+    bool stale;
+    DWORD validatedTickCount;
+    FileStat stat;
+    // The sequential streams read-ahead follows (see ReadAhead.h)
+    ReadAheadStreams readAhead;
+    // The allocated ranges of a sparse file (see SparseMap.h)
+    SparseMap sparse;
+};
+
+// Opens a file or directory just to get its attributes
+// Note: doesn't use any server state, it is called from the file system workers
+// Returns: 0 on success, otherwise the error
+DWORD StatPath(const char* path, FileStat* outStat)
+{
+    HANDLE file = CreateFile(path, FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS, NULL); // required to open directories
+    if(file == INVALID_HANDLE_VALUE)
+    {
+        return GetLastError();
+    }
+    DWORD error = GetFileStat(file, outStat);
+    CloseHandle(file);
+    return error;
+}
+
+// Sets up the reply of a GETATTR from the attributes of its file
+// error: from getting the attributes, stat is only used if it is 0
+// Returns: response length
+UINT FinishGetattr(UINT handle, DWORD error, FileStat* stat, char* buffer)
+{
+    String localName = nameHandles[handle].localName;
+    if(error)
+    {
+        LOG_AT(NFS, ERROR, "[NFS] GETATTR: \"%s\" failed (e=%d)", localName.ptr, error);
+        SET_UINT(buffer    , Nfs3ErrorFromWin32(error));
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+
+    SET_UINT(buffer, NFS3_STATUS_OK_NETWORK_ORDER);
+    CopyFattr3(buffer + 4, handle, stat);
+    LOG_AT(NFS, DEBUG, "[NFS] GETATTR \"%s\"", localName.ptr);
+    return 4 + FATTR3_SIZE;
+}
+
+// A GETATTR whose file isn't open, it lives in the call's arena while a
+// file system worker opens the file
+struct AsyncGetattr
+{
+    AsyncCall call; // must be first
+    UINT handle;
+    const char* path;
+    DWORD error;
+    FileStat stat;
+};
+
+void GetattrWork(IoRequest* request)
+{
+    AsyncGetattr* getattr = (AsyncGetattr*)request;
+    getattr->error = StatPath(getattr->path, &getattr->stat);
+}
+
+UINT GetattrFinish(AsyncCall* call, char* buffer, SyncRequest* outSync)
+{
+    AsyncGetattr* getattr = (AsyncGetattr*)call;
+    return FinishGetattr(getattr->handle, getattr->error, &getattr->stat, buffer);
+}
+
+// Returns: response length, 0 if the file went to a worker to be opened
+UINT GETATTR(SelectSock* sock, RpcCallInfo* callInfo, char* handleBuffer, UINT handleLength, char* buffer)
+{
+    UINT handle = TryParseHandle(handleBuffer, handleLength);
+    if(handle == NO_HANDLE)
+    {
+        LOG_AT(NFS, INFO, "[NFS] GETATTR: bad handle");
+        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+
+    // The size and times must include any writes that are still gathered
+    if(nameHandles[handle].gather)
+    {
+        WriteGatherFlush(nameHandles[handle].gather);
+    }
+
+    // The file id and change time can only be read from an open file, use
+    // the one WRITE or READ opened if there is one
+    HANDLE file = nameHandles[handle].file;
+    if(!file && nameHandles[handle].read)
+    {
+        file = nameHandles[handle].read->file;
+    }
+    if(file)
+    {
+        FileStat stat;
+        DWORD error = GetFileStat(file, &stat);
+        return FinishGetattr(handle, error, &stat, buffer);
+    }
+
+    AsyncGetattr local;
+    AsyncGetattr* getattr = (AsyncGetattr*)AllocAsyncCall(callInfo, sizeof(AsyncGetattr), &local.call);
+    getattr->handle = handle;
+    getattr->path = nameHandles[handle].localName.ptr;
+    return RunAsyncCall(sock, callInfo, &getattr->call, &GetattrWork, &GetattrFinish, buffer, NULL);
+}
+
+// Returns: response length
+UINT ACCESS(char* handle, UINT handleLength, UINT flags, char* buffer)
+{
+    String localName = TryLookupHandle(handle, handleLength);
+    if(localName.ptr == NULL)
+    {
+        LOG_AT(NFS, INFO, "[NFS] ACCESS: bad handle");
+        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+
+    SET_UINT  (buffer + 0 , NFS3_STATUS_OK_NETWORK_ORDER);
+    SET_UINT  (buffer + 4, 0);     // no post-op_attr
+    AppendUint(buffer + 8, flags); // Just return all the flags for now
+    return 12;
+}
+
+// value_follows, fileid, name length, cookie, post_op_attr and post_op_fh3
+// with a 4 byte handle (the name itself is not included)
+#define READDIRPLUS_ENTRY_FIXED_SIZE (4 + 8 + 4 + 8 + 4 + FATTR3_SIZE + 12)
+
+// A READDIRPLUS whose entries the enumeration worker hasn't read yet, it
+// lives in the call's arena until the worker publishes them
+struct AsyncReaddirplus
+{
+    AsyncCall call; // must be first
+    DirWaiter waiter;
+    UINT dirHandle;
+    DirSnapshot* snapshot; // holds a reference
+    UINT maxLength;
+};
+
+UINT ReaddirplusPage(UINT dirHandle, DirSnapshot* snapshot, UINT index, UINT available,
+                     bool complete, DWORD error, char* buffer, UINT maxLength);
+
+// Called on the enumeration worker once the entries are published
+void ReaddirplusReady(DirWaiter* waiter)
+{
+    AsyncReaddirplus* readdir = (AsyncReaddirplus*)((char*)waiter - offsetof(AsyncReaddirplus, waiter));
+    IoPoolComplete(&readdir->call.request);
+}
+
+UINT ReaddirplusFinish(AsyncCall* call, char* buffer, SyncRequest* outSync)
+{
+    AsyncReaddirplus* readdir = (AsyncReaddirplus*)call;
+    bool complete;
+    DWORD error;
+    UINT available = readdir->snapshot->WaitForEntries(readdir->waiter.index, &complete, &error); // doesn't wait
+    UINT length = ReaddirplusPage(readdir->dirHandle, readdir->snapshot, readdir->waiter.index, available,
+        complete, error, buffer, readdir->maxLength);
+    readdir->snapshot->Release();
+    return length;
+}
+
+// Returns: response length, 0 if the call waits for the enumeration worker
+//          to read the entries at the cookie (if out of memory it waits on
+//          this thread)
+UINT READDIRPLUS(SelectSock* sock, RpcCallInfo* callInfo, char* handleBuffer, UINT handleLength, char* buffer,
+                 UINT64 cookie, UINT64 cookieVerifier, UINT maxLength)
+{
+    UINT dirHandle = TryParseHandle(handleBuffer, handleLength);
+    if(dirHandle == NO_HANDLE)
+    {
+        LOG_AT(NFS, INFO, "[NFS] READDIRPLUS: bad handle");
+        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+    NameHandle* dir = &nameHandles[dirHandle];
+    LOG_AT(NFS, DEBUG, "[NFS] READDIRPLUS \"%s\" cookie=%llu", dir->localName.ptr, (unsigned long long)cookie);
+
+    // A cookie of 0 starts a new listing, every other cookie continues the
+    // listing in the directory's snapshot
+    DirSnapshot* snapshot = dir->dirSnapshot;
+    if(cookie == 0)
+    {
+        if(snapshot)
+        {
+            snapshot->Cancel();
+            snapshot->Release();
+        }
+        snapshot = StartDirEnum(dir->localName);
+        dir->dirSnapshot = snapshot;
+        if(!snapshot)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] READDIRPLUS: out of memory");
+            SET_UINT(buffer    , NFS3_ERROR_SERVERFAULT_NETWORK_ORDER);
+            SET_UINT(buffer + 4, 0); // no post_op_attr
+            return 8;
+        }
+    }
+    else if(snapshot == NULL || snapshot->verifier != cookieVerifier || cookie > 0xFFFFFFFF)
+    {
+        LOG_AT(NFS, INFO, "[NFS] READDIRPLUS: cookie %llu is stale", (unsigned long long)cookie);
+        SET_UINT(buffer    , NFS3_ERROR_BAD_COOKIE_NETWORK_ORDER);
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+
+    // The cookie of an entry is the index of the entry after it
+    UINT index = (UINT)cookie;
+    UINT available;
+    bool complete;
+    DWORD error;
+    AsyncReaddirplus* wait = (AsyncReaddirplus*)CallAlloc(callInfo, sizeof(AsyncReaddirplus));
+    if(wait == NULL)
+    {
+        available = snapshot->WaitForEntries(index, &complete, &error);
+    }
+    else
+    {
+        // The worker can call the waiter as soon as it is registered, but
+        // the call is only finished on this thread
+        wait->waiter.ready = &ReaddirplusReady;
+        wait->dirHandle = dirHandle;
+        wait->snapshot = snapshot;
+        wait->maxLength = maxLength;
+        if(!snapshot->GetEntries(index, &wait->waiter, &available, &complete, &error))
+        {
+            snapshot->AddRef();
+            WaitAsyncCall(sock, callInfo, &wait->call, &ReaddirplusFinish);
+            return 0;
+        }
+    }
+    return ReaddirplusPage(dirHandle, snapshot, index, available, complete, error, buffer, maxLength);
+}
+
+// Returns the entries from index that are already in the snapshot, as many
+// as fit in maxLength
+// Assumption: index is less than available or the listing is complete
+// Returns: response length
+UINT ReaddirplusPage(UINT dirHandle, DirSnapshot* snapshot, UINT index, UINT available,
+                     bool complete, DWORD error, char* buffer, UINT maxLength)
+{
+    NameHandle* dir = &nameHandles[dirHandle];
+    if(index > available || (index == available && error))
+    {
+        LOG_AT(NFS, INFO, "[NFS] READDIRPLUS: listing \"%s\" failed at entry %u (e=%d)", dir->localName.ptr, index, error);
+        // A listing that was restarted while this call waited is stale
+        SET_UINT(buffer    , (error == ERROR_DIRECTORY)                      ? NFS3_ERROR_NOTDIR_NETWORK_ORDER :
+                             (index > available ||
+                              error == ERROR_OPERATION_ABORTED)              ? NFS3_ERROR_BAD_COOKIE_NETWORK_ORDER :
+                                                                               NFS3_ERROR_SERVERFAULT_NETWORK_ORDER);
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+
+    SET_UINT    (buffer     , NFS3_STATUS_OK_NETWORK_ORDER);
+    SET_UINT    (buffer +  4, 0); // no post_op_attr
+    AppendUint64(buffer +  8, snapshot->verifier);
+
+    // Every entry is on the same volume as the export
+    Export* dirExport = FindExport(dir->localName);
+    DWORD volumeSerial = dirExport ? dirExport->volumeSerial : 0;
+
+    // Entry handles are created from the directory path plus the entry name
+    char path[MAX_PATH];
+    UINT dirPathLength = dir->localName.length;
+    memcpy(path, dir->localName.ptr, dirPathLength);
+    if(dirPathLength > 0 && path[dirPathLength - 1] != '\\')
+    {
+        path[dirPathLength++] = '\\';
+    }
+
+    // Only the entries that are already in the snapshot are returned, a page
+    // can be short while the worker is still reading the directory
+    UINT offset = 16;
+    UINT entryLimit = (maxLength > 8) ? maxLength - 8 : 0; // leave room for the end of the list and eof
+    bool pageFull = false;
+    for(; index < available; index++)
+    {
+        DirEntry* entry = snapshot->Entry(index);
+        if(offset + READDIRPLUS_ENTRY_FIXED_SIZE + Align4(entry->nameLength) > entryLimit)
+        {
+            pageFull = true;
+            break;
+        }
+
+        UINT handle = NO_HANDLE;
+        if(entry->nameLength == 1 && entry->name[0] == '.')
+        {
+            handle = dirHandle;
+        }
+        else if((entry->nameLength == 2 && entry->name[0] == '.' && entry->name[1] == '.') ||
+                dirPathLength + entry->nameLength >= MAX_PATH)
+        {
+            // The parent may be outside the export, long paths are not supported yet
+        }
+        else
+        {
+            memcpy(path + dirPathLength, entry->name, entry->nameLength + 1);
+            handle = GetOrCreateHandle(String(path, dirPathLength + entry->nameLength));
+        }
+        FileStat stat;
+        stat.attributes   = entry->attributes;
+        stat.volumeSerial = volumeSerial;
+        stat.fileid       = entry->fileId;
+        stat.size         = entry->size;
+        stat.accessTime   = entry->accessTime;
+        stat.writeTime    = entry->writeTime;
+        stat.changeTime   = entry->changeTime;
+
+        char* next = buffer + offset;
+        SET_UINT    (next +  0, _1_NETWORK_ORDER); // value follows
+        AppendUint64(next +  4, stat.fileid);
+        AppendUint  (next + 12, entry->nameLength);
+        SET_UINT  (next + 12 + Align4(entry->nameLength), 0); // zero the padding
+        memcpy    (next + 16, entry->name, entry->nameLength);
+        next += 16 + Align4(entry->nameLength);
+
+        AppendUint64(next, index + 1); // cookie
+        SET_UINT    (next + 8, _1_NETWORK_ORDER); // post_op_attr follows
+        if(handle == NO_HANDLE)
+        {
+            SetFattr3(next + 12, &stat);
+        }
+        else
+        {
+            CopyFattr3(next + 12, handle, &stat);
+        }
+        next += 12 + FATTR3_SIZE;
+
+        if(handle == NO_HANDLE)
+        {
+            SET_UINT(next, 0); // no post_op_fh3
+            next += 4;
+        }
+        else
+        {
+            SET_UINT  (next + 0, _1_NETWORK_ORDER); // post_op_fh3 follows
+            SET_UINT  (next + 4, _4_NETWORK_ORDER); // handle length
+            AppendUint(next + 8, handle);
+            next += 12;
+        }
+        offset = (UINT)(next - buffer);
+    }
+
+    if(offset == 16 && pageFull)
+    {
+        LOG_AT(NFS, INFO, "[NFS] READDIRPLUS: maxcount %u is too small", maxLength);
+        SET_UINT(buffer    , NFS3_ERROR_TOOSMALL_NETWORK_ORDER);
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+
+    // If the listing failed part way through, the error is returned
+    // on the next call
+    bool eof = !pageFull && complete && index == available && !error;
+    // Note: creating the entry handles may have moved the handle table
+    if(eof && nameHandles[dirHandle].dirSnapshot == snapshot)
+    {
+        snapshot->Release();
+        nameHandles[dirHandle].dirSnapshot = NULL;
+    }
+    SET_UINT(buffer + offset    , 0); // no more entries
+    SET_UINT(buffer + offset + 4, eof ? _1_NETWORK_ORDER : 0);
+    return offset + 8;
+}
+
+// Returns: response length
+UINT FSINFO(char* handle, UINT handleLength, char* buffer)
+{
+    String localName = TryLookupHandle(handle, handleLength);
+    if(localName.ptr == NULL)
+    {
+        LOG_AT(NFS, INFO, "[NFS] FSINFO: bad handle");
+        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+
+    // Transfer sizes come from the buffer pool, the max is what a single
+    // record can hold and the preferred size is a whole pool buffer
+    SET_UINT  (buffer +  0, NFS3_STATUS_OK_NETWORK_ORDER);
+    SET_UINT  (buffer +  4, 0);                                   // no post-op_attr
+    AppendUint(buffer +  8, config.maxTransferSize);              // rtmax
+    AppendUint(buffer + 12, config.preferredTransferSize);        // rtpref
+    AppendUint(buffer + 16, (UINT)BUFFER_POOL_MIN_BUFFER_SIZE);   // rtmult
+    AppendUint(buffer + 20, config.maxTransferSize);              // wtmax
+    AppendUint(buffer + 24, config.preferredTransferSize);        // wtpref
+    AppendUint(buffer + 28, (UINT)BUFFER_POOL_MIN_BUFFER_SIZE);   // wtmult
+    AppendUint(buffer + 32, config.preferredTransferSize);        // dtpref, preferred size of a READDIR request
+    SET_UINT  (buffer + 36, 0xFFFFFFFF); // maxfilesize HIGH_DWORD (no limit)
+    SET_UINT  (buffer + 40, 0xFFFFFFFF); // maxfilesize LOW_DWORD  (no limit)
+    SET_UINT  (buffer + 44, 0);          // time_delta (seconds)
+    AppendUint(buffer + 48, 1000000);    // time_delta (nanoseconds) set to 1 millsecond for now
+    SET_UINT  (buffer + 52, 0);          // properties (all off for now)
+                                         // TODO: should probably set value for symbolic/hard links
+    return 56;
+}
+// Returns: response length
+UINT PATHCONF(char* handle, UINT handleLength, char* buffer)
+{
+    String localName = TryLookupHandle(handle, handleLength);
+    if(localName.ptr == NULL)
+    {
+        LOG_AT(NFS, INFO, "[NFS] PATHCONF: bad handle");
+        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+
+    SET_UINT  (buffer +  0, NFS3_STATUS_OK_NETWORK_ORDER);
+    SET_UINT  (buffer +  4, 0);                // no post-op_attr
+    SET_UINT  (buffer +  8, 0xFFFFFFFF);       // linkmax, no limit
+    AppendUint(buffer + 12, MAX_PATH);         // name_max, no limit
+    SET_UINT  (buffer + 16, _1_NETWORK_ORDER); // no-trunc (TRUE, server does not truncate names that are too large)
+    SET_UINT  (buffer + 20, 0);                // chown_restricted (FALSE)
+    SET_UINT  (buffer + 24, _1_NETWORK_ORDER); // case_insensitive (TRUE)
+    SET_UINT  (buffer + 28, 0);                // case_preserving (FALSE)
+    return 32;
+}
+
+// Application can override the alignment of direct I/O, a multiple of the
+// sector size of every volume it is used on
+#ifndef DIRECT_IO_ALIGNMENT
+#define DIRECT_IO_ALIGNMENT 4096
+#endif
+
+// Returns: true if the handle's direct file is open or can be opened, false
+//          if its export doesn't use direct I/O or it can't be opened
+bool UsesDirectIo(UINT handle)
+{
+    NameHandle* nameHandle = &nameHandles[handle];
+    if(nameHandle->directFile == NULL)
+    {
+        Export* fileExport = FindExport(nameHandle->localName);
+        if(!fileExport || !fileExport->directIo)
+        {
+            nameHandle->directFile = INVALID_HANDLE_VALUE;
+        }
+    }
+    return nameHandle->directFile != INVALID_HANDLE_VALUE;
+}
+
+// Note: doesn't use any server state, it is called from the file system workers
+// Returns: the file opened without buffering, INVALID_HANDLE_VALUE if it
+//          can't be
+HANDLE OpenDirectFile(const char* path)
+{
+    HANDLE file = CreateFile(path, GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_FLAG_NO_BUFFERING, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+    {
+        LOG_AT(NFS, INFO, "[NFS] \"%s\" can't be opened for direct I/O (e=%d), it goes through the system cache",
+            path, GetLastError());
+    }
+    return file;
+}
+
+// Keeps the file OpenDirectFile returned with the handle, if another call
+// opened the handle's direct file first that one is kept and file is closed
+// file: NULL if it wasn't opened
+void InstallDirectFile(UINT handle, HANDLE file)
+{
+    if(file == NULL)
+    {
+        return;
+    }
+    if(nameHandles[handle].directFile != NULL)
+    {
+        if(file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+        }
+        return;
+    }
+    nameHandles[handle].directFile = file;
+}
+
+// Returns: the handle's file opened without buffering, NULL if its export
+//          doesn't use direct I/O or it can't be opened
+HANDLE GetDirectFile(UINT handle)
+{
+    if(!UsesDirectIo(handle))
+    {
+        return NULL;
+    }
+    if(nameHandles[handle].directFile == NULL)
+    {
+        nameHandles[handle].directFile = OpenDirectFile(nameHandles[handle].localName.ptr);
+    }
+    return (nameHandles[handle].directFile == INVALID_HANDLE_VALUE) ? NULL : nameHandles[handle].directFile;
+}
+
+// Direct I/O done by the file system workers (and the select thread when
+// there are none), for the DIRECT_IO stats procedure
+static volatile LONG64 directReads;
+static volatile LONG64 directReadBytes;
+static volatile LONG64 directWrites;
+static volatile LONG64 directWriteBytes;
+
+// Finds the part of a READ or WRITE that is aligned for direct I/O, the
+// unaligned head and tail go through the system cache
+// Returns: true if the aligned part is at least DirectIoMinSize
+bool GetDirectRange(UINT64 offset, UINT count, UINT64* outStart, UINT64* outEnd)
+{
+    UINT64 start = (offset + DIRECT_IO_ALIGNMENT - 1) & ~(UINT64)(DIRECT_IO_ALIGNMENT - 1);
+    UINT64 end = (offset + count) & ~(UINT64)(DIRECT_IO_ALIGNMENT - 1);
+    if(end <= start || end - start < config.directIoMinSize)
+    {
+        return false;
+    }
+    *outStart = start;
+    *outEnd = end;
+    return true;
+}
+
+// Creates the handle's read state for a file READ opened, its attributes
+// are read by the next READ
+// Returns: the read state, NULL if out of memory (the file is closed)
+ReadState* CreateReadState(UINT handle, HANDLE file)
+{
+    ReadState* read = (ReadState*)malloc(sizeof(ReadState));
+    if(!read)
+    {
+        LOG_AT(NFS, ERROR, "[NFS] READ: out of memory for the read state of \"%s\"", nameHandles[handle].localName.ptr);
+        CloseHandle(file);
+        return NULL;
+    }
+    read->file = file;
+    read->stale = true;
+    memset(&read->readAhead, 0, sizeof(read->readAhead));
+    memset(&read->sparse, 0, sizeof(read->sparse));
+    nameHandles[handle].read = read;
+    return read;
+}
+
+// Returns: count, less if the READ reaches past the end of the file
+UINT ClampReadCount(FileStat* stat, UINT64 offset, UINT count)
+{
+    if(offset >= stat->size)
+    {
+        return 0;
+    }
+    if(stat->size - offset < count)
+    {
+        return (UINT)(stat->size - offset);
+    }
+    return count;
+}
+
+// What ReadFileData reads from
+struct ReadDataContext
+{
+    UINT handle;
+    HANDLE file;
+    UINT64 changeTime;
+    HANDLE directFile; // NULL if the export doesn't use direct I/O
+    bool cached; // reads go through the block cache, only on the select thread
+};
+
+// Reads through the block cache when the context is cached, otherwise
+// straight from the file
+// Returns: 0 on success, otherwise the error, outLength is less than count
+//          only at the end of the file
+DWORD ReadCachedData(ReadDataContext* context, UINT64 offset, UINT count, char* data, UINT* outLength)
+{
+    UINT dataLength = 0;
+    if(context->cached)
+    {
+        // Copy the data out of the cached blocks that cover the range
+        UINT64 blockIndex = offset >> BLOCK_CACHE_BLOCK_SHIFT;
+        UINT blockOffset = (UINT)(offset & (BLOCK_CACHE_BLOCK_SIZE - 1));
+        while(dataLength < count)
+        {
+            UINT blockLength;
+            DWORD error;
+            char* block = BlockCacheGet(context->handle, context->file, blockIndex, context->changeTime, &blockLength, &error);
+            if(!block)
+            {
+                return error;
+            }
+            if(blockLength <= blockOffset)
+            {
+                break; // the file is shorter than its attributes said
+            }
+            UINT copyLength = blockLength - blockOffset;
+            if(copyLength > count - dataLength)
+            {
+                copyLength = count - dataLength;
+            }
+            memcpy(data + dataLength, block + blockOffset, copyLength);
+            dataLength += copyLength;
+            if(blockLength < BLOCK_CACHE_BLOCK_SIZE)
+            {
+                break;
+            }
+            blockIndex++;
+            blockOffset = 0;
+        }
+    }
+    else
+    {
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset     = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD readLength;
+        if(!ReadFile(context->file, data, count, &readLength, &overlapped))
+        {
+            DWORD error = GetLastError();
+            if(error != ERROR_HANDLE_EOF)
+            {
+                return error;
+            }
+            readLength = 0;
+        }
+        dataLength = readLength;
+    }
+    *outLength = dataLength;
+    return 0;
+}
+
+// Reads the aligned part of a large READ without buffering into a buffer
+// pool buffer (which is page aligned) and the head and tail through the
+// system cache, a direct READ doesn't use the block cache (a
+// SparseReadHandler)
+// Returns: 0 on success, otherwise the error, outLength is less than count
+//          only at the end of the file
+DWORD ReadFileData(void* param, UINT64 offset, UINT count, char* data, UINT* outLength)
+{
+    ReadDataContext* context = (ReadDataContext*)param;
+    UINT64 directStart, directEnd;
+    if(!context->directFile || !GetDirectRange(offset, count, &directStart, &directEnd))
+    {
+        return ReadCachedData(context, offset, count, data, outLength);
+    }
+    ReadDataContext uncached = *context;
+    uncached.cached = false;
+
+    UINT headLength = (UINT)(directStart - offset);
+    if(headLength)
+    {
+        UINT length;
+        DWORD error = ReadCachedData(&uncached, offset, headLength, data, &length);
+        if(error || length < headLength)
+        {
+            *outLength = length;
+            return error;
+        }
+    }
+
+    UINT directLength = (UINT)(directEnd - directStart);
+    char* directBuffer = BufferPoolAlloc(directLength);
+    if(!directBuffer)
+    {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset     = (DWORD)directStart;
+    overlapped.OffsetHigh = (DWORD)(directStart >> 32);
+    DWORD readLength;
+    if(!ReadFile(context->directFile, directBuffer, directLength, &readLength, &overlapped))
+    {
+        DWORD error = GetLastError();
+        if(error != ERROR_HANDLE_EOF)
+        {
+            BufferPoolFree(directBuffer, directLength);
+            return error;
+        }
+        readLength = 0;
+    }
+    InterlockedIncrement64(&directReads);
+    InterlockedExchangeAdd64(&directReadBytes, readLength);
+    memcpy(data + headLength, directBuffer, readLength);
+    BufferPoolFree(directBuffer, directLength);
+    if(readLength < directLength)
+    {
+        *outLength = headLength + readLength;
+        return 0;
+    }
+
+    UINT tailLength = (UINT)(offset + count - directEnd);
+    UINT length = 0;
+    if(tailLength)
+    {
+        DWORD error = ReadCachedData(&uncached, directEnd, tailLength, data + headLength + directLength, &length);
+        if(error)
+        {
+            return error;
+        }
+    }
+    *outLength = headLength + directLength + length;
+    return 0;
+}
+
+// Sets up the reply of a READ whose data is already at buffer + 104
+// Returns: response length
+UINT SetReadReply(UINT handle, FileStat* stat, UINT64 offset, UINT dataLength, char* buffer)
+{
+    char* data = buffer + 104;
+    SET_UINT  (buffer +  0, NFS3_STATUS_OK_NETWORK_ORDER);
+    SET_UINT  (buffer +  4, _1_NETWORK_ORDER); // post_op_attr follows
+    CopyFattr3(buffer +  8, handle, stat);
+    AppendUint(buffer + 92, dataLength);
+    SET_UINT  (buffer + 96, (offset + dataLength >= stat->size) ? _1_NETWORK_ORDER : 0); // eof
+    AppendUint(buffer + 100, dataLength);
+    memset(data + dataLength, 0, Align4(dataLength) - dataLength);
+    return 104 + Align4(dataLength);
+}
+
+// Answers a READ from the read state and the block cache without any file
+// system calls, the read state's attributes must be fresh
+// Returns: response length, 0 if the file has to be read
+UINT ReadFromCache(UINT handle, ReadState* read, UINT64 offset, UINT count, char* buffer)
+{
+    if(read->stat.attributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        return 0;
+    }
+    count = ClampReadCount(&read->stat, offset, count);
+    char* data = buffer + 104;
+    UINT dataLength = 0;
+    UINT64 directStart, directEnd;
+    if(count > 0 && GetDirectRange(offset, count, &directStart, &directEnd) && UsesDirectIo(handle))
+    {
+        return 0; // direct reads skip the cache
+    }
+    SparseMap* sparse = &read->sparse;
+    UINT first;
+    if(count > 0 && config.sparseReads && (read->stat.attributes & FILE_ATTRIBUTE_SPARSE_FILE) &&
+       sparse->valid && !sparse->dense && sparse->changeTime == read->stat.changeTime &&
+       SparseMapOverlap(sparse, offset, count, &first) == 0)
+    {
+        // Entirely in a hole
+        memset(data, 0, count);
+        dataLength = count;
+    }
+    else
+    {
+        UINT64 blockIndex = offset >> BLOCK_CACHE_BLOCK_SHIFT;
+        UINT blockOffset = (UINT)(offset & (BLOCK_CACHE_BLOCK_SIZE - 1));
+        while(dataLength < count)
+        {
+            UINT blockLength;
+            char* block = BlockCacheLookup(handle, blockIndex, read->stat.changeTime, &blockLength);
+            if(!block)
+            {
+                return 0;
+            }
+            if(blockLength <= blockOffset)
+            {
+                break; // the file is shorter than its attributes said
+            }
+            UINT copyLength = blockLength - blockOffset;
+            if(copyLength > count - dataLength)
+            {
+                copyLength = count - dataLength;
+            }
+            memcpy(data + dataLength, block + blockOffset, copyLength);
+            dataLength += copyLength;
+            if(blockLength < BLOCK_CACHE_BLOCK_SIZE)
+            {
+                break;
+            }
+            blockIndex++;
+            blockOffset = 0;
+        }
+    }
+    if(count > 0 && config.readAheadMax)
+    {
+        ReadAheadAccess(&read->readAhead, nameHandles[handle].localName.ptr, read->stat.size, offset, count);
+    }
+    LOG_AT(NFS, DEBUG, "[NFS] READ \"%s\" offset %llu count %u", nameHandles[handle].localName.ptr,
+        (unsigned long long)offset, dataLength);
+    return SetReadReply(handle, &read->stat, offset, dataLength, buffer);
+}
+
+// Adds the whole blocks a READ read from the file to the block cache, and
+// the last block of the file if the READ reached it
+void CacheReadBlocks(UINT handle, FileStat* stat, UINT64 offset, char* data, UINT length)
+{
+    UINT64 end = offset + length;
+    for(UINT64 blockIndex = (offset + BLOCK_CACHE_BLOCK_SIZE - 1) >> BLOCK_CACHE_BLOCK_SHIFT; ; blockIndex++)
+    {
+        UINT64 blockStart = blockIndex << BLOCK_CACHE_BLOCK_SHIFT;
+        UINT64 blockEnd = blockStart + BLOCK_CACHE_BLOCK_SIZE;
+        if(blockEnd > stat->size)
+        {
+            blockEnd = stat->size;
+        }
+        if(blockStart >= blockEnd || blockEnd > end)
+        {
+            break;
+        }
+        BlockCachePut(handle, blockIndex, stat->changeTime, data + (blockStart - offset), (UINT)(blockEnd - blockStart));
+    }
+}
+
+// A READ that has to read the file, it lives in the call's arena while a
+// file system worker reads it.  The worker only uses what is copied here,
+// the read state is updated once the READ is finished.
+struct AsyncRead
+{
+    AsyncCall call; // must be first
+    UINT handle;
+    const char* path;
+    UINT writeCount; // of the handle when the READ started
+    UINT64 offset;
+    UINT count;
+    char* data; // count bytes, buffer + 104 if the READ isn't submitted
+    HANDLE file; // the read state's file, opened by the worker if NULL
+    bool opened;
+    bool refresh; // the worker gets the attributes again
+    FileStat stat;
+    HANDLE directFile; // NULL if the export doesn't use direct I/O
+    bool openDirect;   // the worker opens directFile
+    bool cached; // reads go through the block cache
+    // The map of the read state, a copy of the ranges the READ overlaps if
+    // the READ is submitted, NULL if there is none
+    SparseMap* sparse;
+    bool loadSparse; // the worker mapped the file into loaded
+    DWORD sparseError;
+    SparseMap loaded;
+    bool isDirectory;
+    DWORD error;
+    UINT dataLength;
+};
+
+void ReadWork(IoRequest* request)
+{
+    AsyncRead* read = (AsyncRead*)request;
+    if(!read->file)
+    {
+        HANDLE file = CreateFile(read->path, GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if(file == INVALID_HANDLE_VALUE)
+        {
+            read->error = GetLastError();
+            // Directories can't be opened for reading
+            DWORD attributes = GetFileAttributes(read->path);
+            read->isDirectory = (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY));
+            return;
+        }
+        read->file = file;
+        read->opened = true;
+        read->refresh = true;
+    }
+    if(read->refresh)
+    {
+        read->error = GetFileStat(read->file, &read->stat);
+        if(read->error)
+        {
+            return;
+        }
+    }
+    if(read->stat.attributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        read->isDirectory = true;
+        return;
+    }
+    read->count = ClampReadCount(&read->stat, read->offset, read->count);
+    if(read->count == 0)
+    {
+        return;
+    }
+    if(read->openDirect)
+    {
+        read->directFile = OpenDirectFile(read->path);
+    }
+
+    SparseMap* sparse = NULL;
+    if(config.sparseReads && (read->stat.attributes & FILE_ATTRIBUTE_SPARSE_FILE))
+    {
+        sparse = read->sparse;
+        if(!sparse || sparse->changeTime != read->stat.changeTime)
+        {
+            read->loadSparse = true;
+            read->sparseError = SparseMapLoad(&read->loaded, read->file, read->stat.size, read->stat.changeTime);
+            sparse = read->sparseError ? NULL : &read->loaded;
+        }
+        if(sparse && sparse->dense)
+        {
+            sparse = NULL;
+        }
+    }
+    ReadDataContext context = {read->handle, read->file, read->stat.changeTime,
+        (read->directFile == INVALID_HANDLE_VALUE) ? NULL : read->directFile, read->cached};
+    if(sparse)
+    {
+        read->error = SparseMapRead(sparse, read->offset, read->count, read->data, &ReadFileData, &context, &read->dataLength);
+    }
+    else
+    {
+        read->error = ReadFileData(&context, read->offset, read->count, read->data, &read->dataLength);
+    }
+}
+
+UINT ReadFinish(AsyncCall* call, char* buffer, SyncRequest* outSync)
+{
+    AsyncRead* async = (AsyncRead*)call;
+    UINT handle = async->handle;
+    String localName = nameHandles[handle].localName;
+    // What the READ found out about the file is only kept if nothing was
+    // written to it while the READ was made
+    bool current = (nameHandles[handle].writeCount == async->writeCount);
+    if(async->openDirect)
+    {
+        InstallDirectFile(handle, async->directFile);
+    }
+    ReadState* read = nameHandles[handle].read;
+    if(async->opened)
+    {
+        if(read)
+        {
+            CloseHandle(async->file); // another READ opened the file first
+        }
+        else
+        {
+            read = CreateReadState(handle, async->file);
+        }
+    }
+    if(async->loadSparse)
+    {
+        if(async->sparseError)
+        {
+            LOG_AT(NFS, INFO, "[NFS] READ: failed to map the allocated ranges of \"%s\" (e=%d)", localName.ptr, async->sparseError);
+        }
+        else
+        {
+            LOG_AT(NFS, DEBUG, "[NFS] READ: \"%s\" has %u allocated ranges%s", localName.ptr, async->loaded.count,
+                async->loaded.dense ? " (too many to map)" : "");
+        }
+    }
+    if(read)
+    {
+        if(async->error)
+        {
+            read->stale = true;
+        }
+        else if(async->refresh && current)
+        {
+            read->stat = async->stat;
+            read->validatedTickCount = GetTickCount();
+            read->stale = false;
+        }
+        if(async->loadSparse && current)
+        {
+            free(read->sparse.ranges);
+            read->sparse = async->loaded;
+            async->loadSparse = false;
+        }
+    }
+    if(async->loadSparse)
+    {
+        free(async->loaded.ranges);
+    }
+
+    if(async->isDirectory)
+    {
+        LOG_AT(NFS, INFO, "[NFS] READ: \"%s\" is a directory", localName.ptr);
+        SET_UINT(buffer    , NFS3_ERROR_ISDIR_NETWORK_ORDER);
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+    if(async->error)
+    {
+        if(async->file)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] READ: reading \"%s\" failed (e=%d)", localName.ptr, async->error);
+        }
+        else
+        {
+            LOG_AT(NFS, ERROR, "[NFS] READ: failed to open \"%s\" (e=%d)", localName.ptr, async->error);
+        }
+        SET_UINT(buffer    , Nfs3ErrorFromWin32(async->error));
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+
+    UINT64 directStart, directEnd;
+    bool direct = async->directFile && async->directFile != INVALID_HANDLE_VALUE &&
+                  GetDirectRange(async->offset, async->count, &directStart, &directEnd);
+    // Reading ahead would fill the system cache that direct reads skip
+    if(async->count > 0 && config.readAheadMax && read && !direct)
+    {
+        ReadAheadAccess(&read->readAhead, localName.ptr, async->stat.size, async->offset, async->count);
+    }
+    // A READ made by a worker doesn't use the block cache, what it read is
+    // added to it here
+    if(!async->cached && current && config.blockCacheSize && !direct)
+    {
+        CacheReadBlocks(handle, &async->stat, async->offset, async->data, async->dataLength);
+    }
+    if(async->data != buffer + 104)
+    {
+        memcpy(buffer + 104, async->data, async->dataLength);
+    }
+    LOG_AT(NFS, DEBUG, "[NFS] READ \"%s\" offset %llu count %u", localName.ptr,
+        (unsigned long long)async->offset, async->dataLength);
+    return SetReadReply(handle, &async->stat, async->offset, async->dataLength, buffer);
+}
+
+// Returns: response length, 0 if the READ went to a worker
+UINT READ(SelectSock* sock, RpcCallInfo* callInfo, char* handleBuffer, UINT handleLength,
+          UINT64 offset, UINT count, char* buffer)
+{
+    UINT handle = TryParseHandle(handleBuffer, handleLength);
+    if(handle == NO_HANDLE)
+    {
+        LOG_AT(NFS, INFO, "[NFS] READ: bad handle");
+        SET_UINT(buffer    , NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
+        SET_UINT(buffer + 4, 0); // no post_op_attr
+        return 8;
+    }
+
+    // Reads must see the writes that are still gathered
+    if(nameHandles[handle].gather)
+    {
+        WriteGatherFlush(nameHandles[handle].gather);
+    }
+    if(count > config.maxTransferSize)
+    {
+        count = config.maxTransferSize;
+    }
+
+    ReadState* read = nameHandles[handle].read;
+    bool fresh = read && !read->stale && config.blockCacheSize &&
+                 GetTickCount() - read->validatedTickCount < config.blockCacheValidate;
+    if(fresh)
+    {
+        UINT length = ReadFromCache(handle, read, offset, count, buffer);
+        if(length)
+        {
+            return length;
+        }
+    }
+
+    AsyncRead local;
+    AsyncRead* async = (AsyncRead*)AllocAsyncCall(callInfo, sizeof(AsyncRead), &local.call);
+    async->data = buffer + 104;
+    if(async->call.submit && count)
+    {
+        async->data = (char*)CallAlloc(callInfo, count);
+        if(!async->data)
+        {
+            async = &local;
+            async->call.submit = false;
+            async->data = buffer + 104;
+        }
+    }
+    async->handle = handle;
+    async->path = nameHandles[handle].localName.ptr;
+    async->writeCount = nameHandles[handle].writeCount;
+    async->offset = offset;
+    async->count = count;
+    async->file = read ? read->file : NULL;
+    async->opened = false;
+    async->refresh = !fresh;
+    if(read)
+    {
+        async->stat = read->stat;
+    }
+    async->directFile = NULL;
+    async->openDirect = false;
+    if(count > 0 && UsesDirectIo(handle))
+    {
+        async->directFile = nameHandles[handle].directFile;
+        async->openDirect = (async->directFile == NULL);
+    }
+    // The block cache is only used on this thread
+    async->cached = !async->call.submit && config.blockCacheSize;
+    async->sparse = NULL;
+    if(read && read->sparse.valid)
+    {
+        if(!async->call.submit)
+        {
+            async->sparse = &read->sparse;
+        }
+        else
+        {
+            // The read state's map can change before the worker runs
+            UINT first = 0;
+            UINT rangeCount = read->sparse.dense ? 0 : SparseMapOverlap(&read->sparse, offset, count, &first);
+            SparseMap* sparse = (SparseMap*)CallAlloc(callInfo, sizeof(SparseMap) + rangeCount * sizeof(FILE_ALLOCATED_RANGE_BUFFER));
+            if(sparse)
+            {
+                *sparse = read->sparse;
+                sparse->count = rangeCount;
+                sparse->capacity = rangeCount;
+                sparse->ranges = (FILE_ALLOCATED_RANGE_BUFFER*)(sparse + 1);
+                memcpy(sparse->ranges, read->sparse.ranges + first, rangeCount * sizeof(FILE_ALLOCATED_RANGE_BUFFER));
+                async->sparse = sparse;
+            }
+        }
+    }
+    async->loadSparse = false;
+    async->sparseError = 0;
+    memset(&async->loaded, 0, sizeof(async->loaded));
+    async->isDirectory = false;
+    async->error = 0;
+    async->dataLength = 0;
+    return RunAsyncCall(sock, callInfo, &async->call, &ReadWork, &ReadFinish, buffer, NULL);
+}
+
+// Changes every time the server starts, so clients know to send unstable
+// writes again if the server restarted before they were committed
+static UINT64 writeVerifier;
+
+// Note: doesn't use any server state, it is called from the file system workers
+// Returns: the file opened for writing, INVALID_HANDLE_VALUE on error
+HANDLE OpenWriteFile(const char* path)
+{
+    return CreateFile(path, GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+// Keeps a file opened for writing with the handle, if another WRITE opened
+// the handle's file first that one is kept and file is closed
+void InstallWriteFile(UINT handle, HANDLE file)
+{
+    NameHandle* nameHandle = &nameHandles[handle];
+    if(nameHandle->file)
+    {
+        CloseHandle(file);
+        return;
+    }
+    nameHandle->file = file;
+    nameHandle->volume = FindExportVolume(nameHandle->localName);
+    if(config.writeGatherSize)
+    {
+        // Without a gather the writes still work, they just aren't gathered
+        nameHandle->gather = WriteGatherCreate(file, (void*)(size_t)handle);
+    }
+}
+
+// Returns: the handle's file opened for writing, NULL on error
+HANDLE GetWriteFile(UINT handle, DWORD* outError)
+{
+    if(nameHandles[handle].file == NULL)
+    {
+        HANDLE file = OpenWriteFile(nameHandles[handle].localName.ptr);
+        if(file == INVALID_HANDLE_VALUE)
+        {
+            *outError = GetLastError();
+            return NULL;
+        }
+        InstallWriteFile(handle, file);
+    }
+    return nameHandles[handle].file;
+}
+
+// Writes the aligned part of a large WRITE without buffering from a buffer
+// pool buffer and the head and tail through the cache
+// directFile: NULL if the export doesn't use direct I/O
+// Returns: 0 on success, otherwise the error from WriteFile
+DWORD WriteFileData(HANDLE file, HANDLE directFile, UINT64 offset, char* data, UINT count)
+{
+    UINT64 directStart = offset + count;
+    UINT64 directEnd = offset + count;
+    if(directFile && GetDirectRange(offset, count, &directStart, &directEnd))
+    {
+        UINT directLength = (UINT)(directEnd - directStart);
+        char* directBuffer = BufferPoolAlloc(directLength);
+        if(!directBuffer)
+        {
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        memcpy(directBuffer, data + (directStart - offset), directLength);
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset     = (DWORD)directStart;
+        overlapped.OffsetHigh = (DWORD)(directStart >> 32);
+        DWORD written;
+        BOOL success = WriteFile(directFile, directBuffer, directLength, &written, &overlapped);
+        DWORD error = success ? 0 : GetLastError();
+        BufferPoolFree(directBuffer, directLength);
+        if(error)
+        {
+            return error;
+        }
+        InterlockedIncrement64(&directWrites);
+        InterlockedExchangeAdd64(&directWriteBytes, written);
+    }
+
+    // The head, or the whole write if it doesn't go direct
+    if(directStart > offset)
+    {
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset     = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD written;
+        if(!WriteFile(file, data, (DWORD)(directStart - offset), &written, &overlapped))
+        {
+            return GetLastError();
+        }
+    }
+    if(offset + count > directEnd)
+    {
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset     = (DWORD)directEnd;
+        overlapped.OffsetHigh = (DWORD)(directEnd >> 32);
+        DWORD written;
+        if(!WriteFile(file, data + (directEnd - offset), (DWORD)(offset + count - directEnd), &written, &overlapped))
+        {
+            return GetLastError();
+        }
+    }
+    return 0;
+}
+
+// Sets the reply for a WRITE or COMMIT that failed (status and empty wcc_data)
+// Returns: response length
+UINT SetWccError(char* buffer, UINT status)
+{
+    SET_UINT(buffer    , status);
+    SET_UINT(buffer + 4, 0); // no pre_op_attr
+    SET_UINT(buffer + 8, 0); // no post_op_attr
+    return 12;
+}
+
+// Makes READ get the attributes of the handle's file again before it uses
+// them or the blocks it has cached, and makes the READs a worker is making
+// drop what they read
+void MarkReadsStale(UINT handle)
+{
+    ReadState* read = nameHandles[handle].read;
+    if(read)
+    {
+        read->stale = true;
+        read->sparse.valid = false;
+    }
+    nameHandles[handle].writeCount++;
+}
+
+// Makes READ see a write of length bytes at offset to the handle's file that
+// hasn't been answered yet, the attributes READ keeps and the blocks it has
+// cached may not show it
+void InvalidateReads(UINT handle, UINT64 offset, UINT64 length)
+{
+    MarkReadsStale(handle);
+    if(config.blockCacheSize)
+    {
+        BlockCacheInvalidate(handle, offset, length);
+    }
+}
+
+// Called when the gathered writes of a handle are written to its file
+void GatherFlushed(void* context, UINT64 offset, UINT length)
+{
+    InvalidateReads((UINT)(size_t)context, offset, length);
+}
+
+// Sets up the reply of a WRITE of count bytes at offset that has been
+// written to the file or gathered
+// stat: the attributes after the write, NULL if they aren't known (gathered
+//       data isn't in the file yet, so its attributes would be out of date)
+// outSync: file is set if the reply must wait until the file is flushed
+// Returns: response length
+UINT SetWriteReply(UINT handle, HANDLE file, UINT64 offset, UINT stable, UINT count, FileStat* stat,
+                   char* buffer, SyncRequest* outSync)
+{
+    // The file's change time doesn't show the write yet, so the blocks it
+    // overwrote (or will, once gathered data is written) are dropped here
+    InvalidateReads(handle, offset, count);
+
+    // DATA_SYNC and FILE_SYNC writes are flushed by the sync thread along with
+    // any other writes and commits that are waiting.  FlushFileBuffers always
+    // flushes the metadata too, so both are FILE_SYNC.
+    UINT committed = NFS3_STABLE_UNSTABLE_NETWORK_ORDER;
+    if(stable != NFS3_STABLE_UNSTABLE)
+    {
+        outSync->file = file;
+        outSync->volume = nameHandles[handle].volume;
+        committed = NFS3_STABLE_FILE_SYNC_NETWORK_ORDER;
+    }
+
+    // The attributes after the write are returned so the client doesn't
+    // need a GETATTR to see them
+    SET_UINT(buffer    , NFS3_STATUS_OK_NETWORK_ORDER);
+    SET_UINT(buffer + 4, 0); // no pre_op_attr
+    char* next = buffer + 12;
+    if(stat)
+    {
+        SET_UINT  (buffer + 8, _1_NETWORK_ORDER); // post_op_attr follows
+        CopyFattr3(next, handle, stat);
+        next += FATTR3_SIZE;
+    }
+    else
+    {
+        SET_UINT(buffer + 8, 0); // no post_op_attr
+    }
+    AppendUint  (next +  0, count);
+    SET_UINT    (next +  4, committed);
+    AppendUint64(next +  8, writeVerifier);
+    return (UINT)(next + 16 - buffer);
+}
+
+// A WRITE that isn't gathered, it lives in the call's arena while a file
+// system worker writes the data
+struct AsyncWrite
+{
+    AsyncCall call; // must be first
+    UINT handle;
+    const char* path;
+    UINT64 offset;
+    UINT stable;
+    UINT count;
+    char* data; // the call's arguments if they are in the arena, otherwise a copy
+    HANDLE file; // the handle's file, opened by the worker if NULL
+    bool opened;
+    HANDLE directFile; // NULL if the write doesn't skip the system cache
+    bool openDirect;   // the worker opens directFile
+    bool isDirectory;
+    DWORD error;
+    DWORD statError;
+    FileStat stat; // after the write
+};
+
+void WriteWork(IoRequest* request)
+{
+    AsyncWrite* write = (AsyncWrite*)request;
+    if(!write->file)
+    {
+        HANDLE file = OpenWriteFile(write->path);
+        if(file == INVALID_HANDLE_VALUE)
+        {
+            write->error = GetLastError();
+            DWORD attributes = GetFileAttributes(write->path);
+            write->isDirectory = (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY));
+            return;
+        }
+        write->file = file;
+        write->opened = true;
+    }
+    if(write->openDirect)
+    {
+        write->directFile = OpenDirectFile(write->path);
+    }
+    HANDLE directFile = (write->directFile == INVALID_HANDLE_VALUE) ? NULL : write->directFile;
+    write->error = WriteFileData(write->file, directFile, write->offset, write->data, write->count);
+    if(write->error == 0)
+    {
+        write->statError = GetFileStat(write->file, &write->stat);
+    }
+}
+
+UINT WriteFinish(AsyncCall* call, char* buffer, SyncRequest* outSync)
+{
+    AsyncWrite* write = (AsyncWrite*)call;
+    UINT handle = write->handle;
+    String localName = nameHandles[handle].localName;
+    if(write->opened)
+    {
+        InstallWriteFile(handle, write->file);
+    }
+    if(write->openDirect)
+    {
+        InstallDirectFile(handle, write->directFile);
+    }
+    if(write->isDirectory)
+    {
+        LOG_AT(NFS, INFO, "[NFS] WRITE: \"%s\" is a directory", localName.ptr);
+        return SetWccError(buffer, NFS3_ERROR_ISDIR_NETWORK_ORDER);
+    }
+    if(write->error)
+    {
+        if(write->file)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] WRITE: WriteFile \"%s\" failed (e=%d)", localName.ptr, write->error);
+        }
+        else
+        {
+            LOG_AT(NFS, ERROR, "[NFS] WRITE: failed to open \"%s\" (e=%d)", localName.ptr, write->error);
+        }
+        return SetWccError(buffer, Nfs3ErrorFromWin32(write->error));
+    }
+    LOG_AT(NFS, DEBUG, "[NFS] WRITE \"%s\" offset %llu count %u stable %u", localName.ptr,
+        (unsigned long long)write->offset, write->count, write->stable);
+    return SetWriteReply(handle, nameHandles[handle].file, write->offset, write->stable, write->count,
+        write->statError ? NULL : &write->stat, buffer, outSync);
+}
+
+// Returns: the file a WRITE of the handle goes to, NULL if it can't be
+//          written (outStatus is set to the error)
+HANDLE GetWriteTarget(char* handleBuffer, UINT handleLength, UINT* outHandle, UINT* outStatus)
+{
+    UINT handle = TryParseHandle(handleBuffer, handleLength);
+    if(handle == NO_HANDLE)
+    {
+        LOG_AT(NFS, INFO, "[NFS] WRITE: bad handle");
+        *outStatus = NFS3_ERROR_BADHANDLE_NETWORK_ORDER;
+        return NULL;
+    }
+    DWORD error;
+    HANDLE file = GetWriteFile(handle, &error);
+    if(!file)
+    {
+        String localName = nameHandles[handle].localName;
+        DWORD attributes = GetFileAttributes(localName.ptr);
+        if(attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            LOG_AT(NFS, INFO, "[NFS] WRITE: \"%s\" is a directory", localName.ptr);
+            *outStatus = NFS3_ERROR_ISDIR_NETWORK_ORDER;
+            return NULL;
+        }
+        LOG_AT(NFS, ERROR, "[NFS] WRITE: failed to open \"%s\" (e=%d)", localName.ptr, error);
+        *outStatus = Nfs3ErrorFromWin32(error);
+        return NULL;
+    }
+    *outHandle = handle;
+    return file;
+}
+
+// UNSTABLE writes to a file that is open are gathered, every other write
+// goes to a file system worker
+// outSync: file is set if the reply must wait until the file is flushed
+// Returns: response length, 0 if the write went to a worker
+UINT WRITE(SelectSock* sock, RpcCallInfo* callInfo, char* handleBuffer, UINT handleLength, UINT64 offset,
+           UINT stable, char* data, UINT count, char* buffer, SyncRequest* outSync)
+{
+    UINT handle = TryParseHandle(handleBuffer, handleLength);
+    if(handle == NO_HANDLE)
+    {
+        LOG_AT(NFS, INFO, "[NFS] WRITE: bad handle");
+        return SetWccError(buffer, NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
+    }
+    NameHandle* nameHandle = &nameHandles[handle];
+
+    // Large writes to a direct I/O export skip the system cache and the gather
+    UINT64 directStart, directEnd;
+    bool direct = GetDirectRange(offset, count, &directStart, &directEnd) && UsesDirectIo(handle);
+
+    // Anything that isn't gathered is written to the file after the gathered data
+    WriteGather* gather = nameHandle->gather;
+    if(gather && (direct || stable != NFS3_STABLE_UNSTABLE || WriteGatherAdd(gather, offset, data, count)))
+    {
+        WriteGatherFlush(gather);
+        gather = NULL;
+    }
+    if(gather)
+    {
+        LOG_AT(NFS, DEBUG, "[NFS] WRITE \"%s\" offset %llu count %u stable %u", nameHandle->localName.ptr,
+            (unsigned long long)offset, count, stable);
+        return SetWriteReply(handle, nameHandle->file, offset, stable, count, NULL, buffer, outSync);
+    }
+
+    AsyncWrite local;
+    AsyncWrite* write = (AsyncWrite*)AllocAsyncCall(callInfo, sizeof(AsyncWrite), &local.call);
+    write->data = data;
+    if(write->call.submit && count && !callInfo->argsInArena)
+    {
+        // The data is only valid until the handler returns
+        write->data = (char*)CallAlloc(callInfo, count);
+        if(write->data)
+        {
+            memcpy(write->data, data, count);
+        }
+        else
+        {
+            write = &local;
+            write->call.submit = false;
+            write->data = data;
+        }
+    }
+    write->handle = handle;
+    write->path = nameHandle->localName.ptr;
+    write->offset = offset;
+    write->stable = stable;
+    write->count = count;
+    write->file = nameHandle->file;
+    write->opened = false;
+    write->directFile = direct ? nameHandle->directFile : NULL;
+    write->openDirect = direct && nameHandle->directFile == NULL;
+    write->isDirectory = false;
+    write->error = 0;
+    write->statError = 0;
+    // A READ that is made while the data is written doesn't keep what it
+    // read, or serve the blocks it overwrites from the block cache
+    InvalidateReads(handle, offset, count);
+    return RunAsyncCall(sock, callInfo, &write->call, &WriteWork, &WriteFinish, buffer, outSync);
+}
+
+// outSync: file is set if the reply must wait until the file is flushed
+// Returns: response length
+// Note: the whole file is flushed, the offset and count are ignored
+UINT COMMIT(char* handleBuffer, UINT handleLength, char* buffer, SyncRequest* outSync)
+{
+    UINT handle = TryParseHandle(handleBuffer, handleLength);
+    if(handle == NO_HANDLE)
+    {
+        LOG_AT(NFS, INFO, "[NFS] COMMIT: bad handle");
+        return SetWccError(buffer, NFS3_ERROR_BADHANDLE_NETWORK_ORDER);
+    }
+    LOG_AT(NFS, DEBUG, "[NFS] COMMIT \"%s\"", nameHandles[handle].localName.ptr);
+
+    // Gathered writes are written to the file before it is flushed, if
+    // writing any of them failed the commit fails
+    WriteGather* gather = nameHandles[handle].gather;
+    if(gather)
+    {
+        WriteGatherFlush(gather);
+        DWORD error = WriteGatherTakeError(gather);
+        if(error)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] COMMIT: a gathered write to \"%s\" failed (e=%d)",
+                nameHandles[handle].localName.ptr, error);
+            return SetWccError(buffer, Nfs3ErrorFromWin32(error));
+        }
+    }
+
+    // If the file was never opened for writing there is nothing to flush
+    if(nameHandles[handle].file)
+    {
+        outSync->file = nameHandles[handle].file;
+        outSync->volume = nameHandles[handle].volume;
+    }
+
+    SET_UINT    (buffer +  0, NFS3_STATUS_OK_NETWORK_ORDER);
+    SET_UINT    (buffer +  4, 0); // no pre_op_attr
+    SET_UINT    (buffer +  8, 0); // no post_op_attr
+    AppendUint64(buffer + 12, writeVerifier);
+    return 20;
+}
+
+// Records a span of the call if it was sampled
+void CallSpan(RpcCallInfo* callInfo, UINT type, INT64 start, INT64 end)
+{
+    if(callInfo->sampled)
+    {
+        SpanRecord(type, callInfo->xid, callInfo->connection, callInfo->program, callInfo->procedure, start, end);
+    }
+}
+// Returns: the start of a backend span, 0 if the call wasn't sampled
+inline INT64 BackendSpanBegin(RpcCallInfo* callInfo)
+{
+    return callInfo->sampled ? StatsNow() : 0;
+}
+void BackendSpanEnd(RpcCallInfo* callInfo, INT64 start)
+{
+    if(callInfo->sampled)
+    {
+        callInfo->lastSpanEnd = StatsNow();
+        CallSpan(callInfo, SPAN_BACKEND, start, callInfo->lastSpanEnd);
+    }
+}
+
+// reply is the reply after the rpc header (starting at the accept status)
+void RecordCallStats(RpcCallInfo* callInfo, char* reply, UINT replySize)
+{
+    // Every NFS procedure except NULL and MNT start their reply with a status
+    UINT status = 0;
+    if(replySize >= 8 && (callInfo->program == RPC_PROGRAM_NFS ||
+       (callInfo->program == RPC_PROGRAM_MOUNT && callInfo->procedure == MOUNT3_PROC_MNT)))
+    {
+        status = ParseUint(reply + 4);
+    }
+    StatsRecordCall(callInfo->program, callInfo->procedure, ParseUint(reply), status,
+        callInfo->recordLength, REPLY_OFFSET + replySize, callInfo->receiveTime, callInfo->startTime);
+}
+
+// Sends a reply record and counts the call as done
+// waitSpan: the span from the call's last span until the send
+void TransmitReply(TcpConnection* conn, RpcCallInfo* callInfo, char* record, UINT length, UINT waitSpan)
+{
+    INT64 sendStart = callInfo->sampled ? StatsNow() : 0;
+    conn->Send("[RPC]", record, length);
+    if(callInfo->sampled)
+    {
+        CallSpan(callInfo, waitSpan, callInfo->lastSpanEnd, sendStart);
+        CallSpan(callInfo, SPAN_SEND, sendStart, StatsNow());
+    }
+    RecordCallStats(callInfo, record + REPLY_OFFSET, length - REPLY_OFFSET);
+    SchedulerCallDone(conn->client);
+}
+
+// A reply that was ready before the replies of calls its connection handled
+// earlier, it lives in the call's arena.  An empty one only keeps the turn
+// of a reply that is sent on its own (see ReleaseTurn), it lives in an arena
+// of its own.
+struct HeldReply
+{
+    HeldReply* next;
+    RpcCallInfo callInfo;
+    UINT length; // 0 for an empty reply
+    char record[1]; // length bytes
+};
+
+// Sends the held replies that are next in order
+void SendHeldReplies(TcpConnection* conn)
+{
+    while(conn->held && (conn->unordered || conn->held->callInfo.sequence == conn->replySequence))
+    {
+        HeldReply* reply = conn->held;
+        conn->held = reply->next;
+        conn->replySequence++;
+        Arena* arena = reply->callInfo.arena;
+        if(reply->length)
+        {
+            TransmitReply(conn, &reply->callInfo, reply->record, reply->length, SPAN_ORDER_WAIT);
+        }
+        ArenaRelease(arena);
+    }
+}
+
+// Adds a reply to the connection's held replies in the order of its sequence
+void HoldReply(TcpConnection* conn, HeldReply* reply)
+{
+    // Sequences wrap, so they are compared by their difference
+    HeldReply** link = &conn->held;
+    while(*link && (INT)((*link)->callInfo.sequence - reply->callInfo.sequence) < 0)
+    {
+        link = &(*link)->next;
+    }
+    reply->next = *link;
+    *link = reply;
+}
+
+// Sends a reply record once the replies of the calls the connection handled
+// before it have been sent, until then it is copied into the call's arena
+// waitSpan: the span from the call's last span until the reply is ready
+void SendRecord(TcpConnection* conn, RpcCallInfo* callInfo, char* record, UINT length, UINT waitSpan)
+{
+    if(!conn->unordered && callInfo->sequence != conn->replySequence)
+    {
+        HeldReply* reply = (HeldReply*)CallAlloc(callInfo, offsetof(HeldReply, record) + length);
+        if(reply)
+        {
+            if(callInfo->sampled)
+            {
+                INT64 now = StatsNow();
+                CallSpan(callInfo, waitSpan, callInfo->lastSpanEnd, now);
+                callInfo->lastSpanEnd = now;
+            }
+            reply->callInfo = *callInfo;
+            callInfo->arena = NULL; // released once the reply is sent
+            reply->length = length;
+            memcpy(reply->record, record, length);
+            HoldReply(conn, reply);
+            return;
+        }
+        LOG_ERROR("(s=%u) out of memory to hold a reply, sending the connection's replies out of order", conn->so);
+        conn->unordered = true;
+    }
+    TransmitReply(conn, callInfo, record, length, waitSpan);
+    conn->replySequence++;
+    SendHeldReplies(conn);
+}
+
+// Gives up the turn of a call whose reply is sent on its own whenever it is
+// ready, the replies after it are sent as soon as the ones before it are
+void ReleaseTurn(TcpConnection* conn, RpcCallInfo* callInfo)
+{
+    if(!conn->unordered && callInfo->sequence != conn->replySequence)
+    {
+        // An empty reply is skipped once the replies before it are sent
+        Arena* arena = ArenaAcquire();
+        HeldReply* turn = arena ? (HeldReply*)ArenaAlloc(arena, offsetof(HeldReply, record)) : NULL;
+        if(turn)
+        {
+            turn->callInfo.sequence = callInfo->sequence;
+            turn->callInfo.arena = arena;
+            turn->length = 0;
+            HoldReply(conn, turn);
+            return;
+        }
+        if(arena)
+        {
+            ArenaRelease(arena);
+        }
+        LOG_ERROR("(s=%u) out of memory to hold a reply's turn, sending the connection's replies out of order", conn->so);
+        conn->unordered = true;
+    }
+    conn->replySequence++;
+    SendHeldReplies(conn);
+}
+
+// Sends the reply in the shared buffer and counts the call as done
+// replySize: the size of the reply after the rpc header
+void SendReply(TcpConnection* conn, RpcCallInfo* callInfo, char* sharedBuffer, UINT replySize)
+{
+    AppendUint(sharedBuffer +  0, RPC_LAST_FRAGMENT_FLAG | (REPLY_OFFSET - 4 + replySize));
+    SetupReply(sharedBuffer +  4, callInfo->xid);
+    SendRecord(conn, callInfo, sharedBuffer, REPLY_OFFSET + replySize, SPAN_ENCODE);
+}
+
+// Large enough for a WRITE or COMMIT reply
+#define DEFERRED_REPLY_MAX_LENGTH (REPLY_OFFSET + 4 + 28 + FATTR3_SIZE)
+
+// A reply that is sent once the sync thread has flushed its file, it lives
+// in the call's arena.  It gives up its turn in the connection's order when
+// it is deferred, so the replies after it don't wait for the flush.
+struct DeferredReply
+{
+    SyncRequest request; // must be first
+    IoRequest flushed; // completed by the sync thread
+    TcpConnection* conn;
+    RpcCallInfo callInfo;
+    DWORD error;
+    UINT length;
+    char record[DEFERRED_REPLY_MAX_LENGTH];
+};
+
+// Called on the sync thread once the file is flushed
+void DeferredReplyComplete(SyncRequest* request, DWORD error)
+{
+    DeferredReply* reply = (DeferredReply*)request;
+    reply->error = error;
+    IoPoolComplete(&reply->flushed);
+}
+
+void DeferredReplySend(IoRequest* request, char* sharedBuffer)
+{
+    ArenaRequestScope requestScope;
+    DeferredReply* reply = (DeferredReply*)((char*)request - offsetof(DeferredReply, flushed));
+    LoopMonitorSetCall(reply->callInfo.program, reply->callInfo.procedure);
+    if(reply->error)
+    {
+        UINT length = SetWccError(reply->record + REPLY_OFFSET + 4, Nfs3ErrorFromWin32(reply->error));
+        reply->length = REPLY_OFFSET + 4 + length;
+        AppendUint(reply->record, RPC_LAST_FRAGMENT_FLAG | (reply->length - 4));
+    }
+    // The reply is in the call's arena
+    RpcCallInfo callInfo = reply->callInfo;
+    TcpConnection* conn = reply->conn;
+    TransmitReply(conn, &callInfo, reply->record, reply->length, SPAN_SYNC_WAIT);
+    conn->Release();
+    ArenaRelease(callInfo.arena);
+}
+
+// Moves the reply in the shared buffer to the sync thread, the reply is sent
+// once sync->file is flushed
+// Returns: 0 if the reply was deferred, otherwise the reply size (a
+//          NFS3ERR_JUKEBOX error if out of memory)
+UINT DeferReply(TcpConnection* conn, RpcCallInfo* callInfo, char* sharedBuffer, UINT replySize, SyncRequest* sync)
+{
+    DeferredReply* reply = (DeferredReply*)CallAlloc(callInfo, sizeof(DeferredReply));
+    if(!reply)
+    {
+        LOG_AT(NFS, ERROR, "[NFS] out of memory for a deferred reply");
+        return 4 + SetWccError(sharedBuffer + REPLY_OFFSET + 4, NFS3_ERROR_JUKEBOX_NETWORK_ORDER);
+    }
+    reply->request.file = sync->file;
+    reply->request.volume = sync->volume;
+    reply->request.complete = &DeferredReplyComplete;
+    reply->flushed.complete = &DeferredReplySend;
+    reply->conn = conn;
+    reply->conn->AddRef();
+    if(callInfo->sampled)
+    {
+        INT64 now = StatsNow();
+        CallSpan(callInfo, SPAN_ENCODE, callInfo->lastSpanEnd, now);
+        callInfo->lastSpanEnd = now;
+    }
+    reply->callInfo = *callInfo;
+    callInfo->arena = NULL; // released once the reply is sent
+    reply->error = 0;
+    reply->length = REPLY_OFFSET + replySize;
+    AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (reply->length - 4));
+    SetupReply(sharedBuffer + 4, callInfo->xid);
+    memcpy(reply->record, sharedBuffer, reply->length);
+    IoPoolExternal(&reply->flushed);
+    QueueSync(&reply->request);
+    ReleaseTurn(conn, callInfo);
+    return 0;
+}
+
+// Finishes a call on the select thread once its file system calls are done
+// and sends its reply
+void AsyncCallComplete(IoRequest* request, char* sharedBuffer)
+{
+    ArenaRequestScope requestScope;
+    AsyncCall* call = (AsyncCall*)request;
+    // The call is in its arena
+    RpcCallInfo callInfo = call->callInfo;
+    TcpConnection* conn = call->conn;
+    LoopMonitorSetCall(callInfo.program, callInfo.procedure);
+    SyncRequest sync;
+    sync.file = NULL;
+    UINT length = call->finish(call, sharedBuffer + REPLY_OFFSET + 4, &sync);
+    // The backend span includes the wait for the worker
+    BackendSpanEnd(&callInfo, callInfo.lastSpanEnd);
+    SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+    UINT replySize = length + 4;
+    if(sync.file)
+    {
+        replySize = DeferReply(conn, &callInfo, sharedBuffer, replySize, &sync);
+    }
+    if(replySize)
+    {
+        SendReply(conn, &callInfo, sharedBuffer, replySize);
+    }
+    conn->Release();
+    if(callInfo.arena)
+    {
+        ArenaRelease(callInfo.arena);
+    }
+}
+
+#define NFS3_RESPONSE_OK 0
+#define NFS3_RESPONSE_OK 0
+#define NFS3_PROCEDURE_NULL 0
+UINT Nfs3Handler(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit)
+{
+    switch(callInfo->procedure)
+    {
+      case PROC_NULL: // 0
+        LOG_AT(NFS, DEBUG, "[NFS] NULL(s=%u)", sock->so);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4;
+      case NFS3_PROC_GETATTR: // 1
+      {
+        UINT handleLength = ParseUint(command);
+        char* handle = command + 4;
+        if(handle + Align4(handleLength) != limit)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] GETATTR has a bad handle length %u (actualSize is %u)", handleLength, limit-handle);
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        LOG_AT(NFS, DEBUG, "[NFS] GETATTR handle is %u bytes", handleLength);
+        INT64 backendStart = BackendSpanBegin(callInfo);
+        UINT length = GETATTR(sock, callInfo, handle, handleLength, sharedBuffer + REPLY_OFFSET + 4);
+        if(length == 0)
+        {
+            return 0; // finished by AsyncCallComplete
+        }
+        BackendSpanEnd(callInfo, backendStart);
+        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return length + 4;
+      }
+      case NFS3_PROC_LOOKUP: // 3
+      {
+        LOG_AT(NFS, INFO, "[NFS] LOOKUP(procedure 3) not implemented");
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
+        return 4;
+      }
+      case NFS3_PROC_ACCESS: // 4
+      {
+        UINT handleLength = ParseUint(command);
+        char* handle = command + 4;
+        UINT accessFlags;
+        {
+            char* endOfHandle = handle + Align4(handleLength);
+            if(endOfHandle + 4 != limit)
+            {
+                LOG_AT(NFS, ERROR, "[NFS] ACCESS has invalid arguments");
+                SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+                return 4;
+            }
+            accessFlags = ParseUint(endOfHandle);
+        }
+        LOG_AT(NFS, DEBUG, "[NFS] ACCESS handle is %u bytes, flags = 0x%08x", handleLength, accessFlags);
+        INT64 backendStart = BackendSpanBegin(callInfo);
+        UINT length = ACCESS(handle, handleLength, accessFlags, sharedBuffer + REPLY_OFFSET + 4);
+        BackendSpanEnd(callInfo, backendStart);
+        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return length + 4;
+      }
+      case NFS3_PROC_READ: // 6
+      {
+        UINT handleLength = ParseUint(command);
+        char* handle = command + 4;
+        char* endOfHandle = handle + Align4(handleLength);
+        if(endOfHandle + 12 != limit)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] READ has invalid arguments");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        UINT64 offset = ParseUint64(endOfHandle + 0);
+        UINT count    = ParseUint  (endOfHandle + 8);
+        INT64 backendStart = BackendSpanBegin(callInfo);
+        UINT length = READ(sock, callInfo, handle, handleLength, offset, count, sharedBuffer + REPLY_OFFSET + 4);
+        if(length == 0)
+        {
+            return 0; // finished by AsyncCallComplete
+        }
+        BackendSpanEnd(callInfo, backendStart);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return length + 4;
+      }
+      case NFS3_PROC_WRITE: // 7
+      {
+        UINT handleLength = ParseUint(command);
+        char* handle = command + 4;
+        char* endOfHandle = handle + Align4(handleLength);
+        if(endOfHandle + 20 > limit)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] WRITE has invalid arguments");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        UINT64 offset  = ParseUint64(endOfHandle +  0);
+        UINT count     = ParseUint  (endOfHandle +  8);
+        UINT stable    = ParseUint  (endOfHandle + 12);
+        UINT dataLength = ParseUint (endOfHandle + 16);
+        char* data = endOfHandle + 20;
+        if(dataLength != count || stable > NFS3_STABLE_FILE_SYNC || data + Align4(dataLength) != limit)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] WRITE has invalid arguments (count %u, stable %u, data length %u)", count, stable, dataLength);
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        SyncRequest sync;
+        sync.file = NULL;
+        INT64 backendStart = BackendSpanBegin(callInfo);
+        UINT length = WRITE(sock, callInfo, handle, handleLength, offset, stable, data, count,
+            sharedBuffer + REPLY_OFFSET + 4, &sync);
+        if(length == 0)
+        {
+            return 0; // finished by AsyncCallComplete
+        }
+        BackendSpanEnd(callInfo, backendStart);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        if(WriteGatherPending())
+        {
+            // The timer writes out the gathered data once the client stops writing
+            SchedulerSetTimer(config.writeGatherDelay);
+        }
+        if(sync.file)
+        {
+            return DeferReply((TcpConnection*)sock->user, callInfo, sharedBuffer, length + 4, &sync);
+        }
+        return length + 4;
+      }
+      case NFS3_PROC_READDIRPLUS: // 17
+      {
+        UINT handleLength = ParseUint(command);
+        char* handle = command + 4;
+        char* endOfHandle = handle + Align4(handleLength);
+        if(endOfHandle + 24 != limit)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] READDIRPLUS has invalid arguments");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        LOG_AT(NFS, DEBUG, "[NFS] READDIRPLUS handle is %u bytes", handleLength);
+        UINT64 cookie         = ParseUint64(endOfHandle +  0);
+        UINT64 cookieVerifier = ParseUint64(endOfHandle +  8);
+        UINT maxCount         = ParseUint  (endOfHandle + 20); // dircount (at 16) is only a hint
+        UINT maxLength        = sharedBufferSize - REPLY_OFFSET - 4;
+        if(maxCount < maxLength)
+        {
+            maxLength = maxCount;
+        }
+        INT64 backendStart = BackendSpanBegin(callInfo);
+        UINT length = READDIRPLUS(sock, callInfo, handle, handleLength, sharedBuffer + REPLY_OFFSET + 4,
+            cookie, cookieVerifier, maxLength);
+        if(length == 0)
+        {
+            return 0; // finished by AsyncCallComplete
+        }
+        BackendSpanEnd(callInfo, backendStart);
+        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return length + 4;
+      }
+      case NFS3_PROC_FSINFO: // 19
+      {
+        UINT handleLength = ParseUint(command);
+        char* handle = command + 4;
+        if(handle + Align4(handleLength) != limit)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] FSINFO has a bad handle length %u (actualSize is %u)", handleLength, limit-handle);
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        LOG_AT(NFS, DEBUG, "[NFS] FSINFO handle is %u bytes", handleLength);
+        INT64 backendStart = BackendSpanBegin(callInfo);
+        UINT length = FSINFO(handle, handleLength, sharedBuffer + REPLY_OFFSET + 4);
+        BackendSpanEnd(callInfo, backendStart);
+        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return length + 4;
+      }
+      case NFS3_PROC_PATHCONF: // 20
+      {
+        UINT handleLength = ParseUint(command);
+        char* handle = command + 4;
+        if(handle + Align4(handleLength) != limit)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] PATHCONF has a bad handle length %u (actualSize is %u)", handleLength, limit-handle);
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        LOG_AT(NFS, DEBUG, "[NFS] PATHCONF handle is %u bytes", handleLength);
+        INT64 backendStart = BackendSpanBegin(callInfo);
+        UINT length = PATHCONF(handle, handleLength, sharedBuffer + REPLY_OFFSET + 4);
+        BackendSpanEnd(callInfo, backendStart);
+        AppendUint(sharedBuffer, RPC_LAST_FRAGMENT_FLAG | (24+length));
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return length + 4;
+      }
+      case NFS3_PROC_COMMIT: // 21
+      {
+        UINT handleLength = ParseUint(command);
+        char* handle = command + 4;
+        if(handle + Align4(handleLength) + 12 != limit)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] COMMIT has invalid arguments");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        SyncRequest sync;
+        sync.file = NULL;
+        INT64 backendStart = BackendSpanBegin(callInfo);
+        UINT length = COMMIT(handle, handleLength, sharedBuffer + REPLY_OFFSET + 4, &sync);
+        BackendSpanEnd(callInfo, backendStart);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        if(sync.file)
+        {
+            // The sync thread flushes the file, the reply is finished on this
+            // thread once it is done
+            return DeferReply((TcpConnection*)sock->user, callInfo, sharedBuffer, length + 4, &sync);
+        }
+        return length + 4;
+      }
+      default:
+        LOG_AT(NFS, INFO, "[NFS] unhandled procedure %u", callInfo->procedure);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
+        return 4;
+    }
+}
+UINT Nfs4Handler(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit)
+{
+    switch(callInfo->procedure)
+    {
+      case PROC_NULL: // 0
+        LOG_AT(NFS, DEBUG, "[NFSv4] NULL(s=%u)", sock->so);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4;
+      default:
+        LOG_AT(NFS, INFO, "[NFSv4] unhandled procedure %u", callInfo->procedure);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
+        return 4;
+    }
+}
+
+UINT Stats1Handler(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* command, char* limit)
+{
+    switch(callInfo->procedure)
+    {
+      case STATS_PROC_NULL: // 0
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4;
+      case STATS_PROC_SUMMARY: // 1
+      {
+        UINT length = StatsEncodeSummary(sharedBuffer + REPLY_OFFSET + 4, sharedBufferSize - REPLY_OFFSET - 4);
+        if(length == 0)
+        {
+            LOG_ERROR("[STATS] SUMMARY doesn't fit in the shared buffer");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SYSTEM_ERR_NETWORK_ORDER);
+            return 4;
+        }
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4 + length;
+      }
+      case STATS_PROC_HISTOGRAM: // 2
+      {
+        if(command + 8 != limit)
+        {
+            LOG_ERROR("[STATS] HISTOGRAM has invalid arguments");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_GARBAGE_ARGS_NETWORK_ORDER);
+            return 4;
+        }
+        UINT program   = ParseUint(command);
+        UINT procedure = ParseUint(command + 4);
+        UINT length = StatsEncodeHistograms(program, procedure,
+            sharedBuffer + REPLY_OFFSET + 4, sharedBufferSize - REPLY_OFFSET - 4);
+        if(length == 0)
+        {
+            LOG_ERROR("[STATS] HISTOGRAM doesn't fit in the shared buffer");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SYSTEM_ERR_NETWORK_ORDER);
+            return 4;
+        }
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4 + length;
+      }
+      case STATS_PROC_LOOP: // 3
+      {
+        UINT length = LoopMonitorEncode(sharedBuffer + REPLY_OFFSET + 4, sharedBufferSize - REPLY_OFFSET - 4);
+        if(length == 0)
+        {
+            LOG_ERROR("[STATS] LOOP doesn't fit in the shared buffer");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SYSTEM_ERR_NETWORK_ORDER);
+            return 4;
+        }
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4 + length;
+      }
+      case STATS_PROC_DUMP_SPANS: // 4
+      {
+        UINT written, dropped;
+        if(!spansEnabled || SpanDump(&written, &dropped))
+        {
+            SET_UINT(sharedBuffer + REPLY_OFFSET    , RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+            AppendUint(sharedBuffer + REPLY_OFFSET + 4, 1);
+            return 8;
+        }
+        SET_UINT  (sharedBuffer + REPLY_OFFSET     , RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        AppendUint(sharedBuffer + REPLY_OFFSET +  4, 0);
+        AppendUint(sharedBuffer + REPLY_OFFSET +  8, written);
+        AppendUint(sharedBuffer + REPLY_OFFSET + 12, dropped);
+        return 16;
+      }
+      case STATS_PROC_HEAP_CALLS: // 5
+      {
+        UINT64 heapCalls = ArenaHeapCalls();
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        if(heapCalls == ARENA_HEAP_CALLS_UNKNOWN)
+        {
+            AppendUint(sharedBuffer + REPLY_OFFSET + 4, 1);
+            return 8;
+        }
+        AppendUint  (sharedBuffer + REPLY_OFFSET + 4, 0);
+        AppendUint64(sharedBuffer + REPLY_OFFSET + 8, heapCalls);
+        return 16;
+      }
+      case STATS_PROC_SCHEDULER: // 6
+      {
+        UINT length = SchedulerEncode(sharedBuffer + REPLY_OFFSET + 4, sharedBufferSize - REPLY_OFFSET - 4);
+        if(length == 0)
+        {
+            LOG_ERROR("[STATS] SCHEDULER doesn't fit in the shared buffer");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SYSTEM_ERR_NETWORK_ORDER);
+            return 4;
+        }
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4 + length;
+      }
+      case STATS_PROC_CLIENTS: // 7
+      {
+        UINT length = SchedulerEncodeClients(sharedBuffer + REPLY_OFFSET + 4, sharedBufferSize - REPLY_OFFSET - 4);
+        if(length == 0)
+        {
+            LOG_ERROR("[STATS] CLIENTS doesn't fit in the shared buffer");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SYSTEM_ERR_NETWORK_ORDER);
+            return 4;
+        }
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4 + length;
+      }
+      case STATS_PROC_READ_AHEAD: // 8
+      {
+        UINT length = ReadAheadEncode(sharedBuffer + REPLY_OFFSET + 4, sharedBufferSize - REPLY_OFFSET - 4);
+        if(length == 0)
+        {
+            LOG_ERROR("[STATS] READ_AHEAD doesn't fit in the shared buffer");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SYSTEM_ERR_NETWORK_ORDER);
+            return 4;
+        }
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4 + length;
+      }
+      case STATS_PROC_BLOCK_CACHE: // 9
+      {
+        UINT length = BlockCacheEncode(sharedBuffer + REPLY_OFFSET + 4, sharedBufferSize - REPLY_OFFSET - 4);
+        if(length == 0)
+        {
+            LOG_ERROR("[STATS] BLOCK_CACHE doesn't fit in the shared buffer");
+            SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SYSTEM_ERR_NETWORK_ORDER);
+            return 4;
+        }
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        return 4 + length;
+      }
+      case STATS_PROC_DIRECT_IO: // 10
+      {
+        SET_UINT    (sharedBuffer + REPLY_OFFSET     , RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        AppendUint  (sharedBuffer + REPLY_OFFSET +  4, config.directIoExportCount ? config.directIoMinSize : 0);
+        AppendUint64(sharedBuffer + REPLY_OFFSET +  8, (UINT64)directReads);
+        AppendUint64(sharedBuffer + REPLY_OFFSET + 16, (UINT64)directReadBytes);
+        AppendUint64(sharedBuffer + REPLY_OFFSET + 24, (UINT64)directWrites);
+        AppendUint64(sharedBuffer + REPLY_OFFSET + 32, (UINT64)directWriteBytes);
+        return 40;
+      }
+      case STATS_PROC_ATTRIBUTES: // 11
+      {
+        SET_UINT    (sharedBuffer + REPLY_OFFSET     , RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+        AppendUint64(sharedBuffer + REPLY_OFFSET +  4, encodedAttributesStats.copies);
+        AppendUint64(sharedBuffer + REPLY_OFFSET + 12, encodedAttributesStats.encodes);
+        return 20;
+      }
+      default:
+        LOG("[STATS] unhandled procedure %u", callInfo->procedure);
+        SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL_NETWORK_ORDER);
+        return 4;
+    }
+}
+
+ProgramCallHandler portmapHandlers[] = {&Portmap2Handler};
+ProgramCallHandler nfsHandlers[]     = {&Nfs3Handler, &Nfs4Handler};
+ProgramCallHandler mountHandlers[]   = {&Mount3Handler};
+ProgramCallHandler statsHandlers[]   = {&Stats1Handler};
+
+RpcProgramSet Programs[] = {
+    RpcProgramSet("Portmap", RPC_PROGRAM_PORTMAP, 2, 2, portmapHandlers),
+    RpcProgramSet("Nfs"    , RPC_PROGRAM_NFS    , 3, 4, nfsHandlers),
+    RpcProgramSet("Mount"  , RPC_PROGRAM_MOUNT  , 3, 3, mountHandlers),
+    RpcProgramSet("Stats"  , RPC_PROGRAM_STATS  , 1, 1, statsHandlers),
+};
+
+// Parses the rpc header of a call into callInfo
+// receiveTime: when the record was received (from StatsNow)
+// Returns: the call's arguments, NULL if the record is invalid (the
+//          connection should be closed)
+char* DecodeRpcCall(SelectSock* sock, RpcCallInfo* callInfo, char* command, char* limit, INT64 receiveTime)
+{
+    if(command + 8 > limit)
+    {
+        LOG_ERROR("Invalid RPC command, header not long enough");
+        return NULL; // error
+    }
+
+    callInfo->recordLength = 4 + (UINT)(limit - command);
+    callInfo->receiveTime = receiveTime;
+    callInfo->startTime = StatsNow();
+    callInfo->arena = NULL;
+    callInfo->argsInArena = false;
+    callInfo->xid = ParseUint(command +  0);
+    UINT messageType  = ParseUint(command +  4);
+    if(messageType != RPC_MESSAGE_TYPE_CALL)
+    {
+        LOG_ERROR("Unhandled rpc message type %d", messageType);
+        return NULL; // error
+    }
+    command += 8;
+    if(command + 28 > limit)
+    {
+        LOG_RPC("Invalid RPC command, header not long enough");
+        return NULL; // error
+    }
+    callInfo->rpcVersion     = ParseUint(command +  0);
+    if(callInfo->rpcVersion != 2)
+    {
+        LOG_RPC("unsupported rpc version %u", callInfo->rpcVersion);
+        return NULL; // error
+    }
+    // TODO: check rpc version and send error if not matched
+
+    callInfo->program        = ParseUint(command +  4);
+    callInfo->programVersion = ParseUint(command +  8);
+    callInfo->procedure      = ParseUint(command + 12);
+    TcpConnection* conn      = (TcpConnection*)sock->user;
+    callInfo->connection     = conn->id;
+    callInfo->sampled        = spansEnabled && SpanSample();
+
+    UINT credentialsAuthFlavor = ParseUint(command + 16);
+    UINT credentialsLength     = ParseUint(command + 20);
+    if(credentialsLength > 400)
+    {
+        LOG_RPC("Invalid RPC command, credentials length %u is too long", credentialsLength);
+        return NULL; // error
+    }
+    command += 24 + credentialsLength;
+    if(command + 8 > limit)
+    {
+        LOG_RPC("Invalid RPC command, header not long enough");
+        return NULL; // error
+    }
+    UINT verifierAuthFlavor = ParseUint(command + 0);
+    UINT verifierLength     = ParseUint(command + 4);
+    if(verifierLength > 400)
+    {
+        LOG_RPC("Invalid RPC command, verifier length %u is too long", verifierLength);
+        return NULL; // error
+    }
+    command += 8 + verifierLength;
+    if(command > limit)
+    {
+        LOG_RPC("Invalid RPC command, header not long enough");
+        return NULL; // error
+    }
+
+    LOG_RPC("HandleRpcCommand(s=%d) xid 0x%08x, type %u, rpcv %u, prog %u, progv %u, proc %u, cred %u, verf %u, data_length %u",
+        sock->so, callInfo->xid, messageType, callInfo->rpcVersion, callInfo->program, callInfo->programVersion, callInfo->procedure,
+        credentialsAuthFlavor, verifierAuthFlavor, limit - command);
+
+    if(callInfo->sampled)
+    {
+        callInfo->lastSpanEnd = StatsNow();
+        if(conn->recvStart)
+        {
+            if(conn->recordStart < conn->recvStart)
+            {
+                CallSpan(callInfo, SPAN_REASSEMBLY, conn->recordStart, receiveTime);
+            }
+            CallSpan(callInfo, SPAN_RECV, conn->recvStart, receiveTime);
+        }
+        CallSpan(callInfo, SPAN_QUEUE, receiveTime, callInfo->startTime);
+        CallSpan(callInfo, SPAN_DECODE, callInfo->startTime, callInfo->lastSpanEnd);
+    }
+    return command;
+}
+
+// Handles a decoded call and sends its reply
+void ExecuteRpcCall(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer, char* args, char* limit)
+{
+    LoopMonitorSetCall(callInfo->program, callInfo->procedure);
+    callInfo->sequence = ((TcpConnection*)sock->user)->nextSequence++;
+
+    bool foundProgram = false;
+    UINT replySize;
+    for(unsigned i = 0; i < STATIC_ARRAY_LENGTH(Programs); i++)
+    {
+        if(Programs[i].program == callInfo->program)
+        {
+            foundProgram = true;
+
+            if(callInfo->programVersion < Programs[i].minVersion ||
+               callInfo->programVersion > Programs[i].maxVersion)
+            {
+                LOG_RPC("Program %s(%u) does not support version %u", Programs[i].name, callInfo->program, callInfo->programVersion);
+                SET_UINT  (sharedBuffer + 24, RPC_REPLY_ACCEPT_STATUS_PROG_MISMATCH_NETWORK_ORDER);
+                AppendUint(sharedBuffer + 28, Programs[i].minVersion);
+                AppendUint(sharedBuffer + 32, Programs[i].maxVersion);
+                replySize = 12;
+            }
+            else
+            {
+                replySize = Programs[i].handlers[callInfo->programVersion - Programs[i].minVersion]
+                    (sock, callInfo, sharedBuffer, args, limit);
+            }
+            break;
+        }
+    }
+
+    if(!foundProgram)
+    {
+        LOG_RPC("program %u unavailable", callInfo->program);
+        SET_UINT(sharedBuffer + 24, RPC_REPLY_ACCEPT_STATUS_PROG_UNAVAIL_NETWORK_ORDER);
+        replySize = 4;
+    }
+
+    if(replySize)
+    {
+        SendReply((TcpConnection*)sock->user, callInfo, sharedBuffer, replySize);
+    }
+    if(callInfo->arena)
+    {
+        ArenaRelease(callInfo->arena);
+    }
+}
+
+// A call that is waiting in the scheduler, it lives in the call's arena
+struct ScheduledCall
+{
+    SchedulerEntry entry; // must be first
+    TcpConnection* conn;
+    RpcCallInfo callInfo;
+    char* args; // copied from the record, the record is gone once the call is queued
+    char* limit;
+};
+
+// Moves a decoded call to the scheduler
+// Returns: non-zero if out of memory (the call should be handled right away)
+int QueueCall(SelectSock* sock, RpcCallInfo* callInfo, char* args, char* limit, UINT schedClass, UINT cost)
+{
+    UINT argsLength = (UINT)(limit - args);
+    ScheduledCall* call = (ScheduledCall*)CallAlloc(callInfo, sizeof(ScheduledCall) + argsLength);
+    if(!call)
+    {
+        LOG_ERROR("[SCHED] out of memory for a %u byte call, handling it right away", argsLength);
+        return 1;
+    }
+    call->conn = (TcpConnection*)sock->user;
+    call->conn->AddRef();
+    call->callInfo = *callInfo;
+    call->callInfo.argsInArena = true;
+    call->args = (char*)(call + 1);
+    memcpy(call->args, args, argsLength);
+    call->limit = call->args + argsLength;
+    SchedulerQueue(&call->entry, call->conn->client, schedClass, cost, callInfo->xid);
+    return 0;
+}
+
+void RpcTcpRecvHandler(SynchronizedSelectServer server, SelectSock* sock, PopReason reason, char* sharedBuffer);
+
+// Frees a call the scheduler took off its queue without handling it
+// reason: SCHED_DROP_
+void DropScheduledCall(ScheduledCall* call, UINT reason)
+{
+    TcpConnection* conn = call->conn;
+    Arena* arena = call->callInfo.arena;
+    LOG_RPC("dropping call xid 0x%08x (prog %u proc %u) of connection %u, reason %u",
+        call->callInfo.xid, call->callInfo.program, call->callInfo.procedure, conn->id, reason);
+    SchedulerDrop(&call->entry, conn->client, reason);
+    conn->Release();
+    ArenaRelease(arena);
+}
+
+// Handles a call the scheduler took off its queue
+void DispatchScheduledCall(SchedulerEntry* entry, char* sharedBuffer)
+{
+    ArenaRequestScope requestScope;
+    ScheduledCall* call = (ScheduledCall*)entry;
+    // The client has given up on a call this old and sent it again
+    if(config.callDeadline &&
+       StatsTicksToMicros(StatsNow() - call->callInfo.receiveTime) >= (UINT64)config.callDeadline * 1000)
+    {
+        DropScheduledCall(call, SCHED_DROP_STALE);
+        return;
+    }
+    if(call->conn->IsClosed())
+    {
+        DropScheduledCall(call, SCHED_DROP_CLOSED);
+        return;
+    }
+    // The call lives in its arena, which is released as soon as its reply is
+    // sent (or handed to whatever sends it later), so nothing in it is used
+    // after the handler
+    RpcCallInfo callInfo = call->callInfo;
+    TcpConnection* conn = call->conn;
+    callInfo.startTime = StatsNow();
+    if(callInfo.sampled)
+    {
+        CallSpan(&callInfo, SPAN_QUEUE, callInfo.lastSpanEnd, callInfo.startTime);
+        callInfo.lastSpanEnd = callInfo.startTime;
+    }
+    // Runs outside of the connection's handler, the socket is only used for its
+    // connection (like a replayed connection)
+    SelectSock sock(conn->so, conn, &RpcTcpRecvHandler, SelectSock::READ, SelectSock::INF);
+    LoopMonitorHandlerBegin((UINT)conn->so);
+    ExecuteRpcCall(&sock, &callInfo, sharedBuffer, call->args, call->limit);
+    LoopMonitorHandlerEnd();
+    conn->Release();
+}
+
+// Returns: the bytes a call costs its client in the scheduler, the record
+//          plus the data a READ asks for
+UINT CallCost(RpcCallInfo* callInfo, char* args, char* limit)
+{
+    UINT cost = callInfo->recordLength;
+    if(callInfo->program == RPC_PROGRAM_NFS && callInfo->programVersion == 3 &&
+       callInfo->procedure == NFS3_PROC_READ && limit - args >= 16)
+    {
+        UINT count = ParseUint(limit - 4); // READ args end with the count
+        cost += (count < config.maxTransferSize) ? count : config.maxTransferSize;
+    }
+    return cost;
+}
+
+// Bytes after the status of a failed NFSv3 reply of each procedure (the
+// post_op_attr and wcc_data it returns, all empty)
+static const BYTE nfs3FailBodyLengths[] = {
+     0, // NULL
+     0, // GETATTR
+     8, // SETATTR
+     4, // LOOKUP
+     4, // ACCESS
+     4, // READLINK
+     4, // READ
+     8, // WRITE
+     8, // CREATE
+     8, // MKDIR
+     8, // SYMLINK
+     8, // MKNOD
+     8, // REMOVE
+     8, // RMDIR
+    16, // RENAME
+    12, // LINK
+     4, // READDIR
+     4, // READDIRPLUS
+     4, // FSSTAT
+     4, // FSINFO
+     4, // PATHCONF
+     8, // COMMIT
+};
+
+// Returns: true if the call is an NFSv3 call that is turned away while the
+//          server is overloaded, everything but NULL and GETATTR of a handle
+//          whose attributes are cached
+bool CanJukebox(RpcCallInfo* callInfo, char* args, char* limit)
+{
+    if(callInfo->program != RPC_PROGRAM_NFS || callInfo->programVersion != 3 ||
+       callInfo->procedure == PROC_NULL || callInfo->procedure >= STATIC_ARRAY_LENGTH(nfs3FailBodyLengths))
+    {
+        return false;
+    }
+    if(callInfo->procedure == NFS3_PROC_GETATTR && limit - args == 8 && ParseUint(args) == 4)
+    {
+        UINT handle = ParseUint(args + 4);
+        if(handle < nameHandleCount && nameHandles[handle].attributes)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Answers a call with NFS3ERR_JUKEBOX without handling it, so the client
+// retries it after a delay
+void SendJukebox(SelectSock* sock, RpcCallInfo* callInfo, char* sharedBuffer)
+{
+    UINT bodyLength = nfs3FailBodyLengths[callInfo->procedure];
+    UINT replySize = 8 + bodyLength;
+    SET_UINT(sharedBuffer + REPLY_OFFSET    , RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+    SET_UINT(sharedBuffer + REPLY_OFFSET + 4, NFS3_ERROR_JUKEBOX_NETWORK_ORDER);
+    memset(sharedBuffer + REPLY_OFFSET + 8, 0, bodyLength);
+    AppendUint(sharedBuffer + 0, RPC_LAST_FRAGMENT_FLAG | (REPLY_OFFSET - 4 + replySize));
+    SetupReply(sharedBuffer + 4, callInfo->xid);
+    ((TcpConnection*)sock->user)->Send("[RPC]", sharedBuffer, REPLY_OFFSET + replySize);
+    RecordCallStats(callInfo, sharedBuffer + REPLY_OFFSET, replySize);
+}
+
+// receiveTime: when the record was received (from StatsNow)
+// Return: 1 on error
+int HandleRpcCommand(SelectSock* sock, char* sharedBuffer, char* command, char* limit, INT64 receiveTime)
+{
+    ArenaRequestScope requestScope;
+    RpcCallInfo callInfo;
+    char* args = DecodeRpcCall(sock, &callInfo, command, limit, receiveTime);
+    if(!args)
+    {
+        return 1; // error
+    }
+    if(CanJukebox(&callInfo, args, limit) && !SchedulerAdmit())
+    {
+        SendJukebox(sock, &callInfo, sharedBuffer);
+        return 0;
+    }
+    TcpConnection* conn = (TcpConnection*)sock->user;
+    UINT schedClass = SchedulerClassify(callInfo.program, callInfo.procedure);
+    UINT cost = CallCost(&callInfo, args, limit);
+    // A retransmit replaces the call that is still queued
+    SchedulerEntry* superseded = SchedulerTakeQueued(conn->client, schedClass, callInfo.xid);
+    if(superseded)
+    {
+        DropScheduledCall((ScheduledCall*)superseded, SCHED_DROP_SUPERSEDED);
+    }
+    if(SchedulerRunNow(conn->client, schedClass, cost) || QueueCall(sock, &callInfo, args, limit, schedClass, cost))
+    {
+        ExecuteRpcCall(sock, &callInfo, sharedBuffer, args, limit);
+    }
+    return 0;
+}
+
+// Room for the rpc header (with two 400 byte auth bodies) and the WRITE
+// arguments before the data (with a 64 byte handle)
+#define STREAM_WRITE_HEADER_SIZE 1024
+
+// A WRITE whose data is written to the file a chunk at a time as it is
+// received, instead of once the whole record is in pending.  It lives in the
+// call's arena.
+struct StreamWrite
+{
+    RpcCallInfo callInfo;
+    UINT handle;
+    HANDLE file;        // NULL if the WRITE already failed or was answered
+    HANDLE directFile;  // NULL if the export doesn't use direct I/O
+    UINT64 offset;      // where the chunk goes in the file
+    UINT count;
+    UINT stable;
+    UINT status;        // the WRITE's status so far, the data that follows an error is dropped
+    bool answered;      // the call was answered with JUKEBOX, its data is dropped
+    UINT dataLeft;      // data that hasn't been received yet
+    UINT padLeft;       // padding after the data that hasn't been received yet
+    char* chunk;        // a config.streamWriteChunk byte buffer pool buffer
+    UINT chunkLength;
+};
+
+// Returns: the pending capacity for a partly received record of recordSize,
+//          a record that could be a streamed WRITE only gets room for its
+//          header until it is known not to be one
+UINT PendingRecordCapacity(UINT recordSize)
+{
+    // A traced record has to be received whole to be traced
+    if(config.streamWriteChunk && recordSize > config.streamWriteChunk && !traceEnabled)
+    {
+        return STREAM_WRITE_HEADER_SIZE;
+    }
+    return recordSize;
+}
+
+// Counts length bytes of data that were received into the end of the
+// stream's chunk, the chunk is written once it is full or has the last of
+// the data
+void StreamWriteReceived(StreamWrite* stream, UINT length)
+{
+    stream->chunkLength += length;
+    stream->dataLeft -= length;
+    if(stream->chunkLength < config.streamWriteChunk && stream->dataLeft)
+    {
+        return;
+    }
+    if(stream->file && stream->status == NFS3_STATUS_OK_NETWORK_ORDER)
+    {
+        DWORD error = WriteFileData(stream->file, stream->directFile, stream->offset, stream->chunk, stream->chunkLength);
+        if(error)
+        {
+            LOG_AT(NFS, ERROR, "[NFS] WRITE: WriteFile \"%s\" failed (e=%d)",
+                nameHandles[stream->handle].localName.ptr, error);
+            stream->status = Nfs3ErrorFromWin32(error);
+        }
+        // A READ between chunks must not keep blocks it cached before this one
+        InvalidateReads(stream->handle, stream->offset, stream->chunkLength);
+    }
+    stream->offset += stream->chunkLength;
+    stream->chunkLength = 0;
+}
+
+// Starts streaming the data of the WRITE at the start of pending, whose
+// record is recordSize bytes and has only partly been received
+// Returns: true if the WRITE is streamed (the caller releases pending),
+//          false if the record isn't a valid WRITE and has to be received whole
+bool StartStreamWrite(SelectSock* sock, TcpConnection* conn, char* sharedBuffer, UINT recordSize)
+{
+    char* record = conn->pending;
+    char* received = record + conn->pendingLength;
+    // The whole header is checked against what has been received before it
+    // is decoded, decoding has side effects (span sampling) that must only
+    // happen once for a record that turns out to be received whole
+    if(ParseUint(record + 8) != RPC_MESSAGE_TYPE_CALL || ParseUint(record + 12) != 2 ||
+       ParseUint(record + 16) != RPC_PROGRAM_NFS || ParseUint(record + 20) != 3 ||
+       ParseUint(record + 24) != NFS3_PROC_WRITE)
+    {
+        return false;
+    }
+    UINT credentialsLength = ParseUint(record + 32);
+    if(credentialsLength > 400)
+    {
+        return false;
+    }
+    char* verifier = record + 36 + credentialsLength;
+    if(verifier + 8 > received || ParseUint(verifier + 4) > 400)
+    {
+        return false;
+    }
+    char* args = verifier + 8 + ParseUint(verifier + 4);
+    if(args + 4 > received)
+    {
+        return false;
+    }
+    UINT handleLength = ParseUint(args);
+    char* endOfHandle = args + 4 + Align4(handleLength);
+    if(handleLength > 64 || endOfHandle + 20 > received)
+    {
+        return false;
+    }
+    UINT64 offset   = ParseUint64(endOfHandle +  0);
+    UINT count      = ParseUint  (endOfHandle +  8);
+    UINT stable     = ParseUint  (endOfHandle + 12);
+    UINT dataLength = ParseUint  (endOfHandle + 16);
+    char* data = endOfHandle + 20;
+    if(dataLength != count || stable > NFS3_STABLE_FILE_SYNC || (UINT)(record + recordSize - data) != Align4(count))
+    {
+        return false; // answered with GARBAGE_ARGS once it is received
+    }
+
+    ArenaRequestScope requestScope;
+    RpcCallInfo callInfo;
+    if(DecodeRpcCall(sock, &callInfo, record + 4, record + recordSize, conn->receiveTime) != args)
+    {
+        return false; // the checks above match DecodeRpcCall's, this can't happen
+    }
+    StreamWrite* stream = (StreamWrite*)CallAlloc(&callInfo, sizeof(StreamWrite));
+    char* chunk = BufferPoolAlloc(config.streamWriteChunk);
+    if(!stream || !chunk)
+    {
+        LOG_ERROR("[NFS] out of memory to stream a %u byte WRITE, receiving it whole", count);
+        if(chunk)
+        {
+            BufferPoolFree(chunk, config.streamWriteChunk);
+        }
+        if(callInfo.arena)
+        {
+            ArenaRelease(callInfo.arena);
+        }
+        return false;
+    }
+    stream->handle      = NO_HANDLE;
+    stream->file        = NULL;
+    stream->directFile  = NULL;
+    stream->offset      = offset;
+    stream->count       = count;
+    stream->stable      = stable;
+    stream->status      = NFS3_STATUS_OK_NETWORK_ORDER;
+    stream->answered    = false;
+    stream->dataLeft    = count;
+    stream->padLeft     = Align4(count) - count;
+    stream->chunk       = chunk;
+    stream->chunkLength = 0;
+
+    // A WRITE can always be turned away, its data is still read off the socket
+    if(!SchedulerAdmit())
+    {
+        SendJukebox(sock, &callInfo, sharedBuffer);
+        stream->answered = true;
+    }
+    else
+    {
+        // The reply is sent in order with the calls handled before it
+        callInfo.sequence = conn->nextSequence++;
+        UINT schedClass = SchedulerClassify(callInfo.program, callInfo.procedure);
+        SchedulerEntry* superseded = SchedulerTakeQueued(conn->client, schedClass, callInfo.xid);
+        if(superseded)
+        {
+            DropScheduledCall((ScheduledCall*)superseded, SCHED_DROP_SUPERSEDED);
+        }
+        // The data is written as it arrives instead of waiting in the bulk
+        // queue, the call is only counted as in flight
+        SchedulerRunNow(conn->client, schedClass, CallCost(&callInfo, args, record + recordSize));
+        stream->file = GetWriteTarget(args + 4, handleLength, &stream->handle, &stream->status);
+        if(stream->file)
+        {
+            stream->directFile = GetDirectFile(stream->handle);
+            // The data goes to the file after anything that was gathered before it
+            if(nameHandles[stream->handle].gather)
+            {
+                WriteGatherFlush(nameHandles[stream->handle].gather);
+            }
+            // READs that run while the data is received must not serve what
+            // it overwrites from the block cache
+            InvalidateReads(stream->handle, offset, count);
+        }
+        LOG_AT(NFS, DEBUG, "[NFS] WRITE of %u bytes at offset %llu is streamed", count, (unsigned long long)offset);
+    }
+    stream->callInfo = callInfo;
+    conn->stream = stream;
+
+    // The data that was received with the header
+    UINT length = (UINT)(received - data);
+    while(length && stream->dataLeft)
+    {
+        UINT copyLength = config.streamWriteChunk - stream->chunkLength;
+        if(copyLength > stream->dataLeft)
+        {
+            copyLength = stream->dataLeft;
+        }
+        if(copyLength > length)
+        {
+            copyLength = length;
+        }
+        memcpy(stream->chunk + stream->chunkLength, data, copyLength);
+        StreamWriteReceived(stream, copyLength);
+        data += copyLength;
+        length -= copyLength;
+    }
+    stream->padLeft -= length;
+    return true;
+}
+
+// Sends the reply of the connection's streamed WRITE once all of its data
+// has been received
+void FinishStreamWrite(SelectSock* sock, TcpConnection* conn, char* sharedBuffer)
+{
+    ArenaRequestScope requestScope;
+    StreamWrite* stream = conn->stream;
+    conn->stream = NULL;
+    BufferPoolFree(stream->chunk, config.streamWriteChunk);
+    // The stream is in the call's arena, which a deferred or held reply takes
+    RpcCallInfo callInfo = stream->callInfo;
+    if(stream->answered)
+    {
+        ArenaRelease(callInfo.arena);
+        return;
+    }
+
+    SyncRequest sync;
+    sync.file = NULL;
+    UINT length;
+    if(stream->status == NFS3_STATUS_OK_NETWORK_ORDER)
+    {
+        LOG_AT(NFS, DEBUG, "[NFS] WRITE \"%s\" offset %llu count %u stable %u", nameHandles[stream->handle].localName.ptr,
+            (unsigned long long)(stream->offset - stream->count), stream->count, stream->stable);
+        FileStat stat;
+        DWORD error = GetFileStat(stream->file, &stat);
+        length = SetWriteReply(stream->handle, stream->file, stream->offset - stream->count, stream->stable,
+            stream->count, error ? NULL : &stat, sharedBuffer + REPLY_OFFSET + 4, &sync);
+    }
+    else
+    {
+        length = SetWccError(sharedBuffer + REPLY_OFFSET + 4, stream->status);
+    }
+    // The backend span of a streamed WRITE includes receiving its data
+    BackendSpanEnd(&callInfo, callInfo.lastSpanEnd);
+    SET_UINT(sharedBuffer + REPLY_OFFSET, RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER);
+    UINT replySize = length + 4;
+    if(sync.file)
+    {
+        replySize = DeferReply(conn, &callInfo, sharedBuffer, replySize, &sync);
+    }
+    if(replySize)
+    {
+        SendReply(conn, &callInfo, sharedBuffer, replySize);
+    }
+    if(callInfo.arena)
+    {
+        ArenaRelease(callInfo.arena);
+    }
+}
+
+// Frees the connection's streamed WRITE when the connection closes before
+// all of its data is received, the call isn't answered
+void AbortStreamWrite(TcpConnection* conn)
+{
+    StreamWrite* stream = conn->stream;
+    conn->stream = NULL;
+    BufferPoolFree(stream->chunk, config.streamWriteChunk);
+    if(!stream->answered)
+    {
+        SchedulerCallDone(conn->client);
+    }
+    ArenaRelease(stream->callInfo.arena);
+}
+
+// Receives more data of the connection's streamed WRITE, at most a chunk, and
+// writes it to the file
+// Returns: 1 on error (the connection should be closed)
+int ReceiveStreamWrite(SelectSock* sock, TcpConnection* conn, char* sharedBuffer)
+{
+    StreamWrite* stream = conn->stream;
+    LoopMonitorSetCall(stream->callInfo.program, stream->callInfo.procedure);
+    // Only the record's own bytes are received, the next record starts after them
+    char* dest = sharedBuffer;
+    UINT length = stream->padLeft;
+    if(stream->dataLeft)
+    {
+        dest = stream->chunk + stream->chunkLength;
+        length = config.streamWriteChunk - stream->chunkLength;
+        if(length > stream->dataLeft)
+        {
+            length = stream->dataLeft;
+        }
+    }
+    int size = recv(sock->so, dest, length, 0);
+    if(size <= 0)
+    {
+        LOG_NET("RpcTcpRecvHandler(s=%d) recv returned %d with %u bytes of WRITE data left (e=%d)",
+            sock->so, size, stream->dataLeft, GetLastError());
+        return 1;
+    }
+    LOG_NET("RpcTcpRecvHandler(s=%d) Got %u bytes of WRITE data (%u bytes left)", sock->so, size, stream->dataLeft);
+    if(stream->dataLeft)
+    {
+        StreamWriteReceived(stream, (UINT)size);
+    }
+    else
+    {
+        stream->padLeft -= (UINT)size;
+    }
+    if(stream->dataLeft == 0 && stream->padLeft == 0)
+    {
+        FinishStreamWrite(sock, conn, sharedBuffer);
+    }
+    return 0;
+}
+
+// Returns: the size of the record including the 4 byte record marker, 0 on error
+UINT ParseRecordMarker(SelectSock* sock, char* data)
+{
+    bool lastFragment = (unsigned char)data[0] >> 7;
+    UINT fragmentLength =
+        ((unsigned char)data[0] & 0x7F) << 24 |
+        (unsigned char)data[1] << 16 |
+        (unsigned char)data[2] <<  8 |
+        (unsigned char)data[3]       ;
+    if(!lastFragment)
+    {
+        LOG_ERROR("multiple fragments not implemented");
+        return 0;
+    }
+    if(fragmentLength > maxFragmentLength)
+    {
+        LOG_ERROR("(s=%u) fragment length %u is too large (max is %u)", sock->so, fragmentLength, maxFragmentLength);
+        return 0;
+    }
+    LOG_RPC("RpcTcpRecvHandler(s=%d) fragment length is %u", sock->so, fragmentLength);
+    return 4 + fragmentLength;
+}
+
+// Receives data and handles every record that is complete
+// Returns: 1 on error (the connection should be closed)
+int ReceiveRecords(SelectSock* sock, TcpConnection* conn, char* sharedBuffer)
+{
+    if(conn->stream)
+    {
+        return ReceiveStreamWrite(sock, conn, sharedBuffer);
+    }
+    INT64 recvStart = spansEnabled ? StatsNow() : 0;
+    if(conn->pendingLength == 0)
+    {
+        int size = recv(sock->so, receiveBuffer, sharedBufferSize, 0);
+        if(size <= 0)
+        {
+            if(size == 0)
+            {
+                LOG_NET("RpcTcpRecvHandler(s=%d) client closed", sock->so);
+            }
+            else
+            {
+                LOG_NET("RpcTcpRecvHandler(s=%d) recv returned error (return=%d, e=%d)", sock->so, size, GetLastError());
+            }
+            return 1;
+        }
+        LOG_NET("RpcTcpRecvHandler(s=%d) Got %u bytes", sock->so, size);
+        INT64 receiveTime = StatsNow();
+        conn->recvStart = recvStart;
+        conn->recordStart = recvStart;
+
+        // Fast path, the recv returned exactly one record which can be
+        // handled straight out of the receive buffer
+        UINT recordSize = 0;
+        if(size >= 4)
+        {
+            recordSize = ParseRecordMarker(sock, receiveBuffer);
+            if(recordSize == 0)
+            {
+                return 1;
+            }
+            if(recordSize == (UINT)size)
+            {
+                if(traceEnabled)
+                {
+                    TraceRecord(conn->id, receiveBuffer, size);
+                }
+                return HandleRpcCommand(sock, sharedBuffer, receiveBuffer + 4, receiveBuffer + size, receiveTime);
+            }
+        }
+
+        // The next recv reuses the receive buffer, so anything that isn't
+        // handled right away has to be moved out of it first
+        UINT capacity = PendingRecordCapacity(recordSize);
+        if(conn->ReservePending((capacity > (UINT)size) ? capacity : (UINT)size))
+        {
+            LOG_ERROR("(s=%u) out of memory for a %u byte record", sock->so, recordSize);
+            return 1;
+        }
+        memcpy(conn->pending, receiveBuffer, size);
+        conn->pendingLength = size;
+        conn->receiveTime = receiveTime;
+    }
+    else
+    {
+        int size = recv(sock->so, conn->pending + conn->pendingLength,
+                        conn->pendingCapacity - conn->pendingLength, 0);
+        if(size <= 0)
+        {
+            LOG_NET("RpcTcpRecvHandler(s=%d) recv returned %d with %u bytes pending (e=%d)",
+                sock->so, size, conn->pendingLength, GetLastError());
+            return 1;
+        }
+        LOG_NET("RpcTcpRecvHandler(s=%d) Got %u bytes (%u bytes pending)", sock->so, size, conn->pendingLength);
+        conn->pendingLength += size;
+        conn->receiveTime = StatsNow();
+        conn->recvStart = recvStart;
+    }
+
+    UINT offset = 0;
+    UINT nextRecordSize = 0;
+    while(conn->pendingLength - offset >= 4)
+    {
+        UINT recordSize = ParseRecordMarker(sock, conn->pending + offset);
+        if(recordSize == 0)
+        {
+            return 1;
+        }
+        if(conn->pendingLength - offset < recordSize)
+        {
+            nextRecordSize = recordSize;
+            break;
+        }
+        if(traceEnabled)
+        {
+            TraceRecord(conn->id, conn->pending + offset, recordSize);
+        }
+        if(HandleRpcCommand(sock, sharedBuffer, conn->pending + offset + 4, conn->pending + offset + recordSize,
+                            conn->receiveTime))
+        {
+            return 1;
+        }
+        offset += recordSize;
+    }
+
+    conn->pendingLength -= offset;
+    if(conn->pendingLength == 0)
+    {
+        conn->ReleasePending();
+        return 0;
+    }
+    memmove(conn->pending, conn->pending + offset, conn->pendingLength);
+    if(offset)
+    {
+        conn->recordStart = conn->recvStart;
+    }
+    // A large WRITE is streamed once its header is in, so the connection never
+    // holds more than a chunk of its data
+    UINT capacity = PendingRecordCapacity(nextRecordSize);
+    if(capacity < nextRecordSize && conn->pendingCapacity < nextRecordSize &&
+       conn->pendingLength >= STREAM_WRITE_HEADER_SIZE)
+    {
+        if(StartStreamWrite(sock, conn, sharedBuffer, nextRecordSize))
+        {
+            conn->ReleasePending();
+            return 0;
+        }
+        capacity = nextRecordSize;
+    }
+    if(conn->ReservePending(capacity))
+    {
+        LOG_ERROR("(s=%u) out of memory for a %u byte record", sock->so, nextRecordSize);
+        return 1;
+    }
+    return 0;
+}
+
+// How often a connection that isn't read from because its client has too
+// many calls in flight checks if it can be read from again
+#define CLIENT_PAUSE_MILLIS 10
+
+void RpcTcpRecvHandler(SynchronizedSelectServer server, SelectSock* sock, PopReason reason, char* sharedBuffer)
+{
+    TcpConnection* conn = (TcpConnection*)sock->user;
+    if(reason == POP_REASON_TIMEOUT)
+    {
+        if(!SchedulerClientOverLimit(conn->client))
+        {
+            LOG_NET("RpcTcpRecvHandler(s=%u) resuming", sock->so);
+            sock->UpdateEventFlags(SelectSock::READ);
+            sock->UpdateTimeout(SelectSock::INF);
+        }
+        return;
+    }
+    if(ReceiveRecords(sock, conn, sharedBuffer))
+    {
+        LOG_NET("RpcTcpRecvHandler(s=%u) closing", sock->so);
+        conn->ReleasePending();
+        if(conn->stream)
+        {
+            AbortStreamWrite(conn);
+        }
+        conn->Close();
+        // Nothing is sent anymore, the held replies and the replies of the
+        // calls still in flight are only counted as done
+        conn->unordered = true;
+        SendHeldReplies(conn);
+        SchedulerClientRelease(conn->client);
+        conn->Release();
+        sock->user = NULL;
+        StatsConnectionClosed();
+        sock->UpdateEventFlags(SelectSock::NONE);
+        WriteGatherFlushAll();
+        return;
+    }
+    // The rest of the client's calls wait in the socket until some of the
+    // ones in flight are done.  A streamed WRITE is in flight until all of its
+    // data is received, so its connection keeps being read.
+    if(!conn->stream && SchedulerClientOverLimit(conn->client))
+    {
+        LOG_NET("RpcTcpRecvHandler(s=%u) pausing, the client has too many calls in flight", sock->so);
+        SchedulerClientPaused(conn->client);
+        sock->UpdateEventFlags(SelectSock::NONE);
+        sock->UpdateTimeout(CLIENT_PAUSE_MILLIS);
+    }
+}
+void TcpAcceptHandler(SynchronizedSelectServer server, SelectSock* sock, PopReason reason, char* sharedBuffer)
+{
+    sockaddr_in addr;
+    int addrSize = sizeof(addr);
+    SOCKET newSock = accept(sock->so, (sockaddr*)&addr, &addrSize);
+    if(INVALID_SOCKET == newSock)
+    {
+        LOG_NET("TcpAcceptHandler(s=%d) accept failed (e=%d)", sock->so, GetLastError());
+        return;
+    }
+    char addrString[MAX_ADDR_STRING+1];
+    AddrToString(addrString, (sockaddr*)&addr);
+
+    ClientLimit limit = FindClientLimit(ntohl(addr.sin_addr.s_addr));
+    SchedulerClient* client = SchedulerClientAcquire(addr.sin_addr.s_addr, limit.quantum, limit.maxInFlight);
+    if(!client)
+    {
+        LOG_NET("TcpAcceptHandler(s=%d) rejected socket (s=%d) from '%s'", sock->so, newSock, addrString);
+        closesocket(newSock);
+        return;
+    }
+
+    static UINT nextConnectionId = 1;
+    TcpConnection* conn = new TcpConnection(newSock, nextConnectionId++, client);
+    if(server.TryAddSock(SelectSock(newSock, conn, &RpcTcpRecvHandler, SelectSock::READ, SelectSock::INF)))
+    {
+        LOG_NET("TcpAcceptHandler(s=%d) server full, rejected socket (s=%d) from '%s'", sock->so, newSock, addrString);
+        conn->Close();
+        SchedulerClientRelease(client);
+        conn->Release();
+        return;
+    }
+    StatsConnectionOpened();
+    LOG_NET("TcpAcceptHandler(s=%d) accepted new connection (s=%d) from '%s'", sock->so, newSock, addrString);
+}
+
+bool nfs2Enabled = false;
+bool nfs3Enabled = true;
+
+#define PORTMAP_PORT 111
+#define NFS_PORT     2049
+#define LISTEN_BACKLOG 8
+
+
+// Design Note:
+// This server will support any rpc program on any of the ports.
+// It uses the RPC program number to determine which program is actually being called.
+
+// Writes out the gathered writes that have been held for the gather delay
+void WriteGatherTimer()
+{
+    if(WriteGatherFlushExpired())
+    {
+        SchedulerSetTimer(config.writeGatherDelay);
+    }
+    else
+    {
+        WriteGatherLogStats();
+    }
+}
+
+// Initializes everything but the listeners
+// Returns: the shared buffer, NULL on error
+static char* InitServer()
+{
+    StatsInit();
+    if(LoopMonitorStart(config.stallThreshold))
+    {
+        return NULL;
+    }
+    if(config.spanFile && SpanStart(config.spanFile, config.spanSample))
+    {
+        return NULL;
+    }
+    if(BufferPoolInit(config.largePages))
+    {
+        return NULL;
+    }
+    ArenaInit();
+    if(DirEnumInit(config.dirEnumThreads))
+    {
+        return NULL;
+    }
+    if(IoPoolInit(config.ioThreads))
+    {
+        return NULL;
+    }
+    if(GroupCommitInit())
+    {
+        return NULL;
+    }
+    OpenExportVolumes();
+    if(ConfigureDirectIo())
+    {
+        return NULL;
+    }
+    if(config.blockCacheSize && BlockCacheInit(config.blockCacheSize))
+    {
+        return NULL;
+    }
+    if(config.readAheadMax && ReadAheadInit(config.readAheadThreads, config.readAheadMin, config.readAheadMax))
+    {
+        return NULL;
+    }
+    if(config.writeGatherSize)
+    {
+        WriteGatherInit(config.writeGatherSize, config.writeGatherMemory, config.writeGatherDelay, &GatherFlushed);
+    }
+    SchedulerInit(config.schedulerWeights, config.schedulerMaxWait, &DispatchScheduledCall, &WriteGatherTimer);
+    SchedulerSetOverload(config.overloadQueued, config.overloadDelay);
+    {
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        writeVerifier = FileTimeToUint64(now);
+    }
+    maxFragmentLength = config.maxTransferSize + RPC_MAX_CALL_OVERHEAD - 4;
+    sharedBufferSize = (UINT)BufferPoolRoundSize(config.maxTransferSize + RPC_MAX_CALL_OVERHEAD);
+    char* sharedBuffer = BufferPoolAlloc(sharedBufferSize);
+    receiveBuffer = BufferPoolAlloc(sharedBufferSize);
+    if(!sharedBuffer || !receiveBuffer)
+    {
+        LOG_ERROR("failed to allocate %u byte shared and receive buffers", sharedBufferSize);
+        return NULL;
+    }
+    LOG("Transfer sizes: max %u, preferred %u", config.maxTransferSize, config.preferredTransferSize);
+    return sharedBuffer;
+}
+
+// Completes the file system operations the workers have finished
+void IoWakeHandler(SynchronizedSelectServer server, SelectSock* sock, PopReason reason, char* sharedBuffer)
+{
+    IoPoolRunCompletions(sharedBuffer);
+}
+
+int RunNfsServer()
+{
+    char* sharedBuffer = InitServer();
+    if(!sharedBuffer)
+    {
+        return 1; // error
+    }
+    if(config.traceFile && TraceStart(config.traceFile))
+    {
+        return 1; // error
+    }
+
+    SelectServer server;
+    {
+        // TODO: I don't like that I have to lock the server
+        //       because it hasn't started yet.
+        LockedSelectServer locked(&server);
+        locked.TryAddSock(SelectSock(IoPoolWakeSocket(), NULL, &IoWakeHandler, SelectSock::READ, SelectSock::INF));
+        {
+            sockaddr_in addr;
+            addr.sin_family = AF_INET;
+
+            // If NFSv2 or NVSv3 is enabled, then most clients
+            // will expect the PORTMAP service to be listening on port 111
+            if(nfs2Enabled || nfs3Enabled)
+            {
+                SOCKET so = socket(addr.sin_family, SOCK_STREAM, IPPROTO_TCP);
+                if(so == INVALID_SOCKET)
+                {
+                    LOG_ERROR("socket function failed (e=%d)", GetLastError());
+                    return 1; // error
+                }
+                addr.sin_port = htons(PORTMAP_PORT);
+                addr.sin_addr.s_addr = 0;
+                LOG("(s=%d) Adding TCP Listener on port %u", so, PORTMAP_PORT);
+                if(SOCKET_ERROR == bind(so, (sockaddr*)&addr, sizeof(addr)))
+                {
+                    LOG_ERROR("bind failed (e=%d)", GetLastError());
+                    return 1; // error
+                }
+                if(SOCKET_ERROR == listen(so, LISTEN_BACKLOG))
+                {
+                    LOG_ERROR("listen failed (e=%d)", GetLastError());
+                    return 1; // error
+                }
+                locked.TryAddSock(SelectSock(so, NULL, &TcpAcceptHandler, SelectSock::READ, SelectSock::INF));
+            }
+
+            {
+                SOCKET so = socket(addr.sin_family, SOCK_STREAM, IPPROTO_TCP);
+                if(so == INVALID_SOCKET)
+                {
+                    LOG_ERROR("socket function failed (e=%d)", GetLastError());
+                    return 1; // error
+                }
+                addr.sin_port = htons(NFS_PORT);
+                addr.sin_addr.s_addr = 0;
+                LOG("(s=%d) Adding TCP Listener on port %u", so, NFS_PORT);
+                if(SOCKET_ERROR == bind(so, (sockaddr*)&addr, sizeof(addr)))
+                {
+                    LOG_ERROR("bind failed (e=%d)", GetLastError());
+                    return 1; // error
+                }
+                if(SOCKET_ERROR == listen(so, LISTEN_BACKLOG))
+                {
+                    LOG_ERROR("listen failed (e=%d)", GetLastError());
+                    return 1; // error
+                }
+                locked.TryAddSock(SelectSock(so, NULL, &TcpAcceptHandler, SelectSock::READ, SelectSock::INF));
+            }
+        }
+    }
+    LOG("Starting Server...");
+    return server.Run(sharedBuffer, sharedBufferSize);
+}
+
+#define REPLAY_MAX_CONNECTIONS 1024
+
+struct ReplayConnection
+{
+    UINT id;
+    TcpConnection* conn;
+    SelectSock* sock;
+};
+
+int ReplayTrace(const char* path, bool fast)
+{
+    char* sharedBuffer = InitServer();
+    if(!sharedBuffer)
+    {
+        return 1; // error
+    }
+    TraceReader reader;
+    if(TraceReaderOpen(&reader, path))
+    {
+        return 1; // error
+    }
+
+    ReplayConnection* conns = (ReplayConnection*)calloc(REPLAY_MAX_CONNECTIONS, sizeof(ReplayConnection));
+    if(!conns)
+    {
+        LOG_ERROR("[REPLAY] out of memory");
+        TraceReaderClose(&reader);
+        return 1; // error
+    }
+    UINT connCount = 0;
+    UINT64 records = 0;
+    UINT64 bytes = 0;
+    UINT64 errors = 0;
+    INT64 start = TraceClock();
+    TraceRecordHeader header;
+    int result;
+    while((result = TraceReaderNext(&reader, &header)) == 1)
+    {
+        ReplayConnection* replay = NULL;
+        for(UINT i = 0; i < connCount; i++)
+        {
+            if(conns[i].id == header.connection)
+            {
+                replay = &conns[i];
+                break;
+            }
+        }
+        if(!replay)
+        {
+            if(connCount == REPLAY_MAX_CONNECTIONS)
+            {
+                LOG_ERROR("[REPLAY] the trace has more than %u connections", REPLAY_MAX_CONNECTIONS);
+                result = -1;
+                break;
+            }
+            // The trace doesn't record addresses, every connection is one client
+            ClientLimit limit = FindClientLimit(0);
+            SchedulerClient* client = SchedulerClientAcquire(0, limit.quantum, limit.maxInFlight);
+            if(!client)
+            {
+                result = -1;
+                break;
+            }
+            replay = &conns[connCount++];
+            replay->id = header.connection;
+            replay->conn = new TcpConnection(INVALID_SOCKET, header.connection, client);
+            replay->sock = new SelectSock(INVALID_SOCKET, replay->conn, &RpcTcpRecvHandler, SelectSock::READ, SelectSock::INF);
+        }
+        if(!fast)
+        {
+            TraceWait(start, header.time);
+        }
+        if(ParseRecordMarker(replay->sock, reader.record) != header.length ||
+           HandleRpcCommand(replay->sock, sharedBuffer, reader.record + 4, reader.record + header.length, StatsNow()))
+        {
+            errors++; // the server would have closed the connection
+        }
+        // Calls are replayed one at a time, calls that went to a worker
+        // finish before the next record
+        IoPoolWait(sharedBuffer);
+        while(SchedulerTimeout() == 0)
+        {
+            SchedulerRun(sharedBuffer);
+            IoPoolWait(sharedBuffer);
+        }
+        if(WriteGatherPending())
+        {
+            WriteGatherFlushExpired();
+        }
+        records++;
+        bytes += header.length;
+    }
+    WriteGatherFlushAll();
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    double seconds = (double)(TraceClock() - start) / (double)frequency.QuadPart;
+    TraceReaderClose(&reader);
+    for(UINT i = 0; i < connCount; i++)
+    {
+        delete conns[i].sock;
+        SchedulerClientRelease(conns[i].conn->client);
+        conns[i].conn->Release();
+    }
+    free(conns);
+
+    LOG("[REPLAY] %llu records (%llu bytes) from %u connections in %.3f seconds, %.0f records/s, %llu bad records",
+        records, bytes, connCount, seconds, (seconds > 0) ? records / seconds : 0, errors);
+    return (result < 0) ? 1 : 0;
+}
@@ -1,3 +1,8 @@
-#pragma once
-
-int RunNfsServer();
\ No newline at end of file
+#pragma once
+
+int RunNfsServer();
+
+// Replays a trace recorded with the TraceFile setting, see Trace.h
+// fast: replay as fast as possible instead of at the recorded pace
+// Returns: non-zero on error
+int ReplayTrace(const char* path, bool fast);
@@ -0,0 +1,329 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Common.h"
+#include "Rpc.h"
+#include "BufferPool.h"
+#include "ReadAhead.h"
+
+struct ReadAheadPiece
+{
+    const char* path;
+    UINT64 offset;
+    UINT length;
+};
+
+// NOTE: only read/modify the queue inside the critical section
+static CRITICAL_SECTION queueCriticalSection;
+static CONDITION_VARIABLE queueNotEmpty;
+static ReadAheadPiece queue[READ_AHEAD_QUEUE_SIZE];
+static UINT queueHead = 0;
+static UINT queueCount = 0;
+
+static UINT readAheadThreads = 0;
+static UINT minWindow;
+static UINT maxWindow;
+
+// Only used by the select thread
+static UINT useCounter = 0;
+static UINT64 streamsStarted = 0;
+static UINT64 hits = 0;
+static UINT64 misses = 0;
+static UINT64 piecesQueued = 0;
+static UINT64 bytesQueued = 0;
+static UINT64 piecesSkipped = 0;
+static UINT64 bytesWasted = 0;
+
+static volatile LONG64 bytesRead = 0;
+
+DWORD WINAPI ReadAheadThread(LPVOID param)
+{
+    char* buffer = BufferPoolAlloc(READ_AHEAD_IO_SIZE);
+    if(!buffer)
+    {
+        LOG_ERROR("[READAHEAD] failed to allocate %u byte buffer", READ_AHEAD_IO_SIZE);
+        return 1;
+    }
+
+    // The file of the last piece stays open until the queue is empty, a
+    // stream's pieces usually follow each other
+    const char* openPath = NULL;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    while(true)
+    {
+        EnterCriticalSection(&queueCriticalSection);
+        while(queueCount == 0)
+        {
+            if(file != INVALID_HANDLE_VALUE)
+            {
+                LeaveCriticalSection(&queueCriticalSection);
+                CloseHandle(file);
+                file = INVALID_HANDLE_VALUE;
+                openPath = NULL;
+                EnterCriticalSection(&queueCriticalSection);
+                continue;
+            }
+            SleepConditionVariableCS(&queueNotEmpty, &queueCriticalSection, INFINITE);
+        }
+        ReadAheadPiece piece = queue[queueHead];
+        queueHead = (queueHead + 1) % READ_AHEAD_QUEUE_SIZE;
+        queueCount--;
+        LeaveCriticalSection(&queueCriticalSection);
+
+        // The worker opens the file itself, reads on the handle READ uses
+        // would wait on each other
+        if(piece.path != openPath)
+        {
+            if(file != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(file);
+            }
+            openPath = NULL;
+            file = CreateFile(piece.path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if(file == INVALID_HANDLE_VALUE)
+            {
+                LOG_DEBUG("[READAHEAD] failed to open \"%s\" (e=%d)", piece.path, GetLastError());
+                continue;
+            }
+            openPath = piece.path;
+        }
+
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset     = (DWORD)piece.offset;
+        overlapped.OffsetHigh = (DWORD)(piece.offset >> 32);
+        DWORD readLength;
+        if(ReadFile(file, buffer, piece.length, &readLength, &overlapped))
+        {
+            InterlockedExchangeAdd64(&bytesRead, readLength);
+        }
+    }
+}
+
+int ReadAheadInit(UINT threadCount, UINT minWindowSize, UINT maxWindowSize)
+{
+    InitializeCriticalSection(&queueCriticalSection);
+    InitializeConditionVariable(&queueNotEmpty);
+    minWindow = minWindowSize;
+    maxWindow = maxWindowSize;
+
+    for(UINT i = 0; i < threadCount; i++)
+    {
+        HANDLE thread = CreateThread(NULL, 0, &ReadAheadThread, NULL, 0, NULL);
+        if(thread == NULL)
+        {
+            LOG_ERROR("[READAHEAD] CreateThread failed (e=%d)", GetLastError());
+            return 1;
+        }
+        CloseHandle(thread);
+    }
+    readAheadThreads = threadCount;
+    LOG("[READAHEAD] %u threads, window %u to %u bytes", threadCount, minWindow, maxWindow);
+    return 0;
+}
+
+// Returns: the stream with read-ahead the read starts in, NULL if none
+static ReadAheadStream* FindPrefetched(ReadAheadStreams* streams, UINT64 offset)
+{
+    for(UINT i = 0; i < READ_AHEAD_STREAMS; i++)
+    {
+        ReadAheadStream* stream = &streams->streams[i];
+        if(stream->lastUse && offset >= stream->prefetchStart && offset < stream->readAheadEnd)
+        {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+// Returns: the stream the read continues, NULL if none
+static ReadAheadStream* FindSequential(ReadAheadStreams* streams, UINT64 offset)
+{
+    for(UINT i = 0; i < READ_AHEAD_STREAMS; i++)
+    {
+        ReadAheadStream* stream = &streams->streams[i];
+        if(stream->lastUse &&
+           offset + READ_AHEAD_REORDER >= stream->nextOffset &&
+           offset <= stream->nextOffset + READ_AHEAD_REORDER)
+        {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+// Returns: the stream whose read-ahead the read skipped past by less than
+//          its window, NULL if none
+static ReadAheadStream* FindSkipped(ReadAheadStreams* streams, UINT64 offset)
+{
+    for(UINT i = 0; i < READ_AHEAD_STREAMS; i++)
+    {
+        ReadAheadStream* stream = &streams->streams[i];
+        if(stream->lastUse && stream->window &&
+           offset >= stream->readAheadEnd && offset < stream->readAheadEnd + stream->window)
+        {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+// Returns: the stream that was used longest ago (or never)
+static ReadAheadStream* FindOldest(ReadAheadStreams* streams)
+{
+    ReadAheadStream* oldest = &streams->streams[0];
+    for(UINT i = 1; i < READ_AHEAD_STREAMS; i++)
+    {
+        ReadAheadStream* stream = &streams->streams[i];
+        if(useCounter - stream->lastUse > useCounter - oldest->lastUse)
+        {
+            oldest = stream;
+        }
+    }
+    return oldest;
+}
+
+static void ShrinkWindow(ReadAheadStream* stream)
+{
+    misses++;
+    stream->window /= 2;
+    if(stream->window < minWindow)
+    {
+        stream->window = 0;
+    }
+}
+
+void ReadAheadAccess(ReadAheadStreams* streams, const char* path, UINT64 fileSize, UINT64 offset, UINT count)
+{
+    UINT64 end = offset + count;
+    UINT now = GetTickCount();
+    useCounter++;
+    if(useCounter == 0)
+    {
+        useCounter = 1; // 0 marks a stream that isn't used
+    }
+
+    ReadAheadStream* stream = FindPrefetched(streams, offset);
+    if(stream)
+    {
+        if(now - stream->queueTime > READ_AHEAD_MAX_AGE)
+        {
+            ShrinkWindow(stream);
+        }
+        else
+        {
+            hits++;
+            stream->window = (stream->window > maxWindow / 2) ? maxWindow : stream->window * 2;
+        }
+    }
+    else if((stream = FindSequential(streams, offset)) != NULL)
+    {
+        if(stream->window == 0)
+        {
+            stream->window = minWindow;
+        }
+    }
+    else
+    {
+        stream = FindSkipped(streams, offset);
+        if(stream)
+        {
+            ShrinkWindow(stream);
+        }
+        else
+        {
+            streamsStarted++;
+            stream = FindOldest(streams);
+            stream->window = 0;
+        }
+        bytesWasted += stream->readAheadEnd - stream->prefetchStart;
+        stream->nextOffset    = end;
+        stream->prefetchStart = end;
+        stream->readAheadEnd  = end;
+    }
+    stream->lastUse = useCounter;
+    if(end > stream->nextOffset)
+    {
+        stream->nextOffset = end;
+    }
+    if(end > stream->prefetchStart)
+    {
+        stream->prefetchStart = end;
+    }
+    if(stream->readAheadEnd < stream->prefetchStart)
+    {
+        stream->readAheadEnd = stream->prefetchStart;
+    }
+
+    if(stream->window == 0)
+    {
+        return;
+    }
+    // Wait until half of the window has been read so pieces are queued in
+    // batches instead of a little after every READ
+    if(stream->readAheadEnd - stream->nextOffset >= stream->window / 2)
+    {
+        return;
+    }
+    UINT64 target = stream->nextOffset + stream->window;
+    if(target > fileSize)
+    {
+        target = fileSize;
+    }
+    if(stream->readAheadEnd >= target)
+    {
+        return;
+    }
+
+    UINT queued = 0;
+    EnterCriticalSection(&queueCriticalSection);
+    while(stream->readAheadEnd < target)
+    {
+        if(queueCount == READ_AHEAD_QUEUE_SIZE)
+        {
+            piecesSkipped++;
+            break;
+        }
+        UINT length = (target - stream->readAheadEnd > READ_AHEAD_IO_SIZE) ?
+            READ_AHEAD_IO_SIZE : (UINT)(target - stream->readAheadEnd);
+        ReadAheadPiece* piece = &queue[(queueHead + queueCount) % READ_AHEAD_QUEUE_SIZE];
+        piece->path   = path;
+        piece->offset = stream->readAheadEnd;
+        piece->length = length;
+        queueCount++;
+        queued++;
+        bytesQueued += length;
+        stream->readAheadEnd += length;
+    }
+    LeaveCriticalSection(&queueCriticalSection);
+    if(queued)
+    {
+        piecesQueued += queued;
+        stream->queueTime = now;
+        WakeAllConditionVariable(&queueNotEmpty);
+    }
+}
+
+UINT ReadAheadEncode(char* buffer, UINT maxLength)
+{
+    UINT length = 12 + 8 * 8;
+    if(length > maxLength)
+    {
+        return 0;
+    }
+    AppendUint  (buffer +  0, readAheadThreads ? minWindow : 0);
+    AppendUint  (buffer +  4, readAheadThreads ? maxWindow : 0);
+    AppendUint  (buffer +  8, readAheadThreads);
+    AppendUint64(buffer + 12, streamsStarted);
+    AppendUint64(buffer + 20, hits);
+    AppendUint64(buffer + 28, misses);
+    AppendUint64(buffer + 36, piecesQueued);
+    AppendUint64(buffer + 44, bytesQueued);
+    AppendUint64(buffer + 52, piecesSkipped);
+    AppendUint64(buffer + 60, (UINT64)bytesRead);
+    AppendUint64(buffer + 68, bytesWasted);
+    return length;
+}
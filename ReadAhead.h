@@ -0,0 +1,110 @@
+#pragma once
+
+//
+// Read-Ahead
+// --------------------------------------------------------
+// Clients read a large file as a run of READs no larger than their rsize,
+// and only keep a few of them in flight.  When the file isn't in the system
+// cache every one of those READs waits for the disk on its own, so a client
+// with a small rsize never gets near the bandwidth of the device.
+//
+// READ reports every read of a file to the file's streams.  A file has up
+// to READ_AHEAD_STREAMS of them, so several clients reading one file, or one
+// client reading several parts of it at once, are each followed.  The
+// window of a stream only grows when its read-ahead is used:
+//
+//   hit     the read starts in data the stream has read ahead and the client
+//           hasn't read yet, the window doubles up to ReadAheadMax
+//   aged    the read starts in data the stream read ahead, but the stream
+//           queued its last read-ahead more than READ_AHEAD_MAX_AGE ms ago,
+//           so the data has likely been evicted from the system cache
+//           unread, the window is halved (counted as a miss)
+//   next    the read starts within READ_AHEAD_REORDER bytes of where the
+//           stream's reads have reached (clients reorder their reads a
+//           little) but outside its read-ahead, a stream without a window
+//           starts reading ahead with ReadAheadMin, otherwise the window
+//           stays as it is
+//   miss    the read skips past the stream's read-ahead by less than its
+//           window, the stream stopped being sequential and the read-ahead
+//           it skipped is wasted, the window is halved
+//   new     any other read starts a new stream with no window, replacing
+//           the stream that was used longest ago, whose unread read-ahead
+//           is wasted
+//
+// A window halved below ReadAheadMin stops reading ahead until the stream
+// continues sequentially again.
+//
+// Once a stream has less than half of its window read ahead of the client,
+// the rest of the window is queued in READ_AHEAD_IO_SIZE pieces to the
+// ReadAheadThreads worker threads.  Windows has nothing like fadvise or
+// readahead, so a worker reads every piece with a ReadFile of its own handle
+// into a scratch buffer, which leaves the data in the system cache (and
+// several workers keep several reads in flight on the device).  The client's
+// READs, and the block cache misses behind them, then find it there.  The
+// queue holds READ_AHEAD_QUEUE_SIZE pieces, read-ahead that doesn't fit is
+// skipped.
+//
+// The stats are served by the READ_AHEAD procedure of the stats program,
+// which returns the min and max window and the worker threads (uints), then
+// streams started, hits, misses, pieces queued, bytes queued, pieces skipped
+// because the queue was full, bytes the workers have read and bytes read
+// ahead that no client read (uint64s).
+//
+// NOTE: ReadAheadAccess is only called from the select thread
+//
+
+// Application can override how many streams of one file are followed
+#ifndef READ_AHEAD_STREAMS
+#define READ_AHEAD_STREAMS 4
+#endif
+
+// Application can override how far a read can be from where a stream
+// reached and still continue it
+#ifndef READ_AHEAD_REORDER
+#define READ_AHEAD_REORDER (256*1024)
+#endif
+
+// Application can override how long (ms) data read ahead is expected to
+// stay in the system cache
+#ifndef READ_AHEAD_MAX_AGE
+#define READ_AHEAD_MAX_AGE 5000
+#endif
+
+// Application can override the size of a worker read, must be a buffer pool size
+#ifndef READ_AHEAD_IO_SIZE
+#define READ_AHEAD_IO_SIZE (1024*1024)
+#endif
+
+// Application can override how many pieces can wait for a worker
+#ifndef READ_AHEAD_QUEUE_SIZE
+#define READ_AHEAD_QUEUE_SIZE 256
+#endif
+
+struct ReadAheadStream
+{
+    UINT64 nextOffset;    // where the stream's reads have reached
+    UINT64 prefetchStart; // the read-ahead from here to readAheadEnd hasn't been read
+    UINT64 readAheadEnd;  // where the read-ahead queued for the stream ends
+    UINT window;          // 0 while the stream isn't reading ahead
+    UINT queueTime;       // tick count when read-ahead was last queued
+    UINT lastUse;
+};
+
+// Kept with every file READ has opened, zeroed when it is opened
+struct ReadAheadStreams
+{
+    ReadAheadStream streams[READ_AHEAD_STREAMS];
+};
+
+// Starts the worker threads
+// Note: BufferPoolInit must have been called
+// Returns: non-zero on error
+int ReadAheadInit(UINT threadCount, UINT minWindow, UINT maxWindow);
+
+// Follows a read of count bytes at offset and queues any read-ahead it needs
+// path: the file, it must stay valid for as long as the server runs
+void ReadAheadAccess(ReadAheadStreams* streams, const char* path, UINT64 fileSize, UINT64 offset, UINT count);
+
+// Writes the stats in the format of the READ_AHEAD procedure
+// Returns: the length written, 0 if they don't fit in maxLength
+UINT ReadAheadEncode(char* buffer, UINT maxLength);
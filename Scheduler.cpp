@@ -0,0 +1,478 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdlib.h>
+
+#include "Common.h"
+#include "Rpc.h"
+#include "Scheduler.h"
+
+struct SchedulerClient
+{
+    ULONG address;
+    UINT quantum;
+    UINT maxInFlight;
+    UINT connections;
+    volatile LONG inFlight;
+
+    // The client's queued calls of each class, and its place in the class's
+    // round robin while it has any
+    SchedulerEntry* heads[SCHED_CLASS_COUNT];
+    SchedulerEntry* tails[SCHED_CLASS_COUNT];
+    UINT deficits[SCHED_CLASS_COUNT];
+    bool visited[SCHED_CLASS_COUNT]; // the quantum was added for the current turn
+    SchedulerClient* nextActive[SCHED_CLASS_COUNT];
+
+    UINT64 calls;
+    UINT64 bytes;
+    UINT64 queued;
+    UINT64 pauses;
+
+    SchedulerClient* next;
+};
+
+struct SchedulerQueueState
+{
+    // The clients that have calls of the class queued, the front one is next
+    SchedulerClient* activeHead;
+    SchedulerClient* activeTail;
+    UINT weight;
+    UINT depth;
+    UINT maxDepth;
+    UINT64 calls;
+    UINT64 queued;
+    UINT64 starved;
+};
+
+static SchedulerQueueState queues[SCHED_CLASS_COUNT];
+static UINT queuedCount = 0;
+static DWORD schedulerMaxWait;
+static SchedulerDispatch schedulerDispatch;
+static SchedulerTimer schedulerTimer;
+static bool timerSet = false;
+static DWORD timerTickCount;
+static SchedulerClient* clients = NULL;
+static UINT clientCount = 0;
+
+static UINT overloadMaxQueued = 0;
+static DWORD overloadMaxDelay = 0;
+static bool overloaded = false;
+static bool standingQueue = false; // every call of the last interval waited past the max delay
+static DWORD intervalTickCount;
+static DWORD intervalMinDelay = INFINITE; // INFINITE until a call runs in the interval
+static UINT64 overloads = 0;
+static UINT64 rejected = 0;
+
+// Queued calls that were dropped instead of handled
+struct SchedulerDrops
+{
+    UINT64 calls;
+    UINT64 bytes; // what the calls cost
+};
+static SchedulerDrops drops[SCHED_DROP_COUNT];
+
+void SchedulerInit(const UINT weights[SCHED_CLASS_COUNT], DWORD maxWait, SchedulerDispatch dispatch, SchedulerTimer timer)
+{
+    for(UINT i = 0; i < SCHED_CLASS_COUNT; i++)
+    {
+        queues[i].weight = weights[i];
+    }
+    schedulerMaxWait = maxWait;
+    schedulerDispatch = dispatch;
+    schedulerTimer = timer;
+    LOG("[SCHED] weights metadata %u, directory %u, bulk %u, max wait %u ms",
+        weights[SCHED_CLASS_METADATA], weights[SCHED_CLASS_DIRECTORY], weights[SCHED_CLASS_BULK], maxWait);
+}
+
+void SchedulerSetOverload(UINT maxQueued, DWORD maxDelay)
+{
+    overloadMaxQueued = maxQueued;
+    overloadMaxDelay = maxDelay;
+    intervalTickCount = GetTickCount();
+    LOG("[SCHED] overloaded at %u queued calls or a queue delay of %u ms (0 is no limit)", maxQueued, maxDelay);
+}
+
+bool SchedulerAdmit()
+{
+    DWORD now = GetTickCount();
+    if(now - intervalTickCount >= SCHEDULER_OVERLOAD_INTERVAL)
+    {
+        standingQueue = overloadMaxDelay && intervalMinDelay != INFINITE && intervalMinDelay >= overloadMaxDelay;
+        intervalTickCount = now;
+        intervalMinDelay = INFINITE;
+    }
+    bool overloadedNow = standingQueue || (overloadMaxQueued && queuedCount >= overloadMaxQueued);
+    if(overloadedNow != overloaded)
+    {
+        overloaded = overloadedNow;
+        if(overloaded)
+        {
+            overloads++;
+            LOG_AT(SERVER, WARNING, "[SCHED] overloaded with %u calls queued, answering calls with JUKEBOX", queuedCount);
+        }
+        else
+        {
+            LOG("[SCHED] no longer overloaded, %llu calls answered with JUKEBOX so far", rejected);
+        }
+    }
+    if(overloaded)
+    {
+        rejected++;
+        return false;
+    }
+    return true;
+}
+
+// Records how long a call waited in its queue before it ran
+static void RecordDelay(DWORD delay)
+{
+    if(delay < intervalMinDelay)
+    {
+        intervalMinDelay = delay;
+    }
+}
+
+SchedulerClient* SchedulerClientAcquire(ULONG address, UINT quantum, UINT maxInFlight)
+{
+    SchedulerClient* client;
+    for(client = clients; client; client = client->next)
+    {
+        if(client->address == address)
+        {
+            break;
+        }
+    }
+    if(!client)
+    {
+        client = (SchedulerClient*)calloc(1, sizeof(SchedulerClient));
+        if(!client)
+        {
+            LOG_ERROR("[SCHED] out of memory for a client");
+            return NULL;
+        }
+        client->address = address;
+        client->next = clients;
+        clients = client;
+        clientCount++;
+    }
+    client->quantum = quantum;
+    client->maxInFlight = maxInFlight;
+    client->connections++;
+    return client;
+}
+
+void SchedulerClientRelease(SchedulerClient* client)
+{
+    client->connections--;
+}
+
+bool SchedulerClientOverLimit(SchedulerClient* client)
+{
+    return (UINT)client->inFlight >= client->maxInFlight;
+}
+
+void SchedulerClientPaused(SchedulerClient* client)
+{
+    client->pauses++;
+}
+
+UINT SchedulerClassify(UINT program, UINT procedure)
+{
+    if(program == RPC_PROGRAM_NFS)
+    {
+        switch(procedure)
+        {
+          case NFS3_PROC_READ:
+          case NFS3_PROC_WRITE:
+          case NFS3_PROC_COMMIT:
+            return SCHED_CLASS_BULK;
+          case NFS3_PROC_READDIR:
+          case NFS3_PROC_READDIRPLUS:
+            return SCHED_CLASS_DIRECTORY;
+        }
+    }
+    return SCHED_CLASS_METADATA;
+}
+
+bool SchedulerRunNow(SchedulerClient* client, UINT schedClass, UINT cost)
+{
+    queues[schedClass].calls++;
+    client->calls++;
+    client->bytes += cost;
+    InterlockedIncrement(&client->inFlight);
+    if(schedClass == SCHED_CLASS_METADATA && queuedCount == 0)
+    {
+        RecordDelay(0);
+        return true;
+    }
+    return false;
+}
+
+void SchedulerQueue(SchedulerEntry* entry, SchedulerClient* client, UINT schedClass, UINT cost, UINT xid)
+{
+    SchedulerQueueState* queue = &queues[schedClass];
+    entry->next = NULL;
+    entry->xid = xid;
+    entry->queueTickCount = GetTickCount();
+    entry->cost = cost;
+    if(client->tails[schedClass])
+    {
+        client->tails[schedClass]->next = entry;
+    }
+    else
+    {
+        // The client joins the back of the class's round robin
+        client->heads[schedClass] = entry;
+        client->nextActive[schedClass] = NULL;
+        if(queue->activeTail)
+        {
+            queue->activeTail->nextActive[schedClass] = client;
+        }
+        else
+        {
+            queue->activeHead = client;
+        }
+        queue->activeTail = client;
+    }
+    client->tails[schedClass] = entry;
+    client->queued++;
+    queue->queued++;
+    queue->depth++;
+    if(queue->depth > queue->maxDepth)
+    {
+        queue->maxDepth = queue->depth;
+    }
+    queuedCount++;
+}
+
+void SchedulerCallDone(SchedulerClient* client)
+{
+    InterlockedDecrement(&client->inFlight);
+}
+
+void SchedulerDrop(SchedulerEntry* entry, SchedulerClient* client, UINT reason)
+{
+    drops[reason].calls++;
+    drops[reason].bytes += entry->cost;
+    InterlockedDecrement(&client->inFlight);
+}
+
+void SchedulerSetTimer(DWORD millis)
+{
+    timerSet = true;
+    timerTickCount = GetTickCount() + millis;
+}
+
+DWORD SchedulerTimeout()
+{
+    if(queuedCount)
+    {
+        return 0;
+    }
+    if(timerSet)
+    {
+        DWORD diff = timerTickCount - GetTickCount();
+        return (diff >= 0x7FFFFFFF) ? 0 : diff;
+    }
+    return INFINITE;
+}
+
+// Takes the call after previous (the first call if previous is NULL) off
+// the client's queue of the class, the client leaves the round robin once it
+// has none left
+static SchedulerEntry* RemoveCall(SchedulerQueueState* queue, SchedulerClient* client, UINT schedClass,
+    SchedulerEntry* previousEntry)
+{
+    SchedulerEntry* entry;
+    if(previousEntry)
+    {
+        entry = previousEntry->next;
+        previousEntry->next = entry->next;
+    }
+    else
+    {
+        entry = client->heads[schedClass];
+        client->heads[schedClass] = entry->next;
+    }
+    if(client->tails[schedClass] == entry)
+    {
+        client->tails[schedClass] = previousEntry;
+    }
+    if(client->heads[schedClass] == NULL)
+    {
+        client->deficits[schedClass] = 0;
+        client->visited[schedClass] = false;
+        SchedulerClient* previous = NULL;
+        for(SchedulerClient* active = queue->activeHead; active != client; active = active->nextActive[schedClass])
+        {
+            previous = active;
+        }
+        if(previous)
+        {
+            previous->nextActive[schedClass] = client->nextActive[schedClass];
+        }
+        else
+        {
+            queue->activeHead = client->nextActive[schedClass];
+        }
+        if(queue->activeTail == client)
+        {
+            queue->activeTail = previous;
+        }
+    }
+    queue->depth--;
+    queuedCount--;
+    return entry;
+}
+
+SchedulerEntry* SchedulerTakeQueued(SchedulerClient* client, UINT schedClass, UINT xid)
+{
+    SchedulerEntry* previous = NULL;
+    for(SchedulerEntry* entry = client->heads[schedClass]; entry; entry = entry->next)
+    {
+        if(entry->xid == xid)
+        {
+            return RemoveCall(&queues[schedClass], client, schedClass, previous);
+        }
+        previous = entry;
+    }
+    return NULL;
+}
+
+// Returns: the next call of the class by deficit round robin
+// Note: the class must have a call queued
+static SchedulerEntry* NextCall(SchedulerQueueState* queue, UINT schedClass)
+{
+    while(1)
+    {
+        SchedulerClient* client = queue->activeHead;
+        if(!client->visited[schedClass])
+        {
+            client->deficits[schedClass] += client->quantum;
+            client->visited[schedClass] = true;
+        }
+        UINT cost = client->heads[schedClass]->cost;
+        if(cost <= client->deficits[schedClass])
+        {
+            client->deficits[schedClass] -= cost;
+            return RemoveCall(queue, client, schedClass, NULL);
+        }
+        // The client's turn is over
+        client->visited[schedClass] = false;
+        if(client != queue->activeTail)
+        {
+            queue->activeHead = client->nextActive[schedClass];
+            client->nextActive[schedClass] = NULL;
+            queue->activeTail->nextActive[schedClass] = client;
+            queue->activeTail = client;
+        }
+    }
+}
+
+void SchedulerRun(char* sharedBuffer)
+{
+    if(timerSet && (int)(GetTickCount() - timerTickCount) >= 0)
+    {
+        timerSet = false;
+        schedulerTimer();
+    }
+    if(queuedCount == 0)
+    {
+        return;
+    }
+
+    // The call that has waited longest in each class goes first if it has
+    // waited too long
+    DWORD now = GetTickCount();
+    for(UINT i = 0; i < SCHED_CLASS_COUNT; i++)
+    {
+        SchedulerQueueState* queue = &queues[i];
+        SchedulerClient* oldest = NULL;
+        for(SchedulerClient* client = queue->activeHead; client; client = client->nextActive[i])
+        {
+            if(!oldest || (int)(client->heads[i]->queueTickCount - oldest->heads[i]->queueTickCount) < 0)
+            {
+                oldest = client;
+            }
+        }
+        if(oldest && now - oldest->heads[i]->queueTickCount >= schedulerMaxWait)
+        {
+            queue->starved++;
+            SchedulerEntry* entry = RemoveCall(queue, oldest, i, NULL);
+            RecordDelay(now - entry->queueTickCount);
+            schedulerDispatch(entry, sharedBuffer);
+        }
+    }
+
+    for(UINT i = 0; i < SCHED_CLASS_COUNT; i++)
+    {
+        SchedulerQueueState* queue = &queues[i];
+        for(UINT count = 0; count < queue->weight && queue->activeHead; count++)
+        {
+            SchedulerEntry* entry = NextCall(queue, i);
+            RecordDelay(now - entry->queueTickCount);
+            schedulerDispatch(entry, sharedBuffer);
+        }
+    }
+}
+
+UINT SchedulerEncode(char* buffer, UINT maxLength)
+{
+    UINT length = 8 + SCHED_CLASS_COUNT * 36 + 28 + 4 + SCHED_DROP_COUNT * 16;
+    if(length > maxLength)
+    {
+        return 0;
+    }
+    AppendUint(buffer + 0, schedulerMaxWait);
+    AppendUint(buffer + 4, SCHED_CLASS_COUNT);
+    char* next = buffer + 8;
+    for(UINT i = 0; i < SCHED_CLASS_COUNT; i++)
+    {
+        SchedulerQueueState* queue = &queues[i];
+        AppendUint  (next +  0, queue->weight);
+        AppendUint  (next +  4, queue->depth);
+        AppendUint  (next +  8, queue->maxDepth);
+        AppendUint64(next + 12, queue->calls);
+        AppendUint64(next + 20, queue->queued);
+        AppendUint64(next + 28, queue->starved);
+        next += 36;
+    }
+    AppendUint  (next +  0, overloadMaxQueued);
+    AppendUint  (next +  4, overloadMaxDelay);
+    AppendUint  (next +  8, overloaded ? 1 : 0);
+    AppendUint64(next + 12, overloads);
+    AppendUint64(next + 20, rejected);
+    AppendUint  (next + 28, SCHED_DROP_COUNT);
+    next += 32;
+    for(UINT i = 0; i < SCHED_DROP_COUNT; i++)
+    {
+        AppendUint64(next + 0, drops[i].calls);
+        AppendUint64(next + 8, drops[i].bytes);
+        next += 16;
+    }
+    return length;
+}
+
+UINT SchedulerEncodeClients(char* buffer, UINT maxLength)
+{
+    UINT length = 4 + clientCount * 52;
+    if(length > maxLength)
+    {
+        return 0;
+    }
+    AppendUint(buffer, clientCount);
+    char* next = buffer + 4;
+    for(SchedulerClient* client = clients; client; client = client->next)
+    {
+        SET_UINT    (next +  0, client->address);
+        AppendUint  (next +  4, client->connections);
+        AppendUint  (next +  8, client->quantum);
+        AppendUint  (next + 12, client->maxInFlight);
+        AppendUint  (next + 16, (UINT)client->inFlight);
+        AppendUint64(next + 20, client->calls);
+        AppendUint64(next + 28, client->bytes);
+        AppendUint64(next + 36, client->queued);
+        AppendUint64(next + 44, client->pauses);
+        next += 52;
+    }
+    return length;
+}
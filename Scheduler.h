@@ -0,0 +1,187 @@
+#pragma once
+
+//
+// Call Scheduler
+// --------------------------------------------------------
+// Decoded calls aren't always handled in the order they arrive.  Every call
+// is put in a class by its procedure:
+//
+//   metadata   GETATTR, LOOKUP, ACCESS and anything else that isn't below
+//   directory  READDIR and READDIRPLUS
+//   bulk       READ, WRITE and COMMIT
+//
+// A metadata call that arrives while nothing is queued is handled right
+// away.  Every other call is queued in its class, and after the select
+// thread has handled the sockets select returned it runs one round of the
+// queues: up to the class's weight calls from each class, metadata first.
+// Select doesn't wait while calls are queued, so a GETATTR that arrives
+// behind a backlog of 1 MB READs waits for at most one round, not for the
+// whole backlog.
+//
+// Every class has a weight of at least 1 so every class runs in every
+// round.  On top of that a call at the head of a queue that has waited
+// longer than the max wait runs at the start of the next round, ahead of
+// the weighted order.
+//
+// Clients
+// --------------------------------------------------------
+// Calls are queued per client (an IPv4 address, for all of its
+// connections), and each class picks the client its next call comes from
+// by deficit round robin: a client at the front of the class's clients
+// gets its quantum of bytes added to its deficit, it runs calls while their
+// cost (the record, plus the data a READ asks for) fits in its deficit,
+// then it moves to the back.  So a client flooding the server with calls
+// gets its quantum per turn like everyone else instead of its backlog.
+//
+// Calls that have been decoded but not replied to (queued, or waiting for
+// a flush) are in flight.  A client that has its max in flight stops being
+// read from until some of its calls finish, so its backlog waits in its
+// socket buffers instead of the server.  A recv can hold any number of
+// calls, so the limit can be passed by the calls of one recv.
+//
+// Overload
+// --------------------------------------------------------
+// The server is overloaded while more than the max queued calls are queued,
+// or while there is a standing queue: every call that ran in the last
+// SCHEDULER_OVERLOAD_INTERVAL milliseconds waited in its queue for at least
+// the max delay (a burst drains within an interval, a standing queue
+// doesn't).  While it is overloaded new NFS calls that take real work are
+// answered right away with NFS3ERR_JUKEBOX, so clients back off and retry
+// instead of waiting in the socket buffers until they time out and
+// retransmit on top of the load.  NULL, calls of the other programs and
+// GETATTR of a handle whose attributes are cached are still handled.
+//
+// Wasted Work
+// --------------------------------------------------------
+// A call that waited in its queue for longer than the client's retransmit
+// timeout has already been sent again, so handling it is wasted work.  The
+// server drops a queued call instead of handling it when
+//
+//   stale       it was received longer ago than CallDeadline
+//   superseded  the client sent a call with the same xid while it was queued
+//               (the call that is queued last is handled)
+//   closed      its connection closed while it was queued
+//
+// Dropped calls aren't replied to.
+//
+// The scheduler also keeps one timer for work the select thread has to do
+// after a delay (writing out gathered writes), it runs before the round.
+//
+// The stats are served by the stats program:
+//   SCHEDULER returns the max wait in milliseconds and the class count
+//             (uints), then for each class its weight, the calls queued now
+//             and the most that were ever queued (uints), then the calls of
+//             the class, the calls that were queued and the calls that ran
+//             for waiting past the max wait (uint64s), then the max
+//             queued calls, the max delay in milliseconds and 1 if the
+//             server is overloaded now (uints), then the times it became
+//             overloaded and the calls answered with JUKEBOX (uint64s),
+//             then the drop reason count (uint) and for each reason the
+//             calls dropped and the bytes they cost (uint64s)
+//   CLIENTS   returns the client count, then for each client its address
+//             (in network order), open connections, quantum, max in flight
+//             and calls in flight (uints), then its calls, the bytes they
+//             cost, the calls that were queued and the times its
+//             connections were paused for having too many calls in flight
+//             (uint64s)
+//
+// NOTE: only called from the select thread, except SchedulerCallDone
+//
+
+#define SCHED_CLASS_METADATA  0
+#define SCHED_CLASS_DIRECTORY 1
+#define SCHED_CLASS_BULK      2
+#define SCHED_CLASS_COUNT     3
+
+#define SCHED_DROP_STALE      0
+#define SCHED_DROP_SUPERSEDED 1
+#define SCHED_DROP_CLOSED     2
+#define SCHED_DROP_COUNT      3
+
+// Application can override how long the queue delay is watched before the
+// server is overloaded (or no longer is)
+#ifndef SCHEDULER_OVERLOAD_INTERVAL
+#define SCHEDULER_OVERLOAD_INTERVAL 100
+#endif
+
+// Must be the first member of whatever is queued
+struct SchedulerEntry
+{
+    SchedulerEntry* next;
+    DWORD queueTickCount;
+    UINT cost;
+    UINT xid;
+};
+
+struct SchedulerClient;
+
+// Handles a queued call, the entry isn't touched by the scheduler again
+typedef void (*SchedulerDispatch)(SchedulerEntry* entry, char* sharedBuffer);
+typedef void (*SchedulerTimer)();
+
+// weights: calls of each class in one round, at least 1
+// maxWait: milliseconds a call can wait at the head of its queue before it
+//          runs ahead of the weighted order
+void SchedulerInit(const UINT weights[SCHED_CLASS_COUNT], DWORD maxWait, SchedulerDispatch dispatch, SchedulerTimer timer);
+
+// maxQueued: queued calls that overload the server, 0 for no limit
+// maxDelay: milliseconds calls have to wait for an interval to overload the
+//           server, 0 for no limit
+void SchedulerSetOverload(UINT maxQueued, DWORD maxDelay);
+
+// Returns: false if the server is overloaded, the call should be answered
+//          with NFS3ERR_JUKEBOX
+bool SchedulerAdmit();
+
+// Adds a connection to the client with address, creating the client the
+// first time it connects (clients and their counters are never freed)
+// address: IPv4 in network order
+// quantum: bytes of calls the client gets every turn, at least 1
+// maxInFlight: calls the client can have in flight, at least 1
+// Returns: the client, NULL if out of memory
+SchedulerClient* SchedulerClientAcquire(ULONG address, UINT quantum, UINT maxInFlight);
+// Removes a connection from the client
+void SchedulerClientRelease(SchedulerClient* client);
+
+// Returns: true if the client has its max calls in flight
+bool SchedulerClientOverLimit(SchedulerClient* client);
+// Counts that one of the client's connections stopped being read from
+void SchedulerClientPaused(SchedulerClient* client);
+
+// Returns: the class of a call
+UINT SchedulerClassify(UINT program, UINT procedure);
+
+// Counts a call of schedClass, the call is in flight until SchedulerCallDone
+// Returns: true if the call should be handled right away, false if it
+//          should be queued
+bool SchedulerRunNow(SchedulerClient* client, UINT schedClass, UINT cost);
+
+void SchedulerQueue(SchedulerEntry* entry, SchedulerClient* client, UINT schedClass, UINT cost, UINT xid);
+
+// Returns: the client's queued call of schedClass with xid, taken off its
+//          queue, NULL if there is none
+SchedulerEntry* SchedulerTakeQueued(SchedulerClient* client, UINT schedClass, UINT xid);
+
+// Counts a call that was taken off its queue and isn't handled, instead of
+// SchedulerCallDone
+// reason: SCHED_DROP_
+void SchedulerDrop(SchedulerEntry* entry, SchedulerClient* client, UINT reason);
+
+// Called once the call's reply is sent, from any thread
+void SchedulerCallDone(SchedulerClient* client);
+
+// Calls the timer callback once millis have passed, replaces any timer
+// that is already set
+void SchedulerSetTimer(DWORD millis);
+
+// Returns: the milliseconds until the scheduler has work to do, 0 if calls
+//          are queued, INFINITE if there is nothing to do
+DWORD SchedulerTimeout();
+
+// Runs the timer if it is due, then one round of the queues
+void SchedulerRun(char* sharedBuffer);
+
+// Write the stats in the format of the SCHEDULER and CLIENTS procedures
+// Returns: the length written, 0 if they don't fit in maxLength
+UINT SchedulerEncode(char* buffer, UINT maxLength);
+UINT SchedulerEncodeClients(char* buffer, UINT maxLength);
@@ -1,7 +1,9 @@
 #include <winsock2.h>
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "SelectServer.h"
 
@@ -24,26 +26,192 @@ class ScopedCriticalSectionLock
 // Assumption: sock->s       != INVALID_SOCKET
 // Assumption: sock->handler != NULL
 // Assumption: sock->flags   != 0 || sock->timeout != SelectSock::INF
-// Returns: non-zero if thread is full
+// Returns: non-zero if thread is full (or out of memory)
 BOOL SynchronizedSelectServer::TryAddSock(const SelectSock& sock)
 {
     if(server->socksReserved >= SELECT_THREAD_CAPACITY) {
         return TRUE; // server is full
     }
-    server->socks[server->socksReserved] = sock;
+    if(server->pendingCount == server->pendingCapacity) {
+        u_int capacity = server->pendingCapacity ? 2 * server->pendingCapacity : 16;
+        SelectSock* pending = (SelectSock*)realloc(server->pending, capacity * sizeof(SelectSock));
+        if(!pending) {
+            SELECT_SERVER_LOG("Error: out of memory for %u pending sockets", capacity);
+            return TRUE;
+        }
+        server->pending = pending;
+        server->pendingCapacity = capacity;
+    }
+    server->pending[server->pendingCount++] = sock;
     server->socksReserved++;
     return FALSE; // server is no full
 }
 
+SelectServer::~SelectServer()
+{
+    free(pending);
+    free(sockets);
+    free(sockFlags);
+    free(timeouts);
+    free(deadlines);
+    free(cold);
+    free(handled);
+    free(removals);
+    free(sets[0]);
+    free(sets[1]);
+    free(sets[2]);
+    DeleteCriticalSection(&criticalSection);
+}
+
+// Moves count elements to a new array of capacity elements
+// Returns: non-zero if out of memory (the old array is kept)
+template<typename T>
+static BOOL GrowArray(T** array, u_int count, u_int capacity)
+{
+    T* newArray = (T*)malloc(capacity * sizeof(T));
+    if(!newArray) {
+        return TRUE;
+    }
+    memcpy(newArray, *array, count * sizeof(T));
+    free(*array);
+    *array = newArray;
+    return FALSE;
+}
+
+BOOL SelectServer::Grow(u_int capacity)
+{
+    SELECT_SERVER_LOG("growing from %u to %u sockets", sockCapacity, capacity);
+    if(GrowArray(&sockets , sockCount, capacity) ||
+       GrowArray(&sockFlags, sockCount, capacity) ||
+       GrowArray(&timeouts , sockCount, capacity) ||
+       GrowArray(&deadlines, sockCount, capacity) ||
+       GrowArray(&cold     , sockCount, capacity) ||
+       GrowArray(&handled  , sockCount, capacity) ||
+       GrowArray(&removals , removalCount, capacity)) {
+        return TRUE;
+    }
+    for(u_int i = 0; i < 3; i++) {
+        SockSet* set = (SockSet*)malloc(offsetof(SockSet, array) + capacity * sizeof(SOCKET));
+        if(!set) {
+            return TRUE;
+        }
+        free(sets[i]);
+        sets[i] = set;
+    }
+    sockCapacity = capacity;
+    return FALSE;
+}
+
+void SelectServer::AddPending()
+{
+    if(sockCount + pendingCount > sockCapacity) {
+        u_int capacity = sockCapacity ? sockCapacity : SELECT_THREAD_INITIAL_CAPACITY;
+        while(capacity < sockCount + pendingCount) {
+            capacity *= 2;
+        }
+        if(Grow(capacity)) {
+            // Leave them pending, they are added once memory frees up
+            SELECT_SERVER_LOG("Error: out of memory growing to %u sockets", capacity);
+            return;
+        }
+    }
+    SELECT_SERVER_LOG("Adding %d sockets (%d sockets total)", pendingCount, sockCount + pendingCount);
+    SELECT_SERVER_SOCKS_CHANGED(pendingCount, 0);
+    DWORD now = GetTickCount();
+    for(u_int i = 0; i < pendingCount; i++) {
+        const SelectSock& sock = pending[i];
+        sockets  [sockCount]         = sock.so;
+        sockFlags[sockCount]         = sock.flags;
+        timeouts [sockCount]         = sock.timeout;
+        cold     [sockCount].handler = sock.handler;
+        cold     [sockCount].user    = sock.user;
+        // setup the deadline if there is a timeout
+        if(sock.timeout != SelectSock::INF) {
+            deadlines[sockCount] = now + sock.timeout;
+            SELECT_SERVER_LOG("[SelectThreadTimeout] s=%d timeout=%d millis time=%d",
+                              sock.so, sock.timeout, deadlines[sockCount]);
+        }
+        SELECT_SERVER_LOG("added socket (s=%d)", sock.so);
+        sockCount++;
+    }
+    pendingCount = 0;
+}
+
+// Set in handled for a socket that is in removals
+#define HANDLED_REMOVE 0x80
+
+void SelectServer::RemoveSocks()
+{
+    u_int removed = 0;
+    for(u_int r = 0; r < removalCount; r++) {
+        u_int index = removals[r];
+        // Drop removed sockets off the end first so the one moved into index is kept
+        while(index < sockCount && (handled[sockCount - 1] & HANDLED_REMOVE)) {
+            SELECT_SERVER_LOG("removing socket (s=%d)", sockets[sockCount - 1]);
+            sockCount--;
+            removed++;
+        }
+        if(index >= sockCount) {
+            continue; // it was at the end
+        }
+        SELECT_SERVER_LOG("removing socket (s=%d)", sockets[index]);
+        u_int last = sockCount - 1;
+        sockets  [index] = sockets  [last];
+        sockFlags[index] = sockFlags[last];
+        timeouts [index] = timeouts [last];
+        deadlines[index] = deadlines[last];
+        cold     [index] = cold     [last];
+        handled  [index] = handled  [last];
+        sockCount--;
+        removed++;
+    }
+    SELECT_SERVER_LOG("Removed %d sockets (%d sockets total)", removed, sockCount);
+    SELECT_SERVER_SOCKS_CHANGED(0, removed);
+    socksReserved -= removed;
+    removalCount = 0;
+}
+
+void SelectServer::CallHandler(u_int index, PopReason reason, char* sharedBuffer)
+{
+    SelectSock sock;
+    sock.so               = sockets[index];
+    sock.user             = cold[index].user;
+    sock.handler          = cold[index].handler;
+    sock.timeout          = timeouts[index];
+    sock.timeoutTickCount = deadlines[index];
+    sock.flags            = (SelectSock::Flags)sockFlags[index];
+
+    //_tprintf(TEXT("Calling handler %p for s = %d..."), sock.handler, sock.so);
+    SELECT_SERVER_HANDLER_BEGIN(&sock);
+    sock.handler(SynchronizedSelectServer(this), &sock, reason, sharedBuffer);
+    SELECT_SERVER_HANDLER_END();
+
+    cold[index].user    = sock.user;
+    cold[index].handler = sock.handler;
+    timeouts[index]     = sock.timeout;
+    sockFlags[index]    = sock.flags;
+
+    if(sock.timeout != SelectSock::INF) {
+        // Check for any timeout
+        deadlines[index] = GetTickCount() + sock.timeout;
+        SELECT_SERVER_LOG("[SelectThreadTimeout] s=%d timeout=%d millis time=%d",
+                          sock.so, sock.timeout, deadlines[index]);
+    } else if((sock.flags & SelectSock::ALL) == 0 && (handled[index] & HANDLED_REMOVE) == 0) {
+        // Remove it before the next select
+        handled[index] |= HANDLED_REMOVE;
+        removals[removalCount++] = index;
+    }
+}
+
 // Returns: index on success, count on error
 // hint: contains the guess of where the next socket will be
-static u_int Find(u_int count, const SelectSock socks[], SOCKET so, u_int* outHint)
+static u_int Find(u_int count, const SOCKET sockets[], SOCKET so, u_int* outHint)
 {
     u_int initialHint = *outHint;
     u_int i;
 
     for(i = initialHint; i < count; i++) {
-        if(so == socks[i].so) {
+        if(so == sockets[i]) {
             *outHint = i + 1; // increment for next time
             return i;
         }
@@ -56,7 +224,7 @@ static u_int Find(u_int count, const SelectSock socks[], SOCKET so, u_int* outHi
     // a better mechanism to find the sockets.
 
     for(i = 0; i < initialHint; i++) {
-        if(so == socks[i].so) {
+        if(so == sockets[i]) {
             *outHint = i + 1; // increment for next time
             return i;
         }
@@ -96,19 +264,19 @@ SetProperties setProps[3] = {
     {"error", POP_REASON_ERROR, SelectSock::ERROR_, CALLED_ERROR_HANDLER        },// error set
 };
 
-unsigned sprintsets(char* buffer, const SockSet sets[])
+unsigned sprintsets(char* buffer, SockSet* const sets[])
 {
     unsigned off = 0;
 
     for(BYTE setIndex = 0; setIndex < 3; setIndex++) {
-        if(sets[setIndex].count > 0) {
+        if(sets[setIndex]->count > 0) {
             u_int sockIndex;
             off += sprintf(buffer + off, " %s=", setProps[setIndex].name);
-            for(sockIndex = 0; sockIndex < sets[setIndex].count; sockIndex++) {
+            for(sockIndex = 0; sockIndex < sets[setIndex]->count; sockIndex++) {
                 if(sockIndex > 0) {
                     buffer[off++] = ',';
                 }
-                off += sprintf(buffer + off, "%d", sets[setIndex].array[sockIndex]);
+                off += sprintf(buffer + off, "%d", sets[setIndex]->array[sockIndex]);
             }
         }
     }
@@ -118,28 +286,6 @@ unsigned sprintsets(char* buffer, const SockSet sets[])
 
 DWORD SelectServer::Run(char* sharedBuffer, size_t sharedBufferSize)
 {
-    u_int activeSockCount = 0;
-    SockSet sets[3];
-
-    // Tracks whether or not a socket was already handled after a select call
-    // We could include this as a field in the private data, but I don't do this
-    // because this data needs to be "zeroed" in every iteration of select, so
-    // in order to use the ZeroMemory function I include it an it's own array.
-    BYTE handled[SELECT_THREAD_CAPACITY];
-
-    // socks is used so much, I'm explicitly caching the pointer to it on the
-    // stack, this is also shadowing the member variable socks so
-    // it will default to the pointer on the stack
-    SelectSock* socks = this->socks;
-
-    // Used to know whether there are any sockets to remove
-    // without having to traverse the whole list of sockets.
-    // Also allows the algorithm to know where to start packing sockets
-    // without having to check all the previous sockets
-    // TODO: rename minSockToRemove to removeStartIndex
-    u_int minSockToRemove = SELECT_THREAD_CAPACITY;
-
-
     while(1)
     {
         //
@@ -148,69 +294,33 @@ DWORD SelectServer::Run(char* sharedBuffer, size_t sharedBufferSize)
         {
             ScopedCriticalSectionLock lock(&criticalSection);
 
-            // Add any new reserved sockets
-            if(socksReserved > activeSockCount)
+            // Remove sockets that have no flags and an infinite timeout.  This
+            // happens before adding so the removed sockets' indexes are still valid.
+            if(removalCount)
             {
-                SELECT_SERVER_LOG("Adding %d sockets (%d sockets total)",
-                                  socksReserved - activeSockCount, socksReserved);
-                do
-                {
-                    // setup timeoutTickCount if there is a timeout
-                    if(socks[activeSockCount].timeout != SelectSock::INF)
-                    {
-                        socks[activeSockCount].timeoutTickCount = GetTickCount() + socks[activeSockCount].timeout;
-                        SELECT_SERVER_LOG("[SelectThreadTimeout] s=%d timeout=%d millis time=%d",
-                                          socks[activeSockCount].so, socks[activeSockCount].timeout, socks[activeSockCount].timeoutTickCount);
-                    }
-                    SELECT_SERVER_LOG("added socket (s=%d)", socks[activeSockCount].so);
-
-                    activeSockCount++;
-                } while(activeSockCount < socksReserved);
+                RemoveSocks();
             }
 
-            // Remove sockets that have no flags and an infinite timeout, then pack the rest
-            if(minSockToRemove != SELECT_THREAD_CAPACITY)
+            // Add any new reserved sockets
+            if(pendingCount)
             {
-                u_int packFrom;
-
-                SELECT_SERVER_LOG("removing socket (s=%d)", socks[minSockToRemove].so);
-
-                for(packFrom = minSockToRemove + 1; packFrom < activeSockCount; packFrom++)
-                {
-                    if((socks[packFrom].flags & SelectSock::ALL) == 0 && socks[packFrom].timeout == SelectSock::INF)
-                    {
-                        SELECT_SERVER_LOG("removing socket (s=%d)", socks[packFrom].so);
-                        // remove it by skipping it
-                        // TODO: maybe there should be a CloseOnRemoval option for this server?
-                        // shutdown and close?
-                    }
-                    else
-                    {
-                        socks [minSockToRemove] = socks [packFrom];
-                        //psocks[minSockToRemove] = psocks[packFrom];
-                        minSockToRemove++;
-                    }
-                }
-                SELECT_SERVER_LOG("Removed %d sockets (%d sockets total)", activeSockCount - minSockToRemove, minSockToRemove);
-                activeSockCount = minSockToRemove;
-                socksReserved = minSockToRemove;
-
-                minSockToRemove = SELECT_THREAD_CAPACITY; // means no more socks to remove
+                AddPending();
             }
+
             if(flags & STOP_FLAG)
             {
                 // TODO: Closing sockets on shutdown should be an option
                 /*
-                for(u_int i = 0; i < activeSockCount; i++) {
-                    shutdown(socks[i].so, SD_BOTH);
-                    closesocket(socks[i].so);
+                for(u_int i = 0; i < sockCount; i++) {
+                    shutdown(sockets[i], SD_BOTH);
+                    closesocket(sockets[i]);
                 }
                 */
                 break;
             }
         } // End of critical section lock
 
-        if(activeSockCount == 0)
+        if(sockCount == 0)
         {
             SELECT_SERVER_LOG("no more sockets");
             break;
@@ -218,53 +328,55 @@ DWORD SelectServer::Run(char* sharedBuffer, size_t sharedBufferSize)
 
         //
         // Setup select call, add sockets to sets and get minimum timeout
+        // Note: only the hot arrays are touched here
         //
-        sets[0].count = 0;
-        sets[1].count = 0;
-        sets[2].count = 0;
+        sets[0]->count = 0;
+        sets[1]->count = 0;
+        sets[2]->count = 0;
 
         DWORD minTimeDiff = 0xFFFFFFFF;
 
         {
             DWORD now;
-            for(u_int i = 0; i < activeSockCount; i++)
+            for(u_int i = 0; i < sockCount; i++)
             {
-                //_tprintf(TEXT("[%d] s = %d"), i, socks[i]);
-                if(socks[i].flags & SelectSock::READ)
+                //_tprintf(TEXT("[%d] s = %d"), i, sockets[i]);
+                BYTE sockFlag = sockFlags[i];
+                if(sockFlag & SelectSock::READ)
                 {
-                    sets[0].Add(socks[i].so);
+                    sets[0]->Add(sockets[i]);
                 }
-                if(socks[i].flags & SelectSock::WRITE)
+                if(sockFlag & SelectSock::WRITE)
                 {
-                    sets[1].Add(socks[i].so);
+                    sets[1]->Add(sockets[i]);
                 }
-                if(socks[i].flags & SelectSock::ERROR_)
+                if(sockFlag & SelectSock::ERROR_)
                 {
-                    sets[2].Add(socks[i].so);
+                    sets[2]->Add(sockets[i]);
                 }
-                if(socks[i].timeout != SelectSock::INF)
+                if(timeouts[i] != SelectSock::INF)
                 {
                     if(minTimeDiff == 0xFFFFFFFF)
                     {
                         // Case: the first socket with a timeout in this loop
                         now = GetTickCount();
 
-                        minTimeDiff = socks[i].timeoutTickCount - now;
+                        minTimeDiff = deadlines[i] - now;
                         if(minTimeDiff >= 0x7FFFFFFF) {
                             minTimeDiff = 0;
                         }
                         SELECT_SERVER_LOG("[SelectThreadTimeout] s=%d timediff=%d millis (time=%d,now=%d)",
-                                          socks[i].so, minTimeDiff, socks[i].timeoutTickCount, now);
+                                          sockets[i], minTimeDiff, deadlines[i], now);
                     }
                     else
                     {
                         // Case: NOTE the first socket with a timeout in this loop
-                        DWORD diff = socks[i].timeoutTickCount - now;
+                        DWORD diff = deadlines[i] - now;
                         if(diff >= 0x7FFFFFFF) {
                             diff = 0;
                         }
                         SELECT_SERVER_LOG("[SelectThreadTimeout] s=%d timediff=%d millis (time=%d,now=%d)",
-                                          socks[i].so, diff, socks[i].timeoutTickCount, now);
+                                          sockets[i], diff, deadlines[i], now);
                         if(diff < minTimeDiff) {
                             minTimeDiff = diff;
                         }
@@ -273,6 +385,13 @@ DWORD SelectServer::Run(char* sharedBuffer, size_t sharedBufferSize)
             }
         }
 
+        {
+            DWORD workTimeout = SELECT_SERVER_WORK_TIMEOUT();
+            if(workTimeout < minTimeDiff) {
+                minTimeDiff = workTimeout;
+            }
+        }
+
         // Setup the timeout
         struct timeval timeout;
         if(minTimeDiff != 0xFFFFFFFF)
@@ -301,17 +420,23 @@ DWORD SelectServer::Run(char* sharedBuffer, size_t sharedBufferSize)
             SELECT_SERVER_LOG("%s", sharedBuffer);
         }
 #endif
-        //_tprintf(TEXT("%s select(read=%d,write=%d,err=%d)..."), thread->logID, sets[0].count, sets[1].count, sets[2].count);
-
-        int selectCount = select(0, (fd_set*)&sets[0], (fd_set*)&sets[1], (fd_set*)&sets[2],
+        //_tprintf(TEXT("%s select(read=%d,write=%d,err=%d)..."), thread->logID, sets[0]->count, sets[1]->count, sets[2]->count);
+
+        // select needs at least one set
+        fd_set* readSet  = (fd_set*)sets[0];
+        fd_set* writeSet = (fd_set*)sets[1];
+        fd_set* errorSet = (fd_set*)sets[2];
+        SELECT_SERVER_SELECT_BEGIN();
+        int selectCount = select(0, readSet, writeSet, errorSet,
                              (minTimeDiff == 0xFFFFFFFF) ? NULL : &timeout);
+        SELECT_SERVER_SELECT_END(selectCount);
         if(selectCount < 0)
         {
             SELECT_SERVER_LOG("Error: select failed (e=%d), stopping thread", GetLastError());
             return 1; // fail
         }
 
-        ZeroMemory(handled, sizeof(handled[0]) * activeSockCount);
+        ZeroMemory(handled, sizeof(handled[0]) * sockCount);
 
         //
         // Handle Popped Sockets
@@ -332,18 +457,20 @@ DWORD SelectServer::Run(char* sharedBuffer, size_t sharedBufferSize)
             {
                 // The hint keeps track of where the last popped socket was found,
                 // it used to determine where to start searching for the next socket.
-                // If select keeps the sockets in order, then the hint will find the sockets
-                // in the most efficient way possible.
+                // The sets are built in registry order and select keeps them in order,
+                // so the hint finds every socket in the most efficient way possible.
+                // Sockets are only removed after all the handlers are called, so their
+                // indexes don't change while the sets are handled.
                 u_int hint = 0;
 
-                for(u_int i = 0; i < sets[setIndex].count; i++)
+                for(u_int i = 0; i < sets[setIndex]->count; i++)
                 {
-                    SOCKET so = sets[setIndex].array[i];
+                    SOCKET so = sets[setIndex]->array[i];
 
                     //_tprintf(TEXT("searching for s = %d (index = %d)..."), s, i);
-                    u_int sockIndex = Find(activeSockCount, socks, so, &hint);
+                    u_int sockIndex = Find(sockCount, sockets, so, &hint);
 
-                    if(sockIndex == activeSockCount)
+                    if(sockIndex == sockCount)
                     {
                         //
                         // This is probably a code bug, in either the application or the
@@ -354,38 +481,21 @@ DWORD SelectServer::Run(char* sharedBuffer, size_t sharedBufferSize)
                         continue;
                     }
 
-                    //
-                    // NOTE: this code is pretty much an exact copy of the handler code in the timeout section
-                    //
-                    if(handled[sockIndex] > setProps[setIndex].handled)
+                    if((handled[sockIndex] & ~HANDLED_REMOVE) > setProps[setIndex].handled)
                     {
                         // Socket already handled for this select iteration
                         continue;
                     }
 
-                    if((socks[sockIndex].flags & setProps[setIndex].setFlag) == 0)
+                    if((sockFlags[sockIndex] & setProps[setIndex].setFlag) == 0)
                     {
                         // This could happen if another handler was called on this select
                         // iteration and removed the select flag on the socket for this set
                         continue;
                     }
 
-                    //_tprintf(TEXT("Calling handler %p for s = %d..."), socks[sockIndex].handler, s);
-                    socks[sockIndex].handler(SynchronizedSelectServer(this), &socks[sockIndex], setProps[setIndex].reason, sharedBuffer);
-                    handled[sockIndex] = setProps[setIndex].handled;
-
-                    if(socks[sockIndex].timeout != SelectSock::INF) {
-                        // Check for any timeout
-                        socks[sockIndex].timeoutTickCount = GetTickCount() + socks[sockIndex].timeout;
-                        SELECT_SERVER_LOG("[SelectThreadTimeout] s=%d timeout=%d millis time=%d",
-                                          socks[sockIndex].so, socks[sockIndex].timeout, socks[sockIndex].timeoutTickCount);
-                    } else if( (socks[sockIndex].flags & SelectSock::ALL) == 0) {
-                        // Set remove socket index so we know there are sockets to remove
-                        if(sockIndex < minSockToRemove) {
-                            // Set the minimum index to remove to assist the removal algorithm
-                            minSockToRemove = sockIndex;
-                        }
-                    }
+                    handled[sockIndex] = (handled[sockIndex] & HANDLED_REMOVE) | setProps[setIndex].handled;
+                    CallHandler(sockIndex, setProps[setIndex].reason, sharedBuffer);
                 }
 
                 if(setIndex == 0)
@@ -400,52 +510,34 @@ DWORD SelectServer::Run(char* sharedBuffer, size_t sharedBufferSize)
         //
         if(minTimeDiff != 0xFFFFFFFF)
         {
-            DWORD diff;
             DWORD now = GetTickCount();
 
-            for(u_int sockIndex = 0; sockIndex < activeSockCount; sockIndex++)
+            for(u_int sockIndex = 0; sockIndex < sockCount; sockIndex++)
             {
-                if(socks[sockIndex].timeout != SelectSock::INF)
+                if(timeouts[sockIndex] != SelectSock::INF)
                 {
                     // check if the timeout has been reached
                     {
-                        DWORD diff = socks[sockIndex].timeoutTickCount - now;
+                        DWORD diff = deadlines[sockIndex] - now;
                         if(diff < 0x7FFFFFFF) {
-                            SELECT_SERVER_LOG("[SelectThreadTimeout] s=%d still has %d milliseconds before timeout", socks[sockIndex].so, diff);
+                            SELECT_SERVER_LOG("[SelectThreadTimeout] s=%d still has %d milliseconds before timeout", sockets[sockIndex], diff);
                             continue;
-                        }   
+                        }
                     }
 
-                    //
-                    // NOTE: this code is pretty much an exact copy of the handler code in the popped sets section
-                    //
                     if(handled[sockIndex]) {
                         // Socket already handled for this select iteration
                         continue;
                     }
 
-                    //_tprintf(TEXT("Calling handler %p for s = %d..."), socks[sockIndex].handler, s);
-                    socks[sockIndex].handler(this, &socks[sockIndex], POP_REASON_TIMEOUT, sharedBuffer);
-
                     // We don't need to mark it as handled because there are no more handler calls
-                    //handled[sockIndex] = setProps[setIndex].handled;
-
-                    if(socks[sockIndex].timeout != SelectSock::INF) {
-                        // Check for any timeout
-                        socks[sockIndex].timeoutTickCount = GetTickCount() + socks[sockIndex].timeout;
-                        SELECT_SERVER_LOG("[SelectThreadTimeout] s=%d timeout=%d millis time=%d",
-                                          socks[sockIndex].so, socks[sockIndex].timeout, socks[sockIndex].timeoutTickCount);
-                    } else if( (socks[sockIndex].flags & SelectSock::ALL) == 0) {
-                        // Set remove socket index so we know there are sockets to remove
-                        if(sockIndex < minSockToRemove) {
-                            // Set the minimum index to remove to assist the removal algorithm
-                            minSockToRemove = sockIndex;
-                        }
-                    }
+                    CallHandler(sockIndex, POP_REASON_TIMEOUT, sharedBuffer);
                 }
             }
         }
 
+        SELECT_SERVER_DO_WORK(sharedBuffer);
+
     } // end of while loop
 
     return 0;
@@ -2,9 +2,16 @@
 
 #include <SelectServerParams.h>
 
-// Application can override the socket capacity for a single thread
+// Application can override the most sockets a single thread will handle,
+// the thread only allocates room for the sockets it has
 #ifndef SELECT_THREAD_CAPACITY
-#define SELECT_THREAD_CAPACITY 64
+#define SELECT_THREAD_CAPACITY (1024*1024)
+#endif
+
+// Application can override how many sockets a thread has room for before
+// it first grows
+#ifndef SELECT_THREAD_INITIAL_CAPACITY
+#define SELECT_THREAD_INITIAL_CAPACITY 64
 #endif
 
 // Application can define this to enable verbose logging
@@ -15,10 +22,43 @@
 #define SELECT_SERVER_LOG(fmt, ...)
 #endif
 
+// Application can define their own instrumentation callbacks, they are called
+// from the select thread around every select call, every handler call, and
+// when sockets are added or removed
+#ifndef SELECT_SERVER_SELECT_BEGIN
+#define SELECT_SERVER_SELECT_BEGIN()
+#endif
+#ifndef SELECT_SERVER_SELECT_END
+#define SELECT_SERVER_SELECT_END(readyCount)
+#endif
+#ifndef SELECT_SERVER_HANDLER_BEGIN
+#define SELECT_SERVER_HANDLER_BEGIN(sock)
+#endif
+#ifndef SELECT_SERVER_HANDLER_END
+#define SELECT_SERVER_HANDLER_END()
+#endif
+#ifndef SELECT_SERVER_SOCKS_CHANGED
+#define SELECT_SERVER_SOCKS_CHANGED(added, removed)
+#endif
+
+// Application can define work the select thread does after it has handled
+// the sockets select returned, SELECT_SERVER_DO_WORK is called once every
+// iteration and select waits no longer than SELECT_SERVER_WORK_TIMEOUT
+// milliseconds (0xFFFFFFFF if there is no work)
+#ifndef SELECT_SERVER_WORK_TIMEOUT
+#define SELECT_SERVER_WORK_TIMEOUT() 0xFFFFFFFF
+#endif
+#ifndef SELECT_SERVER_DO_WORK
+#define SELECT_SERVER_DO_WORK(sharedBuffer)
+#endif
+
+// Has the layout of an fd_set, but it is allocated with room for every
+// socket of the thread (winsock's select reads count sockets no matter
+// what FD_SETSIZE is)
 struct SockSet
 {
     u_int count;
-    SOCKET array[SELECT_THREAD_CAPACITY];
+    SOCKET array[1];
     void Add(SOCKET so)
     {
         array[count++] = so;
@@ -53,6 +93,9 @@ typedef void (*SelectSockHandler)(SynchronizedSelectServer server, SelectSock* s
 // Note: This data should only ever be modified by the select
 //       thread itself.  If it isn't, then all types of synchronization
 //       will need to occur.
+// Note: the SelectSock a handler gets is a copy of the socket's entry in
+//       the select server, changes are written back when the handler
+//       returns, so don't keep the pointer after the handler returns.
 class SelectSock
 {
     friend class SelectServer;
@@ -102,6 +145,13 @@ class SelectSock
     }
 };
 
+// The fields of a socket that are only needed when it pops
+struct SelectSockCold
+{
+    SelectSockHandler handler;
+    void* user;
+};
+
 class SelectServer
 {
     friend class SynchronizedSelectServer;
@@ -117,25 +167,56 @@ class SelectServer
 
     BYTE flags;
 
-    // All the active sockets will be packed to the start
-    // of the array, and any other threads can add sockets
-    // back adding then after the active sockets and incrementing
-    // the socksReserved field (inside the critical section of cource)
-    SelectSock socks[SELECT_THREAD_CAPACITY];
+    // NOTE: only read/modify inside critical section
+    // Sockets that other threads (or handlers) have added, the select
+    // thread moves them to the registry before its next select
+    SelectSock* pending;
+    u_int pendingCount;
+    u_int pendingCapacity;
+
+    //
+    // The registry of active sockets, only used by the select thread.
+    // Every socket has the same index in each array.  The fields that are
+    // scanned on every iteration are packed into their own arrays, the ones
+    // that are only used when a socket pops are kept in cold.  Removed
+    // sockets are replaced by the last socket, so removal is O(1).
+    //
+    u_int sockCount;
+    u_int sockCapacity;
+    SOCKET* sockets;
+    BYTE* sockFlags;           // SelectSock::Flags
+    DWORD* timeouts;           // SelectSock::INF if the socket has no timeout
+    DWORD* deadlines;          // the tick count the socket times out at
+    SelectSockCold* cold;
+    BYTE* handled;             // HandledState for the current iteration
+    u_int* removals;           // indexes of sockets to remove before the next select
+    u_int removalCount;
+    SockSet* sets[3];
+
+    // Returns: non-zero if out of memory
+    BOOL Grow(u_int capacity);
+    // Moves the pending sockets to the registry
+    // Note: must be called inside the critical section
+    void AddPending();
+    // Swap-removes the sockets in removals
+    // Note: must be called inside the critical section
+    void RemoveSocks();
+    // Calls the socket's handler and queues its removal if it has no more flags or timeout
+    void CallHandler(u_int index, PopReason reason, char* sharedBuffer);
 
   public:
     enum Flags {
         STOP_FLAG = 0x01,
     };
 
-    SelectServer() : socksReserved(0), flags(0)
+    SelectServer() : socksReserved(0), flags(0), pending(NULL), pendingCount(0), pendingCapacity(0),
+        sockCount(0), sockCapacity(0), sockets(NULL), sockFlags(NULL), timeouts(NULL), deadlines(NULL),
+        cold(NULL), handled(NULL), removals(NULL), removalCount(0)
     {
+        sets[0] = sets[1] = sets[2] = NULL;
         InitializeCriticalSection(&criticalSection);
     }
-    ~SelectServer()
-    {
-        DeleteCriticalSection(&criticalSection);
-    }
+    ~SelectServer();
     DWORD Run(char* sharedBuffer, size_t sharedBufferSize);
 };
 
@@ -1,4 +1,16 @@
-#pragma once
-
-//#define SELECT_THREAD_VERBOSE
-//#define SELECT_SERVER_LOG(fmt,...) printf("[SELECT-SERVER] " fmt "\r\n",##__VA_ARGS__)
\ No newline at end of file
+#pragma once
+
+//#define SELECT_THREAD_VERBOSE
+#include "Log.h"
+#define SELECT_SERVER_LOG(fmt,...) LOG_AT(SELECT, DEBUG, "[SELECT-SERVER] " fmt,##__VA_ARGS__)
+
+#include "LoopMonitor.h"
+#define SELECT_SERVER_SELECT_BEGIN()                LoopMonitorSelectBegin()
+#define SELECT_SERVER_SELECT_END(readyCount)        LoopMonitorSelectEnd(readyCount)
+#define SELECT_SERVER_HANDLER_BEGIN(sock)           LoopMonitorHandlerBegin((UINT)(sock)->so)
+#define SELECT_SERVER_HANDLER_END()                 LoopMonitorHandlerEnd()
+#define SELECT_SERVER_SOCKS_CHANGED(added, removed) LoopMonitorSocksChanged(added, removed)
+
+#include "Scheduler.h"
+#define SELECT_SERVER_WORK_TIMEOUT()                SchedulerTimeout()
+#define SELECT_SERVER_DO_WORK(sharedBuffer)         SchedulerRun(sharedBuffer)
@@ -0,0 +1,170 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Common.h"
+#include "Stats.h"
+#include "Span.h"
+
+struct Span
+{
+    INT64 start;
+    INT64 end;
+    UINT type;
+    UINT xid;
+    UINT connection;
+    UINT program;
+    UINT procedure;
+};
+
+struct SpanRing
+{
+    Span spans[SPAN_RING_SIZE];
+    volatile UINT head; // only modified by the thread that owns the ring
+    volatile UINT tail; // only modified by SpanDump
+    volatile LONG dropped;
+    DWORD threadId;
+    SpanRing* next;
+};
+
+static const char* spanNames[SPAN_TYPE_COUNT] = {
+    "recv", "reassembly", "queue", "decode", "backend", "encode", "sync wait", "send", "order wait",
+};
+
+bool spansEnabled = false;
+
+static char* spanPath;
+static UINT spanSampleRate;
+static UINT spanCountdown; // only used by the select thread
+static INT64 spanStartTime;
+static double spanTicksPerMicro;
+
+static __declspec(thread) SpanRing* threadRing = NULL;
+static CRITICAL_SECTION ringsLock;
+static SpanRing* volatile allRings = NULL;
+
+int SpanStart(const char* path, UINT sampleRate)
+{
+    spanPath = _strdup(path);
+    if(!spanPath)
+    {
+        LOG_ERROR("[SPAN] out of memory");
+        return 1;
+    }
+    InitializeCriticalSection(&ringsLock);
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    spanTicksPerMicro = (double)frequency.QuadPart / 1000000.0;
+    spanStartTime = StatsNow();
+    spanSampleRate = sampleRate;
+    spanCountdown = 1; // sample the first call
+    spansEnabled = true;
+    LOG("[SPAN] recording the spans of 1 in %u calls, NfsTester spans writes them to '%s'", sampleRate, path);
+    return 0;
+}
+
+bool SpanSample()
+{
+    if(--spanCountdown)
+    {
+        return false;
+    }
+    spanCountdown = spanSampleRate;
+    return true;
+}
+
+// Returns: the calling thread's ring, NULL if out of memory
+static SpanRing* GetThreadRing()
+{
+    if(threadRing == NULL)
+    {
+        SpanRing* ring = (SpanRing*)calloc(1, sizeof(SpanRing));
+        if(!ring)
+        {
+            return NULL;
+        }
+        ring->threadId = GetCurrentThreadId();
+        EnterCriticalSection(&ringsLock);
+        ring->next = allRings;
+        allRings = ring;
+        LeaveCriticalSection(&ringsLock);
+        threadRing = ring;
+    }
+    return threadRing;
+}
+
+void SpanRecord(UINT type, UINT xid, UINT connection, UINT program, UINT procedure, INT64 start, INT64 end)
+{
+    SpanRing* ring = GetThreadRing();
+    if(!ring)
+    {
+        return;
+    }
+    UINT head = ring->head;
+    if(head - ring->tail == SPAN_RING_SIZE)
+    {
+        InterlockedIncrement(&ring->dropped);
+        return;
+    }
+    Span* span = &ring->spans[head & (SPAN_RING_SIZE - 1)];
+    span->start      = start;
+    span->end        = end;
+    span->type       = type;
+    span->xid        = xid;
+    span->connection = connection;
+    span->program    = program;
+    span->procedure  = procedure;
+    MemoryBarrier();
+    ring->head = head + 1;
+}
+
+static double MicrosSinceStart(INT64 time)
+{
+    return (time <= spanStartTime) ? 0.0 : (double)(time - spanStartTime) / spanTicksPerMicro;
+}
+
+int SpanDump(UINT* outWritten, UINT* outDropped)
+{
+    FILE* file = fopen(spanPath, "wb");
+    if(!file)
+    {
+        LOG_ERROR("[SPAN] can't open '%s' for writing", spanPath);
+        return 1;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"WindowsNfsServer\"}}");
+
+    UINT written = 0;
+    UINT dropped = 0;
+    for(SpanRing* ring = allRings; ring; ring = ring->next)
+    {
+        dropped += (UINT)InterlockedExchange(&ring->dropped, 0);
+        UINT head = ring->head;
+        MemoryBarrier();
+        for(UINT tail = ring->tail; tail != head; tail++)
+        {
+            Span* span = &ring->spans[tail & (SPAN_RING_SIZE - 1)];
+            double start = MicrosSinceStart(span->start);
+            double end = MicrosSinceStart(span->end);
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"rpc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+                "\"args\":{\"xid\":\"0x%08x\",\"connection\":%u,\"program\":%u,\"procedure\":%u}}",
+                spanNames[span->type], start, (end > start) ? end - start : 0.0, ring->threadId,
+                span->xid, span->connection, span->program, span->procedure);
+            written++;
+        }
+        MemoryBarrier();
+        ring->tail = head;
+    }
+    fprintf(file, "\n]}\n");
+    if(fclose(file))
+    {
+        LOG_ERROR("[SPAN] writing '%s' failed", spanPath);
+        return 1;
+    }
+    LOG("[SPAN] wrote %u spans to '%s' (%u were dropped)", written, spanPath, dropped);
+    *outWritten = written;
+    *outDropped = dropped;
+    return 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+//
+// Request Spans
+// --------------------------------------------------------
+// With the SpanFile setting 1 in every SpanSample calls is followed through
+// the server and the phases it goes through are recorded as spans:
+//
+//   recv        the recv call that completed the call's record
+//   reassembly  from the first recv of a record that took more than one recv
+//               until it was complete
+//   queue       from the record being complete until its handler started
+//               (records waiting behind other records from the same recv)
+//   decode      parsing the rpc header
+//   backend     the file system work of an NFS procedure
+//   encode      from the end of the backend work until the reply is sent
+//   sync wait   a reply waiting for the sync thread to flush its file
+//   order wait  a reply waiting for the replies of the calls its connection
+//               sent before it
+//   send        sending the reply
+//
+// Every span is tagged with the call's xid, connection, program and
+// procedure.  Calls that aren't sampled don't record anything, and a
+// sampled call writes its spans to a ring owned by the thread that records
+// them, so recording takes no locks.  When a ring is full its spans are
+// dropped.
+//
+// The DUMP_SPANS procedure of the stats program (NfsTester spans) takes the
+// spans out of every ring and writes them to SpanFile as Chrome trace JSON,
+// which opens in chrome://tracing and ui.perfetto.dev.  Every dump replaces
+// the file with the spans recorded since the last dump.
+//
+
+// Application can override the number of spans each thread's ring holds,
+// must be a power of 2
+#ifndef SPAN_RING_SIZE
+#define SPAN_RING_SIZE 16384
+#endif
+
+#define SPAN_RECV       0
+#define SPAN_REASSEMBLY 1
+#define SPAN_QUEUE      2
+#define SPAN_DECODE     3
+#define SPAN_BACKEND    4
+#define SPAN_ENCODE     5
+#define SPAN_SYNC_WAIT  6
+#define SPAN_SEND       7
+#define SPAN_ORDER_WAIT 8
+#define SPAN_TYPE_COUNT 9
+
+// True once SpanStart succeeds
+extern bool spansEnabled;
+
+// sampleRate: 1 records every call
+// Note: StatsInit must have been called
+// Returns: non-zero on error
+int SpanStart(const char* path, UINT sampleRate);
+
+// Returns: true if the next call should record its spans
+// Note: only called from the select thread, the caller checks spansEnabled first
+bool SpanSample();
+
+// start, end: from StatsNow
+void SpanRecord(UINT type, UINT xid, UINT connection, UINT program, UINT procedure, INT64 start, INT64 end);
+
+// Writes every span that has been recorded since the last dump to the span file
+// Returns: non-zero on error
+int SpanDump(UINT* outWritten, UINT* outDropped);
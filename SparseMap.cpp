@@ -0,0 +1,161 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Common.h"
+#include "SparseMap.h"
+
+#define SPARSE_MAP_INITIAL_RANGES 16
+
+DWORD SparseMapLoad(SparseMap* map, HANDLE file, UINT64 fileSize, UINT64 changeTime)
+{
+    map->valid = false;
+    map->dense = false;
+    map->count = 0;
+
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = (LONGLONG)fileSize;
+    while(true)
+    {
+        if(map->count == map->capacity)
+        {
+            if(map->capacity >= SPARSE_MAP_MAX_RANGES)
+            {
+                map->dense = true;
+                break;
+            }
+            UINT newCapacity = map->capacity ? map->capacity * 2 : SPARSE_MAP_INITIAL_RANGES;
+            FILE_ALLOCATED_RANGE_BUFFER* newRanges = (FILE_ALLOCATED_RANGE_BUFFER*)realloc(
+                map->ranges, newCapacity * sizeof(FILE_ALLOCATED_RANGE_BUFFER));
+            if(!newRanges)
+            {
+                return ERROR_NOT_ENOUGH_MEMORY;
+            }
+            map->ranges = newRanges;
+            map->capacity = newCapacity;
+        }
+
+        DWORD returned;
+        DWORD error = 0;
+        if(!DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), map->ranges + map->count,
+            (map->capacity - map->count) * sizeof(FILE_ALLOCATED_RANGE_BUFFER), &returned, NULL))
+        {
+            error = GetLastError();
+            if(error != ERROR_MORE_DATA)
+            {
+                return error;
+            }
+        }
+        UINT rangeCount = returned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+        map->count += rangeCount;
+        if(error == 0)
+        {
+            break;
+        }
+        if(rangeCount == 0)
+        {
+            return ERROR_MORE_DATA; // there was room for at least one range
+        }
+        // Continue the query after the last range returned
+        FILE_ALLOCATED_RANGE_BUFFER* last = &map->ranges[map->count - 1];
+        query.FileOffset.QuadPart = last->FileOffset.QuadPart + last->Length.QuadPart;
+        query.Length.QuadPart = (LONGLONG)fileSize - query.FileOffset.QuadPart;
+        if(query.Length.QuadPart <= 0)
+        {
+            break;
+        }
+    }
+    map->changeTime = changeTime;
+    map->valid = true;
+    return 0;
+}
+
+// Returns: the first range that ends after offset, map->count if none do
+static UINT FindRange(SparseMap* map, UINT64 offset)
+{
+    UINT low = 0;
+    UINT high = map->count;
+    while(low < high)
+    {
+        UINT middle = (low + high) / 2;
+        FILE_ALLOCATED_RANGE_BUFFER* range = &map->ranges[middle];
+        if((UINT64)(range->FileOffset.QuadPart + range->Length.QuadPart) <= offset)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+UINT SparseMapOverlap(SparseMap* map, UINT64 offset, UINT count, UINT* outFirst)
+{
+    UINT64 end = offset + count;
+    UINT first = FindRange(map, offset);
+    UINT last = first;
+    while(last < map->count && (UINT64)map->ranges[last].FileOffset.QuadPart < end)
+    {
+        last++;
+    }
+    *outFirst = first;
+    return last - first;
+}
+
+DWORD SparseMapRead(SparseMap* map, UINT64 offset, UINT count, char* data,
+                    SparseReadHandler readData, void* context, UINT* outLength)
+{
+    UINT64 end = offset + count;
+    UINT64 position = offset;
+    for(UINT i = FindRange(map, offset); position < end; i++)
+    {
+        UINT64 dataStart = end;
+        UINT64 dataEnd = end;
+        if(i < map->count)
+        {
+            dataStart = (UINT64)map->ranges[i].FileOffset.QuadPart;
+            dataEnd = dataStart + (UINT64)map->ranges[i].Length.QuadPart;
+            if(dataStart < position)
+            {
+                dataStart = position;
+            }
+            if(dataStart > end)
+            {
+                dataStart = end;
+            }
+            if(dataEnd > end)
+            {
+                dataEnd = end;
+            }
+        }
+        if(dataStart > position)
+        {
+            memset(data + (position - offset), 0, (size_t)(dataStart - position));
+            position = dataStart;
+        }
+        if(position == end)
+        {
+            break;
+        }
+
+        UINT length;
+        DWORD error = readData(context, position, (UINT)(dataEnd - position), data + (position - offset), &length);
+        if(error)
+        {
+            return error;
+        }
+        if(length < dataEnd - position)
+        {
+            // The file is shorter than when it was mapped
+            *outLength = (UINT)(position - offset) + length;
+            return 0;
+        }
+        position = dataEnd;
+    }
+    *outLength = count;
+    return 0;
+}
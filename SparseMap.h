@@ -0,0 +1,60 @@
+#pragma once
+
+//
+// Sparse Files
+// --------------------------------------------------------
+// VM images and other large sparse files are mostly holes, which read as
+// zeros.  Reading a hole with ReadFile still goes through the file system
+// and copies zeros a page at a time.
+//
+// For a sparse file READ keeps a map of the file's allocated ranges
+// (FSCTL_QUERY_ALLOCATED_RANGES, Windows' SEEK_DATA/SEEK_HOLE) with its
+// handle, and only queries it again after the file's change time moves.
+// A READ that falls entirely in a hole is answered with zeros without any
+// file system call, a READ that is partly holes only reads the allocated
+// ranges it covers.  NTFS allocates in clusters (or compression units for
+// compressed files), so a "hole" is always whole clusters that are really
+// unallocated.
+//
+// A file with more than SPARSE_MAP_MAX_RANGES allocated ranges isn't worth
+// mapping, it is read as if it weren't sparse.
+//
+
+// Application can override the most allocated ranges a map holds
+#ifndef SPARSE_MAP_MAX_RANGES
+#define SPARSE_MAP_MAX_RANGES 4096
+#endif
+
+struct SparseMap
+{
+    UINT64 changeTime; // of the file when its ranges were queried
+    bool valid;
+    bool dense;        // the file has too many ranges to map
+    UINT count;
+    UINT capacity;
+    FILE_ALLOCATED_RANGE_BUFFER* ranges; // sorted by offset
+};
+
+// Reads count bytes at offset from the file into data
+// Returns: 0 on success, otherwise the error, outLength is less than count
+//          only at the end of the file
+typedef DWORD (*SparseReadHandler)(void* context, UINT64 offset, UINT count, char* data, UINT* outLength);
+
+// Queries the allocated ranges of a sparse file, map must be zeroed before
+// it is loaded the first time and can be loaded again after the file changes
+// Returns: 0 on success, otherwise the error from DeviceIoControl
+DWORD SparseMapLoad(SparseMap* map, HANDLE file, UINT64 fileSize, UINT64 changeTime);
+
+// Finds the allocated ranges count bytes at offset overlap, a READ only needs
+// those to be copied to read on another thread
+// Note: map must be valid and not dense
+// Returns: the number of ranges, outFirst is set to the first one
+UINT SparseMapOverlap(SparseMap* map, UINT64 offset, UINT count, UINT* outFirst);
+
+// Reads count bytes at offset, zero filling the holes and calling readData
+// for the allocated ranges
+// Note: map must be valid and not dense
+// Returns: 0 on success, otherwise the error from readData, outLength is less
+//          than count only at the end of the file
+DWORD SparseMapRead(SparseMap* map, UINT64 offset, UINT count, char* data,
+                    SparseReadHandler readData, void* context, UINT* outLength);
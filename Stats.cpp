@@ -0,0 +1,310 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "Common.h"
+#include "Rpc.h"
+#include "Stats.h"
+
+struct ProcedureStats
+{
+    UINT64 calls;
+    UINT64 errors; // calls that were not accepted or returned a non-zero status
+    UINT64 bytesIn;
+    UINT64 bytesOut;
+    UINT64 waitMicros;
+    UINT64 execMicros;
+    UINT64 waitHistogram[STATS_BUCKET_COUNT];
+    UINT64 execHistogram[STATS_BUCKET_COUNT];
+};
+
+// Every procedure of these programs has its own slot, calls to anything
+// else share the last slot
+struct StatsProgram
+{
+    UINT program;
+    UINT procedureCount;
+};
+static const StatsProgram statsPrograms[] = {
+    {RPC_PROGRAM_PORTMAP, 6},
+    {RPC_PROGRAM_NFS    , NFS3_PROC_COMMIT + 1},
+    {RPC_PROGRAM_MOUNT  , MOUNT3_PROC_EXPORT + 1},
+    {RPC_PROGRAM_STATS  , STATS_PROC_COUNT},
+};
+#define STATS_SLOT_COUNT (6 + NFS3_PROC_COMMIT + 1 + MOUNT3_PROC_EXPORT + 1 + STATS_PROC_COUNT + 1)
+#define STATS_OTHER_SLOT (STATS_SLOT_COUNT - 1)
+
+// SUCCESS through SYSTEM_ERR
+#define STATS_ACCEPT_STATUS_COUNT 6
+
+// NFS3 and MOUNT3 statuses are below 100 or between 10001 and 10008, the
+// last index counts anything else
+#define STATS_STATUS_COUNT 109
+
+struct ThreadStats
+{
+    ProcedureStats procedures[STATS_SLOT_COUNT];
+    UINT64 acceptStatuses[STATS_ACCEPT_STATUS_COUNT];
+    UINT64 statuses[STATS_STATUS_COUNT];
+    ThreadStats* next;
+};
+
+static __declspec(thread) ThreadStats* threadStats = NULL;
+
+// NOTE: only read/modify the list inside the critical section
+static CRITICAL_SECTION threadStatsLock;
+static ThreadStats* allThreadStats = NULL;
+
+static LARGE_INTEGER frequency;
+static INT64 statsStartTime;
+
+// Only used by the select thread
+static UINT activeConnections = 0;
+static UINT64 acceptedConnections = 0;
+
+void StatsInit()
+{
+    InitializeCriticalSection(&threadStatsLock);
+    QueryPerformanceFrequency(&frequency);
+    statsStartTime = StatsNow();
+}
+
+INT64 StatsNow()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+UINT64 StatsTicksToMicros(INT64 ticks)
+{
+    return (ticks <= 0) ? 0 : (UINT64)ticks * 1000000 / (UINT64)frequency.QuadPart;
+}
+
+static UINT SlotIndex(UINT program, UINT procedure)
+{
+    UINT first = 0;
+    for(UINT i = 0; i < STATIC_ARRAY_LENGTH(statsPrograms); i++)
+    {
+        if(statsPrograms[i].program == program)
+        {
+            return (procedure < statsPrograms[i].procedureCount) ? first + procedure : STATS_OTHER_SLOT;
+        }
+        first += statsPrograms[i].procedureCount;
+    }
+    return STATS_OTHER_SLOT;
+}
+
+static UINT StatusIndex(UINT status)
+{
+    if(status < 100)
+    {
+        return status;
+    }
+    if(status >= 10001 && status <= 10008)
+    {
+        return 100 + (status - 10001);
+    }
+    return STATS_STATUS_COUNT - 1;
+}
+static UINT StatusFromIndex(UINT index)
+{
+    return (index < 100) ? index : 10001 + (index - 100);
+}
+
+// Returns: the calling thread's stats, NULL if out of memory
+static ThreadStats* GetThreadStats()
+{
+    if(threadStats == NULL)
+    {
+        ThreadStats* stats = (ThreadStats*)calloc(1, sizeof(ThreadStats));
+        if(!stats)
+        {
+            return NULL;
+        }
+        EnterCriticalSection(&threadStatsLock);
+        stats->next = allThreadStats;
+        allThreadStats = stats;
+        LeaveCriticalSection(&threadStatsLock);
+        threadStats = stats;
+    }
+    return threadStats;
+}
+
+void StatsRecordCall(UINT program, UINT procedure, UINT acceptStatus, UINT status,
+                     UINT bytesIn, UINT bytesOut, INT64 receiveTime, INT64 startTime)
+{
+    ThreadStats* stats = GetThreadStats();
+    if(!stats)
+    {
+        return;
+    }
+    UINT64 waitMicros = StatsTicksToMicros(startTime - receiveTime);
+    UINT64 execMicros = StatsTicksToMicros(StatsNow() - startTime);
+
+    ProcedureStats* proc = &stats->procedures[SlotIndex(program, procedure)];
+    proc->calls++;
+    if(acceptStatus != RPC_REPLY_ACCEPT_STATUS_SUCCESS || status != 0)
+    {
+        proc->errors++;
+    }
+    proc->bytesIn  += bytesIn;
+    proc->bytesOut += bytesOut;
+    proc->waitMicros += waitMicros;
+    proc->execMicros += execMicros;
+    proc->waitHistogram[StatsBucketIndex(waitMicros)]++;
+    proc->execHistogram[StatsBucketIndex(execMicros)]++;
+
+    stats->acceptStatuses[(acceptStatus < STATS_ACCEPT_STATUS_COUNT) ? acceptStatus : STATS_ACCEPT_STATUS_COUNT - 1]++;
+    if(acceptStatus == RPC_REPLY_ACCEPT_STATUS_SUCCESS)
+    {
+        stats->statuses[StatusIndex(status)]++;
+    }
+}
+
+void StatsConnectionOpened()
+{
+    activeConnections++;
+    acceptedConnections++;
+}
+void StatsConnectionClosed()
+{
+    activeConnections--;
+}
+
+// Adds the counters of every thread into merged
+static void Merge(ThreadStats* merged)
+{
+    memset(merged, 0, sizeof(ThreadStats));
+    EnterCriticalSection(&threadStatsLock);
+    for(ThreadStats* stats = allThreadStats; stats; stats = stats->next)
+    {
+        UINT64* from = (UINT64*)stats;
+        UINT64* to   = (UINT64*)merged;
+        for(UINT i = 0; i < offsetof(ThreadStats, next) / sizeof(UINT64); i++)
+        {
+            to[i] += from[i];
+        }
+    }
+    LeaveCriticalSection(&threadStatsLock);
+}
+
+UINT StatsEncodeSummary(char* buffer, UINT maxLength)
+{
+    ThreadStats* merged = (ThreadStats*)malloc(sizeof(ThreadStats));
+    if(!merged)
+    {
+        return 0;
+    }
+    Merge(merged);
+
+    UINT slotCount = 0;
+    UINT statusCount = 0;
+    for(UINT i = 0; i < STATS_SLOT_COUNT; i++)
+    {
+        if(merged->procedures[i].calls)
+        {
+            slotCount++;
+        }
+    }
+    for(UINT i = 0; i < STATS_STATUS_COUNT; i++)
+    {
+        if(merged->statuses[i])
+        {
+            statusCount++;
+        }
+    }
+    UINT length = 20 + 4 + slotCount * 56 + 4 + STATS_ACCEPT_STATUS_COUNT * 8 + 4 + statusCount * 12;
+    if(length > maxLength)
+    {
+        free(merged);
+        return 0;
+    }
+
+    AppendUint64(buffer +  0, StatsTicksToMicros(StatsNow() - statsStartTime) / 1000);
+    AppendUint  (buffer +  8, activeConnections);
+    AppendUint64(buffer + 12, acceptedConnections);
+    AppendUint  (buffer + 20, slotCount);
+    char* next = buffer + 24;
+    UINT slot = 0;
+    for(UINT i = 0; i <= STATIC_ARRAY_LENGTH(statsPrograms); i++)
+    {
+        UINT program = (i < STATIC_ARRAY_LENGTH(statsPrograms)) ? statsPrograms[i].program : 0xFFFFFFFF;
+        UINT procedureCount = (i < STATIC_ARRAY_LENGTH(statsPrograms)) ? statsPrograms[i].procedureCount : 1;
+        for(UINT procedure = 0; procedure < procedureCount; procedure++, slot++)
+        {
+            ProcedureStats* proc = &merged->procedures[slot];
+            if(proc->calls == 0)
+            {
+                continue;
+            }
+            AppendUint  (next +  0, program);
+            AppendUint  (next +  4, (program == 0xFFFFFFFF) ? 0xFFFFFFFF : procedure);
+            AppendUint64(next +  8, proc->calls);
+            AppendUint64(next + 16, proc->errors);
+            AppendUint64(next + 24, proc->bytesIn);
+            AppendUint64(next + 32, proc->bytesOut);
+            AppendUint64(next + 40, proc->waitMicros);
+            AppendUint64(next + 48, proc->execMicros);
+            next += 56;
+        }
+    }
+    AppendUint(next, STATS_ACCEPT_STATUS_COUNT);
+    next += 4;
+    for(UINT i = 0; i < STATS_ACCEPT_STATUS_COUNT; i++)
+    {
+        AppendUint64(next, merged->acceptStatuses[i]);
+        next += 8;
+    }
+    AppendUint(next, statusCount);
+    next += 4;
+    for(UINT i = 0; i < STATS_STATUS_COUNT; i++)
+    {
+        if(merged->statuses[i])
+        {
+            AppendUint  (next    , (i == STATS_STATUS_COUNT - 1) ? 0xFFFFFFFF : StatusFromIndex(i));
+            AppendUint64(next + 4, merged->statuses[i]);
+            next += 12;
+        }
+    }
+    free(merged);
+    return (UINT)(next - buffer);
+}
+
+UINT StatsEncodeHistograms(UINT program, UINT procedure, char* buffer, UINT maxLength)
+{
+    if(maxLength < 12 + 2 * STATS_BUCKET_COUNT * 8)
+    {
+        return 0;
+    }
+    UINT slot = SlotIndex(program, procedure);
+    if(slot == STATS_OTHER_SLOT)
+    {
+        AppendUint(buffer, 1);
+        return 4;
+    }
+
+    AppendUint(buffer    , 0);
+    AppendUint(buffer + 4, STATS_SUB_BUCKET_BITS);
+    AppendUint(buffer + 8, STATS_BUCKET_COUNT);
+    char* wait = buffer + 12;
+    char* exec = wait + STATS_BUCKET_COUNT * 8;
+    EnterCriticalSection(&threadStatsLock);
+    for(UINT i = 0; i < STATS_BUCKET_COUNT; i++)
+    {
+        UINT64 waitCount = 0;
+        UINT64 execCount = 0;
+        for(ThreadStats* stats = allThreadStats; stats; stats = stats->next)
+        {
+            waitCount += stats->procedures[slot].waitHistogram[i];
+            execCount += stats->procedures[slot].execHistogram[i];
+        }
+        AppendUint64(wait + i * 8, waitCount);
+        AppendUint64(exec + i * 8, execCount);
+    }
+    LeaveCriticalSection(&threadStatsLock);
+    return 12 + 2 * STATS_BUCKET_COUNT * 8;
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <intrin.h>
+
+//
+// Stats
+// --------------------------------------------------------
+// Counters and latency histograms for every (program, procedure), along
+// with bytes in/out, errors by status and connection counts.
+//
+// Every thread that records calls gets its own block of counters, so the
+// hot path is a few plain increments with no locks or interlocked
+// instructions.  The blocks are merged when the stats are read, which only
+// happens when a client calls the stats program.
+//
+// Latencies are recorded in microseconds into HDR style histograms: values
+// below STATS_SUB_BUCKETS have their own bucket, above that every power of
+// two is split into STATS_SUB_BUCKETS buckets, so every bucket is within
+// 1/STATS_SUB_BUCKETS of the values it holds.  Each call records two
+// latencies, the time it waited after its record was received before its
+// handler started (queue wait), and the time from the start of its handler
+// until its reply was sent (execution).
+//
+// The stats are served by a private rpc program (RPC_PROGRAM_STATS) on the
+// same listeners as every other program:
+//
+//   SUMMARY   (1) no arguments, returns
+//                 uptime in milliseconds (uint64), active connections (uint),
+//                 accepted connections (uint64),
+//                 the procedures that were called (count, then for each one
+//                 program, procedure, calls, errors, bytes in, bytes out,
+//                 total queue wait and total execution microseconds),
+//                 the calls for each rpc accept status (count, then uint64s),
+//                 the procedure statuses that were returned (count, then
+//                 status and uint64 calls for each one)
+//   HISTOGRAM (2) program, procedure, returns
+//                 0 and the sub bucket bits, the bucket count, then the queue
+//                 wait buckets and the execution buckets (uint64s), or 1 if
+//                 the procedure isn't tracked
+//   LOOP      (3) no arguments, returns the select loop stats, see LoopMonitor.h
+//   DUMP_SPANS (4) no arguments, writes the sampled request spans to the span
+//                 file, returns 0, the spans written and the spans dropped
+//                 (uints), or 1 if spans are off or the file can't be written
+//   HEAP_CALLS (5) no arguments, returns 0 and the heap calls made while
+//                 handling calls (uint64), or 1 if the build doesn't count them
+//   SCHEDULER (6) no arguments, returns the call scheduler stats, see Scheduler.h
+//   CLIENTS   (7) no arguments, returns the stats of every client, see Scheduler.h
+//   READ_AHEAD (8) no arguments, returns the read-ahead stats, see ReadAhead.h
+//   BLOCK_CACHE (9) no arguments, returns the block cache stats, see BlockCache.h
+//   DIRECT_IO (10) no arguments, returns DirectIoMinSize (0 if no export uses
+//                 direct I/O), the direct reads, bytes read, direct writes and
+//                 bytes written (uint64s)
+//   ATTRIBUTES (11) no arguments, returns the replies that copied a handle's
+//                 encoded attributes and the times they were encoded again
+//                 (uint64s)
+//
+// NOTE: counters from other threads are read without synchronization, a
+//       merged value can be a few calls behind
+//
+
+#define STATS_SUB_BUCKET_BITS 3
+#define STATS_SUB_BUCKETS     (1 << STATS_SUB_BUCKET_BITS)
+// Covers up to 2^32 microseconds (over an hour)
+#define STATS_BUCKET_COUNT    ((32 - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+#define STATS_PROC_NULL       0
+#define STATS_PROC_SUMMARY    1
+#define STATS_PROC_HISTOGRAM  2
+#define STATS_PROC_LOOP       3 // see LoopMonitor.h
+#define STATS_PROC_DUMP_SPANS 4 // see Span.h
+#define STATS_PROC_HEAP_CALLS 5 // see Arena.h
+#define STATS_PROC_SCHEDULER  6 // see Scheduler.h
+#define STATS_PROC_CLIENTS    7 // see Scheduler.h
+#define STATS_PROC_READ_AHEAD 8 // see ReadAhead.h
+#define STATS_PROC_BLOCK_CACHE 9 // see BlockCache.h
+#define STATS_PROC_DIRECT_IO  10 // see NfsServer.cpp
+#define STATS_PROC_ATTRIBUTES 11 // see NfsServer.cpp
+#define STATS_PROC_COUNT      12
+
+// Returns: the bucket that holds micros
+inline UINT StatsBucketIndex(UINT64 micros)
+{
+    if(micros < STATS_SUB_BUCKETS)
+    {
+        return (UINT)micros;
+    }
+    if(micros > 0xFFFFFFFF)
+    {
+        micros = 0xFFFFFFFF;
+    }
+    unsigned long msb;
+    _BitScanReverse(&msb, (unsigned long)micros);
+    UINT shift = msb - STATS_SUB_BUCKET_BITS;
+    return (shift + 1) * STATS_SUB_BUCKETS + (UINT)((micros >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+// Returns: the largest value that is counted in bucket index
+inline UINT64 StatsBucketHighest(UINT index)
+{
+    if(index < STATS_SUB_BUCKETS)
+    {
+        return index;
+    }
+    UINT shift = index / STATS_SUB_BUCKETS - 1;
+    UINT64 lowest = (UINT64)(STATS_SUB_BUCKETS + index % STATS_SUB_BUCKETS) << shift;
+    return lowest + ((UINT64)1 << shift) - 1;
+}
+
+// Note: must be called before any other Stats function
+void StatsInit();
+
+// Returns: the current time for StatsRecordCall
+INT64 StatsNow();
+
+// Returns: the microseconds in a difference of two StatsNow times
+UINT64 StatsTicksToMicros(INT64 ticks);
+
+// Records a call that has been replied to
+// acceptStatus: the rpc accept status of the reply
+// status: the status the procedure returned, 0 for procedures that don't
+//         return a status
+// receiveTime, startTime: when the record was received and when its handler
+//                         started (from StatsNow)
+void StatsRecordCall(UINT program, UINT procedure, UINT acceptStatus, UINT status,
+                     UINT bytesIn, UINT bytesOut, INT64 receiveTime, INT64 startTime);
+
+// Only called from the select thread
+void StatsConnectionOpened();
+void StatsConnectionClosed();
+
+// Writes the merged stats in the format of the SUMMARY procedure
+// Returns: the length written, 0 if they don't fit in maxLength
+UINT StatsEncodeSummary(char* buffer, UINT maxLength);
+
+// Writes the merged histograms of one procedure in the format of the
+// HISTOGRAM procedure
+// Returns: the length written, 0 if they don't fit in maxLength
+UINT StatsEncodeHistograms(UINT program, UINT procedure, char* buffer, UINT maxLength);
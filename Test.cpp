@@ -1,314 +1,4365 @@
-#include <winsock2.h>
-#include <stdio.h>
-#include <stdarg.h>
-
-#include "Common.h"
-#include "Rpc.h"
-
-char buffer[4096];
-
-#define TEST_FAIL    0
-#define TEST_SUCCESS 1
-
-#define TEST_ASSERT(condition, line, fmt, ...)                              \
-    do                                                                      \
-    {                                                                       \
-        if(!(condition))                                                    \
-        {                                                                   \
-            printf("TEST_ASSERT line %u: " fmt "\r\n", line,##__VA_ARGS__); \
-            return TEST_FAIL;                                               \
-        }                                                                   \
-    } while(0);
-
-class Connection
-{
-  private:
-    SOCKET so;
-  public:
-    Connection(unsigned short port)
-    {
-        sockaddr_in addr;
-        addr.sin_family      = AF_INET;
-        addr.sin_port        = htons(port);
-        addr.sin_addr.s_addr = htonl(0x7F000001);
-
-        so = socket(addr.sin_family, SOCK_STREAM, IPPROTO_TCP);
-        if(so == INVALID_SOCKET)
-        {
-            printf("Error: socket function failed (e=%d)\r\n", GetLastError());
-        }
-        else
-        {
-            if(SOCKET_ERROR == connect(so, (sockaddr*)&addr, sizeof(addr)))
-            {
-                printf("Error: connect function failed (e=%d)\r\n", GetLastError());
-                closesocket(so);
-                so = INVALID_SOCKET;
-            }
-        }
-    }
-    ~Connection()
-    {
-        if(so != INVALID_SOCKET)
-        {
-            shutdown(so, SD_BOTH);
-            closesocket(so);
-            so = INVALID_SOCKET;
-        }
-    }
-    SOCKET sock()
-    {
-        return so;
-    }
-};
-
-UINT SetupCall(UINT programNetworkOrder, UINT progVersionNetworkOrder, UINT procNetworkOrder, UINT argCount, ...)
-{
-    AppendUint(buffer +  0, RPC_LAST_FRAGMENT_FLAG | (40 + (argCount*4)));
-    SET_UINT(buffer +  8, RPC_MESSAGE_TYPE_CALL_NETWORK_ORDER);
-    SET_UINT(buffer + 12, RPC_VERSION_NETWORK_ORDER);
-    SET_UINT(buffer + 16, programNetworkOrder);
-    SET_UINT(buffer + 20, progVersionNetworkOrder);
-    SET_UINT(buffer + 24, procNetworkOrder);
-    SET_UINT(buffer + 28, RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER);
-    SET_UINT(buffer + 32, 0);
-    SET_UINT(buffer + 36, RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER);
-    SET_UINT(buffer + 40, 0);
-    va_list args;
-    va_start(args, argCount);
-    UINT offset = 44;
-    for(int i = 0; i < argCount; i++)
-    {
-        AppendUint(buffer + offset, va_arg(args, UINT));
-        offset += 4;
-    }
-    va_end(args);
-    return offset;
-}
-
-// Tests that cannot be recovered and should be closed by the server
-int TestInvalidCall(UINT xid, UINT callSize)
-{
-    Connection conn(2049);
-
-    AppendUint(buffer +  4, xid);
-
-    int sent = send(conn.sock(), buffer, callSize, 0);
-    TEST_ASSERT(callSize == sent, __LINE__, "send failed, returned %d", sent);
-    int received = recv(conn.sock(), buffer, sizeof(buffer), 0);
-    TEST_ASSERT(received == 0, __LINE__, "expected recv to return 0 but got %d", received);
-    return TEST_SUCCESS;
-}
-
-int TestCall(Connection* conn, UINT xid, UINT callSize, UINT argCount, ...)
-{
-    AppendUint(buffer +  4, xid);
-    int sent = send(conn->sock(), buffer, callSize, 0);
-    TEST_ASSERT(callSize == sent, __LINE__, "expected to send %d but sent %d", callSize, sent);
-    int received = recv(conn->sock(), buffer, sizeof(buffer), 0);
-    unsigned expectedReceived = 24+(4*argCount);
-    TEST_ASSERT(received == expectedReceived, __LINE__, "expected to receive %d but got %d", expectedReceived, received);
-    TEST_ASSERT(ParseUint(buffer) == (RPC_LAST_FRAGMENT_FLAG | (expectedReceived-4)), __LINE__,
-        "expected fragment 0x%08x but got 0x%08x", (RPC_LAST_FRAGMENT_FLAG | expectedReceived), ParseUint(buffer));
-    TEST_ASSERT(ParseUint(buffer +  4) == xid, __LINE__, "bad xid (expected 0x%08x, got 0x%08x)", xid, ParseUint(buffer+4));
-    TEST_ASSERT(GET_UINT (buffer +  8) == RPC_MESSAGE_TYPE_REPLY_NETWORK_ORDER, __LINE__, "bad message type");
-    TEST_ASSERT(GET_UINT (buffer + 12) == RPC_REPLY_ACCEPTED_NETWORK_ORDER, __LINE__, "bad reply status");
-    TEST_ASSERT(GET_UINT (buffer + 16) == RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER, __LINE__, "bad auth flavor");
-    TEST_ASSERT(GET_UINT (buffer + 20) == 0, __LINE__, "bad auth length");
-    va_list args;
-    va_start(args, argCount);
-    UINT offset = 24;
-    for(int i = 0; i < argCount; i++)
-    {
-        UINT expected = va_arg(args, UINT);
-        UINT actual = ParseUint(buffer + offset + (4*i));
-        TEST_ASSERT(actual == expected, __LINE__, "expected replyUintData[%u] to be %u, but is %u",
-            i, expected, actual);
-    }
-    va_end(args);
-    return TEST_SUCCESS;
-}
-
-int run()
-{
-    Connection conn(2049);
-    //
-    // Test that the NULL procedures work
-    //
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, _2_NETWORK_ORDER, PROC_NULL, 0);
-        TEST_ASSERT(TestCall(&conn, 0x40f18a0f, callSize, 1, RPC_REPLY_ACCEPT_STATUS_SUCCESS), __LINE__, "PORTMAPv2 NULL failed");
-    }
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_MOUNT_NETWORK_ORDER, _3_NETWORK_ORDER, PROC_NULL, 0);
-        TEST_ASSERT(TestCall(&conn, 0xaf29bec8, callSize, 1, RPC_REPLY_ACCEPT_STATUS_SUCCESS), __LINE__, "MOUNTv4 NULL failed");
-    }
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, PROC_NULL, 0);
-        TEST_ASSERT(TestCall(&conn, 0xab9828de, callSize, 1, RPC_REPLY_ACCEPT_STATUS_SUCCESS), __LINE__, "NFSv3 NULL failed");
-    }
-
-    // TODO: test malformed calls
-    //   - fragment length is too short
-    //   - invalid credentials and verifier lengths (too long/too short)
-    //   - unknown message type (not call or reply)
-
-    #define RPC_VERSION_OFFSET 12
-    // Test invalid rpc version 0
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, _2_NETWORK_ORDER, PROC_NULL, 0);
-        AppendUint(buffer + RPC_VERSION_OFFSET, 0);
-        TEST_ASSERT(TestInvalidCall(0x9e0f824c, callSize), __LINE__, "TestInvalidCall failed");
-    }
-    // Test invalid rpc version 1
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, _2_NETWORK_ORDER, PROC_NULL, 0);
-        AppendUint(buffer + RPC_VERSION_OFFSET, 1);
-        TEST_ASSERT(TestInvalidCall(0x97e9b9a7, callSize), __LINE__, "TestInvalidCall failed");
-    }
-    // Test invalid rpc version 3
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, _2_NETWORK_ORDER, PROC_NULL, 0);
-        AppendUint(buffer + RPC_VERSION_OFFSET, 3);
-        TEST_ASSERT(TestInvalidCall(0x1fb8a732, callSize), __LINE__, "TestInvalidCall failed");
-    }
-
-    //
-    // Test program unavailable
-    //
-    {
-        UINT callSize = SetupCall(0x819a, 0, 0, 0);
-        TEST_ASSERT(TestCall(&conn, 0xb8932af1, callSize, 1, RPC_REPLY_ACCEPT_STATUS_PROG_UNAVAIL),
-            __LINE__, "test failed");
-    }
-    //
-    // Test program version mismatch
-    //
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, 0xf12, PROC_NULL, 0);
-        TEST_ASSERT(TestCall(&conn, 0xf0188a8f, callSize,
-            3, RPC_REPLY_ACCEPT_STATUS_PROG_MISMATCH, 2, 2), __LINE__, "test failed");
-    }
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, 0x4289, PROC_NULL, 0);
-        TEST_ASSERT(TestCall(&conn, 0x23547890, callSize,
-            3, RPC_REPLY_ACCEPT_STATUS_PROG_MISMATCH, 3, 4), __LINE__, "test failed");
-    }
-
-    //
-    // Test procedure unavailable
-    //
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, _2_NETWORK_ORDER, 0x9184, 0);
-        TEST_ASSERT(TestCall(&conn, 0x5918f8a9, callSize,
-            1, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL), __LINE__, "test failed");
-    }
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, 0x4f20, 0);
-        TEST_ASSERT(TestCall(&conn, 0x1948f910, callSize,
-            1, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL), __LINE__, "test failed");
-    }
-
-    // TODO: test a handle length of 0, some other value like 10, test max value of 64, and a value that is too large
-    {
-        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_FSINFO_NETWORK_ORDER,
-            2, 4, 0x84398184);
-        TEST_ASSERT(TestCall(&conn, 0xa819f9e8, callSize,
-            3, RPC_REPLY_ACCEPT_STATUS_SUCCESS, NFS3_ERROR_BADHANDLE, 0), __LINE__, "test failed");
-    }
-
-    return TEST_SUCCESS;
-}
-
-
-
-int PerformanceTest(unsigned runCount, unsigned loopCount)
-{
-    volatile char buffer[4];
-
-    LARGE_INTEGER frequency;
-    if(!QueryPerformanceFrequency(&frequency))
-    {
-        LOG_ERROR("QueryPerformanceFrequency failed (e=%d)", GetLastError());
-        return 1; // fail
-    }
-    LOG("frequency %llu", frequency.QuadPart);
-
-    LARGE_INTEGER before;
-    LARGE_INTEGER after;
-
-    for(unsigned run = 0; run < runCount; run++)
-    {
-        if(!QueryPerformanceCounter(&before))
-        {
-            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
-            return 1;
-        }
-        for(unsigned loop = 0; loop < loopCount; loop++)
-        {
-            AppendUint((char*)buffer, loop);
-        }
-        if(!QueryPerformanceCounter(&after))
-        {
-            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
-            return 1;
-        }
-        LOG("AppendUint: %llu", (after.QuadPart-before.QuadPart));
-        if(!QueryPerformanceCounter(&before))
-        {
-            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
-            return 1;
-        }
-        for(unsigned loop = 0; loop < loopCount; loop++)
-        {
-            *((volatile UINT*)buffer) = htonl(loop);
-        }
-        if(!QueryPerformanceCounter(&after))
-        {
-            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
-            return 1;
-        }
-        LOG("htonl     : %llu", (after.QuadPart-before.QuadPart));
-        if(!QueryPerformanceCounter(&before))
-        {
-            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
-            return 1;
-        }
-        for(unsigned loop = 0; loop < loopCount; loop++)
-        {
-            SET_UINT(buffer, loop);
-        }
-        if(!QueryPerformanceCounter(&after))
-        {
-            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
-            return 1;
-        }
-        LOG("rawset    : %llu", (after.QuadPart-before.QuadPart));
-    }
-    return TEST_SUCCESS;
-}
-
-int main(int argc, char* argv[])
-{
-    //PerformanceTest(3, 1000000000);
-
-    Wsa wsa;
-    if(wsa.error)
-    {
-        LOG_ERROR("WSAStartup failed (returned %d)", wsa.error);
-        return 1;
-    }
-
-    int result = run();
-
-    if(result == TEST_SUCCESS)
-    {
-        printf("SUCCESS\r\n");
-        return 0;
-    }
-    else
-    {
-        printf("ERROR\r\n");
-        return 1; // fail
-    }
+#include <winsock2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "Common.h"
+#include "Rpc.h"
+#include "BufferPool.h"
+#include "DirEnum.h"
+#include "SparseMap.h"
+#include "ReadAhead.h"
+#include "WriteGather.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "SelectServer.h"
+
+char buffer[4096];
+char largeRecord[512*1024];
+
+#define TEST_FAIL    0
+#define TEST_SUCCESS 1
+
+#define TEST_ASSERT(condition, line, fmt, ...)                              \
+    do                                                                      \
+    {                                                                       \
+        if(!(condition))                                                    \
+        {                                                                   \
+            printf("TEST_ASSERT line %u: " fmt "\r\n", line,##__VA_ARGS__); \
+            return TEST_FAIL;                                               \
+        }                                                                   \
+    } while(0);
+
+class Connection
+{
+  private:
+    SOCKET so;
+  public:
+    // address: in network order
+    Connection(unsigned short port, ULONG address = htonl(0x7F000001))
+    {
+        sockaddr_in addr;
+        addr.sin_family      = AF_INET;
+        addr.sin_port        = htons(port);
+        addr.sin_addr.s_addr = address;
+
+        so = socket(addr.sin_family, SOCK_STREAM, IPPROTO_TCP);
+        if(so == INVALID_SOCKET)
+        {
+            printf("Error: socket function failed (e=%d)\r\n", GetLastError());
+        }
+        else
+        {
+            if(SOCKET_ERROR == connect(so, (sockaddr*)&addr, sizeof(addr)))
+            {
+                printf("Error: connect function failed (e=%d)\r\n", GetLastError());
+                closesocket(so);
+                so = INVALID_SOCKET;
+            }
+        }
+    }
+    ~Connection()
+    {
+        if(so != INVALID_SOCKET)
+        {
+            shutdown(so, SD_BOTH);
+            closesocket(so);
+            so = INVALID_SOCKET;
+        }
+    }
+    SOCKET sock()
+    {
+        return so;
+    }
+};
+
+UINT SetupCall(UINT programNetworkOrder, UINT progVersionNetworkOrder, UINT procNetworkOrder, UINT argCount, ...)
+{
+    AppendUint(buffer +  0, RPC_LAST_FRAGMENT_FLAG | (40 + (argCount*4)));
+    SET_UINT(buffer +  8, RPC_MESSAGE_TYPE_CALL_NETWORK_ORDER);
+    SET_UINT(buffer + 12, RPC_VERSION_NETWORK_ORDER);
+    SET_UINT(buffer + 16, programNetworkOrder);
+    SET_UINT(buffer + 20, progVersionNetworkOrder);
+    SET_UINT(buffer + 24, procNetworkOrder);
+    SET_UINT(buffer + 28, RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER);
+    SET_UINT(buffer + 32, 0);
+    SET_UINT(buffer + 36, RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER);
+    SET_UINT(buffer + 40, 0);
+    va_list args;
+    va_start(args, argCount);
+    UINT offset = 44;
+    for(int i = 0; i < argCount; i++)
+    {
+        AppendUint(buffer + offset, va_arg(args, UINT));
+        offset += 4;
+    }
+    va_end(args);
+    return offset;
+}
+
+// Tests that cannot be recovered and should be closed by the server
+int TestInvalidCall(UINT xid, UINT callSize)
+{
+    Connection conn(2049);
+
+    AppendUint(buffer +  4, xid);
+
+    int sent = send(conn.sock(), buffer, callSize, 0);
+    TEST_ASSERT(callSize == sent, __LINE__, "send failed, returned %d", sent);
+    int received = recv(conn.sock(), buffer, sizeof(buffer), 0);
+    TEST_ASSERT(received == 0, __LINE__, "expected recv to return 0 but got %d", received);
+    return TEST_SUCCESS;
+}
+
+int TestCall(Connection* conn, UINT xid, UINT callSize, UINT argCount, ...)
+{
+    AppendUint(buffer +  4, xid);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(callSize == sent, __LINE__, "expected to send %d but sent %d", callSize, sent);
+    int received = recv(conn->sock(), buffer, sizeof(buffer), 0);
+    unsigned expectedReceived = 24+(4*argCount);
+    TEST_ASSERT(received == expectedReceived, __LINE__, "expected to receive %d but got %d", expectedReceived, received);
+    TEST_ASSERT(ParseUint(buffer) == (RPC_LAST_FRAGMENT_FLAG | (expectedReceived-4)), __LINE__,
+        "expected fragment 0x%08x but got 0x%08x", (RPC_LAST_FRAGMENT_FLAG | expectedReceived), ParseUint(buffer));
+    TEST_ASSERT(ParseUint(buffer +  4) == xid, __LINE__, "bad xid (expected 0x%08x, got 0x%08x)", xid, ParseUint(buffer+4));
+    TEST_ASSERT(GET_UINT (buffer +  8) == RPC_MESSAGE_TYPE_REPLY_NETWORK_ORDER, __LINE__, "bad message type");
+    TEST_ASSERT(GET_UINT (buffer + 12) == RPC_REPLY_ACCEPTED_NETWORK_ORDER, __LINE__, "bad reply status");
+    TEST_ASSERT(GET_UINT (buffer + 16) == RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER, __LINE__, "bad auth flavor");
+    TEST_ASSERT(GET_UINT (buffer + 20) == 0, __LINE__, "bad auth length");
+    va_list args;
+    va_start(args, argCount);
+    UINT offset = 24;
+    for(int i = 0; i < argCount; i++)
+    {
+        UINT expected = va_arg(args, UINT);
+        UINT actual = ParseUint(buffer + offset + (4*i));
+        TEST_ASSERT(actual == expected, __LINE__, "expected replyUintData[%u] to be %u, but is %u",
+            i, expected, actual);
+    }
+    va_end(args);
+    return TEST_SUCCESS;
+}
+
+int RecvAll(SOCKET so, char* dest, int length)
+{
+    int total = 0;
+    while(total < length)
+    {
+        int received = recv(so, dest + total, length - total, 0);
+        TEST_ASSERT(received > 0, __LINE__, "recv returned %d after %d of %d bytes", received, total, length);
+        total += received;
+    }
+    return TEST_SUCCESS;
+}
+
+int CheckNullReply(char* reply, UINT xid)
+{
+    TEST_ASSERT(ParseUint(reply) == (RPC_LAST_FRAGMENT_FLAG | 24), __LINE__, "bad fragment 0x%08x", ParseUint(reply));
+    TEST_ASSERT(ParseUint(reply + 4) == xid, __LINE__, "bad xid (expected 0x%08x, got 0x%08x)", xid, ParseUint(reply + 4));
+    TEST_ASSERT(GET_UINT (reply + 24) == RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER, __LINE__, "bad accept status");
+    return TEST_SUCCESS;
+}
+
+// Tests a record that arrives over multiple recvs (including a split record
+// marker), and multiple records that arrive in a single recv
+int TestRecordReassembly(Connection* conn)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, PROC_NULL, 0);
+    memcpy(largeRecord, buffer, callSize);
+    memset(largeRecord + callSize, 0, sizeof(largeRecord) - callSize);
+    AppendUint(largeRecord + 0, RPC_LAST_FRAGMENT_FLAG | (sizeof(largeRecord) - 4));
+    AppendUint(largeRecord + 4, 0x6a0c83b1);
+
+    const UINT splits[] = {3, 100000, sizeof(largeRecord)};
+    UINT offset = 0;
+    for(UINT i = 0; i < STATIC_ARRAY_LENGTH(splits); i++)
+    {
+        int sent = send(conn->sock(), largeRecord + offset, splits[i] - offset, 0);
+        TEST_ASSERT(sent == splits[i] - offset, __LINE__, "send returned %d", sent);
+        offset = splits[i];
+        Sleep(100);
+    }
+    TEST_ASSERT(RecvAll(conn->sock(), buffer, 28), __LINE__, "recv failed");
+    TEST_ASSERT(CheckNullReply(buffer, 0x6a0c83b1), __LINE__, "large record reply failed");
+
+    memcpy(buffer + callSize, buffer, callSize);
+    AppendUint(buffer + 4, 0x1d77e402);
+    AppendUint(buffer + callSize + 4, 0x1d77e403);
+    int sent = send(conn->sock(), buffer, 2*callSize, 0);
+    TEST_ASSERT(sent == 2*callSize, __LINE__, "send returned %d", sent);
+    TEST_ASSERT(RecvAll(conn->sock(), buffer, 56), __LINE__, "recv failed");
+    TEST_ASSERT(CheckNullReply(buffer     , 0x1d77e402), __LINE__, "first pipelined reply failed");
+    TEST_ASSERT(CheckNullReply(buffer + 28, 0x1d77e403), __LINE__, "second pipelined reply failed");
+    return TEST_SUCCESS;
+}
+
+// Mounts "/share" and returns its handle
+int Mount(Connection* conn, UINT* outHandle)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_MOUNT_NETWORK_ORDER, _3_NETWORK_ORDER, _1_NETWORK_ORDER,
+        3, 6, 0x2F736861, 0x72650000); // "/share"
+    AppendUint(buffer + 4, 0x8810a2f3);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    TEST_ASSERT(RecvAll(conn->sock(), buffer, 44), __LINE__, "recv failed");
+    TEST_ASSERT(GET_UINT (buffer + 24) == RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER, __LINE__, "bad accept status");
+    TEST_ASSERT(GET_UINT (buffer + 28) == MOUNT3_STATUS_OK_NETWORK_ORDER, __LINE__, "MNT failed");
+    TEST_ASSERT(ParseUint(buffer + 32) == 4, __LINE__, "expected a 4 byte handle");
+    *outHandle = ParseUint(buffer + 36);
+    return TEST_SUCCESS;
+}
+
+// Tests that FSINFO advertises real transfer sizes
+int TestFsinfo(Connection* conn, UINT handle)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_FSINFO_NETWORK_ORDER,
+        2, 4, handle);
+    AppendUint(buffer + 4, 0x3e91c0d7);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    TEST_ASSERT(RecvAll(conn->sock(), buffer, 84), __LINE__, "recv failed");
+    TEST_ASSERT(GET_UINT (buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "FSINFO failed");
+    UINT rtmax  = ParseUint(buffer + 36);
+    UINT rtpref = ParseUint(buffer + 40);
+    UINT rtmult = ParseUint(buffer + 44);
+    UINT wtmax  = ParseUint(buffer + 48);
+    UINT wtpref = ParseUint(buffer + 52);
+    UINT dtpref = ParseUint(buffer + 60);
+    TEST_ASSERT(rtmax != 0xFFFFFFFF, __LINE__, "rtmax is unlimited");
+    TEST_ASSERT(rtpref > 0 && rtpref <= rtmax, __LINE__, "rtpref %u is not within rtmax %u", rtpref, rtmax);
+    TEST_ASSERT(rtmult > 0 && rtmax % rtmult == 0, __LINE__, "rtmax %u is not a multiple of rtmult %u", rtmax, rtmult);
+    TEST_ASSERT(wtmax == rtmax && wtpref == rtpref && dtpref == rtpref, __LINE__, "write sizes don't match read sizes");
+    return TEST_SUCCESS;
+}
+
+// Receives a whole reply record into buffer
+int RecvReply(Connection* conn, UINT xid, UINT* outLength)
+{
+    TEST_ASSERT(RecvAll(conn->sock(), buffer, 4), __LINE__, "recv failed");
+    UINT length = ParseUint(buffer) & ~RPC_LAST_FRAGMENT_FLAG;
+    TEST_ASSERT(length >= 24 && length + 4 <= sizeof(buffer), __LINE__, "bad reply length %u", length);
+    TEST_ASSERT(RecvAll(conn->sock(), buffer + 4, length), __LINE__, "recv failed");
+    TEST_ASSERT(ParseUint(buffer + 4) == xid, __LINE__, "bad xid (expected 0x%08x, got 0x%08x)", xid, ParseUint(buffer + 4));
+    TEST_ASSERT(GET_UINT (buffer + 24) == RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER, __LINE__, "bad accept status");
+    *outLength = length + 4;
+    return TEST_SUCCESS;
+}
+
+// Lists the share in small pages and checks that every page continues
+// where the last one stopped
+int TestReaddirplus(Connection* conn, UINT handle)
+{
+    UINT64 cookie = 0;
+    UINT64 verifier = 0;
+    UINT entryCount = 0;
+    for(UINT page = 0; ; page++)
+    {
+        TEST_ASSERT(page < 100000, __LINE__, "READDIRPLUS never returned eof");
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_READDIRPLUS_NETWORK_ORDER,
+            8, 4, handle, (UINT)(cookie >> 32), (UINT)cookie, (UINT)(verifier >> 32), (UINT)verifier, 512, 1024);
+        UINT xid = 0x5b210000 + page;
+        AppendUint(buffer + 4, xid);
+        int sent = send(conn->sock(), buffer, callSize, 0);
+        TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+        UINT length;
+        TEST_ASSERT(RecvReply(conn, xid, &length), __LINE__, "READDIRPLUS reply failed");
+        TEST_ASSERT(length <= 28 + 1024, __LINE__, "reply of %u bytes is larger than maxcount", length);
+        TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__,
+            "READDIRPLUS failed with %u", ParseUint(buffer + 28));
+        TEST_ASSERT(GET_UINT(buffer + 32) == 0, __LINE__, "unexpected directory attributes");
+        UINT64 pageVerifier = ParseUint64(buffer + 36);
+        TEST_ASSERT(page == 0 || pageVerifier == verifier, __LINE__, "cookie verifier changed");
+        verifier = pageVerifier;
+
+        UINT offset = 44;
+        UINT pageEntries = 0;
+        while(ParseUint(buffer + offset) == 1)
+        {
+            UINT nameLength = ParseUint(buffer + offset + 12);
+            offset += 16 + Align4(nameLength);
+            UINT64 entryCookie = ParseUint64(buffer + offset);
+            TEST_ASSERT(entryCookie == cookie + 1, __LINE__, "expected cookie %llu but got %llu", cookie + 1, entryCookie);
+            cookie = entryCookie;
+            offset += 8;
+            if(ParseUint(buffer + offset) == 1)
+            {
+                offset += 84;
+            }
+            offset += 4;
+            if(ParseUint(buffer + offset) == 1)
+            {
+                offset += 8 + Align4(ParseUint(buffer + offset + 4));
+            }
+            else
+            {
+                offset += 4;
+            }
+            TEST_ASSERT(offset + 8 <= length, __LINE__, "entry runs past the end of the reply");
+            pageEntries++;
+        }
+        entryCount += pageEntries;
+        UINT eof = ParseUint(buffer + offset + 4);
+        TEST_ASSERT(offset + 8 == length, __LINE__, "reply is %u bytes but the entries end at %u", length, offset + 8);
+        if(eof)
+        {
+            break;
+        }
+        TEST_ASSERT(pageEntries > 0, __LINE__, "page %u has no entries but is not eof", page);
+    }
+    // "." and ".."
+    TEST_ASSERT(entryCount >= 2, __LINE__, "expected at least 2 entries but got %u", entryCount);
+
+    // A continuation with the wrong verifier is rejected
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_READDIRPLUS_NETWORK_ORDER,
+        8, 4, handle, 0, 1, (UINT)(verifier >> 32), (UINT)verifier + 1, 512, 1024);
+    TEST_ASSERT(TestCall(conn, 0x5b2fffff, callSize, 3, RPC_REPLY_ACCEPT_STATUS_SUCCESS, NFS3_ERROR_BAD_COOKIE, 0),
+        __LINE__, "stale cookie was not rejected");
+    return TEST_SUCCESS;
+}
+
+// Tests that COMMIT returns the same write verifier every time, and that
+// writing to or reading from a directory fails
+// Note: only the share root is used so the test never modifies any files
+int TestWriteCommit(Connection* conn, UINT handle)
+{
+    UINT64 verifier = 0;
+    for(UINT i = 0; i < 2; i++)
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_COMMIT_NETWORK_ORDER,
+            5, 4, handle, 0, 0, 0);
+        AppendUint(buffer + 4, 0x77c10a00 + i);
+        int sent = send(conn->sock(), buffer, callSize, 0);
+        TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+        TEST_ASSERT(RecvAll(conn->sock(), buffer, 48), __LINE__, "recv failed");
+        TEST_ASSERT(GET_UINT (buffer + 24) == RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER, __LINE__, "bad accept status");
+        TEST_ASSERT(GET_UINT (buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "COMMIT failed");
+        UINT64 commitVerifier = ParseUint64(buffer + 40);
+        TEST_ASSERT(i == 0 || commitVerifier == verifier, __LINE__, "write verifier changed");
+        verifier = commitVerifier;
+    }
+
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_WRITE_NETWORK_ORDER,
+        9, 4, handle, 0, 0, 4, NFS3_STABLE_FILE_SYNC, 4, 0x74657374); // "test"
+    TEST_ASSERT(TestCall(conn, 0x77c10a10, callSize, 4, RPC_REPLY_ACCEPT_STATUS_SUCCESS, NFS3_ERROR_ISDIR, 0, 0),
+        __LINE__, "WRITE to a directory did not fail");
+
+    callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_READ_NETWORK_ORDER,
+        5, 4, handle, 0, 0, 4096);
+    TEST_ASSERT(TestCall(conn, 0x77c10a11, callSize, 3, RPC_REPLY_ACCEPT_STATUS_SUCCESS, NFS3_ERROR_ISDIR, 0),
+        __LINE__, "READ of a directory did not fail");
+    return TEST_SUCCESS;
+}
+
+// Tests that a WRITE larger than StreamWriteChunk that arrives over several
+// recvs is answered once all of its data is in, and that the record after
+// its data is still handled
+// Note: only the share root is used, so the WRITE fails with ISDIR
+int TestStreamWrite(Connection* conn, UINT handle)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_WRITE_NETWORK_ORDER, 7,
+        4, handle, 0, 0, sizeof(largeRecord) - 72, NFS3_STABLE_FILE_SYNC, sizeof(largeRecord) - 72);
+    TEST_ASSERT(callSize == 72, __LINE__, "expected a 72 byte header but got %u", callSize);
+    memcpy(largeRecord, buffer, callSize);
+    memset(largeRecord + callSize, 0x5a, sizeof(largeRecord) - callSize);
+    AppendUint(largeRecord + 0, RPC_LAST_FRAGMENT_FLAG | (sizeof(largeRecord) - 4));
+    AppendUint(largeRecord + 4, 0x57e4a000);
+
+    // The NULL call follows the last of the data in the same send
+    UINT nullSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, PROC_NULL, 0);
+    AppendUint(buffer + 4, 0x57e4a001);
+
+    const UINT splits[] = {40, 2000, 300000, sizeof(largeRecord) - 10};
+    UINT offset = 0;
+    for(UINT i = 0; i < STATIC_ARRAY_LENGTH(splits); i++)
+    {
+        int sent = send(conn->sock(), largeRecord + offset, splits[i] - offset, 0);
+        TEST_ASSERT(sent == splits[i] - offset, __LINE__, "send returned %d", sent);
+        offset = splits[i];
+        Sleep(50);
+    }
+    memmove(buffer + 10, buffer, nullSize);
+    memcpy(buffer, largeRecord + offset, 10);
+    int sent = send(conn->sock(), buffer, 10 + nullSize, 0);
+    TEST_ASSERT(sent == 10 + nullSize, __LINE__, "send returned %d", sent);
+
+    TEST_ASSERT(RecvAll(conn->sock(), buffer, 40 + 28), __LINE__, "recv failed");
+    TEST_ASSERT(ParseUint(buffer + 4) == 0x57e4a000, __LINE__, "bad xid 0x%08x", ParseUint(buffer + 4));
+    TEST_ASSERT(GET_UINT (buffer + 24) == RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER, __LINE__, "bad accept status");
+    TEST_ASSERT(ParseUint(buffer + 28) == NFS3_ERROR_ISDIR, __LINE__, "WRITE to a directory returned %u", ParseUint(buffer + 28));
+    TEST_ASSERT(CheckNullReply(buffer + 40, 0x57e4a001), __LINE__, "reply after the WRITE failed");
+    return TEST_SUCCESS;
+}
+
+// The attributes a client checks to decide whether its cache is still valid
+struct ClientAttributes
+{
+    UINT type;
+    UINT64 fsid;
+    UINT64 fileid;
+    UINT64 size;
+    UINT64 mtime; // seconds << 32 | nanoseconds
+    UINT64 ctime;
+};
+void ParseClientAttributes(char* fattr3, ClientAttributes* attributes)
+{
+    attributes->type   = ParseUint  (fattr3);
+    attributes->size   = ParseUint64(fattr3 + 20);
+    attributes->fsid   = ParseUint64(fattr3 + 44);
+    attributes->fileid = ParseUint64(fattr3 + 52);
+    attributes->mtime  = ParseUint64(fattr3 + 68);
+    attributes->ctime  = ParseUint64(fattr3 + 76);
+}
+
+// Tests that GETATTR and READDIRPLUS agree on the attributes of the share
+int TestAttributes(Connection* conn, UINT handle)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_GETATTR_NETWORK_ORDER,
+        2, 4, handle);
+    AppendUint(buffer + 4, 0x6a0e3100);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, 0x6a0e3100, &length), __LINE__, "GETATTR reply failed");
+    TEST_ASSERT(length == 32 + 84, __LINE__, "GETATTR reply is %u bytes", length);
+    TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "GETATTR failed");
+    ClientAttributes attributes;
+    ParseClientAttributes(buffer + 32, &attributes);
+    TEST_ASSERT(attributes.type == NFS3_FILE_TYPE_DIR, __LINE__, "the share is type %u", attributes.type);
+    TEST_ASSERT(attributes.fsid != 0, __LINE__, "fsid is 0");
+    TEST_ASSERT((UINT)attributes.mtime < 1000000000 && (UINT)attributes.ctime < 1000000000, __LINE__,
+        "nanoseconds out of range");
+
+    // The first entry of the listing is "."
+    callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_READDIRPLUS_NETWORK_ORDER,
+        8, 4, handle, 0, 0, 0, 0, 512, 1024);
+    AppendUint(buffer + 4, 0x6a0e3101);
+    sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    TEST_ASSERT(RecvReply(conn, 0x6a0e3101, &length), __LINE__, "READDIRPLUS reply failed");
+    TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "READDIRPLUS failed");
+    TEST_ASSERT(ParseUint(buffer + 44) == 1, __LINE__, "READDIRPLUS returned no entries");
+    TEST_ASSERT(ParseUint(buffer + 56) == 1 && buffer[60] == '.', __LINE__, "the first entry is not \".\"");
+    UINT64 entryFileid = ParseUint64(buffer + 48);
+    TEST_ASSERT(ParseUint(buffer + 72) == 1, __LINE__, "\".\" has no attributes");
+    ClientAttributes entryAttributes;
+    ParseClientAttributes(buffer + 76, &entryAttributes);
+    TEST_ASSERT(entryFileid == attributes.fileid && entryAttributes.fileid == attributes.fileid, __LINE__,
+        "fileid %llu from GETATTR doesn't match %llu and %llu from READDIRPLUS",
+        attributes.fileid, entryFileid, entryAttributes.fileid);
+    TEST_ASSERT(entryAttributes.fsid == attributes.fsid, __LINE__, "fsid doesn't match");
+    TEST_ASSERT(entryAttributes.type == NFS3_FILE_TYPE_DIR, __LINE__, "\".\" is type %u", entryAttributes.type);
+    return TEST_SUCCESS;
+}
+
+// Returns: the heap calls the server has made while handling calls, or
+//          0xFFFFFFFFFFFFFFFF if the server doesn't count them (or on error)
+UINT64 GetHeapCalls(Connection* conn, UINT xid)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _5_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, xid);
+    UINT length;
+    if(send(conn->sock(), buffer, callSize, 0) != (int)callSize || !RecvReply(conn, xid, &length) ||
+       ParseUint(buffer + 28) != 0 || length != 40)
+    {
+        return 0xFFFFFFFFFFFFFFFFULL;
+    }
+    return ParseUint64(buffer + 32);
+}
+
+// Tests that calls the server has seen before make no heap calls, only
+// debug builds of the server count them
+int TestHeapCalls(Connection* conn, UINT handle)
+{
+    UINT64 before = 0;
+    for(UINT round = 0; round < 8; round++)
+    {
+        // The first round creates whatever state outlives the calls
+        if(round == 1)
+        {
+            before = GetHeapCalls(conn, 0x4ea90000);
+            if(before == 0xFFFFFFFFFFFFFFFFULL)
+            {
+                printf("heap calls are only counted by debug builds of the server, skipped\r\n");
+                return TEST_SUCCESS;
+            }
+        }
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_GETATTR_NETWORK_ORDER,
+            2, 4, handle);
+        AppendUint(buffer + 4, 0x4ea90100 + round);
+        int sent = send(conn->sock(), buffer, callSize, 0);
+        TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+        UINT length;
+        TEST_ASSERT(RecvReply(conn, 0x4ea90100 + round, &length), __LINE__, "GETATTR reply failed");
+
+        callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_COMMIT_NETWORK_ORDER,
+            5, 4, handle, 0, 0, 0);
+        AppendUint(buffer + 4, 0x4ea90200 + round);
+        sent = send(conn->sock(), buffer, callSize, 0);
+        TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+        TEST_ASSERT(RecvReply(conn, 0x4ea90200 + round, &length), __LINE__, "COMMIT reply failed");
+
+        callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_READ_NETWORK_ORDER,
+            5, 4, handle, 0, 0, 4096);
+        TEST_ASSERT(TestCall(conn, 0x4ea90300 + round, callSize, 3, RPC_REPLY_ACCEPT_STATUS_SUCCESS, NFS3_ERROR_ISDIR, 0),
+            __LINE__, "READ of a directory did not fail");
+
+        callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_FSINFO_NETWORK_ORDER,
+            2, 4, handle);
+        AppendUint(buffer + 4, 0x4ea90400 + round);
+        sent = send(conn->sock(), buffer, callSize, 0);
+        TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+        TEST_ASSERT(RecvReply(conn, 0x4ea90400 + round, &length), __LINE__, "FSINFO reply failed");
+    }
+    UINT64 after = GetHeapCalls(conn, 0x4ea90001);
+    TEST_ASSERT(after == before, __LINE__, "%llu heap calls were made by 28 calls", after - before);
+    return TEST_SUCCESS;
+}
+
+// Returns: the calls that the histogram buckets add up to
+UINT64 HistogramTotal(char* buckets, UINT bucketCount)
+{
+    UINT64 total = 0;
+    for(UINT i = 0; i < bucketCount; i++)
+    {
+        total += ParseUint64(buckets + i * 8);
+    }
+    return total;
+}
+// Returns: the highest value of the bucket that holds the call at fraction
+//          of the total (in microseconds)
+UINT64 HistogramPercentile(char* buckets, UINT bucketCount, UINT64 total, double fraction)
+{
+    UINT64 target = (UINT64)((double)total * fraction + 0.5);
+    if(target == 0)
+    {
+        target = 1;
+    }
+    UINT64 seen = 0;
+    for(UINT i = 0; i < bucketCount; i++)
+    {
+        seen += ParseUint64(buckets + i * 8);
+        if(seen >= target)
+        {
+            return StatsBucketHighest(i);
+        }
+    }
+    return StatsBucketHighest(bucketCount - 1);
+}
+
+// Offset of the first procedure in a SUMMARY reply
+#define STATS_SUMMARY_PROCEDURES_OFFSET 52
+#define STATS_SUMMARY_PROCEDURE_SIZE    56
+
+// Layout of a LOOP reply
+#define STATS_LOOP_WINDOWS_OFFSET 44
+#define STATS_LOOP_WINDOW_SIZE(bucketCount) (44 + 4 * (bucketCount) * 8)
+#define STATS_LOOP_STALL_SIZE     24
+
+// Layout of a SCHEDULER reply
+#define STATS_SCHEDULER_CLASSES_OFFSET 36
+#define STATS_SCHEDULER_CLASS_SIZE     36
+#define STATS_SCHEDULER_CLASS_COUNT    3
+#define STATS_SCHEDULER_OVERLOAD_SIZE  28
+#define STATS_SCHEDULER_DROP_COUNT     3
+#define STATS_SCHEDULER_DROPS_SIZE     (4 + STATS_SCHEDULER_DROP_COUNT * 16)
+
+// Layout of a CLIENTS reply
+#define STATS_CLIENTS_OFFSET     32
+#define STATS_CLIENT_SIZE        52
+
+// Length of a READ_AHEAD reply
+#define STATS_READ_AHEAD_SIZE    (28 + 12 + 8 * 8)
+
+// Length of a BLOCK_CACHE reply
+#define STATS_BLOCK_CACHE_SIZE   (28 + 4 + 4 * 8)
+
+// Length of a DIRECT_IO reply
+#define STATS_DIRECT_IO_SIZE     (28 + 4 + 4 * 8)
+
+// Length of an ATTRIBUTES reply
+#define STATS_ATTRIBUTES_SIZE    (28 + 2 * 8)
+
+// The alignment of direct I/O in the server (DIRECT_IO_ALIGNMENT)
+#define DIRECT_IO_TEST_ALIGNMENT 4096
+
+// Tests that the stats program counts the calls of the earlier tests
+int TestStats(Connection* conn)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _1_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a70001);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, 0x51a70001, &length), __LINE__, "SUMMARY reply failed");
+    UINT activeConnections = ParseUint(buffer + 36);
+    TEST_ASSERT(activeConnections >= 1, __LINE__, "%u active connections", activeConnections);
+    UINT procedureCount = ParseUint(buffer + 48);
+    UINT64 getattrCalls = 0;
+    for(UINT i = 0; i < procedureCount; i++)
+    {
+        char* procedure = buffer + STATS_SUMMARY_PROCEDURES_OFFSET + i * STATS_SUMMARY_PROCEDURE_SIZE;
+        TEST_ASSERT(procedure + STATS_SUMMARY_PROCEDURE_SIZE <= buffer + length, __LINE__, "procedures run past the reply");
+        if(ParseUint(procedure) == RPC_PROGRAM_NFS && ParseUint(procedure + 4) == NFS3_PROC_GETATTR)
+        {
+            getattrCalls = ParseUint64(procedure + 8);
+        }
+    }
+    TEST_ASSERT(getattrCalls >= 1, __LINE__, "no GETATTR calls were counted");
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _2_NETWORK_ORDER,
+        2, RPC_PROGRAM_NFS, NFS3_PROC_GETATTR);
+    AppendUint(buffer + 4, 0x51a70002);
+    sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    TEST_ASSERT(RecvReply(conn, 0x51a70002, &length), __LINE__, "HISTOGRAM reply failed");
+    TEST_ASSERT(ParseUint(buffer + 28) == 0, __LINE__, "HISTOGRAM failed");
+    UINT bucketCount = ParseUint(buffer + 36);
+    TEST_ASSERT(length == 40 + 2 * bucketCount * 8, __LINE__, "HISTOGRAM reply is %u bytes", length);
+    UINT64 waitTotal = HistogramTotal(buffer + 40, bucketCount);
+    UINT64 execTotal = HistogramTotal(buffer + 40 + bucketCount * 8, bucketCount);
+    TEST_ASSERT(waitTotal == getattrCalls && execTotal == getattrCalls, __LINE__,
+        "histograms have %llu and %llu calls but there were %llu", waitTotal, execTotal, getattrCalls);
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _2_NETWORK_ORDER,
+        2, RPC_PROGRAM_NFS, 0x9184);
+    TEST_ASSERT(TestCall(conn, 0x51a70003, callSize, 2, RPC_REPLY_ACCEPT_STATUS_SUCCESS, 1),
+        __LINE__, "HISTOGRAM of an unknown procedure did not fail");
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _3_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a70004);
+    sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    TEST_ASSERT(RecvReply(conn, 0x51a70004, &length), __LINE__, "LOOP reply failed");
+    TEST_ASSERT(ParseUint(buffer + 28) == 0, __LINE__, "LOOP failed");
+    bucketCount = ParseUint(buffer + 36);
+    UINT windowSize = STATS_LOOP_WINDOW_SIZE(bucketCount);
+    char* current = buffer + STATS_LOOP_WINDOWS_OFFSET + windowSize;
+    UINT stallCount = ParseUint(current + windowSize);
+    TEST_ASSERT(length == STATS_LOOP_WINDOWS_OFFSET + 2 * windowSize + 4 + stallCount * STATS_LOOP_STALL_SIZE,
+        __LINE__, "LOOP reply is %u bytes", length);
+    UINT64 iterations = ParseUint64(current + 4) + ParseUint64(buffer + STATS_LOOP_WINDOWS_OFFSET + 4);
+    UINT64 handlerCalls = ParseUint64(current + 12);
+    TEST_ASSERT(iterations >= 1 && handlerCalls >= 1, __LINE__,
+        "%llu iterations and %llu handler calls", iterations, handlerCalls);
+    UINT64 handlerTotal = HistogramTotal(current + 44 + bucketCount * 8, bucketCount);
+    TEST_ASSERT(handlerTotal == handlerCalls, __LINE__,
+        "handler histogram has %llu calls but there were %llu", handlerTotal, handlerCalls);
+
+    // Fails with 1 when the server has no SpanFile
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _4_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a70005);
+    sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    TEST_ASSERT(RecvReply(conn, 0x51a70005, &length), __LINE__, "DUMP_SPANS reply failed");
+    UINT dumpStatus = ParseUint(buffer + 28);
+    TEST_ASSERT((dumpStatus == 0 && length == 40) || (dumpStatus == 1 && length == 32), __LINE__,
+        "DUMP_SPANS returned %u in %u bytes", dumpStatus, length);
+    return TEST_SUCCESS;
+}
+
+#define ASYNC_TEST_GETATTRS 16
+
+// Tests that GETATTRs of the share root sent together, which the server
+// hands to its file system workers, are replied to in the order they were sent
+int TestAsyncGetattr(Connection* conn, UINT handle)
+{
+    UINT offset = 0;
+    for(UINT i = 0; i < ASYNC_TEST_GETATTRS; i++)
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_GETATTR_NETWORK_ORDER,
+            2, 4, handle);
+        AppendUint(buffer + 4, 0x6e7a0000 + i);
+        memcpy(largeRecord + offset, buffer, callSize);
+        offset += callSize;
+    }
+    int sent = send(conn->sock(), largeRecord, offset, 0);
+    TEST_ASSERT(sent == offset, __LINE__, "send returned %d", sent);
+
+    for(UINT i = 0; i < ASYNC_TEST_GETATTRS; i++)
+    {
+        UINT length;
+        TEST_ASSERT(RecvReply(conn, 0x6e7a0000 + i, &length), __LINE__, "GETATTR %u reply failed", i);
+        TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "GETATTR %u failed", i);
+    }
+    return TEST_SUCCESS;
+}
+
+#define SCHEDULER_TEST_READS 8
+
+// Tests that a GETATTR that arrives behind a backlog of READs is handled
+// first, and that a retransmit of a queued READ replaces it (the READ is only
+// replied to once), the calls are sent in one send so the server receives
+// them together
+int TestScheduler(Connection* conn, UINT handle)
+{
+    UINT offset = 0;
+    for(UINT i = 0; i < SCHEDULER_TEST_READS; i++)
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_READ_NETWORK_ORDER,
+            5, 4, handle, 0, 0, 4096);
+        AppendUint(buffer + 4, 0x5c4e0000 + i);
+        memcpy(largeRecord + offset, buffer, callSize);
+        offset += callSize;
+        if(i == SCHEDULER_TEST_READS - 1)
+        {
+            memcpy(largeRecord + offset, buffer, callSize);
+            offset += callSize;
+        }
+    }
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_GETATTR_NETWORK_ORDER,
+        2, 4, handle);
+    AppendUint(buffer + 4, 0x5c4e0100);
+    memcpy(largeRecord + offset, buffer, callSize);
+    offset += callSize;
+    int sent = send(conn->sock(), largeRecord, offset, 0);
+    TEST_ASSERT(sent == offset, __LINE__, "send returned %d", sent);
+
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, 0x5c4e0100, &length), __LINE__, "GETATTR was not handled before the READs");
+    TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "GETATTR failed");
+    for(UINT i = 0; i < SCHEDULER_TEST_READS; i++)
+    {
+        TEST_ASSERT(RecvReply(conn, 0x5c4e0000 + i, &length), __LINE__, "READ %u reply failed", i);
+        TEST_ASSERT(ParseUint(buffer + 28) == NFS3_ERROR_ISDIR, __LINE__, "READ of a directory did not fail");
+    }
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _6_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x5c4e0200);
+    sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    TEST_ASSERT(RecvReply(conn, 0x5c4e0200, &length), __LINE__, "SCHEDULER reply failed");
+    TEST_ASSERT(ParseUint(buffer + 32) == STATS_SCHEDULER_CLASS_COUNT && length == STATS_SCHEDULER_CLASSES_OFFSET +
+        STATS_SCHEDULER_CLASS_COUNT * STATS_SCHEDULER_CLASS_SIZE + STATS_SCHEDULER_OVERLOAD_SIZE +
+        STATS_SCHEDULER_DROPS_SIZE, __LINE__, "SCHEDULER reply is %u bytes", length);
+    // The test's handful of calls never overload the server
+    char* overload = buffer + STATS_SCHEDULER_CLASSES_OFFSET + STATS_SCHEDULER_CLASS_COUNT * STATS_SCHEDULER_CLASS_SIZE;
+    TEST_ASSERT(ParseUint(overload + 8) == 0, __LINE__, "the server is overloaded");
+    char* superseded = overload + STATS_SCHEDULER_OVERLOAD_SIZE + 4 + 1 * 16;
+    TEST_ASSERT(ParseUint64(superseded) >= 1, __LINE__, "the retransmitted READ was not superseded");
+    char* bulk = buffer + STATS_SCHEDULER_CLASSES_OFFSET + 2 * STATS_SCHEDULER_CLASS_SIZE;
+    TEST_ASSERT(ParseUint(bulk + 4) == 0, __LINE__, "%u bulk calls are still queued", ParseUint(bulk + 4));
+    TEST_ASSERT(ParseUint(bulk + 8) >= SCHEDULER_TEST_READS && ParseUint64(bulk + 20) >= SCHEDULER_TEST_READS,
+        __LINE__, "at most %u of %llu bulk calls were queued", ParseUint(bulk + 8), ParseUint64(bulk + 20));
+    return TEST_SUCCESS;
+}
+
+// Tests that this client's calls are counted and that every call that has
+// been replied to is out of flight (only the CLIENTS call itself is in flight)
+int TestClients(Connection* conn)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _7_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0xc11e0000);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, 0xc11e0000, &length), __LINE__, "CLIENTS reply failed");
+    UINT clientCount = ParseUint(buffer + 28);
+    TEST_ASSERT(length == STATS_CLIENTS_OFFSET + clientCount * STATS_CLIENT_SIZE, __LINE__,
+        "CLIENTS reply is %u bytes", length);
+    char* client = NULL;
+    for(UINT i = 0; i < clientCount; i++)
+    {
+        char* next = buffer + STATS_CLIENTS_OFFSET + i * STATS_CLIENT_SIZE;
+        if(GET_UINT(next) == inet_addr("127.0.0.1"))
+        {
+            client = next;
+        }
+    }
+    TEST_ASSERT(client, __LINE__, "127.0.0.1 is not one of the %u clients", clientCount);
+    TEST_ASSERT(ParseUint(client + 4) >= 1, __LINE__, "the client has no connections");
+    TEST_ASSERT(ParseUint(client + 16) == 1, __LINE__, "the client has %u calls in flight", ParseUint(client + 16));
+    TEST_ASSERT(ParseUint64(client + 20) > SCHEDULER_TEST_READS, __LINE__, "the client made %llu calls",
+        ParseUint64(client + 20));
+    TEST_ASSERT(ParseUint64(client + 28) >= ParseUint64(client + 20) * 40, __LINE__, "%llu calls only cost %llu bytes",
+        ParseUint64(client + 20), ParseUint64(client + 28));
+    return TEST_SUCCESS;
+}
+
+// Tests that the read-ahead stats are consistent, the test only reads the
+// share root so it never reads ahead itself
+int TestReadAhead(Connection* conn)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _8_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x4eadae00);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, 0x4eadae00, &length), __LINE__, "READ_AHEAD reply failed");
+    TEST_ASSERT(length == STATS_READ_AHEAD_SIZE, __LINE__, "READ_AHEAD reply is %u bytes", length);
+    TEST_ASSERT(ParseUint(buffer + 28) <= ParseUint(buffer + 32), __LINE__, "the min window %u is over the max %u",
+        ParseUint(buffer + 28), ParseUint(buffer + 32));
+    TEST_ASSERT(ParseUint64(buffer + 88) <= ParseUint64(buffer + 72), __LINE__,
+        "%llu bytes were read ahead but only %llu were queued", ParseUint64(buffer + 88), ParseUint64(buffer + 72));
+    TEST_ASSERT(ParseUint64(buffer + 96) <= ParseUint64(buffer + 72), __LINE__,
+        "%llu bytes read ahead were wasted but only %llu were queued", ParseUint64(buffer + 96), ParseUint64(buffer + 72));
+    return TEST_SUCCESS;
+}
+
+// Receives a whole reply record of any size into largeRecord
+int RecvLargeReply(Connection* conn, UINT* outXid, UINT* outLength)
+{
+    TEST_ASSERT(RecvAll(conn->sock(), largeRecord, 4), __LINE__, "recv failed");
+    UINT length = ParseUint(largeRecord) & ~RPC_LAST_FRAGMENT_FLAG;
+    TEST_ASSERT(length >= 24 && length + 4 <= sizeof(largeRecord), __LINE__, "bad reply length %u", length);
+    TEST_ASSERT(RecvAll(conn->sock(), largeRecord + 4, length), __LINE__, "recv failed");
+    TEST_ASSERT(GET_UINT(largeRecord + 24) == RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER, __LINE__, "bad accept status");
+    *outXid = ParseUint(largeRecord + 4);
+    *outLength = length + 4;
+    return TEST_SUCCESS;
+}
+
+// The tests of a file in the share write their own data over its first
+// FILE_TEST_SIZE bytes
+#define FILE_TEST_SIZE (1024*1024)
+char fileData[FILE_TEST_SIZE];
+
+// Fills count bytes with the data at offset of a file written with seed,
+// every byte depends on where it is and on the seed, so data left by a
+// write with another seed is never mistaken for it
+void FillFileData(char* data, UINT64 offset, UINT count, UINT seed)
+{
+    for(UINT i = 0; i < count; i++)
+    {
+        UINT64 position = offset + i;
+        data[i] = (char)(position + (position >> 12) * 7 + seed * 131);
+    }
+}
+
+// Returns: the index of the first byte that FillFileData wouldn't have
+//          written, count if they all match
+UINT CheckFileData(char* data, UINT64 offset, UINT count, UINT seed)
+{
+    for(UINT i = 0; i < count; i++)
+    {
+        UINT64 position = offset + i;
+        if(data[i] != (char)(position + (position >> 12) * 7 + seed * 131))
+        {
+            return i;
+        }
+    }
+    return count;
+}
+
+// Builds a WRITE of count bytes of data at offset in largeRecord, the
+// caller sets the xid
+// Returns: the size of the record, 0 if it doesn't fit in largeRecord
+UINT SetupWriteCall(UINT handle, UINT64 offset, UINT stable, char* data, UINT count)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_WRITE_NETWORK_ORDER, 7,
+        4, handle, (UINT)(offset >> 32), (UINT)offset, count, stable, count);
+    UINT recordSize = callSize + Align4(count);
+    if(recordSize > sizeof(largeRecord))
+    {
+        return 0;
+    }
+    memcpy(largeRecord, buffer, callSize);
+    memcpy(largeRecord + callSize, data, count);
+    memset(largeRecord + callSize + count, 0, recordSize - callSize - count);
+    AppendUint(largeRecord, RPC_LAST_FRAGMENT_FLAG | (recordSize - 4));
+    return recordSize;
+}
+
+// Checks the reply in buffer of a WRITE of count bytes
+int CheckWriteReply(UINT count)
+{
+    TEST_ASSERT(ParseUint(buffer + 28) == NFS3_STATUS_OK, __LINE__, "WRITE failed with %u", ParseUint(buffer + 28));
+    // The count follows the post_op_attr, if there is one
+    UINT countOffset = (ParseUint(buffer + 36) == 1) ? 40 + 84 : 40;
+    TEST_ASSERT(ParseUint(buffer + countOffset) == count, __LINE__, "WRITE wrote %u of %u bytes",
+        ParseUint(buffer + countOffset), count);
+    return TEST_SUCCESS;
+}
+
+// Writes count bytes of the data FillFileData makes at offset with one WRITE
+// Note: the reply is left in buffer
+int WriteShareFile(Connection* conn, UINT handle, UINT xid, UINT64 offset, UINT stable, UINT count, UINT seed)
+{
+    FillFileData(fileData, offset, count, seed);
+    UINT recordSize = SetupWriteCall(handle, offset, stable, fileData, count);
+    TEST_ASSERT(recordSize, __LINE__, "a WRITE of %u bytes doesn't fit in a record", count);
+    AppendUint(largeRecord + 4, xid);
+    int sent = send(conn->sock(), largeRecord, recordSize, 0);
+    TEST_ASSERT(sent == recordSize, __LINE__, "send returned %d", sent);
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, xid, &length), __LINE__, "WRITE reply failed");
+    TEST_ASSERT(CheckWriteReply(count), __LINE__, "WRITE at %llu failed", offset);
+    return TEST_SUCCESS;
+}
+
+// Checks the reply in largeRecord of a READ of at most count bytes and
+// copies its data
+// outLength: the bytes the READ returned
+int CheckReadReply(UINT count, char* data, UINT* outLength)
+{
+    TEST_ASSERT(ParseUint(largeRecord + 28) == NFS3_STATUS_OK, __LINE__, "READ failed with %u", ParseUint(largeRecord + 28));
+    UINT length = ParseUint(largeRecord + 128);
+    TEST_ASSERT(length <= count && ParseUint(largeRecord + 120) == length, __LINE__, "READ returned %u of %u bytes",
+        length, count);
+    memcpy(data, largeRecord + 132, length);
+    *outLength = length;
+    return TEST_SUCCESS;
+}
+
+// Reads count bytes at offset with one READ
+// outLength: the bytes the READ returned, less than count only at the end
+//            of the file
+int ReadShareFile(Connection* conn, UINT handle, UINT xid, UINT64 offset, UINT count, char* data, UINT* outLength)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_READ_NETWORK_ORDER,
+        5, 4, handle, (UINT)(offset >> 32), (UINT)offset, count);
+    AppendUint(buffer + 4, xid);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    UINT replyXid, length;
+    TEST_ASSERT(RecvLargeReply(conn, &replyXid, &length), __LINE__, "READ reply failed");
+    TEST_ASSERT(replyXid == xid, __LINE__, "bad xid (expected 0x%08x, got 0x%08x)", xid, replyXid);
+    TEST_ASSERT(CheckReadReply(count, data, outLength), __LINE__, "READ at %llu failed", offset);
+    return TEST_SUCCESS;
+}
+
+// Reads count bytes at offset twice (the second READ is usually served by
+// the block cache) and checks that both return what seed wrote
+int CheckShareFile(Connection* conn, UINT handle, UINT xid, UINT64 offset, UINT count, UINT seed)
+{
+    for(UINT i = 0; i < 2; i++)
+    {
+        UINT length;
+        TEST_ASSERT(ReadShareFile(conn, handle, xid + i, offset, count, fileData, &length), __LINE__, "READ failed");
+        TEST_ASSERT(length == count, __LINE__, "READ returned %u of %u bytes", length, count);
+        UINT mismatch = CheckFileData(fileData, offset, count, seed);
+        TEST_ASSERT(mismatch == count, __LINE__, "READ %u returned other data at %llu than write %u wrote",
+            i, offset + mismatch, seed);
+    }
+    return TEST_SUCCESS;
+}
+
+// Gets the block cache stats into buffer (see BlockCache.h), the blocks the
+// cache can hold are at buffer + 28
+int GetBlockCacheStats(Connection* conn, UINT xid)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _9_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, xid);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, xid, &length), __LINE__, "BLOCK_CACHE reply failed");
+    TEST_ASSERT(length == STATS_BLOCK_CACHE_SIZE, __LINE__, "BLOCK_CACHE reply is %u bytes", length);
+    return TEST_SUCCESS;
+}
+
+#define WRITE_READ_TEST_SIZE (2 * 65536)
+
+// Tests that every kind of WRITE (written by a worker, gathered, and
+// gathered then written out by the gather timer) is seen by the READs after
+// it, also when the blocks it overwrote were in the block cache.  The
+// change time of a file doesn't show a write right away, so it is up to
+// the WRITE to drop those blocks.
+int TestWriteRead(Connection* conn, UINT handle)
+{
+    TEST_ASSERT(GetBlockCacheStats(conn, 0x3b0c0000), __LINE__, "BLOCK_CACHE failed");
+    if(ParseUint(buffer + 28) == 0)
+    {
+        printf("the block cache is off, READs after WRITEs only read the file\r\n");
+    }
+
+    TEST_ASSERT(WriteShareFile(conn, handle, 0x3b0c0100, 0, NFS3_STABLE_FILE_SYNC, WRITE_READ_TEST_SIZE, 1),
+        __LINE__, "WRITE failed");
+    TEST_ASSERT(CheckShareFile(conn, handle, 0x3b0c0200, 0, WRITE_READ_TEST_SIZE, 1), __LINE__, "first data");
+    TEST_ASSERT(WriteShareFile(conn, handle, 0x3b0c0300, 0, NFS3_STABLE_FILE_SYNC, WRITE_READ_TEST_SIZE, 2),
+        __LINE__, "WRITE failed");
+    TEST_ASSERT(CheckShareFile(conn, handle, 0x3b0c0400, 0, WRITE_READ_TEST_SIZE, 2), __LINE__, "FILE_SYNC WRITE");
+
+    // UNSTABLE writes smaller than the gather buffer are gathered, a READ
+    // writes them out first
+    for(UINT i = 0; i < WRITE_READ_TEST_SIZE / 32768; i++)
+    {
+        TEST_ASSERT(WriteShareFile(conn, handle, 0x3b0c0500 + i, i * 32768, NFS3_STABLE_UNSTABLE, 32768, 3),
+            __LINE__, "WRITE %u failed", i);
+    }
+    TEST_ASSERT(CheckShareFile(conn, handle, 0x3b0c0600, 0, WRITE_READ_TEST_SIZE, 3), __LINE__, "gathered WRITE");
+
+    // Gathered data the gather timer writes out
+    for(UINT i = 0; i < WRITE_READ_TEST_SIZE / 32768; i++)
+    {
+        TEST_ASSERT(WriteShareFile(conn, handle, 0x3b0c0700 + i, i * 32768, NFS3_STABLE_UNSTABLE, 32768, 4),
+            __LINE__, "WRITE %u failed", i);
+    }
+    Sleep(1000);
+    TEST_ASSERT(CheckShareFile(conn, handle, 0x3b0c0800, 0, WRITE_READ_TEST_SIZE, 4), __LINE__, "flushed WRITE");
+
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_COMMIT_NETWORK_ORDER,
+        5, 4, handle, 0, 0, 0);
+    AppendUint(buffer + 4, 0x3b0c0900);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, 0x3b0c0900, &length), __LINE__, "COMMIT reply failed");
+    TEST_ASSERT(ParseUint(buffer + 28) == NFS3_STATUS_OK, __LINE__, "COMMIT failed with %u", ParseUint(buffer + 28));
+    return TEST_SUCCESS;
+}
+
+#define GATHER_TEST_BUFFER (64*1024)
+
+// What the write gather reported about its last flush
+static UINT gatherTestFlushes;
+static void* gatherTestContext;
+static UINT64 gatherTestOffset;
+static UINT gatherTestLength;
+
+void GatherTestFlushed(void* context, UINT64 offset, UINT length)
+{
+    gatherTestFlushes++;
+    gatherTestContext = context;
+    gatherTestOffset = offset;
+    gatherTestLength = length;
+}
+
+// Checks that count bytes at offset of the file are what FillFileData makes
+// with seed
+int CheckGatherFile(HANDLE file, UINT64 offset, UINT count, UINT seed)
+{
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset     = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD readLength;
+    TEST_ASSERT(ReadFile(file, fileData, count, &readLength, &overlapped), __LINE__, "ReadFile failed (e=%d)", GetLastError());
+    TEST_ASSERT(readLength == count, __LINE__, "read %u of %u bytes at %llu", readLength, count, offset);
+    UINT mismatch = CheckFileData(fileData, offset, count, seed);
+    TEST_ASSERT(mismatch == count, __LINE__, "the file has other data at %llu", offset + mismatch);
+    return TEST_SUCCESS;
+}
+
+// Gathers the data FillFileData makes at offset with seed
+// Returns: what WriteGatherAdd returned
+int GatherTestAdd(WriteGather* gather, UINT64 offset, UINT count, UINT seed)
+{
+    FillFileData(largeRecord, offset, count, seed);
+    return WriteGatherAdd(gather, offset, largeRecord, count);
+}
+
+int TestWriteGatherFile(HANDLE file, char* path)
+{
+    WriteGatherInit(GATHER_TEST_BUFFER, 2 * GATHER_TEST_BUFFER, 60000, &GatherTestFlushed);
+    WriteGatherStats before = writeGatherStats;
+    int contexts[3];
+
+    // Contiguous writes are combined and nothing is written yet
+    WriteGather* gather = WriteGatherCreate(file, &contexts[0]);
+    TEST_ASSERT(gather, __LINE__, "out of memory");
+    for(UINT i = 0; i < 3; i++)
+    {
+        TEST_ASSERT(GatherTestAdd(gather, i * 16384, 16384, 1) == 0, __LINE__, "write %u wasn't gathered", i);
+    }
+    LARGE_INTEGER size;
+    TEST_ASSERT(GetFileSizeEx(file, &size) && size.QuadPart == 0, __LINE__, "gathered data was written");
+    TEST_ASSERT(WriteGatherPending() && writeGatherStats.writes == before.writes + 3 &&
+                writeGatherStats.flushes == before.flushes, __LINE__, "%llu writes in %llu flushes",
+                writeGatherStats.writes - before.writes, writeGatherStats.flushes - before.flushes);
+
+    // A write that doesn't continue them writes them out with one WriteFile
+    TEST_ASSERT(GatherTestAdd(gather, 100*1024, 16384, 1) == 0, __LINE__, "write wasn't gathered");
+    TEST_ASSERT(writeGatherStats.flushes == before.flushes + 1 && writeGatherStats.bytes == before.bytes + 49152,
+        __LINE__, "%llu flushes of %llu bytes", writeGatherStats.flushes - before.flushes, writeGatherStats.bytes - before.bytes);
+    TEST_ASSERT(gatherTestFlushes == 1 && gatherTestContext == &contexts[0] && gatherTestOffset == 0 &&
+        gatherTestLength == 49152, __LINE__, "flush of %u bytes at %llu wasn't reported", gatherTestLength, gatherTestOffset);
+    TEST_ASSERT(CheckGatherFile(file, 0, 49152, 1), __LINE__, "combined writes");
+
+    // A full buffer is written out right away
+    TEST_ASSERT(GatherTestAdd(gather, 116*1024, 49152, 1) == 0, __LINE__, "write wasn't gathered");
+    TEST_ASSERT(!WriteGatherPending() && writeGatherStats.flushes == before.flushes + 2 && gatherTestOffset == 100*1024 &&
+        gatherTestLength == GATHER_TEST_BUFFER, __LINE__, "the full buffer wasn't written");
+    TEST_ASSERT(CheckGatherFile(file, 100*1024, GATHER_TEST_BUFFER, 1), __LINE__, "full buffer");
+    TEST_ASSERT(GatherTestAdd(gather, 0, GATHER_TEST_BUFFER, 1) != 0, __LINE__, "a write as large as the buffer was gathered");
+
+    // A third file's data writes out the oldest gathered data to stay under
+    // the memory limit
+    WriteGather* second = WriteGatherCreate(file, &contexts[1]);
+    WriteGather* third = WriteGatherCreate(file, &contexts[2]);
+    TEST_ASSERT(second && third, __LINE__, "out of memory");
+    TEST_ASSERT(GatherTestAdd(gather, 200*1024, 16384, 2) == 0 && GatherTestAdd(second, 300*1024, 16384, 2) == 0,
+        __LINE__, "writes weren't gathered");
+    TEST_ASSERT(gatherTestFlushes == 2, __LINE__, "%u flushes under the memory limit", gatherTestFlushes - 2);
+    TEST_ASSERT(GatherTestAdd(third, 400*1024, 16384, 2) == 0, __LINE__, "write wasn't gathered");
+    TEST_ASSERT(gatherTestFlushes == 3 && gatherTestContext == &contexts[0] && gatherTestOffset == 200*1024 &&
+        gather->length == 0 && second->length == 16384 && third->length == 16384, __LINE__,
+        "the oldest data wasn't written at the memory limit");
+    WriteGatherFlushAll();
+    TEST_ASSERT(!WriteGatherPending() && gatherTestFlushes == 5, __LINE__, "%u flushes", gatherTestFlushes);
+    for(UINT i = 0; i < 3; i++)
+    {
+        TEST_ASSERT(CheckGatherFile(file, (2 + i) * 100*1024, 16384, 2), __LINE__, "file %u", i);
+    }
+    TEST_ASSERT(writeGatherStats.writes == before.writes + 8 && writeGatherStats.flushes == before.flushes + 5 &&
+        writeGatherStats.bytes == before.bytes + 49152 + GATHER_TEST_BUFFER + 3 * 16384, __LINE__,
+        "%llu writes in %llu flushes of %llu bytes", writeGatherStats.writes - before.writes,
+        writeGatherStats.flushes - before.flushes, writeGatherStats.bytes - before.bytes);
+    free(gather);
+    free(second);
+    free(third);
+
+    // A failed write of gathered data is kept until it is taken (by COMMIT)
+    HANDLE readOnly = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    TEST_ASSERT(readOnly != INVALID_HANDLE_VALUE, __LINE__, "failed to open \"%s\" (e=%d)", path, GetLastError());
+    gather = WriteGatherCreate(readOnly, NULL);
+    int added = gather ? GatherTestAdd(gather, 0, 16384, 3) : 1;
+    DWORD error = added ? 0 : WriteGatherFlush(gather);
+    DWORD taken = added ? 0 : WriteGatherTakeError(gather);
+    DWORD takenAgain = added ? 0 : WriteGatherTakeError(gather);
+    free(gather);
+    CloseHandle(readOnly);
+    TEST_ASSERT(added == 0, __LINE__, "write wasn't gathered");
+    TEST_ASSERT(error != 0 && taken == error && takenAgain == 0, __LINE__,
+        "flush returned %u, then %u and %u were taken", error, taken, takenAgain);
+    return TEST_SUCCESS;
+}
+
+// Tests that the write gather combines contiguous writes and writes them
+// out when a write doesn't continue them, its buffer is full or the memory
+// limit is reached, and that it keeps the error of a failed write
+int TestWriteGather()
+{
+    char directory[MAX_PATH];
+    char path[MAX_PATH];
+    TEST_ASSERT(GetTempPath(sizeof(directory), directory) && GetTempFileName(directory, "nfs", 0, path),
+        __LINE__, "no temporary file (e=%d)", GetLastError());
+    HANDLE file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, CREATE_ALWAYS, FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    TEST_ASSERT(file != INVALID_HANDLE_VALUE, __LINE__, "failed to create \"%s\" (e=%d)", path, GetLastError());
+    int result = TestWriteGatherFile(file, path);
+    CloseHandle(file);
+    return result;
+}
+
+#define READ_AHEAD_TEST_MIN (256*1024)
+#define READ_AHEAD_TEST_MAX (1024*1024)
+
+// Gets the read-ahead counters: streams started, hits and misses
+void GetReadAheadCounts(UINT64* outStarted, UINT64* outHits, UINT64* outMisses)
+{
+    char stats[12 + 8 * 8];
+    ReadAheadEncode(stats, sizeof(stats));
+    *outStarted = ParseUint64(stats + 12);
+    *outHits    = ParseUint64(stats + 20);
+    *outMisses  = ParseUint64(stats + 28);
+}
+
+// Tests that the window of a sequential stream starts when it continues,
+// only grows when its read-ahead is read, and shrinks when a read skips past
+// it, and that a random read starts a stream of its own
+// Note: without worker threads read-ahead is only queued, never read
+int TestReadAheadWindow()
+{
+    TEST_ASSERT(ReadAheadInit(0, READ_AHEAD_TEST_MIN, READ_AHEAD_TEST_MAX) == 0, __LINE__, "ReadAheadInit failed");
+    static const char path[] = "read-ahead test";
+    ReadAheadStreams streams;
+    memset(&streams, 0, sizeof(streams));
+    ReadAheadStream* stream = &streams.streams[0];
+    UINT64 fileSize = 64*1024*1024;
+    UINT64 started, hits, misses;
+    GetReadAheadCounts(&started, &hits, &misses);
+
+    // The first read starts a stream, the next one starts reading ahead and
+    // every read of the read-ahead doubles the window up to the max
+    static const UINT windows[] = {0, READ_AHEAD_TEST_MIN, 2 * READ_AHEAD_TEST_MIN, READ_AHEAD_TEST_MAX,
+        READ_AHEAD_TEST_MAX};
+    for(UINT i = 0; i < sizeof(windows) / sizeof(windows[0]); i++)
+    {
+        ReadAheadAccess(&streams, path, fileSize, i * 65536, 65536);
+        TEST_ASSERT(stream->window == windows[i], __LINE__, "read %u: window is %u instead of %u",
+            i, stream->window, windows[i]);
+    }
+    TEST_ASSERT(stream->readAheadEnd > stream->nextOffset, __LINE__, "nothing was read ahead");
+    UINT64 nowStarted, nowHits, nowMisses;
+    GetReadAheadCounts(&nowStarted, &nowHits, &nowMisses);
+    TEST_ASSERT(nowStarted == started + 1 && nowHits == hits + 3 && nowMisses == misses, __LINE__,
+        "%llu streams, %llu hits, %llu misses", nowStarted - started, nowHits - hits, nowMisses - misses);
+
+    // A random read starts its own stream and leaves the window alone
+    ReadAheadAccess(&streams, path, fileSize, 32*1024*1024, 65536);
+    TEST_ASSERT(stream->window == READ_AHEAD_TEST_MAX && streams.streams[1].window == 0 &&
+        streams.streams[1].lastUse != 0, __LINE__, "the random read changed window %u", stream->window);
+    GetReadAheadCounts(&nowStarted, &nowHits, &nowMisses);
+    TEST_ASSERT(nowStarted == started + 2 && nowHits == hits + 3, __LINE__, "the random read was a hit");
+
+    // A read that skips past the read-ahead halves the window, below the min
+    // the stream stops reading ahead
+    static const UINT shrunk[] = {READ_AHEAD_TEST_MAX / 2, READ_AHEAD_TEST_MIN, 0};
+    for(UINT i = 0; i < sizeof(shrunk) / sizeof(shrunk[0]); i++)
+    {
+        ReadAheadAccess(&streams, path, fileSize, stream->readAheadEnd + 65536, 65536);
+        TEST_ASSERT(stream->window == shrunk[i], __LINE__, "skip %u: window is %u instead of %u",
+            i, stream->window, shrunk[i]);
+    }
+    GetReadAheadCounts(&nowStarted, &nowHits, &nowMisses);
+    TEST_ASSERT(nowStarted == started + 2 && nowHits == hits + 3 && nowMisses == misses + 3, __LINE__,
+        "%llu streams, %llu hits, %llu misses", nowStarted - started, nowHits - hits, nowMisses - misses);
+
+    // Reading on sequentially starts again with the min window
+    ReadAheadAccess(&streams, path, fileSize, stream->nextOffset, 65536);
+    TEST_ASSERT(stream->window == READ_AHEAD_TEST_MIN, __LINE__, "window is %u after the stream continued",
+        stream->window);
+    return TEST_SUCCESS;
+}
+
+// Counts the times its argument was evaluated
+static UINT logTestEvaluations;
+
+UINT LogTestArgument()
+{
+    logTestEvaluations++;
+    return logTestEvaluations;
+}
+
+// Tests that LogSetLevel sets the level bits of one component or of all of
+// them, rejects unknown names, and that a disabled LOG_AT doesn't evaluate
+// its arguments
+int TestLogLevels()
+{
+    UINT savedMask = logMask;
+    UINT componentMask = (1U << LOG_LEVEL_COUNT) - 1;
+    UINT nfsShift = LOG_COMPONENT_NFS * LOG_LEVEL_COUNT;
+
+    int result = LogSetLevel("nfs", "warning");
+    UINT nfsBits = (logMask >> nfsShift) & componentMask;
+    UINT others = logMask & ~(componentMask << nfsShift);
+    logMask = savedMask;
+    TEST_ASSERT(result == 0 && nfsBits == (LOG_BIT(0, LOG_LEVEL_ERROR) | LOG_BIT(0, LOG_LEVEL_WARNING)), __LINE__,
+        "nfs warning set bits 0x%x", nfsBits);
+    TEST_ASSERT(others == (savedMask & ~(componentMask << nfsShift)), __LINE__, "nfs warning changed other components");
+
+    result = LogSetLevel("all", "debug");
+    UINT allMask = logMask;
+    int offResult = LogSetLevel("mount", "off");
+    UINT mountBits = (logMask >> (LOG_COMPONENT_MOUNT * LOG_LEVEL_COUNT)) & componentMask;
+    UINT rpcBits = (logMask >> (LOG_COMPONENT_RPC * LOG_LEVEL_COUNT)) & componentMask;
+    logMask = savedMask;
+    TEST_ASSERT(result == 0 && allMask == (1U << (LOG_COMPONENT_COUNT * LOG_LEVEL_COUNT)) - 1, __LINE__,
+        "all debug set mask 0x%x", allMask);
+    TEST_ASSERT(offResult == 0 && mountBits == 0 && rpcBits == componentMask, __LINE__,
+        "mount off left 0x%x, rpc 0x%x", mountBits, rpcBits);
+
+    TEST_ASSERT(LogSetLevel("disk", "debug") != 0 && LogSetLevel("nfs", "verbose") != 0, __LINE__,
+        "an unknown component or level was accepted");
+    TEST_ASSERT(logMask == savedMask, __LINE__, "an unknown component or level changed the mask");
+
+    logMask &= ~LOG_BIT(LOG_COMPONENT_NFS, LOG_LEVEL_DEBUG);
+    logTestEvaluations = 0;
+    LOG_AT(NFS, DEBUG, "[TEST] disabled %u", LogTestArgument());
+    logMask = savedMask;
+    TEST_ASSERT(logTestEvaluations == 0, __LINE__, "a disabled LOG_AT evaluated its arguments");
+    return TEST_SUCCESS;
+}
+
+// Tests the modules of the server that don't need a server to run
+int RunModuleTests()
+{
+    TEST_ASSERT(BufferPoolInit(false) == 0, __LINE__, "BufferPoolInit failed");
+    TEST_ASSERT(TestWriteGather(), __LINE__, "write gather test failed");
+    TEST_ASSERT(TestReadAheadWindow(), __LINE__, "read-ahead window test failed");
+    TEST_ASSERT(TestLogLevels(), __LINE__, "log level test failed");
+    return TEST_SUCCESS;
+}
+
+#define DEFERRED_TEST_CALLS 4
+
+// Tests that every reply is sent when a COMMIT's reply is deferred until its
+// file is flushed while the reply of a call handled before it is still
+// outstanding (a READ on a file system worker, the WRITE before it makes
+// the READ get the attributes again).  The deferred reply gives up its turn
+// in the connection's order, so it can arrive before or after any of the
+// others, and the replies after it don't wait for the flush.
+int TestDeferredReply(Connection* conn, UINT handle)
+{
+    FillFileData(fileData, 0, 4096, 5);
+    UINT offset = SetupWriteCall(handle, 0, NFS3_STABLE_UNSTABLE, fileData, 4096);
+    AppendUint(largeRecord + 4, 0x7dfe0000);
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_READ_NETWORK_ORDER,
+        5, 4, handle, 0, 0, 256*1024);
+    AppendUint(buffer + 4, 0x7dfe0001);
+    memcpy(largeRecord + offset, buffer, callSize);
+    offset += callSize;
+    callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_COMMIT_NETWORK_ORDER,
+        5, 4, handle, 0, 0, 0);
+    AppendUint(buffer + 4, 0x7dfe0002);
+    memcpy(largeRecord + offset, buffer, callSize);
+    offset += callSize;
+    callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_GETATTR_NETWORK_ORDER,
+        2, 4, handle);
+    AppendUint(buffer + 4, 0x7dfe0003);
+    memcpy(largeRecord + offset, buffer, callSize);
+    offset += callSize;
+    int sent = send(conn->sock(), largeRecord, offset, 0);
+    TEST_ASSERT(sent == offset, __LINE__, "send returned %d", sent);
+
+    bool received[DEFERRED_TEST_CALLS] = {false};
+    for(UINT i = 0; i < DEFERRED_TEST_CALLS; i++)
+    {
+        UINT xid, length;
+        TEST_ASSERT(RecvLargeReply(conn, &xid, &length), __LINE__, "reply %u failed", i);
+        UINT call = xid - 0x7dfe0000;
+        TEST_ASSERT(call < DEFERRED_TEST_CALLS && !received[call], __LINE__, "unexpected reply 0x%08x", xid);
+        received[call] = true;
+        TEST_ASSERT(ParseUint(largeRecord + 28) == NFS3_STATUS_OK, __LINE__, "call %u failed with %u",
+            call, ParseUint(largeRecord + 28));
+    }
+    return TEST_SUCCESS;
+}
+
+// Gets how many replies copied the encoded attributes of a handle and how
+// many times they were encoded again
+int GetAttributeEncodes(Connection* conn, UINT xid, UINT64* outCopies, UINT64* outEncodes)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _11_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, xid);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, xid, &length), __LINE__, "ATTRIBUTES reply failed");
+    TEST_ASSERT(length == STATS_ATTRIBUTES_SIZE, __LINE__, "ATTRIBUTES reply is %u bytes", length);
+    *outCopies  = ParseUint64(buffer + 28);
+    *outEncodes = ParseUint64(buffer + 36);
+    return TEST_SUCCESS;
+}
+
+// Copies the fattr3 GETATTR returns for handle
+int GetShareFileAttributes(Connection* conn, UINT handle, UINT xid, char* fattr3)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_GETATTR_NETWORK_ORDER,
+        2, 4, handle);
+    AppendUint(buffer + 4, xid);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, xid, &length), __LINE__, "GETATTR reply failed");
+    TEST_ASSERT(length == 32 + 84, __LINE__, "GETATTR reply is %u bytes", length);
+    TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "GETATTR failed");
+    memcpy(fattr3, buffer + 32, 84);
+    return TEST_SUCCESS;
+}
+
+// Tests that the attributes of a file are copied as they were encoded while
+// they stay the same, and that the attributes a WRITE returns are encoded
+// again when they changed and are the ones the next GETATTR returns
+int TestEncodedAttributes(Connection* conn, UINT handle)
+{
+    char first[84], second[84], written[84], after[84];
+    UINT64 copies, encodes, nowCopies, nowEncodes;
+    TEST_ASSERT(GetShareFileAttributes(conn, handle, 0x0a7e0000, first), __LINE__, "GETATTR failed");
+    TEST_ASSERT(GetAttributeEncodes(conn, 0x0a7e0001, &copies, &encodes), __LINE__, "ATTRIBUTES failed");
+    TEST_ASSERT(GetShareFileAttributes(conn, handle, 0x0a7e0002, second), __LINE__, "GETATTR failed");
+    TEST_ASSERT(GetAttributeEncodes(conn, 0x0a7e0003, &nowCopies, &nowEncodes), __LINE__, "ATTRIBUTES failed");
+    TEST_ASSERT(memcmp(first, second, sizeof(first)) == 0, __LINE__, "GETATTRs of an unchanged file returned other attributes");
+    TEST_ASSERT(nowCopies == copies + 1 && nowEncodes == encodes, __LINE__,
+        "GETATTR of an unchanged file made %llu copies and %llu encodes", nowCopies - copies, nowEncodes - encodes);
+
+    TEST_ASSERT(WriteShareFile(conn, handle, 0x0a7e0004, 0, NFS3_STABLE_FILE_SYNC, 4096, 8), __LINE__, "WRITE failed");
+    TEST_ASSERT(ParseUint(buffer + 36) == 1, __LINE__, "WRITE returned no attributes");
+    memcpy(written, buffer + 40, sizeof(written));
+    TEST_ASSERT(GetShareFileAttributes(conn, handle, 0x0a7e0005, after), __LINE__, "GETATTR failed");
+    TEST_ASSERT(memcmp(written, after, sizeof(written)) == 0, __LINE__,
+        "GETATTR after a WRITE returned other attributes than the WRITE");
+    copies = nowCopies;
+    encodes = nowEncodes;
+    TEST_ASSERT(GetAttributeEncodes(conn, 0x0a7e0006, &nowCopies, &nowEncodes), __LINE__, "ATTRIBUTES failed");
+    UINT64 expectedEncodes = (memcmp(first, written, sizeof(first)) != 0) ? 1 : 0;
+    TEST_ASSERT(nowEncodes - encodes <= 1 && nowEncodes - encodes >= expectedEncodes &&
+        nowCopies + nowEncodes == copies + encodes + 2, __LINE__, "WRITE and GETATTR made %llu copies and %llu encodes",
+        nowCopies - copies, nowEncodes - encodes);
+    return TEST_SUCCESS;
+}
+
+#define STREAM_FILE_TEST_READ (256*1024)
+
+// Tests that a WRITE larger than StreamWriteChunk that arrives over several
+// sends writes all of its data to the file, is replied to once, and drops
+// the blocks it overwrote from the block cache
+int TestStreamWriteFile(Connection* conn, UINT handle)
+{
+    UINT count = sizeof(largeRecord) - 72;
+    for(UINT offset = 0; offset < count; offset += STREAM_FILE_TEST_READ)
+    {
+        UINT readCount = (count - offset < STREAM_FILE_TEST_READ) ? count - offset : STREAM_FILE_TEST_READ;
+        UINT length;
+        TEST_ASSERT(ReadShareFile(conn, handle, 0x57e4b000 + offset / STREAM_FILE_TEST_READ, offset, readCount,
+            fileData, &length), __LINE__, "READ at %u failed", offset);
+    }
+
+    FillFileData(fileData, 0, count, 7);
+    UINT recordSize = SetupWriteCall(handle, 0, NFS3_STABLE_FILE_SYNC, fileData, count);
+    TEST_ASSERT(recordSize == sizeof(largeRecord), __LINE__, "the WRITE record is %u bytes", recordSize);
+    AppendUint(largeRecord + 4, 0x57e4b100);
+    UINT nullSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, PROC_NULL, 0);
+    AppendUint(buffer + 4, 0x57e4b101);
+
+    const UINT splits[] = {40, 2000, 300000, sizeof(largeRecord) - 10};
+    UINT offset = 0;
+    for(UINT i = 0; i < STATIC_ARRAY_LENGTH(splits); i++)
+    {
+        int sent = send(conn->sock(), largeRecord + offset, splits[i] - offset, 0);
+        TEST_ASSERT(sent == splits[i] - offset, __LINE__, "send returned %d", sent);
+        offset = splits[i];
+        Sleep(50);
+    }
+    memmove(buffer + 10, buffer, nullSize);
+    memcpy(buffer, largeRecord + offset, 10);
+    int sent = send(conn->sock(), buffer, 10 + nullSize, 0);
+    TEST_ASSERT(sent == 10 + nullSize, __LINE__, "send returned %d", sent);
+
+    // One WRITE reply, then the reply of the NULL call
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, 0x57e4b100, &length), __LINE__, "WRITE reply failed");
+    TEST_ASSERT(CheckWriteReply(count), __LINE__, "streamed WRITE failed");
+    TEST_ASSERT(RecvAll(conn->sock(), buffer, 28), __LINE__, "recv failed");
+    TEST_ASSERT(CheckNullReply(buffer, 0x57e4b101), __LINE__, "reply after the WRITE failed");
+
+    for(offset = 0; offset < count; offset += STREAM_FILE_TEST_READ)
+    {
+        UINT readCount = (count - offset < STREAM_FILE_TEST_READ) ? count - offset : STREAM_FILE_TEST_READ;
+        TEST_ASSERT(CheckShareFile(conn, handle, 0x57e4b200 + offset / STREAM_FILE_TEST_READ * 2, offset, readCount, 7),
+            __LINE__, "streamed WRITE data at %u", offset);
+    }
+    return TEST_SUCCESS;
+}
+
+// Gets the direct I/O stats into buffer, DirectIoMinSize is at buffer + 28
+// (0 if no export uses direct I/O) followed by the direct reads and bytes
+// read and the direct writes and bytes written (uint64s)
+int GetDirectIoStats(Connection* conn, UINT xid)
+{
+    UINT callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _10_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, xid);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    UINT length;
+    TEST_ASSERT(RecvReply(conn, xid, &length), __LINE__, "DIRECT_IO reply failed");
+    TEST_ASSERT(length == STATS_DIRECT_IO_SIZE, __LINE__, "DIRECT_IO reply is %u bytes", length);
+    return TEST_SUCCESS;
+}
+
+// Reads count bytes at offset in READs smaller than a direct I/O page, which
+// always go through the system cache
+// outLength: less than count only at the end of the file
+int ReadShareFileBuffered(Connection* conn, UINT handle, UINT xid, UINT64 offset, UINT count, char* data,
+    UINT* outLength)
+{
+    UINT length = 0;
+    while(length < count)
+    {
+        UINT chunk = (count - length < 4095) ? count - length : 4095;
+        UINT chunkLength;
+        TEST_ASSERT(ReadShareFile(conn, handle, xid++, offset + length, chunk, data + length, &chunkLength),
+            __LINE__, "READ at %llu failed", offset + length);
+        length += chunkLength;
+        if(chunkLength < chunk)
+        {
+            break;
+        }
+    }
+    *outLength = length;
+    return TEST_SUCCESS;
+}
+
+// Reads count bytes at offset with one READ into fileData and with READs
+// that don't use direct I/O, checks that both return the same bytes and
+// that a direct READ left the block cache alone
+// outDirect: true if the READ used direct I/O
+// outLength: the bytes the READ returned
+int CompareDirectRead(Connection* conn, UINT handle, UINT xid, UINT64 offset, UINT count, bool* outDirect,
+    UINT* outLength)
+{
+    char* buffered = fileData + FILE_TEST_SIZE / 2;
+    char cacheStats[4 * 8];
+    TEST_ASSERT(GetBlockCacheStats(conn, xid), __LINE__, "BLOCK_CACHE failed");
+    memcpy(cacheStats, buffer + 32, sizeof(cacheStats));
+    TEST_ASSERT(GetDirectIoStats(conn, xid + 1), __LINE__, "DIRECT_IO failed");
+    UINT64 directReads = ParseUint64(buffer + 32);
+
+    UINT length;
+    TEST_ASSERT(ReadShareFile(conn, handle, xid + 2, offset, count, fileData, &length), __LINE__, "READ failed");
+    TEST_ASSERT(GetDirectIoStats(conn, xid + 3), __LINE__, "DIRECT_IO failed");
+    bool direct = ParseUint64(buffer + 32) > directReads;
+    TEST_ASSERT(GetBlockCacheStats(conn, xid + 4), __LINE__, "BLOCK_CACHE failed");
+    TEST_ASSERT(!direct || memcmp(cacheStats, buffer + 32, sizeof(cacheStats)) == 0, __LINE__,
+        "a direct READ used the block cache");
+
+    UINT bufferedLength;
+    TEST_ASSERT(ReadShareFileBuffered(conn, handle, xid + 0x100, offset, count, buffered, &bufferedLength),
+        __LINE__, "small READs failed");
+    TEST_ASSERT(bufferedLength == length, __LINE__, "the READ returned %u bytes, small READs %u", length, bufferedLength);
+    UINT mismatch = 0;
+    while(mismatch < length && fileData[mismatch] == buffered[mismatch])
+    {
+        mismatch++;
+    }
+    TEST_ASSERT(mismatch == length, __LINE__, "the READ returned other data at %llu than small READs", offset + mismatch);
+    *outDirect = direct;
+    *outLength = length;
+    return TEST_SUCCESS;
+}
+
+#define DIRECT_TEST_OFFSET 1000
+
+// Tests that a large unaligned READ, which reads its aligned middle without
+// the system cache in a DirectIoExport, returns the same bytes as small
+// READs, with an unaligned head and tail and when it runs past the end of
+// the file, and that it doesn't use the block cache
+int TestDirectRead(Connection* conn, UINT handle)
+{
+    TEST_ASSERT(GetDirectIoStats(conn, 0x0d1e0000), __LINE__, "DIRECT_IO failed");
+    UINT minSize = ParseUint(buffer + 28);
+    if(minSize == 0)
+    {
+        printf("no export uses direct I/O, large READs are only compared with small READs\r\n");
+    }
+    // The aligned part is at least DirectIoMinSize
+    UINT count = (minSize ? minSize : 256*1024) + 10000;
+    if(132 + count > sizeof(largeRecord) || count > FILE_TEST_SIZE / 2)
+    {
+        printf("DirectIoMinSize %u is too large for the direct READ test, skipped\r\n", minSize);
+        return TEST_SUCCESS;
+    }
+
+    UINT fileLength = DIRECT_TEST_OFFSET + count;
+    for(UINT i = 0; i * 65536 < fileLength; i++)
+    {
+        UINT writeLength = (fileLength - i * 65536 < 65536) ? fileLength - i * 65536 : 65536;
+        TEST_ASSERT(WriteShareFile(conn, handle, 0x0d1e0100 + i, i * 65536, NFS3_STABLE_FILE_SYNC, writeLength, 6),
+            __LINE__, "WRITE %u failed", i);
+    }
+    bool direct;
+    UINT length;
+    TEST_ASSERT(CompareDirectRead(conn, handle, 0x0d1e1000, DIRECT_TEST_OFFSET, count, &direct, &length),
+        __LINE__, "unaligned READ");
+    TEST_ASSERT(length == count, __LINE__, "READ returned %u of %u bytes", length, count);
+    UINT mismatch = CheckFileData(fileData, DIRECT_TEST_OFFSET, count, 6);
+    TEST_ASSERT(mismatch == count, __LINE__, "READ returned other data at %llu than was written",
+        (UINT64)DIRECT_TEST_OFFSET + mismatch);
+    if(minSize && !direct)
+    {
+        printf("the test file isn't in a DirectIoExport, its READs didn't use direct I/O\r\n");
+    }
+
+    // Past the end of the file, the part before it is still large enough to
+    // go direct
+    UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_GETATTR_NETWORK_ORDER,
+        2, 4, handle);
+    AppendUint(buffer + 4, 0x0d1e2000);
+    int sent = send(conn->sock(), buffer, callSize, 0);
+    TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+    TEST_ASSERT(RecvReply(conn, 0x0d1e2000, &length), __LINE__, "GETATTR reply failed");
+    TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "GETATTR failed");
+    ClientAttributes attributes;
+    ParseClientAttributes(buffer + 32, &attributes);
+    UINT64 offset = attributes.size - (count - 1000);
+    offset -= (offset % DIRECT_IO_TEST_ALIGNMENT == 0) ? 1 : 0;
+    bool endDirect;
+    TEST_ASSERT(CompareDirectRead(conn, handle, 0x0d1e3000, offset, count, &endDirect, &length),
+        __LINE__, "READ past the end of the file");
+    TEST_ASSERT(length == attributes.size - offset, __LINE__, "READ at %llu returned %u bytes of a %llu byte file",
+        offset, length, attributes.size);
+    TEST_ASSERT(endDirect == direct, __LINE__, "only one of the READs used direct I/O");
+    return TEST_SUCCESS;
+}
+
+int FindShareFile(Connection* conn, UINT rootHandle, char* name, UINT* outHandle);
+
+// Runs the tests that need a file in the share
+int RunFileTests(Connection* conn, UINT rootHandle, char* fileName)
+{
+    UINT handle;
+    TEST_ASSERT(FindShareFile(conn, rootHandle, fileName, &handle), __LINE__, "\"%s\" wasn't found", fileName);
+    TEST_ASSERT(TestWriteRead(conn, handle), __LINE__, "WRITE then READ test failed");
+    TEST_ASSERT(TestDeferredReply(conn, handle), __LINE__, "deferred reply test failed");
+    TEST_ASSERT(TestStreamWriteFile(conn, handle), __LINE__, "streamed WRITE test failed");
+    TEST_ASSERT(TestEncodedAttributes(conn, handle), __LINE__, "encoded attributes test failed");
+    TEST_ASSERT(TestDirectRead(conn, handle), __LINE__, "direct READ test failed");
+    return TEST_SUCCESS;
+}
+
+// fileName: a file in the root of the share for the file tests, NULL to
+//           skip them
+int run(char* fileName)
+{
+    TEST_ASSERT(RunModuleTests(), __LINE__, "module tests failed");
+
+    Connection conn(2049);
+    //
+    // Test that the NULL procedures work
+    //
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, _2_NETWORK_ORDER, PROC_NULL, 0);
+        TEST_ASSERT(TestCall(&conn, 0x40f18a0f, callSize, 1, RPC_REPLY_ACCEPT_STATUS_SUCCESS), __LINE__, "PORTMAPv2 NULL failed");
+    }
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_MOUNT_NETWORK_ORDER, _3_NETWORK_ORDER, PROC_NULL, 0);
+        TEST_ASSERT(TestCall(&conn, 0xaf29bec8, callSize, 1, RPC_REPLY_ACCEPT_STATUS_SUCCESS), __LINE__, "MOUNTv4 NULL failed");
+    }
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, PROC_NULL, 0);
+        TEST_ASSERT(TestCall(&conn, 0xab9828de, callSize, 1, RPC_REPLY_ACCEPT_STATUS_SUCCESS), __LINE__, "NFSv3 NULL failed");
+    }
+
+    // TODO: test malformed calls
+    //   - fragment length is too short
+    //   - invalid credentials and verifier lengths (too long/too short)
+    //   - unknown message type (not call or reply)
+
+    #define RPC_VERSION_OFFSET 12
+    // Test invalid rpc version 0
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, _2_NETWORK_ORDER, PROC_NULL, 0);
+        AppendUint(buffer + RPC_VERSION_OFFSET, 0);
+        TEST_ASSERT(TestInvalidCall(0x9e0f824c, callSize), __LINE__, "TestInvalidCall failed");
+    }
+    // Test invalid rpc version 1
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, _2_NETWORK_ORDER, PROC_NULL, 0);
+        AppendUint(buffer + RPC_VERSION_OFFSET, 1);
+        TEST_ASSERT(TestInvalidCall(0x97e9b9a7, callSize), __LINE__, "TestInvalidCall failed");
+    }
+    // Test invalid rpc version 3
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, _2_NETWORK_ORDER, PROC_NULL, 0);
+        AppendUint(buffer + RPC_VERSION_OFFSET, 3);
+        TEST_ASSERT(TestInvalidCall(0x1fb8a732, callSize), __LINE__, "TestInvalidCall failed");
+    }
+
+    //
+    // Test program unavailable
+    //
+    {
+        UINT callSize = SetupCall(0x819a, 0, 0, 0);
+        TEST_ASSERT(TestCall(&conn, 0xb8932af1, callSize, 1, RPC_REPLY_ACCEPT_STATUS_PROG_UNAVAIL),
+            __LINE__, "test failed");
+    }
+    //
+    // Test program version mismatch
+    //
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, 0xf12, PROC_NULL, 0);
+        TEST_ASSERT(TestCall(&conn, 0xf0188a8f, callSize,
+            3, RPC_REPLY_ACCEPT_STATUS_PROG_MISMATCH, 2, 2), __LINE__, "test failed");
+    }
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, 0x4289, PROC_NULL, 0);
+        TEST_ASSERT(TestCall(&conn, 0x23547890, callSize,
+            3, RPC_REPLY_ACCEPT_STATUS_PROG_MISMATCH, 3, 4), __LINE__, "test failed");
+    }
+
+    //
+    // Test procedure unavailable
+    //
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_PORTMAP_NETWORK_ORDER, _2_NETWORK_ORDER, 0x9184, 0);
+        TEST_ASSERT(TestCall(&conn, 0x5918f8a9, callSize,
+            1, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL), __LINE__, "test failed");
+    }
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, 0x4f20, 0);
+        TEST_ASSERT(TestCall(&conn, 0x1948f910, callSize,
+            1, RPC_REPLY_ACCEPT_STATUS_PROC_UNAVAIL), __LINE__, "test failed");
+    }
+
+    // TODO: test a handle length of 0, some other value like 10, test max value of 64, and a value that is too large
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_FSINFO_NETWORK_ORDER,
+            2, 4, 0x84398184);
+        TEST_ASSERT(TestCall(&conn, 0xa819f9e8, callSize,
+            3, RPC_REPLY_ACCEPT_STATUS_SUCCESS, NFS3_ERROR_BADHANDLE, 0), __LINE__, "test failed");
+    }
+
+    TEST_ASSERT(TestRecordReassembly(&conn), __LINE__, "record reassembly test failed");
+
+    {
+        UINT handle;
+        TEST_ASSERT(Mount(&conn, &handle), __LINE__, "mount failed");
+        TEST_ASSERT(TestFsinfo(&conn, handle), __LINE__, "FSINFO test failed");
+        TEST_ASSERT(TestReaddirplus(&conn, handle), __LINE__, "READDIRPLUS test failed");
+        TEST_ASSERT(TestWriteCommit(&conn, handle), __LINE__, "WRITE/COMMIT test failed");
+        TEST_ASSERT(TestStreamWrite(&conn, handle), __LINE__, "streamed WRITE test failed");
+        TEST_ASSERT(TestAttributes(&conn, handle), __LINE__, "attributes test failed");
+        TEST_ASSERT(TestStats(&conn), __LINE__, "stats test failed");
+        TEST_ASSERT(TestHeapCalls(&conn, handle), __LINE__, "heap calls test failed");
+        TEST_ASSERT(TestAsyncGetattr(&conn, handle), __LINE__, "GETATTR worker test failed");
+        TEST_ASSERT(TestScheduler(&conn, handle), __LINE__, "scheduler test failed");
+        TEST_ASSERT(TestClients(&conn), __LINE__, "clients test failed");
+        TEST_ASSERT(TestReadAhead(&conn), __LINE__, "read-ahead test failed");
+        if(fileName)
+        {
+            TEST_ASSERT(RunFileTests(&conn, handle, fileName), __LINE__, "file tests failed");
+        }
+    }
+
+    return TEST_SUCCESS;
+}
+
+
+
+int PerformanceTest(unsigned runCount, unsigned loopCount)
+{
+    volatile char buffer[4];
+
+    LARGE_INTEGER frequency;
+    if(!QueryPerformanceFrequency(&frequency))
+    {
+        LOG_ERROR("QueryPerformanceFrequency failed (e=%d)", GetLastError());
+        return 1; // fail
+    }
+    LOG("frequency %llu", frequency.QuadPart);
+
+    LARGE_INTEGER before;
+    LARGE_INTEGER after;
+
+    for(unsigned run = 0; run < runCount; run++)
+    {
+        if(!QueryPerformanceCounter(&before))
+        {
+            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
+            return 1;
+        }
+        for(unsigned loop = 0; loop < loopCount; loop++)
+        {
+            AppendUint((char*)buffer, loop);
+        }
+        if(!QueryPerformanceCounter(&after))
+        {
+            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
+            return 1;
+        }
+        LOG("AppendUint: %llu", (after.QuadPart-before.QuadPart));
+        if(!QueryPerformanceCounter(&before))
+        {
+            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
+            return 1;
+        }
+        for(unsigned loop = 0; loop < loopCount; loop++)
+        {
+            *((volatile UINT*)buffer) = htonl(loop);
+        }
+        if(!QueryPerformanceCounter(&after))
+        {
+            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
+            return 1;
+        }
+        LOG("htonl     : %llu", (after.QuadPart-before.QuadPart));
+        if(!QueryPerformanceCounter(&before))
+        {
+            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
+            return 1;
+        }
+        for(unsigned loop = 0; loop < loopCount; loop++)
+        {
+            SET_UINT(buffer, loop);
+        }
+        if(!QueryPerformanceCounter(&after))
+        {
+            LOG_ERROR("QueryPerformanceCounter failed (e=%d)", GetLastError());
+            return 1;
+        }
+        LOG("rawset    : %llu", (after.QuadPart-before.QuadPart));
+    }
+    return TEST_SUCCESS;
+}
+
+#define READDIR_BENCH_PAGE_ENTRIES 512
+
+double ElapsedMilliseconds(LARGE_INTEGER frequency, LARGE_INTEGER before)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (double)(now.QuadPart - before.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+}
+
+// Compares the old way of listing a directory (FindFirstFile/FindNextFile and
+// a GetFileAttributesEx per entry) with the directory enumeration engine.
+// Measures the time until the first page of entries is ready and the time to
+// list the whole directory.
+int ReaddirBenchmark(char* dir)
+{
+    LARGE_INTEGER frequency;
+    if(!QueryPerformanceFrequency(&frequency))
+    {
+        LOG_ERROR("QueryPerformanceFrequency failed (e=%d)", GetLastError());
+        return 1;
+    }
+    if(BufferPoolInit(false) || DirEnumInit(1))
+    {
+        return 1;
+    }
+    UINT dirLength = strlen(dir);
+    if(dirLength + 2 >= MAX_PATH)
+    {
+        LOG_ERROR("path '%s' is too long", dir);
+        return 1;
+    }
+
+    //
+    // Serial baseline
+    //
+    {
+        char path[MAX_PATH];
+        memcpy(path, dir, dirLength);
+        UINT pathLength = dirLength;
+        if(pathLength > 0 && path[pathLength - 1] != '\\')
+        {
+            path[pathLength++] = '\\';
+        }
+        path[pathLength    ] = '*';
+        path[pathLength + 1] = '\0';
+
+        LARGE_INTEGER before;
+        QueryPerformanceCounter(&before);
+        double firstPage = 0;
+        UINT count = 0;
+
+        WIN32_FIND_DATA findData;
+        HANDLE find = FindFirstFile(path, &findData);
+        if(find == INVALID_HANDLE_VALUE)
+        {
+            LOG_ERROR("FindFirstFile '%s' failed (e=%d)", path, GetLastError());
+            return 1;
+        }
+        do
+        {
+            UINT nameLength = strlen(findData.cFileName);
+            if(pathLength + nameLength < MAX_PATH)
+            {
+                memcpy(path + pathLength, findData.cFileName, nameLength + 1);
+                WIN32_FILE_ATTRIBUTE_DATA info;
+                GetFileAttributesEx(path, GetFileExInfoStandard, &info);
+            }
+            count++;
+            if(count == READDIR_BENCH_PAGE_ENTRIES)
+            {
+                firstPage = ElapsedMilliseconds(frequency, before);
+            }
+        } while(FindNextFile(find, &findData));
+        FindClose(find);
+        double total = ElapsedMilliseconds(frequency, before);
+        if(count < READDIR_BENCH_PAGE_ENTRIES)
+        {
+            firstPage = total;
+        }
+        LOG("serial : %u entries, first page %.3f ms, total %.3f ms", count, firstPage, total);
+    }
+
+    //
+    // Directory enumeration engine
+    //
+    {
+        LARGE_INTEGER before;
+        QueryPerformanceCounter(&before);
+        DirSnapshot* snapshot = StartDirEnum(String(dir, dirLength));
+        if(!snapshot)
+        {
+            LOG_ERROR("StartDirEnum failed");
+            return 1;
+        }
+        bool complete;
+        DWORD error;
+        snapshot->WaitForEntries(READDIR_BENCH_PAGE_ENTRIES - 1, &complete, &error);
+        double firstPage = ElapsedMilliseconds(frequency, before);
+        UINT count;
+        do
+        {
+            count = snapshot->WaitForEntries(0xFFFFFFFF, &complete, &error);
+        } while(!complete);
+        double total = ElapsedMilliseconds(frequency, before);
+        snapshot->Release();
+        if(error)
+        {
+            LOG_ERROR("listing '%s' failed (e=%d)", dir, error);
+            return 1;
+        }
+        LOG("direnum: %u entries, first page %.3f ms, total %.3f ms", count, firstPage, total);
+    }
+    return 0;
+}
+
+#define ATTR_REPLAY_ROUNDS 64
+
+// Finds the handle of a file in the root of the share
+int FindShareFile(Connection* conn, UINT rootHandle, char* name, UINT* outHandle)
+{
+    UINT nameLength = strlen(name);
+    UINT64 cookie = 0;
+    UINT64 verifier = 0;
+    for(UINT page = 0; ; page++)
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_READDIRPLUS_NETWORK_ORDER,
+            8, 4, rootHandle, (UINT)(cookie >> 32), (UINT)cookie, (UINT)(verifier >> 32), (UINT)verifier, 512, 2048);
+        UINT xid = 0x2d7c0000 + page;
+        AppendUint(buffer + 4, xid);
+        int sent = send(conn->sock(), buffer, callSize, 0);
+        TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+        UINT length;
+        TEST_ASSERT(RecvReply(conn, xid, &length), __LINE__, "READDIRPLUS reply failed");
+        TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "READDIRPLUS failed");
+        verifier = ParseUint64(buffer + 36);
+
+        UINT offset = 44;
+        while(ParseUint(buffer + offset) == 1)
+        {
+            UINT entryNameLength = ParseUint(buffer + offset + 12);
+            bool match = (entryNameLength == nameLength &&
+                          _strnicmp(buffer + offset + 16, name, nameLength) == 0);
+            offset += 16 + Align4(entryNameLength);
+            cookie = ParseUint64(buffer + offset);
+            offset += 8;
+            if(ParseUint(buffer + offset) == 1)
+            {
+                offset += 84;
+            }
+            offset += 4;
+            if(ParseUint(buffer + offset) == 1)
+            {
+                if(match)
+                {
+                    *outHandle = ParseUint(buffer + offset + 8);
+                    return TEST_SUCCESS;
+                }
+                offset += 8 + Align4(ParseUint(buffer + offset + 4));
+            }
+            else
+            {
+                offset += 4;
+            }
+        }
+        TEST_ASSERT(ParseUint(buffer + offset + 4) == 0, __LINE__, "\"%s\" is not in the share", name);
+    }
+}
+
+// Replays a workload of small synchronous writes, each read back, against a
+// file in the share and counts the GETATTRs a caching client would send.
+// The client only sends a GETATTR when it doesn't know the attributes of the
+// file after a call, a server that returns no attributes from WRITE costs
+// one GETATTR per round.
+// Note: the first ATTR_REPLAY_ROUNDS * 4 bytes of the file are overwritten
+int AttributeReplay(char* name)
+{
+    Wsa wsa;
+    if(wsa.error)
+    {
+        LOG_ERROR("WSAStartup failed (returned %d)", wsa.error);
+        return 1;
+    }
+    Connection connection(2049);
+    Connection* conn = &connection;
+    UINT rootHandle, handle;
+    if(!Mount(conn, &rootHandle) || !FindShareFile(conn, rootHandle, name, &handle))
+    {
+        return 1;
+    }
+
+    bool known = false; // the client knows the current attributes of the file
+    ClientAttributes cached;
+    UINT getattrCount = 0;
+    UINT unexpectedChanges = 0;
+    for(UINT round = 0; round < ATTR_REPLAY_ROUNDS; round++)
+    {
+        UINT callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_WRITE_NETWORK_ORDER,
+            9, 4, handle, 0, round * 4, 4, NFS3_STABLE_FILE_SYNC, 4, round);
+        UINT xid = 0x2d7d0000 + round;
+        AppendUint(buffer + 4, xid);
+        int sent = send(conn->sock(), buffer, callSize, 0);
+        TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+        UINT length;
+        TEST_ASSERT(RecvReply(conn, xid, &length), __LINE__, "WRITE reply failed");
+        TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__,
+            "WRITE failed with %u", ParseUint(buffer + 28));
+        known = (ParseUint(buffer + 36) == 1);
+        if(known)
+        {
+            ParseClientAttributes(buffer + 40, &cached);
+        }
+
+        // The client checks its cached data is still valid before reading
+        if(!known)
+        {
+            callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_GETATTR_NETWORK_ORDER,
+                2, 4, handle);
+            xid = 0x2d7e0000 + round;
+            AppendUint(buffer + 4, xid);
+            sent = send(conn->sock(), buffer, callSize, 0);
+            TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+            TEST_ASSERT(RecvReply(conn, xid, &length), __LINE__, "GETATTR reply failed");
+            TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "GETATTR failed");
+            ParseClientAttributes(buffer + 32, &cached);
+            getattrCount++;
+        }
+
+        callSize = SetupCall(RPC_PROGRAM_NFS_NETWORK_ORDER, _3_NETWORK_ORDER, NFS3_PROC_READ_NETWORK_ORDER,
+            5, 4, handle, 0, round * 4, 4);
+        xid = 0x2d7f0000 + round;
+        AppendUint(buffer + 4, xid);
+        sent = send(conn->sock(), buffer, callSize, 0);
+        TEST_ASSERT(sent == callSize, __LINE__, "send returned %d", sent);
+        TEST_ASSERT(RecvReply(conn, xid, &length), __LINE__, "READ reply failed");
+        TEST_ASSERT(GET_UINT(buffer + 28) == NFS3_STATUS_OK_NETWORK_ORDER, __LINE__, "READ failed");
+        TEST_ASSERT(ParseUint(buffer + 32) == 1, __LINE__, "READ returned no attributes");
+        ClientAttributes readAttributes;
+        ParseClientAttributes(buffer + 36, &readAttributes);
+        if(readAttributes.fileid != cached.fileid || readAttributes.size != cached.size ||
+           readAttributes.mtime != cached.mtime || readAttributes.ctime != cached.ctime)
+        {
+            unexpectedChanges++; // the client would throw away its cached data
+        }
+        cached = readAttributes;
+    }
+    LOG("%u rounds: %u GETATTRs (%u without WRITE attributes), %u unexpected attribute changes",
+        ATTR_REPLAY_ROUNDS, getattrCount, ATTR_REPLAY_ROUNDS, unexpectedChanges);
+    return (getattrCount < ATTR_REPLAY_ROUNDS && unexpectedChanges == 0) ? 0 : 1;
+}
+
+const char* nfs3ProcedureNames[] = {
+    "NULL", "GETATTR", "SETATTR", "LOOKUP", "ACCESS", "READLINK", "READ", "WRITE",
+    "CREATE", "MKDIR", "SYMLINK", "MKNOD", "REMOVE", "RMDIR", "RENAME", "LINK",
+    "READDIR", "READDIRPLUS", "FSSTAT", "FSINFO", "PATHCONF", "COMMIT",
+};
+
+void PrintProcedureName(UINT program, UINT procedure)
+{
+    if(program == RPC_PROGRAM_NFS && procedure < STATIC_ARRAY_LENGTH(nfs3ProcedureNames))
+    {
+        printf("NFS %-12s", nfs3ProcedureNames[procedure]);
+    }
+    else if(program == RPC_PROGRAM_MOUNT)
+    {
+        printf("MOUNT %-10u", procedure);
+    }
+    else if(program == RPC_PROGRAM_PORTMAP)
+    {
+        printf("PORTMAP %-8u", procedure);
+    }
+    else if(program == RPC_PROGRAM_STATS)
+    {
+        printf("STATS %-10u", procedure);
+    }
+    else
+    {
+        printf("%-16s", "other");
+    }
+}
+
+struct DumpedProcedure
+{
+    UINT program;
+    UINT procedure;
+    UINT64 calls;
+    UINT64 errors;
+    UINT64 bytesIn;
+    UINT64 bytesOut;
+};
+
+// Dumps the stats of the server on this machine
+int StatsDump()
+{
+    Wsa wsa;
+    if(wsa.error)
+    {
+        LOG_ERROR("WSAStartup failed (returned %d)", wsa.error);
+        return 1;
+    }
+    Connection connection(2049);
+    Connection* conn = &connection;
+
+    UINT callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _1_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a70100);
+    send(conn->sock(), buffer, callSize, 0);
+    UINT length;
+    if(!RecvReply(conn, 0x51a70100, &length))
+    {
+        return 1;
+    }
+    printf("uptime %llu ms, %u active connections, %llu accepted\r\n",
+        ParseUint64(buffer + 28), ParseUint(buffer + 36), ParseUint64(buffer + 40));
+
+    DumpedProcedure procedures[64];
+    UINT procedureCount = ParseUint(buffer + 48);
+    if(procedureCount > STATIC_ARRAY_LENGTH(procedures))
+    {
+        procedureCount = STATIC_ARRAY_LENGTH(procedures);
+    }
+    for(UINT i = 0; i < procedureCount; i++)
+    {
+        char* procedure = buffer + STATS_SUMMARY_PROCEDURES_OFFSET + i * STATS_SUMMARY_PROCEDURE_SIZE;
+        procedures[i].program   = ParseUint  (procedure +  0);
+        procedures[i].procedure = ParseUint  (procedure +  4);
+        procedures[i].calls     = ParseUint64(procedure +  8);
+        procedures[i].errors    = ParseUint64(procedure + 16);
+        procedures[i].bytesIn   = ParseUint64(procedure + 24);
+        procedures[i].bytesOut  = ParseUint64(procedure + 32);
+    }
+    char* next = buffer + STATS_SUMMARY_PROCEDURES_OFFSET + ParseUint(buffer + 48) * STATS_SUMMARY_PROCEDURE_SIZE;
+    UINT acceptStatusCount = ParseUint(next);
+    next += 4;
+    printf("accept status:");
+    for(UINT i = 0; i < acceptStatusCount; i++)
+    {
+        printf(" %u=%llu", i, ParseUint64(next + i * 8));
+    }
+    printf("\r\n");
+    next += acceptStatusCount * 8;
+    UINT statusCount = ParseUint(next);
+    next += 4;
+    printf("procedure status:");
+    for(UINT i = 0; i < statusCount; i++)
+    {
+        printf(" %u=%llu", ParseUint(next + i * 12), ParseUint64(next + i * 12 + 4));
+    }
+    printf("\r\n\r\n");
+
+    printf("%-16s %10s %8s %12s %12s   wait us p50/p99/p999   exec us p50/p99/p999\r\n",
+        "procedure", "calls", "errors", "bytes in", "bytes out");
+    for(UINT i = 0; i < procedureCount; i++)
+    {
+        PrintProcedureName(procedures[i].program, procedures[i].procedure);
+        printf(" %10llu %8llu %12llu %12llu", procedures[i].calls, procedures[i].errors,
+            procedures[i].bytesIn, procedures[i].bytesOut);
+
+        callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _2_NETWORK_ORDER,
+            2, procedures[i].program, procedures[i].procedure);
+        AppendUint(buffer + 4, 0x51a70101 + i);
+        send(conn->sock(), buffer, callSize, 0);
+        if(!RecvReply(conn, 0x51a70101 + i, &length))
+        {
+            return 1;
+        }
+        if(ParseUint(buffer + 28) == 0)
+        {
+            UINT bucketCount = ParseUint(buffer + 36);
+            for(UINT h = 0; h < 2; h++)
+            {
+                char* buckets = buffer + 40 + h * bucketCount * 8;
+                UINT64 total = HistogramTotal(buckets, bucketCount);
+                printf("   %6llu/%6llu/%6llu",
+                    HistogramPercentile(buckets, bucketCount, total, 0.50),
+                    HistogramPercentile(buckets, bucketCount, total, 0.99),
+                    HistogramPercentile(buckets, bucketCount, total, 0.999));
+            }
+        }
+        printf("\r\n");
+    }
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _6_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a70180);
+    send(conn->sock(), buffer, callSize, 0);
+    if(!RecvReply(conn, 0x51a70180, &length))
+    {
+        return 1;
+    }
+    static const char* schedulerClassNames[] = {"metadata", "directory", "bulk"};
+    printf("\r\nscheduler, max wait %u ms\r\n", ParseUint(buffer + 28));
+    for(UINT i = 0; i < ParseUint(buffer + 32) && i < STATIC_ARRAY_LENGTH(schedulerClassNames); i++)
+    {
+        char* schedulerClass = buffer + STATS_SCHEDULER_CLASSES_OFFSET + i * STATS_SCHEDULER_CLASS_SIZE;
+        printf("  %-10s weight %4u, %10llu calls, %10llu queued (%u now, %u most), %llu waited past the max\r\n",
+            schedulerClassNames[i], ParseUint(schedulerClass), ParseUint64(schedulerClass + 12),
+            ParseUint64(schedulerClass + 20), ParseUint(schedulerClass + 4), ParseUint(schedulerClass + 8),
+            ParseUint64(schedulerClass + 28));
+    }
+    char* overload = buffer + STATS_SCHEDULER_CLASSES_OFFSET + ParseUint(buffer + 32) * STATS_SCHEDULER_CLASS_SIZE;
+    printf("  overloaded at %u queued or %u ms queue delay: %s now, %llu times, %llu calls answered with JUKEBOX\r\n",
+        ParseUint(overload), ParseUint(overload + 4), ParseUint(overload + 8) ? "overloaded" : "not overloaded",
+        ParseUint64(overload + 12), ParseUint64(overload + 20));
+    static const char* dropReasonNames[] = {"stale", "superseded", "closed"};
+    char* drops = overload + STATS_SCHEDULER_OVERLOAD_SIZE;
+    printf("  dropped calls:");
+    for(UINT i = 0; i < ParseUint(drops) && i < STATIC_ARRAY_LENGTH(dropReasonNames); i++)
+    {
+        printf(" %s %llu (%llu bytes)", dropReasonNames[i], ParseUint64(drops + 4 + i * 16),
+            ParseUint64(drops + 4 + i * 16 + 8));
+    }
+    printf("\r\n");
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _7_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a70190);
+    send(conn->sock(), buffer, callSize, 0);
+    if(!RecvReply(conn, 0x51a70190, &length))
+    {
+        return 1;
+    }
+    printf("\r\n%-16s %5s %8s %8s %12s %14s %10s %8s\r\n",
+        "client", "conns", "quantum", "inflight", "calls", "bytes", "queued", "pauses");
+    for(UINT i = 0; i < ParseUint(buffer + 28); i++)
+    {
+        char* client = buffer + STATS_CLIENTS_OFFSET + i * STATS_CLIENT_SIZE;
+        in_addr address;
+        address.s_addr = GET_UINT(client);
+        printf("%-16s %5u %8u %4u/%-4u %12llu %14llu %10llu %8llu\r\n", inet_ntoa(address),
+            ParseUint(client + 4), ParseUint(client + 8), ParseUint(client + 16), ParseUint(client + 12),
+            ParseUint64(client + 20), ParseUint64(client + 28), ParseUint64(client + 36), ParseUint64(client + 44));
+    }
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _8_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a701a0);
+    send(conn->sock(), buffer, callSize, 0);
+    if(!RecvReply(conn, 0x51a701a0, &length))
+    {
+        return 1;
+    }
+    if(ParseUint(buffer + 36) == 0)
+    {
+        printf("\r\nread-ahead: off\r\n");
+    }
+    else
+    {
+        printf("\r\nread-ahead: %u threads, window %u-%u, streams %llu, hits %llu, misses %llu\r\n",
+            ParseUint(buffer + 36), ParseUint(buffer + 28), ParseUint(buffer + 32),
+            ParseUint64(buffer + 40), ParseUint64(buffer + 48), ParseUint64(buffer + 56));
+        printf("  queued %llu pieces (%llu bytes), skipped %llu, read %llu bytes, %llu bytes never read by a client\r\n",
+            ParseUint64(buffer + 64), ParseUint64(buffer + 72), ParseUint64(buffer + 80), ParseUint64(buffer + 88),
+            ParseUint64(buffer + 96));
+    }
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _9_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a701b0);
+    send(conn->sock(), buffer, callSize, 0);
+    if(!RecvReply(conn, 0x51a701b0, &length))
+    {
+        return 1;
+    }
+    if(ParseUint(buffer + 28) == 0)
+    {
+        printf("\r\nblock cache: off\r\n");
+    }
+    else
+    {
+        printf("\r\nblock cache: %u blocks, hits %llu, misses %llu, stale hits %llu, ghost hits %llu\r\n",
+            ParseUint(buffer + 28), ParseUint64(buffer + 32), ParseUint64(buffer + 40), ParseUint64(buffer + 48),
+            ParseUint64(buffer + 56));
+    }
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _10_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a701c0);
+    send(conn->sock(), buffer, callSize, 0);
+    if(!RecvReply(conn, 0x51a701c0, &length))
+    {
+        return 1;
+    }
+    if(ParseUint(buffer + 28) == 0)
+    {
+        printf("\r\ndirect I/O: off\r\n");
+    }
+    else
+    {
+        printf("\r\ndirect I/O: %u bytes or more, %llu reads (%llu bytes), %llu writes (%llu bytes)\r\n",
+            ParseUint(buffer + 28), ParseUint64(buffer + 32), ParseUint64(buffer + 40), ParseUint64(buffer + 48),
+            ParseUint64(buffer + 56));
+    }
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _11_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a701d0);
+    send(conn->sock(), buffer, callSize, 0);
+    if(!RecvReply(conn, 0x51a701d0, &length))
+    {
+        return 1;
+    }
+    printf("\r\nattributes: %llu replies copied them, encoded %llu times\r\n",
+        ParseUint64(buffer + 28), ParseUint64(buffer + 36));
+
+    callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _3_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a70200);
+    send(conn->sock(), buffer, callSize, 0);
+    if(!RecvReply(conn, 0x51a70200, &length))
+    {
+        return 1;
+    }
+    if(ParseUint(buffer + 28) != 0)
+    {
+        return 0;
+    }
+    UINT bucketCount = ParseUint(buffer + 36);
+    UINT windowSize = STATS_LOOP_WINDOW_SIZE(bucketCount);
+    static const char* loopHistogramNames[] = {"select wait", "handler", "busy", "ready sockets"};
+    for(UINT w = 0; w < 2; w++)
+    {
+        char* window = buffer + STATS_LOOP_WINDOWS_OFFSET + w * windowSize;
+        printf("\r\nselect loop, %s window (%u ms): %llu iterations, %llu handler calls, "
+            "%llu sockets added, %llu removed, %llu stalls\r\n",
+            (w == 0) ? "last" : "current", ParseUint(window), ParseUint64(window + 4), ParseUint64(window + 12),
+            ParseUint64(window + 20), ParseUint64(window + 28), ParseUint64(window + 36));
+        for(UINT h = 0; h < STATIC_ARRAY_LENGTH(loopHistogramNames); h++)
+        {
+            char* buckets = window + 44 + h * bucketCount * 8;
+            UINT64 total = HistogramTotal(buckets, bucketCount);
+            if(total)
+            {
+                printf("  %-14s p50/p99/p999 %llu/%llu/%llu max %llu\r\n", loopHistogramNames[h],
+                    HistogramPercentile(buckets, bucketCount, total, 0.50),
+                    HistogramPercentile(buckets, bucketCount, total, 0.99),
+                    HistogramPercentile(buckets, bucketCount, total, 0.999),
+                    HistogramPercentile(buckets, bucketCount, total, 1.0));
+            }
+        }
+    }
+    char* stall = buffer + STATS_LOOP_WINDOWS_OFFSET + 2 * windowSize;
+    UINT stallCount = ParseUint(stall);
+    for(UINT i = 0; i < stallCount; i++)
+    {
+        stall = buffer + STATS_LOOP_WINDOWS_OFFSET + 2 * windowSize + 4 + i * STATS_LOOP_STALL_SIZE;
+        printf("stall at %llu ms: s=%u running %u ms, ", ParseUint64(stall), ParseUint(stall + 8), ParseUint(stall + 20));
+        PrintProcedureName(ParseUint(stall + 12), ParseUint(stall + 16));
+        printf("\r\n");
+    }
+    return 0;
+}
+
+// Has the server on this machine write its sampled request spans to its span file
+int SpansDump()
+{
+    Wsa wsa;
+    if(wsa.error)
+    {
+        LOG_ERROR("WSAStartup failed (returned %d)", wsa.error);
+        return 1;
+    }
+    Connection conn(2049);
+    UINT callSize = SetupCall(RPC_PROGRAM_STATS_NETWORK_ORDER, _1_NETWORK_ORDER, _4_NETWORK_ORDER, 0);
+    AppendUint(buffer + 4, 0x51a70300);
+    send(conn.sock(), buffer, callSize, 0);
+    UINT length;
+    if(!RecvReply(&conn, 0x51a70300, &length))
+    {
+        return 1;
+    }
+    if(ParseUint(buffer + 28) != 0)
+    {
+        LOG_ERROR("the server has no SpanFile or couldn't write it, see its log");
+        return 1;
+    }
+    printf("the server wrote %u spans to its SpanFile (%u were dropped)\r\n", ParseUint(buffer + 32), ParseUint(buffer + 36));
+    return 0;
+}
+
+//
+// Load Generator
+// --------------------------------------------------------
+// NfsTester load [options]
+//   -server <ipv4-address>     (default 127.0.0.1)
+//   -connections <count>       TCP connections, each one is driven by its own
+//                              thread (default 4)
+//   -outstanding <count>       calls each connection keeps in flight (default 8)
+//   -seconds <count>           (default 10)
+//   -mix <name>=<weight>,...   how often each procedure is called, the names
+//                              are null, getattr, lookup, access, readdirplus,
+//                              read and write (default
+//                              null=1,getattr=4,access=2,readdirplus=1 plus
+//                              read=4,write=1 with -file)
+//   -file <name>               a file in the root of the share for LOOKUP,
+//                              READ and WRITE
+//   -size <bytes>              READ and WRITE size (default 4096)
+//   -save <file>               saves the results as a baseline
+//   -baseline <file>           compares the results with a saved baseline
+//   -threshold <percent>       the run fails if a throughput drops or a p99
+//                              latency rises by more than this compared to the
+//                              baseline (default 10)
+//   -backoff <milliseconds>    how long a connection waits after a JUKEBOX
+//                              reply before it sends again (default 10)
+//   -sweep <connections>       runs for -seconds with 1, 2, 4... connections up
+//                              to this many and fails if the goodput at the
+//                              most connections is more than -threshold below
+//                              the best goodput of the sweep
+//
+// GETATTR, ACCESS and READDIRPLUS use the root of the share, READ and WRITE
+// use random offsets within the first LOAD_SPAN bytes of the file.  Calls
+// the server answers with JUKEBOX (it is overloaded) are counted as busy,
+// not as errors, and aren't part of the goodput.
+//
+// Note: WRITE overwrites the first LOAD_SPAN bytes of the file with zeros
+//
+
+#define LOAD_MAX_CONNECTIONS 256
+#define LOAD_MAX_OUTSTANDING 64 // must be a power of 2, the slot is the low bits of the xid
+#define LOAD_SPAN            (1024*1024)
+// Calls a procedure needs before its latency is compared with the baseline
+#define LOAD_MIN_COMPARE_CALLS 100
+
+#define LOAD_NULL        0
+#define LOAD_GETATTR     1
+#define LOAD_LOOKUP      2
+#define LOAD_ACCESS      3
+#define LOAD_READDIRPLUS 4
+#define LOAD_READ        5
+#define LOAD_WRITE       6
+#define LOAD_PROCEDURE_COUNT 7
+
+struct LoadProcedure
+{
+    const char* name;
+    UINT procedure;
+    UINT weight;
+    bool needsFile;
+};
+static LoadProcedure loadProcedures[LOAD_PROCEDURE_COUNT] = {
+    {"null"       , PROC_NULL            , 0, false},
+    {"getattr"    , NFS3_PROC_GETATTR    , 0, false},
+    {"lookup"     , NFS3_PROC_LOOKUP     , 0, true },
+    {"access"     , NFS3_PROC_ACCESS     , 0, false},
+    {"readdirplus", NFS3_PROC_READDIRPLUS, 0, false},
+    {"read"       , NFS3_PROC_READ       , 0, true },
+    {"write"      , NFS3_PROC_WRITE      , 0, true },
+};
+
+struct LoadResults
+{
+    UINT64 calls[LOAD_PROCEDURE_COUNT];
+    UINT64 errors[LOAD_PROCEDURE_COUNT];
+    UINT64 busy[LOAD_PROCEDURE_COUNT]; // JUKEBOX replies
+    UINT64 bytesIn;
+    UINT64 bytesOut;
+    // latency in microseconds, bucketed like the server stats
+    UINT64 histograms[LOAD_PROCEDURE_COUNT][STATS_BUCKET_COUNT];
+};
+
+struct LoadConnection
+{
+    Connection* conn;
+    HANDLE thread;
+    UINT random;
+    UINT sequence;
+    bool failed;
+    UINT xids[LOAD_MAX_OUTSTANDING];
+    UINT procedures[LOAD_MAX_OUTSTANDING];
+    INT64 sendTimes[LOAD_MAX_OUTSTANDING];
+    char* sendBuffer;
+    char* recvBuffer;
+    UINT recvBufferSize;
+    LoadResults results;
+};
+
+// Settings for a run, only modified before the threads start
+struct LoadSettings
+{
+    ULONG address;
+    UINT connections;
+    UINT outstanding;
+    UINT seconds;
+    char* fileName;
+    UINT size;
+    UINT totalWeight;
+    UINT rootHandle;
+    UINT fileHandle;
+    char* savePath;
+    char* baselinePath;
+    UINT threshold;
+    UINT backoff;
+    UINT sweep;
+};
+static LoadSettings load;
+static volatile bool loadStop = false;
+static LARGE_INTEGER loadFrequency;
+
+static INT64 LoadNow()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+static UINT64 LoadTicksToMicros(INT64 ticks)
+{
+    return (ticks <= 0) ? 0 : (UINT64)ticks * 1000000 / (UINT64)loadFrequency.QuadPart;
+}
+
+static UINT LoadRandom(LoadConnection* conn)
+{
+    // xorshift32
+    UINT x = conn->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    conn->random = x;
+    return x;
+}
+
+// Builds a call to a random procedure of the mix in the connection's send buffer
+// Returns: the size of the call
+static UINT LoadBuildCall(LoadConnection* conn, UINT xid, UINT index)
+{
+    char* call = conn->sendBuffer;
+    AppendUint(call +  4, xid);
+    SET_UINT  (call +  8, RPC_MESSAGE_TYPE_CALL_NETWORK_ORDER);
+    SET_UINT  (call + 12, RPC_VERSION_NETWORK_ORDER);
+    SET_UINT  (call + 16, RPC_PROGRAM_NFS_NETWORK_ORDER);
+    SET_UINT  (call + 20, _3_NETWORK_ORDER);
+    AppendUint(call + 24, loadProcedures[index].procedure);
+    SET_UINT  (call + 28, RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER);
+    SET_UINT  (call + 32, 0);
+    SET_UINT  (call + 36, RPC_AUTH_FLAVOR_NULL_NETWORK_ORDER);
+    SET_UINT  (call + 40, 0);
+    char* args = call + 44;
+    if(index != LOAD_NULL)
+    {
+        AppendUint(args    , 4);
+        AppendUint(args + 4, loadProcedures[index].needsFile && index != LOAD_LOOKUP ? load.fileHandle : load.rootHandle);
+        args += 8;
+    }
+    UINT64 offset = 0;
+    if(index == LOAD_READ || index == LOAD_WRITE)
+    {
+        UINT blocks = LOAD_SPAN / load.size;
+        offset = (blocks > 1) ? (UINT64)(LoadRandom(conn) % blocks) * load.size : 0;
+    }
+    switch(index)
+    {
+      case LOAD_LOOKUP:
+      {
+        UINT nameLength = strlen(load.fileName);
+        AppendUint(args, nameLength);
+        memset(args + 4, 0, Align4(nameLength));
+        memcpy(args + 4, load.fileName, nameLength);
+        args += 4 + Align4(nameLength);
+        break;
+      }
+      case LOAD_ACCESS:
+        AppendUint(args, 0x3F); // every access bit
+        args += 4;
+        break;
+      case LOAD_READDIRPLUS:
+        memset(args, 0, 16); // cookie and verifier
+        AppendUint(args + 16, 512);
+        AppendUint(args + 20, 4096);
+        args += 24;
+        break;
+      case LOAD_READ:
+        AppendUint64(args    , offset);
+        AppendUint  (args + 8, load.size);
+        args += 12;
+        break;
+      case LOAD_WRITE:
+        AppendUint64(args     , offset);
+        AppendUint  (args +  8, load.size);
+        AppendUint  (args + 12, NFS3_STABLE_UNSTABLE);
+        AppendUint  (args + 16, load.size);
+        args += 20 + Align4(load.size); // the data is whatever is in the buffer
+        break;
+    }
+    UINT callSize = (UINT)(args - call);
+    AppendUint(call, RPC_LAST_FRAGMENT_FLAG | (callSize - 4));
+    return callSize;
+}
+
+// Returns: the index of a random procedure of the mix
+static UINT LoadPickProcedure(LoadConnection* conn)
+{
+    UINT pick = LoadRandom(conn) % load.totalWeight;
+    for(UINT i = 0; i < LOAD_PROCEDURE_COUNT; i++)
+    {
+        if(pick < loadProcedures[i].weight)
+        {
+            return i;
+        }
+        pick -= loadProcedures[i].weight;
+    }
+    return LOAD_NULL;
+}
+
+// Returns: non-zero on error
+static int LoadSend(LoadConnection* conn, UINT slot)
+{
+    UINT index = LoadPickProcedure(conn);
+    UINT xid = (conn->sequence++ * LOAD_MAX_OUTSTANDING) | slot;
+    UINT callSize = LoadBuildCall(conn, xid, index);
+    conn->xids[slot] = xid;
+    conn->procedures[slot] = index;
+    conn->sendTimes[slot] = LoadNow();
+    UINT sent = 0;
+    while(sent < callSize)
+    {
+        int result = send(conn->conn->sock(), conn->sendBuffer + sent, callSize - sent, 0);
+        if(result <= 0)
+        {
+            LOG_ERROR("send returned %d (e=%d)", result, GetLastError());
+            return 1;
+        }
+        sent += result;
+    }
+    conn->results.bytesOut += callSize;
+    return 0;
+}
+
+// Receives a whole reply record into the connection's receive buffer
+// Returns: non-zero on error
+static int LoadRecv(LoadConnection* conn, UINT* outLength)
+{
+    if(!RecvAll(conn->conn->sock(), conn->recvBuffer, 4))
+    {
+        return 1;
+    }
+    UINT length = ParseUint(conn->recvBuffer) & ~RPC_LAST_FRAGMENT_FLAG;
+    if(length < 24 || length + 4 > conn->recvBufferSize)
+    {
+        LOG_ERROR("bad reply length %u", length);
+        return 1;
+    }
+    if(!RecvAll(conn->conn->sock(), conn->recvBuffer + 4, length))
+    {
+        return 1;
+    }
+    *outLength = length + 4;
+    return 0;
+}
+
+static DWORD WINAPI LoadThread(LPVOID param)
+{
+    LoadConnection* conn = (LoadConnection*)param;
+    UINT inFlight = 0;
+    for(UINT slot = 0; slot < load.outstanding; slot++)
+    {
+        if(LoadSend(conn, slot))
+        {
+            conn->failed = true;
+            return 1;
+        }
+        inFlight++;
+    }
+    while(inFlight > 0)
+    {
+        UINT length;
+        if(LoadRecv(conn, &length))
+        {
+            conn->failed = true;
+            return 1;
+        }
+        INT64 now = LoadNow();
+        UINT xid = ParseUint(conn->recvBuffer + 4);
+        UINT slot = xid & (LOAD_MAX_OUTSTANDING - 1);
+        if(slot >= load.outstanding || conn->xids[slot] != xid)
+        {
+            LOG_ERROR("reply has an unexpected xid 0x%08x", xid);
+            conn->failed = true;
+            return 1;
+        }
+        inFlight--;
+
+        UINT index = conn->procedures[slot];
+        LoadResults* results = &conn->results;
+        results->calls[index]++;
+        results->bytesIn += length;
+        bool busy = false;
+        if(index != LOAD_NULL && length >= 32 && GET_UINT(conn->recvBuffer + 28) == NFS3_ERROR_JUKEBOX_NETWORK_ORDER)
+        {
+            results->busy[index]++;
+            busy = true;
+        }
+        else if(GET_UINT(conn->recvBuffer + 24) != RPC_REPLY_ACCEPT_STATUS_SUCCESS_NETWORK_ORDER ||
+           (index != LOAD_NULL && (length < 32 || GET_UINT(conn->recvBuffer + 28) != NFS3_STATUS_OK_NETWORK_ORDER)))
+        {
+            results->errors[index]++;
+        }
+        results->histograms[index][StatsBucketIndex(LoadTicksToMicros(now - conn->sendTimes[slot]))]++;
+
+        if(!loadStop)
+        {
+            if(busy && load.backoff)
+            {
+                Sleep(load.backoff);
+            }
+            if(LoadSend(conn, slot))
+            {
+                conn->failed = true;
+                return 1;
+            }
+            inFlight++;
+        }
+    }
+    return 0;
+}
+
+// Returns: the highest value of the bucket that holds the call at fraction
+//          of the total
+static UINT64 LoadPercentile(UINT64* buckets, UINT64 total, double fraction)
+{
+    UINT64 target = (UINT64)((double)total * fraction + 0.5);
+    if(target == 0)
+    {
+        target = 1;
+    }
+    UINT64 seen = 0;
+    for(UINT i = 0; i < STATS_BUCKET_COUNT; i++)
+    {
+        seen += buckets[i];
+        if(seen >= target)
+        {
+            return StatsBucketHighest(i);
+        }
+    }
+    return StatsBucketHighest(STATS_BUCKET_COUNT - 1);
+}
+
+// One line of a baseline, the procedure index is LOAD_PROCEDURE_COUNT for
+// all procedures together
+struct LoadSummary
+{
+    bool present;
+    double callsPerSecond;
+    UINT64 p50;
+    UINT64 p99;
+    UINT64 p999;
+};
+
+// Returns: non-zero on error
+static int LoadParseMix(char* mix)
+{
+    for(char* entry = strtok(mix, ","); entry; entry = strtok(NULL, ","))
+    {
+        char* equals = strchr(entry, '=');
+        if(!equals)
+        {
+            LOG_ERROR("expected <name>=<weight> but got '%s'", entry);
+            return 1;
+        }
+        *equals = '\0';
+        UINT i;
+        for(i = 0; i < LOAD_PROCEDURE_COUNT; i++)
+        {
+            if(strcmp(entry, loadProcedures[i].name) == 0)
+            {
+                loadProcedures[i].weight = strtoul(equals + 1, NULL, 10);
+                break;
+            }
+        }
+        if(i == LOAD_PROCEDURE_COUNT)
+        {
+            LOG_ERROR("unknown procedure '%s'", entry);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns: non-zero on error
+static int LoadParseOptions(int argc, char* argv[])
+{
+    load.address = htonl(0x7F000001);
+    load.connections = 4;
+    load.outstanding = 8;
+    load.seconds = 10;
+    load.size = 4096;
+    load.threshold = 10;
+    load.backoff = 10;
+    char* mix = NULL;
+    for(int i = 2; i < argc; i++)
+    {
+        if(i + 1 == argc)
+        {
+            LOG_ERROR("option '%s' needs a value", argv[i]);
+            return 1;
+        }
+        char* option = argv[i];
+        char* value = argv[++i];
+        if(strcmp(option, "-server") == 0)
+        {
+            load.address = inet_addr(value);
+            if(load.address == INADDR_NONE)
+            {
+                LOG_ERROR("invalid address '%s'", value);
+                return 1;
+            }
+        }
+        else if(strcmp(option, "-connections") == 0) load.connections = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-outstanding") == 0) load.outstanding = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-seconds"    ) == 0) load.seconds     = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-size"       ) == 0) load.size        = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-threshold"  ) == 0) load.threshold   = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-backoff"    ) == 0) load.backoff     = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-sweep"      ) == 0) load.sweep       = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-mix"        ) == 0) mix               = value;
+        else if(strcmp(option, "-file"       ) == 0) load.fileName     = value;
+        else if(strcmp(option, "-save"       ) == 0) load.savePath     = value;
+        else if(strcmp(option, "-baseline"   ) == 0) load.baselinePath = value;
+        else
+        {
+            LOG_ERROR("unknown option '%s'", option);
+            return 1;
+        }
+    }
+    if(load.connections == 0 || load.connections > LOAD_MAX_CONNECTIONS || load.sweep > LOAD_MAX_CONNECTIONS ||
+       load.outstanding == 0 || load.outstanding > LOAD_MAX_OUTSTANDING)
+    {
+        LOG_ERROR("connections must be 1 to %u and outstanding must be 1 to %u",
+            LOAD_MAX_CONNECTIONS, LOAD_MAX_OUTSTANDING);
+        return 1;
+    }
+    if(load.seconds == 0 || load.size == 0 || load.size > LOAD_SPAN)
+    {
+        LOG_ERROR("seconds must be at least 1 and size must be 1 to %u", LOAD_SPAN);
+        return 1;
+    }
+
+    if(mix)
+    {
+        if(LoadParseMix(mix))
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        loadProcedures[LOAD_NULL       ].weight = 1;
+        loadProcedures[LOAD_GETATTR    ].weight = 4;
+        loadProcedures[LOAD_ACCESS     ].weight = 2;
+        loadProcedures[LOAD_READDIRPLUS].weight = 1;
+        if(load.fileName)
+        {
+            loadProcedures[LOAD_READ ].weight = 4;
+            loadProcedures[LOAD_WRITE].weight = 1;
+        }
+    }
+    load.totalWeight = 0;
+    for(UINT i = 0; i < LOAD_PROCEDURE_COUNT; i++)
+    {
+        if(loadProcedures[i].weight && loadProcedures[i].needsFile && !load.fileName)
+        {
+            LOG_ERROR("%s needs -file", loadProcedures[i].name);
+            return 1;
+        }
+        load.totalWeight += loadProcedures[i].weight;
+    }
+    if(load.totalWeight == 0)
+    {
+        LOG_ERROR("the mix has no procedures");
+        return 1;
+    }
+    return 0;
+}
+
+// Returns: non-zero on error
+static int LoadSaveBaseline(LoadSummary* summaries)
+{
+    FILE* file = fopen(load.savePath, "w");
+    if(!file)
+    {
+        LOG_ERROR("can't open '%s' for writing", load.savePath);
+        return 1;
+    }
+    fprintf(file, "# procedure calls/s p50 p99 p999 (microseconds)\n");
+    for(UINT i = 0; i <= LOAD_PROCEDURE_COUNT; i++)
+    {
+        if(summaries[i].present)
+        {
+            fprintf(file, "%s %.1f %llu %llu %llu\n", (i == LOAD_PROCEDURE_COUNT) ? "all" : loadProcedures[i].name,
+                summaries[i].callsPerSecond, summaries[i].p50, summaries[i].p99, summaries[i].p999);
+        }
+    }
+    fclose(file);
+    LOG("saved the results to '%s'", load.savePath);
+    return 0;
+}
+
+// Returns: non-zero if the baseline can't be read or the results regressed
+static int LoadCompareBaseline(LoadSummary* summaries)
+{
+    FILE* file = fopen(load.baselinePath, "r");
+    if(!file)
+    {
+        LOG_ERROR("can't open baseline '%s'", load.baselinePath);
+        return 1;
+    }
+    LoadSummary baseline[LOAD_PROCEDURE_COUNT + 1];
+    memset(baseline, 0, sizeof(baseline));
+    char line[256];
+    while(fgets(line, sizeof(line), file))
+    {
+        char name[32];
+        LoadSummary summary;
+        if(line[0] == '#' || sscanf(line, "%31s %lf %llu %llu %llu", name, &summary.callsPerSecond,
+           &summary.p50, &summary.p99, &summary.p999) != 5)
+        {
+            continue;
+        }
+        summary.present = true;
+        for(UINT i = 0; i <= LOAD_PROCEDURE_COUNT; i++)
+        {
+            if(strcmp(name, (i == LOAD_PROCEDURE_COUNT) ? "all" : loadProcedures[i].name) == 0)
+            {
+                baseline[i] = summary;
+            }
+        }
+    }
+    fclose(file);
+
+    printf("\r\ncompared to '%s' (threshold %u%%):\r\n", load.baselinePath, load.threshold);
+    printf("%-12s %12s %12s %8s %10s %10s %8s\r\n", "procedure", "base/s", "calls/s", "change",
+        "base p99", "p99 us", "change");
+    double threshold = load.threshold / 100.0;
+    UINT regressions = 0;
+    for(UINT i = 0; i <= LOAD_PROCEDURE_COUNT; i++)
+    {
+        if(!summaries[i].present || !baseline[i].present)
+        {
+            continue;
+        }
+        double rateChange = (baseline[i].callsPerSecond > 0) ?
+            summaries[i].callsPerSecond / baseline[i].callsPerSecond - 1.0 : 0;
+        double p99Change = (baseline[i].p99 > 0) ? (double)summaries[i].p99 / (double)baseline[i].p99 - 1.0 : 0;
+        bool regressed = (rateChange < -threshold || p99Change > threshold);
+        printf("%-12s %12.1f %12.1f %+7.1f%% %10llu %10llu %+7.1f%%%s\r\n",
+            (i == LOAD_PROCEDURE_COUNT) ? "all" : loadProcedures[i].name,
+            baseline[i].callsPerSecond, summaries[i].callsPerSecond, rateChange * 100,
+            baseline[i].p99, summaries[i].p99, p99Change * 100, regressed ? "  REGRESSED" : "");
+        if(regressed)
+        {
+            regressions++;
+        }
+    }
+    if(regressions)
+    {
+        LOG_ERROR("%u results regressed by more than %u%%", regressions, load.threshold);
+        return 1;
+    }
+    return 0;
+}
+
+// Runs load.connections connections for load.seconds and merges their results
+// Returns: the results (free them), NULL on error
+static LoadResults* LoadRun(UINT64* totalHistogram, double* outSeconds)
+{
+    // Every reply in flight fits in the socket buffer, so the server never
+    // blocks sending a reply while this connection is blocked sending a call
+    int socketBufferSize = load.outstanding * (load.size + 1024);
+    LoadConnection* conns = (LoadConnection*)calloc(load.connections, sizeof(LoadConnection));
+    if(!conns)
+    {
+        LOG_ERROR("out of memory");
+        return NULL;
+    }
+    int result = 0;
+    for(UINT i = 0; i < load.connections; i++)
+    {
+        LoadConnection* conn = &conns[i];
+        conn->random = 0x9e3779b9 * (i + 1);
+        conn->recvBufferSize = load.size + 1024;
+        conn->sendBuffer = (char*)calloc(1, load.size + 1024);
+        conn->recvBuffer = (char*)malloc(conn->recvBufferSize);
+        conn->conn = new Connection(2049, load.address);
+        if(!conn->sendBuffer || !conn->recvBuffer || conn->conn->sock() == INVALID_SOCKET)
+        {
+            result = 1;
+            break;
+        }
+        setsockopt(conn->conn->sock(), SOL_SOCKET, SO_RCVBUF, (char*)&socketBufferSize, sizeof(socketBufferSize));
+        setsockopt(conn->conn->sock(), SOL_SOCKET, SO_SNDBUF, (char*)&socketBufferSize, sizeof(socketBufferSize));
+    }
+
+    loadStop = false;
+    INT64 startTime = LoadNow();
+    if(result == 0)
+    {
+        for(UINT i = 0; i < load.connections; i++)
+        {
+            conns[i].thread = CreateThread(NULL, 0, &LoadThread, &conns[i], 0, NULL);
+            if(conns[i].thread == NULL)
+            {
+                LOG_ERROR("CreateThread failed (e=%d)", GetLastError());
+                loadStop = true;
+                result = 1;
+                break;
+            }
+        }
+        Sleep(load.seconds * 1000);
+        loadStop = true;
+    }
+    for(UINT i = 0; i < load.connections; i++)
+    {
+        if(conns[i].thread)
+        {
+            WaitForSingleObject(conns[i].thread, INFINITE);
+            CloseHandle(conns[i].thread);
+            if(conns[i].failed)
+            {
+                result = 1;
+            }
+        }
+    }
+    *outSeconds = (double)LoadTicksToMicros(LoadNow() - startTime) / 1000000.0;
+
+    // Merge the results of every connection
+    LoadResults* merged = (LoadResults*)calloc(1, sizeof(LoadResults));
+    memset(totalHistogram, 0, STATS_BUCKET_COUNT * sizeof(UINT64));
+    for(UINT i = 0; merged && i < load.connections; i++)
+    {
+        LoadResults* results = &conns[i].results;
+        for(UINT p = 0; p < LOAD_PROCEDURE_COUNT; p++)
+        {
+            merged->calls[p]  += results->calls[p];
+            merged->errors[p] += results->errors[p];
+            merged->busy[p]   += results->busy[p];
+            for(UINT b = 0; b < STATS_BUCKET_COUNT; b++)
+            {
+                merged->histograms[p][b] += results->histograms[p][b];
+                totalHistogram[b] += results->histograms[p][b];
+            }
+        }
+        merged->bytesIn  += results->bytesIn;
+        merged->bytesOut += results->bytesOut;
+    }
+    for(UINT i = 0; i < load.connections; i++)
+    {
+        delete conns[i].conn;
+        free(conns[i].sendBuffer);
+        free(conns[i].recvBuffer);
+    }
+    free(conns);
+    if(!merged)
+    {
+        LOG_ERROR("out of memory");
+        return NULL;
+    }
+    if(result)
+    {
+        LOG_ERROR("a connection failed, the results are incomplete");
+        free(merged);
+        return NULL;
+    }
+    return merged;
+}
+
+// Runs with more and more connections past the point the server is
+// saturated, its goodput should level off instead of collapsing
+// Returns: non-zero on error or if the goodput collapsed
+static int LoadSweep()
+{
+    printf("%11s %12s %12s %12s %8s %8s\r\n", "connections", "calls/s", "goodput/s", "busy/s", "p50 us", "p99 us");
+    double bestGoodput = 0;
+    double lastGoodput = 0;
+    for(UINT connections = 1; ; connections *= 2)
+    {
+        if(connections > load.sweep)
+        {
+            connections = load.sweep;
+        }
+        load.connections = connections;
+        UINT64 totalHistogram[STATS_BUCKET_COUNT];
+        double seconds;
+        LoadResults* merged = LoadRun(totalHistogram, &seconds);
+        if(!merged)
+        {
+            return 1;
+        }
+        UINT64 calls = 0;
+        UINT64 errors = 0;
+        UINT64 busy = 0;
+        for(UINT i = 0; i < LOAD_PROCEDURE_COUNT; i++)
+        {
+            calls  += merged->calls[i];
+            errors += merged->errors[i];
+            busy   += merged->busy[i];
+        }
+        free(merged);
+        lastGoodput = (double)(calls - errors - busy) / seconds;
+        if(lastGoodput > bestGoodput)
+        {
+            bestGoodput = lastGoodput;
+        }
+        printf("%11u %12.1f %12.1f %12.1f %8llu %8llu\r\n", connections, (double)calls / seconds, lastGoodput,
+            (double)busy / seconds, LoadPercentile(totalHistogram, calls, 0.50), LoadPercentile(totalHistogram, calls, 0.99));
+        if(connections == load.sweep)
+        {
+            break;
+        }
+    }
+    if(lastGoodput < bestGoodput * (1.0 - load.threshold / 100.0))
+    {
+        LOG_ERROR("goodput collapsed to %.1f calls/s with %u connections, the best was %.1f",
+            lastGoodput, load.sweep, bestGoodput);
+        return 1;
+    }
+    return 0;
+}
+
+// Drives the server with a mix of procedures from many connections and
+// reports throughput and latency, see the Load Generator section above
+int LoadGenerator(int argc, char* argv[])
+{
+    if(LoadParseOptions(argc, argv))
+    {
+        return 1;
+    }
+    Wsa wsa;
+    if(wsa.error)
+    {
+        LOG_ERROR("WSAStartup failed (returned %d)", wsa.error);
+        return 1;
+    }
+    QueryPerformanceFrequency(&loadFrequency);
+
+    {
+        Connection connection(2049, load.address);
+        if(connection.sock() == INVALID_SOCKET || !Mount(&connection, &load.rootHandle))
+        {
+            return 1;
+        }
+        if(load.fileName && !FindShareFile(&connection, load.rootHandle, load.fileName, &load.fileHandle))
+        {
+            return 1;
+        }
+    }
+    if(load.sweep)
+    {
+        return LoadSweep();
+    }
+
+    // The last procedure is the total
+    UINT64 totalHistogram[STATS_BUCKET_COUNT];
+    double seconds;
+    LoadResults* merged = LoadRun(totalHistogram, &seconds);
+    if(!merged)
+    {
+        return 1;
+    }
+
+    LoadSummary summaries[LOAD_PROCEDURE_COUNT + 1];
+    memset(summaries, 0, sizeof(summaries));
+    UINT64 totalCalls = 0;
+    UINT64 totalErrors = 0;
+    UINT64 totalBusy = 0;
+    printf("%u connections x %u outstanding for %.1f seconds\r\n\r\n", load.connections, load.outstanding, seconds);
+    printf("%-12s %10s %12s %8s %8s %8s %8s %8s\r\n", "procedure", "calls", "calls/s", "errors", "busy",
+        "p50 us", "p99 us", "p999 us");
+    for(UINT i = 0; i <= LOAD_PROCEDURE_COUNT; i++)
+    {
+        UINT64 calls = (i < LOAD_PROCEDURE_COUNT) ? merged->calls[i] : totalCalls;
+        UINT64 errors = (i < LOAD_PROCEDURE_COUNT) ? merged->errors[i] : totalErrors;
+        UINT64 busy = (i < LOAD_PROCEDURE_COUNT) ? merged->busy[i] : totalBusy;
+        UINT64* histogram = (i < LOAD_PROCEDURE_COUNT) ? merged->histograms[i] : totalHistogram;
+        if(calls == 0)
+        {
+            continue;
+        }
+        totalCalls += calls;
+        totalErrors += errors;
+        totalBusy += busy;
+        LoadSummary* summary = &summaries[i];
+        summary->present = (calls >= LOAD_MIN_COMPARE_CALLS);
+        summary->callsPerSecond = (double)calls / seconds;
+        summary->p50  = LoadPercentile(histogram, calls, 0.50);
+        summary->p99  = LoadPercentile(histogram, calls, 0.99);
+        summary->p999 = LoadPercentile(histogram, calls, 0.999);
+        printf("%-12s %10llu %12.1f %8llu %8llu %8llu %8llu %8llu\r\n",
+            (i == LOAD_PROCEDURE_COUNT) ? "all" : loadProcedures[i].name, calls, summary->callsPerSecond,
+            errors, busy, summary->p50, summary->p99, summary->p999);
+    }
+    printf("\r\n%.1f MB/s in, %.1f MB/s out\r\n",
+        (double)merged->bytesIn / seconds / (1024*1024), (double)merged->bytesOut / seconds / (1024*1024));
+    free(merged);
+
+    if(load.savePath && LoadSaveBaseline(summaries))
+    {
+        return 1;
+    }
+    if(load.baselinePath && LoadCompareBaseline(summaries))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Trace Replay
+// --------------------------------------------------------
+// NfsTester replay <trace-file> [-server <ipv4-address>] [-fast]
+//
+// Sends the records of a trace (see Trace.h) to a server, each connection
+// of the trace gets its own connection.  Replies are received and counted by
+// a thread for each connection.
+//
+
+#define REPLAY_MAX_CONNECTIONS 256
+
+struct ReplayConnection
+{
+    UINT id;
+    Connection* conn;
+    HANDLE thread;
+    UINT64 sent;    // records
+    UINT64 replies; // only modified by the connection's thread
+};
+
+// Counts the replies on a connection until the server closes it
+static DWORD WINAPI ReplayReceiveThread(LPVOID param)
+{
+    ReplayConnection* replay = (ReplayConnection*)param;
+    char chunk[64*1024];
+    char marker[4];
+    UINT markerLength = 0;
+    UINT remaining = 0; // bytes left in the current reply
+    while(true)
+    {
+        int received = recv(replay->conn->sock(), chunk, sizeof(chunk), 0);
+        if(received <= 0)
+        {
+            return 0;
+        }
+        for(int i = 0; i < received; )
+        {
+            if(remaining > 0)
+            {
+                UINT take = ((UINT)(received - i) < remaining) ? (UINT)(received - i) : remaining;
+                remaining -= take;
+                i += take;
+                continue;
+            }
+            marker[markerLength++] = chunk[i++];
+            if(markerLength == 4)
+            {
+                remaining = ParseUint(marker) & ~RPC_LAST_FRAGMENT_FLAG;
+                markerLength = 0;
+                replay->replies++;
+            }
+        }
+    }
+}
+
+int ReplayTraceOverTcp(int argc, char* argv[])
+{
+    ULONG address = htonl(0x7F000001);
+    bool fast = false;
+    for(int i = 3; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-fast") == 0)
+        {
+            fast = true;
+        }
+        else if(strcmp(argv[i], "-server") == 0 && i + 1 < argc)
+        {
+            address = inet_addr(argv[++i]);
+        }
+        else
+        {
+            LOG_ERROR("Usage: NfsTester replay <trace-file> [-server <ipv4-address>] [-fast]");
+            return 1;
+        }
+    }
+    Wsa wsa;
+    if(wsa.error)
+    {
+        LOG_ERROR("WSAStartup failed (returned %d)", wsa.error);
+        return 1;
+    }
+    TraceReader reader;
+    if(TraceReaderOpen(&reader, argv[2]))
+    {
+        return 1;
+    }
+
+    ReplayConnection replays[REPLAY_MAX_CONNECTIONS];
+    UINT replayCount = 0;
+    UINT64 records = 0;
+    UINT64 bytes = 0;
+    int result = 0;
+    INT64 start = TraceClock();
+    TraceRecordHeader header;
+    int next;
+    while((next = TraceReaderNext(&reader, &header)) == 1)
+    {
+        ReplayConnection* replay = NULL;
+        for(UINT i = 0; i < replayCount; i++)
+        {
+            if(replays[i].id == header.connection)
+            {
+                replay = &replays[i];
+                break;
+            }
+        }
+        if(!replay)
+        {
+            if(replayCount == REPLAY_MAX_CONNECTIONS)
+            {
+                LOG_ERROR("the trace has more than %u connections", REPLAY_MAX_CONNECTIONS);
+                result = 1;
+                break;
+            }
+            replay = &replays[replayCount];
+            memset(replay, 0, sizeof(ReplayConnection));
+            replay->id = header.connection;
+            replay->conn = new Connection(2049, address);
+            replayCount++;
+            if(replay->conn->sock() == INVALID_SOCKET)
+            {
+                result = 1;
+                break;
+            }
+            replay->thread = CreateThread(NULL, 0, &ReplayReceiveThread, replay, 0, NULL);
+            if(replay->thread == NULL)
+            {
+                LOG_ERROR("CreateThread failed (e=%d)", GetLastError());
+                result = 1;
+                break;
+            }
+        }
+        if(!fast)
+        {
+            TraceWait(start, header.time);
+        }
+        UINT sent = 0;
+        while(sent < header.length)
+        {
+            int size = send(replay->conn->sock(), reader.record + sent, header.length - sent, 0);
+            if(size <= 0)
+            {
+                break;
+            }
+            sent += size;
+        }
+        if(sent < header.length)
+        {
+            LOG_ERROR("connection %u was closed by the server after %llu records", header.connection, replay->sent);
+            result = 1;
+            break;
+        }
+        replay->sent++;
+        records++;
+        bytes += header.length;
+    }
+    if(next < 0)
+    {
+        result = 1;
+    }
+    TraceReaderClose(&reader);
+
+    // The server closes each connection once it has handled every record
+    UINT64 replies = 0;
+    for(UINT i = 0; i < replayCount; i++)
+    {
+        shutdown(replays[i].conn->sock(), SD_SEND);
+    }
+    for(UINT i = 0; i < replayCount; i++)
+    {
+        if(replays[i].thread)
+        {
+            WaitForSingleObject(replays[i].thread, INFINITE);
+            CloseHandle(replays[i].thread);
+        }
+        replies += replays[i].replies;
+        delete replays[i].conn;
+    }
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    double seconds = (double)(TraceClock() - start) / (double)frequency.QuadPart;
+    LOG("%llu records (%llu bytes) on %u connections in %.3f seconds, %.0f records/s, %llu replies",
+        records, bytes, replayCount, seconds, (seconds > 0) ? records / seconds : 0, replies);
+    return result;
+}
+
+//
+// Select Benchmark
+// --------------------------------------------------------
+// Runs a select server in this process over many UDP sockets bound to
+// 127.0.0.1, while a sender thread sends datagrams to random ones of them.
+// One more socket is always writable, so select never blocks and the
+// handler of that socket counts every loop iteration.  With -churn every
+// that many datagrams the socket that received it removes itself and adds
+// itself back, which exercises the registry's remove and add.
+//
+struct SelectBench
+{
+    UINT sockets;
+    UINT seconds;
+    UINT churn;
+    sockaddr_in* addresses;
+    DWORD endTickCount;
+    volatile bool stop;
+    volatile UINT64 sent;
+    UINT64 iterations;
+    UINT64 received;
+    UINT64 churned;
+};
+static SelectBench bench;
+
+static void SelectBenchRead(SynchronizedSelectServer server, SelectSock* sock, PopReason reason, char* sharedBuffer)
+{
+    if(reason != POP_REASON_READ)
+    {
+        return;
+    }
+    if(recv(sock->so, sharedBuffer, sizeof(largeRecord), 0) < 0)
+    {
+        return;
+    }
+    bench.received++;
+    if(bench.churn && bench.received % bench.churn == 0)
+    {
+        sock->UpdateEventFlags(SelectSock::NONE);
+        if(server.TryAddSock(SelectSock(sock->so, sock->user, &SelectBenchRead, SelectSock::READ, SelectSock::INF)))
+        {
+            LOG_ERROR("failed to add socket %d back", sock->so);
+        }
+        else
+        {
+            bench.churned++;
+        }
+    }
+}
+
+static void SelectBenchTick(SynchronizedSelectServer server, SelectSock* sock, PopReason reason, char* sharedBuffer)
+{
+    bench.iterations++;
+    if((int)(GetTickCount() - bench.endTickCount) >= 0)
+    {
+        bench.stop = true;
+        server.SetStopFlag();
+    }
+}
+
+static DWORD WINAPI SelectBenchSendThread(LPVOID param)
+{
+    SOCKET so = (SOCKET)param;
+    UINT random = 0x2545F491;
+    char datagram[16] = {0};
+    UINT64 sent = 0;
+    while(!bench.stop)
+    {
+        // xorshift32
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        sockaddr_in* address = &bench.addresses[random % bench.sockets];
+        if(sendto(so, datagram, sizeof(datagram), 0, (sockaddr*)address, sizeof(*address)) > 0)
+        {
+            sent++;
+            if((sent & 0xFF) == 0)
+            {
+                bench.sent = sent;
+            }
+        }
+    }
+    bench.sent = sent;
+    return 0;
+}
+
+int SelectBenchmark(int argc, char* argv[])
+{
+    bench.sockets = 10000;
+    bench.seconds = 10;
+    bench.churn   = 0;
+    for(int i = 2; i < argc; i++)
+    {
+        if(i + 1 >= argc)
+        {
+            LOG_ERROR("option '%s' needs a value", argv[i]);
+            return 1;
+        }
+        char* option = argv[i];
+        char* value = argv[++i];
+        if     (strcmp(option, "-sockets") == 0) bench.sockets = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-seconds") == 0) bench.seconds = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-churn"  ) == 0) bench.churn   = strtoul(value, NULL, 10);
+        else
+        {
+            LOG_ERROR("unknown option '%s'", option);
+            return 1;
+        }
+    }
+    if(bench.sockets == 0 || bench.seconds == 0)
+    {
+        LOG_ERROR("-sockets and -seconds must be at least 1");
+        return 1;
+    }
+
+    Wsa wsa;
+    if(wsa.error)
+    {
+        LOG_ERROR("WSAStartup failed (returned %d)", wsa.error);
+        return 1;
+    }
+    StatsInit();
+    if(LoopMonitorStart(0))
+    {
+        return 1;
+    }
+
+    bench.addresses = (sockaddr_in*)malloc(bench.sockets * sizeof(sockaddr_in));
+    if(!bench.addresses)
+    {
+        LOG_ERROR("out of memory");
+        return 1;
+    }
+
+    SelectServer server;
+    {
+        LockedSelectServer locked(&server);
+        for(UINT i = 0; i <= bench.sockets; i++)
+        {
+            SOCKET so = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            if(so == INVALID_SOCKET)
+            {
+                LOG_ERROR("socket function failed after %u sockets (e=%d)", i, GetLastError());
+                return 1;
+            }
+            if(i == bench.sockets)
+            {
+                // The tick socket, a UDP socket is always writable
+                if(locked.TryAddSock(SelectSock(so, NULL, &SelectBenchTick, SelectSock::WRITE, SelectSock::INF)))
+                {
+                    LOG_ERROR("select server is full");
+                    return 1;
+                }
+                break;
+            }
+            sockaddr_in* address = &bench.addresses[i];
+            address->sin_family      = AF_INET;
+            address->sin_port        = 0;
+            address->sin_addr.s_addr = htonl(0x7F000001);
+            int addressLength = sizeof(*address);
+            if(SOCKET_ERROR == bind(so, (sockaddr*)address, sizeof(*address)) ||
+               SOCKET_ERROR == getsockname(so, (sockaddr*)address, &addressLength))
+            {
+                LOG_ERROR("bind failed after %u sockets (e=%d)", i, GetLastError());
+                return 1;
+            }
+            if(locked.TryAddSock(SelectSock(so, NULL, &SelectBenchRead, SelectSock::READ, SelectSock::INF)))
+            {
+                LOG_ERROR("select server is full after %u sockets", i);
+                return 1;
+            }
+        }
+    }
+
+    SOCKET sendSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sendSocket == INVALID_SOCKET)
+    {
+        LOG_ERROR("socket function failed (e=%d)", GetLastError());
+        return 1;
+    }
+    bench.stop = false;
+    HANDLE sendThread = CreateThread(NULL, 0, &SelectBenchSendThread, (LPVOID)sendSocket, 0, NULL);
+    if(sendThread == NULL)
+    {
+        LOG_ERROR("CreateThread failed (e=%d)", GetLastError());
+        return 1;
+    }
+
+    LOG("running a select loop over %u sockets for %u seconds...", bench.sockets, bench.seconds);
+    LARGE_INTEGER frequency, before;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&before);
+    bench.endTickCount = GetTickCount() + bench.seconds * 1000;
+    DWORD result = server.Run(largeRecord, sizeof(largeRecord));
+    double elapsed = ElapsedMilliseconds(frequency, before);
+    bench.stop = true;
+    WaitForSingleObject(sendThread, INFINITE);
+    CloseHandle(sendThread);
+    if(result)
+    {
+        LOG_ERROR("select server failed");
+        return 1;
+    }
+
+    double seconds = elapsed / 1000;
+    LOG("sockets    : %u", bench.sockets);
+    LOG("iterations : %llu (%.0f/s, %.2f us each)", bench.iterations,
+        bench.iterations / seconds, bench.iterations ? elapsed * 1000 / bench.iterations : 0.0);
+    LOG("datagrams  : %llu sent, %llu received (%.0f/s)", bench.sent, bench.received, bench.received / seconds);
+    LOG("churn      : %llu sockets removed and added back", bench.churned);
+    return 0;
+}
+
+#define SPARSE_BENCH_READ_SIZE  (1024*1024)
+#define SPARSE_BENCH_DATA_EVERY ((UINT64)1024*1024*1024) // a created file has one read of data every GB
+
+// A SparseReadHandler that reads straight from the file
+static DWORD SparseBenchRead(void* context, UINT64 offset, UINT count, char* data, UINT* outLength)
+{
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset     = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD readLength;
+    if(!ReadFile((HANDLE)context, data, count, &readLength, &overlapped))
+    {
+        DWORD error = GetLastError();
+        if(error != ERROR_HANDLE_EOF)
+        {
+            return error;
+        }
+        readLength = 0;
+    }
+    *outLength = readLength;
+    return 0;
+}
+
+// Creates a sparse file of size bytes with SPARSE_BENCH_READ_SIZE bytes of
+// data at the start of every SPARSE_BENCH_DATA_EVERY bytes
+static int SparseBenchCreate(char* path, UINT64 size, char* data)
+{
+    HANDLE file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+    {
+        LOG_ERROR("failed to create '%s' (e=%d)", path, GetLastError());
+        return 1;
+    }
+    DWORD returned;
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)size;
+    if(!DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL) ||
+       !SetFilePointerEx(file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+    {
+        LOG_ERROR("failed to make '%s' a %llu byte sparse file (e=%d)", path, size, GetLastError());
+        CloseHandle(file);
+        return 1;
+    }
+    for(UINT64 offset = 0; offset < size; offset += SPARSE_BENCH_DATA_EVERY)
+    {
+        memset(data, (int)(offset / SPARSE_BENCH_DATA_EVERY) % 255 + 1, SPARSE_BENCH_READ_SIZE);
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset     = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD written;
+        DWORD length = (size - offset < SPARSE_BENCH_READ_SIZE) ? (DWORD)(size - offset) : SPARSE_BENCH_READ_SIZE;
+        if(!WriteFile(file, data, length, &written, &overlapped))
+        {
+            LOG_ERROR("failed to write '%s' (e=%d)", path, GetLastError());
+            CloseHandle(file);
+            return 1;
+        }
+    }
+    CloseHandle(file);
+    LOG("created '%s', %llu bytes with data every %llu bytes", path, size, SPARSE_BENCH_DATA_EVERY);
+    return 0;
+}
+
+// Reads a whole file with ReadFile, then again with the sparse map READ
+// uses (holes are zero filled, only the allocated ranges are read), and
+// checks both read the same data.  -create makes a mostly sparse file of
+// the given size first.  The map pass runs second, so the little data the
+// file has is already cached for it.
+int SparseBenchmark(int argc, char* argv[])
+{
+    char* path = argv[2];
+    UINT64 createSize = 0;
+    for(int i = 3; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-create") == 0 && i + 1 < argc)
+        {
+            createSize = (UINT64)strtoul(argv[++i], NULL, 10) * 1024 * 1024 * 1024;
+        }
+        else
+        {
+            LOG_ERROR("unknown option '%s'", argv[i]);
+            return 1;
+        }
+    }
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    char* data = (char*)malloc(SPARSE_BENCH_READ_SIZE);
+    char* check = (char*)malloc(SPARSE_BENCH_READ_SIZE);
+    if(!data || !check)
+    {
+        LOG_ERROR("out of memory");
+        return 1;
+    }
+    if(createSize && SparseBenchCreate(path, createSize, data))
+    {
+        return 1;
+    }
+
+    HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if(file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size))
+    {
+        LOG_ERROR("failed to open '%s' (e=%d)", path, GetLastError());
+        return 1;
+    }
+    UINT64 fileSize = (UINT64)size.QuadPart;
+
+    LARGE_INTEGER before;
+    QueryPerformanceCounter(&before);
+    for(UINT64 offset = 0; offset < fileSize; offset += SPARSE_BENCH_READ_SIZE)
+    {
+        UINT length;
+        DWORD error = SparseBenchRead(file, offset, SPARSE_BENCH_READ_SIZE, data, &length);
+        if(error)
+        {
+            LOG_ERROR("ReadFile failed (e=%d)", error);
+            return 1;
+        }
+    }
+    double readFileMillis = ElapsedMilliseconds(frequency, before);
+
+    SparseMap map;
+    memset(&map, 0, sizeof(map));
+    QueryPerformanceCounter(&before);
+    DWORD error = SparseMapLoad(&map, file, fileSize, 0);
+    if(error)
+    {
+        LOG_ERROR("mapping the allocated ranges failed (e=%d)", error);
+        return 1;
+    }
+    if(map.dense)
+    {
+        LOG_ERROR("'%s' has more than %u allocated ranges", path, SPARSE_MAP_MAX_RANGES);
+        return 1;
+    }
+    UINT64 allocated = 0;
+    for(UINT i = 0; i < map.count; i++)
+    {
+        allocated += (UINT64)map.ranges[i].Length.QuadPart;
+    }
+    for(UINT64 offset = 0; offset < fileSize; offset += SPARSE_BENCH_READ_SIZE)
+    {
+        UINT count = (fileSize - offset < SPARSE_BENCH_READ_SIZE) ? (UINT)(fileSize - offset) : SPARSE_BENCH_READ_SIZE;
+        UINT length;
+        error = SparseMapRead(&map, offset, count, data, &SparseBenchRead, file, &length);
+        if(error)
+        {
+            LOG_ERROR("sparse read failed (e=%d)", error);
+            return 1;
+        }
+    }
+    double mapMillis = ElapsedMilliseconds(frequency, before);
+
+    UINT mismatches = 0;
+    for(UINT64 offset = 0; offset < fileSize; offset += SPARSE_BENCH_READ_SIZE)
+    {
+        UINT count = (fileSize - offset < SPARSE_BENCH_READ_SIZE) ? (UINT)(fileSize - offset) : SPARSE_BENCH_READ_SIZE;
+        UINT length, checkLength;
+        if(SparseBenchRead(file, offset, count, check, &checkLength) ||
+           SparseMapRead(&map, offset, count, data, &SparseBenchRead, file, &length) ||
+           length != checkLength || memcmp(data, check, length) != 0)
+        {
+            mismatches++;
+        }
+    }
+    CloseHandle(file);
+
+    double megabytes = (double)fileSize / (1024 * 1024);
+    LOG("file     : %llu bytes, %u allocated ranges holding %llu bytes", fileSize, map.count, allocated);
+    LOG("ReadFile : %.3f ms (%.0f MB/s)", readFileMillis, megabytes * 1000 / readFileMillis);
+    LOG("map      : %.3f ms (%.0f MB/s)", mapMillis, megabytes * 1000 / mapMillis);
+    if(mismatches)
+    {
+        LOG_ERROR("%u reads of %u bytes didn't match", mismatches, SPARSE_BENCH_READ_SIZE);
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Shard Benchmark
+// --------------------------------------------------------
+// The server's handle, attribute and name tables are only used by the select
+// thread, so they take no locks.  With several event loops a table they all
+// share would need locks, and even a table split into lock stripes moves the
+// cache lines of its locks and entries from core to core on every call.  This
+// benchmark measures both ways of splitting a cache of file attributes keyed
+// by file handle between cores:
+//
+//   striped   one table split into stripes, each with its own lock, any
+//             core can look up any handle after it takes the handle's
+//             stripe lock
+//   sharded   every core owns the shard of the handle space chosen by a hash
+//             of the handle (ShardOf) and is the only one that reads or
+//             writes it.  A core that has a call for a handle of another
+//             core's shard forwards it over a ShardRing, a lock-free single
+//             producer, single consumer ring that only the two cores use.
+//             Every core drains the rings that other cores send to it.
+//
+// It runs a number of cores (threads) that each make calls for random
+// handles, as the event loops of a server would after decoding them, once
+// with a StripedCache that every core shares and once with a ShardTable
+// owned by each core.  Both keep the same number of slots in all.  A GET that
+// misses stores attributes as if the file had been opened, 1 call in 8 is a
+// SET.
+//
+// A shard's table and a stripe's table are the same ShardTable, a fixed size
+// open addressing table with SHARD_TABLE_PROBES slots probed per handle.  A
+// handle that finds no slot replaces the one in its first slot.  Server
+// handles are indices that start at 0, so an empty slot holds
+// SHARD_EMPTY_HANDLE, which can't be a handle.
+//
+#define SHARD_RING_SIZE    256 // calls a ring holds, must be a power of 2
+#define SHARD_TABLE_PROBES 8   // slots probed for a handle
+#define SHARD_CACHE_LINE   64
+#define SHARD_EMPTY_HANDLE 0xFFFFFFFF
+
+struct ShardAttributes
+{
+    UINT64 size;
+    UINT64 changeTime;
+};
+
+struct ShardEntry
+{
+    UINT handle;
+    ShardAttributes attributes;
+};
+
+struct ShardTable
+{
+    UINT mask; // slot count - 1
+    ShardEntry* slots;
+};
+
+// capacity is rounded up to a power of 2
+// Returns: non-zero on error
+static int ShardTableInit(ShardTable* table, UINT capacity)
+{
+    UINT slotCount = SHARD_TABLE_PROBES;
+    while(slotCount < capacity)
+    {
+        slotCount *= 2;
+    }
+    table->slots = (ShardEntry*)calloc(slotCount, sizeof(ShardEntry));
+    if(!table->slots)
+    {
+        LOG_ERROR("failed to allocate %u slots", slotCount);
+        return 1;
+    }
+    for(UINT i = 0; i < slotCount; i++)
+    {
+        table->slots[i].handle = SHARD_EMPTY_HANDLE;
+    }
+    table->mask = slotCount - 1;
+    return 0;
+}
+
+static void ShardTableFree(ShardTable* table)
+{
+    free(table->slots);
+    table->slots = NULL;
+}
+
+// Returns: the shard (0 to shardCount - 1) that owns handle
+static UINT ShardOf(UINT handle, UINT shardCount)
+{
+    // Fibonacci hashing spreads handles that are allocated in order
+    return (UINT)(((UINT64)(handle * 0x9E3779B9) * shardCount) >> 32);
+}
+
+// Returns: the first slot of the handle, the table is probed from there
+static UINT ShardTableHomeSlot(ShardTable* table, UINT handle)
+{
+    // ShardOf uses the high bits of the same hash, the low bits pick the slot
+    return (handle * 0x9E3779B9) & table->mask;
+}
+
+// Returns: true if the handle was found, its attributes are copied to outAttributes
+static bool ShardTableGet(ShardTable* table, UINT handle, ShardAttributes* outAttributes)
+{
+    UINT slot = ShardTableHomeSlot(table, handle);
+    for(UINT i = 0; i < SHARD_TABLE_PROBES; i++)
+    {
+        ShardEntry* entry = &table->slots[(slot + i) & table->mask];
+        if(entry->handle == handle)
+        {
+            *outAttributes = entry->attributes;
+            return true;
+        }
+        if(entry->handle == SHARD_EMPTY_HANDLE)
+        {
+            break;
+        }
+    }
+    return false;
+}
+
+static void ShardTableSet(ShardTable* table, UINT handle, const ShardAttributes* attributes)
+{
+    UINT slot = ShardTableHomeSlot(table, handle);
+    ShardEntry* target = &table->slots[slot]; // replaced if the handle finds no slot
+    for(UINT i = 0; i < SHARD_TABLE_PROBES; i++)
+    {
+        ShardEntry* entry = &table->slots[(slot + i) & table->mask];
+        if(entry->handle == handle || entry->handle == SHARD_EMPTY_HANDLE)
+        {
+            target = entry;
+            break;
+        }
+    }
+    target->handle     = handle;
+    target->attributes = *attributes;
+}
+
+//
+// Forwarded calls
+//
+enum ShardOp
+{
+    SHARD_OP_GET, // look up the attributes, read them from the file on a miss
+    SHARD_OP_SET, // the file changed, store new attributes
+};
+struct ShardCall
+{
+    UINT handle;
+    UINT op;
+    ShardAttributes attributes; // for SHARD_OP_SET
+};
+
+// head is only written by the consumer and tail only by the producer, each
+// on its own cache line so the two cores don't share one they both write
+struct ShardRing
+{
+    volatile LONG head;
+    char headPad[SHARD_CACHE_LINE - sizeof(LONG)];
+    volatile LONG tail;
+    char tailPad[SHARD_CACHE_LINE - sizeof(LONG)];
+    ShardCall calls[SHARD_RING_SIZE];
+};
+
+// Returns: the index the other side of the ring published, the accesses
+//          after it can't move before it (acquire)
+static UINT ShardRingAcquire(volatile LONG* index)
+{
+    UINT value = (UINT)*index;
+    MemoryBarrier();
+    return value;
+}
+// Publishes index, the accesses before it can't move after it (release)
+static void ShardRingRelease(volatile LONG* index, UINT value)
+{
+    InterlockedExchange(index, (LONG)value);
+}
+
+// A call is written before the tail that publishes it is released, and read
+// before the head that frees its slot is released
+// Note: ring must be zeroed before it is used
+// Returns: false if the ring is full
+static bool ShardRingPush(ShardRing* ring, const ShardCall* call)
+{
+    UINT tail = (UINT)ring->tail; // only written by this core
+    if(tail - ShardRingAcquire(&ring->head) == SHARD_RING_SIZE)
+    {
+        return false;
+    }
+    ring->calls[tail & (SHARD_RING_SIZE - 1)] = *call;
+    ShardRingRelease(&ring->tail, tail + 1);
+    return true;
+}
+// Returns: false if the ring is empty
+static bool ShardRingPop(ShardRing* ring, ShardCall* outCall)
+{
+    UINT head = (UINT)ring->head; // only written by this core
+    if(head == ShardRingAcquire(&ring->tail))
+    {
+        return false;
+    }
+    *outCall = ring->calls[head & (SHARD_RING_SIZE - 1)];
+    ShardRingRelease(&ring->head, head + 1);
+    return true;
+}
+
+//
+// Striped cache
+//
+struct ShardStripe
+{
+    CRITICAL_SECTION lock;
+    ShardTable table;
+    char pad[SHARD_CACHE_LINE]; // keeps the next stripe's lock off this one's line
+};
+struct StripedCache
+{
+    UINT stripeCount;
+    ShardStripe* stripes;
+};
+
+// capacity is split between the stripes
+// Returns: non-zero on error
+static int StripedCacheInit(StripedCache* cache, UINT stripeCount, UINT capacity)
+{
+    cache->stripes = (ShardStripe*)calloc(stripeCount, sizeof(ShardStripe));
+    if(!cache->stripes)
+    {
+        LOG_ERROR("failed to allocate %u stripes", stripeCount);
+        return 1;
+    }
+    cache->stripeCount = stripeCount;
+    for(UINT i = 0; i < stripeCount; i++)
+    {
+        InitializeCriticalSection(&cache->stripes[i].lock);
+        if(ShardTableInit(&cache->stripes[i].table, (capacity + stripeCount - 1) / stripeCount))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void StripedCacheFree(StripedCache* cache)
+{
+    for(UINT i = 0; i < cache->stripeCount; i++)
+    {
+        DeleteCriticalSection(&cache->stripes[i].lock);
+        ShardTableFree(&cache->stripes[i].table);
+    }
+    free(cache->stripes);
+    cache->stripes = NULL;
+    cache->stripeCount = 0;
+}
+
+static bool StripedCacheGet(StripedCache* cache, UINT handle, ShardAttributes* outAttributes)
+{
+    ShardStripe* stripe = &cache->stripes[ShardOf(handle, cache->stripeCount)];
+    EnterCriticalSection(&stripe->lock);
+    bool found = ShardTableGet(&stripe->table, handle, outAttributes);
+    LeaveCriticalSection(&stripe->lock);
+    return found;
+}
+
+static void StripedCacheSet(StripedCache* cache, UINT handle, const ShardAttributes* attributes)
+{
+    ShardStripe* stripe = &cache->stripes[ShardOf(handle, cache->stripeCount)];
+    EnterCriticalSection(&stripe->lock);
+    ShardTableSet(&stripe->table, handle, attributes);
+    LeaveCriticalSection(&stripe->lock);
+}
+
+//
+// Benchmark
+//
+#define SHARD_BENCH_STRIPES_PER_CORE 4
+#define SHARD_BENCH_BATCH            32 // calls a core makes between draining its rings
+
+struct ShardBenchCore
+{
+    ShardTable table;
+    UINT random;
+    UINT64 hits;
+    UINT64 misses;
+    UINT64 forwarded;
+    UINT64 handled;
+    char pad[SHARD_CACHE_LINE];
+};
+struct ShardBench
+{
+    UINT cores;
+    UINT handles;
+    UINT calls; // made by every core
+    bool sharded;
+    StripedCache striped;
+    ShardBenchCore* core;
+    ShardRing* rings; // the ring from core a to core b is rings[a * cores + b]
+    volatile LONG64 handled;
+    volatile LONG start;
+};
+static ShardBench shardBench;
+
+static void ShardBenchNextCall(ShardBenchCore* core, ShardCall* call)
+{
+    // xorshift32
+    UINT random = core->random;
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    core->random = random;
+    call->handle = random % shardBench.handles; // handle 0 is the export root
+    call->op = ((random >> 29) == 0) ? SHARD_OP_SET : SHARD_OP_GET;
+    call->attributes.size       = random;
+    call->attributes.changeTime = random;
+}
+
+static void ShardBenchHandle(ShardBenchCore* core, const ShardCall* call)
+{
+    core->handled++;
+    if(call->op == SHARD_OP_SET)
+    {
+        if(shardBench.sharded) ShardTableSet(&core->table, call->handle, &call->attributes);
+        else                   StripedCacheSet(&shardBench.striped, call->handle, &call->attributes);
+        return;
+    }
+    ShardAttributes attributes;
+    bool found = shardBench.sharded ?
+        ShardTableGet(&core->table, call->handle, &attributes) :
+        StripedCacheGet(&shardBench.striped, call->handle, &attributes);
+    if(found)
+    {
+        core->hits++;
+        return;
+    }
+    core->misses++;
+    attributes.size       = call->handle;
+    attributes.changeTime = 0;
+    if(shardBench.sharded) ShardTableSet(&core->table, call->handle, &attributes);
+    else                   StripedCacheSet(&shardBench.striped, call->handle, &attributes);
+}
+
+static DWORD WINAPI ShardBenchThread(LPVOID param)
+{
+    UINT index = (UINT)(UINT_PTR)param;
+    ShardBenchCore* core = &shardBench.core[index];
+    while(!shardBench.start)
+    {
+        SwitchToThread();
+    }
+
+    ShardCall call;
+    if(!shardBench.sharded)
+    {
+        for(UINT i = 0; i < shardBench.calls; i++)
+        {
+            ShardBenchNextCall(core, &call);
+            ShardBenchHandle(core, &call);
+        }
+        InterlockedExchangeAdd64(&shardBench.handled, (LONG64)core->handled);
+        return 0;
+    }
+
+    UINT cores = shardBench.cores;
+    LONG64 total = (LONG64)cores * shardBench.calls;
+    ShardRing* outRings = &shardBench.rings[index * cores];
+    UINT made = 0;
+    bool pending = false;
+    UINT64 reported = 0;
+    while(true)
+    {
+        for(UINT i = 0; i < SHARD_BENCH_BATCH && made < shardBench.calls; i++)
+        {
+            if(!pending)
+            {
+                ShardBenchNextCall(core, &call);
+                pending = true;
+            }
+            UINT owner = ShardOf(call.handle, cores);
+            if(owner == index)
+            {
+                ShardBenchHandle(core, &call);
+            }
+            else if(ShardRingPush(&outRings[owner], &call))
+            {
+                core->forwarded++;
+            }
+            else
+            {
+                break; // the owner may be waiting for room in a ring to this core, drain it first
+            }
+            pending = false;
+            made++;
+        }
+
+        ShardCall forwarded;
+        for(UINT from = 0; from < cores; from++)
+        {
+            ShardRing* ring = &shardBench.rings[from * cores + index];
+            while(ShardRingPop(ring, &forwarded))
+            {
+                ShardBenchHandle(core, &forwarded);
+            }
+        }
+
+        if(core->handled != reported)
+        {
+            InterlockedExchangeAdd64(&shardBench.handled, (LONG64)(core->handled - reported));
+            reported = core->handled;
+        }
+        else if(made == shardBench.calls && shardBench.handled == total)
+        {
+            return 0;
+        }
+        else if(pending || made == shardBench.calls)
+        {
+            SwitchToThread(); // waiting on other cores, there may be more cores than processors
+        }
+    }
+}
+
+// Returns: non-zero on error
+static int ShardBenchRun(UINT cores, bool sharded, double* outMillis)
+{
+    shardBench.cores   = cores;
+    shardBench.sharded = sharded;
+    shardBench.handled = 0;
+    shardBench.start   = 0;
+    shardBench.core = (ShardBenchCore*)calloc(cores, sizeof(ShardBenchCore));
+    HANDLE* threads = (HANDLE*)calloc(cores, sizeof(HANDLE));
+    if(!shardBench.core || !threads)
+    {
+        LOG_ERROR("out of memory");
+        return 1;
+    }
+    UINT capacity = shardBench.handles * 2;
+    if(sharded)
+    {
+        shardBench.rings = (ShardRing*)calloc((size_t)cores * cores, sizeof(ShardRing));
+        if(!shardBench.rings)
+        {
+            LOG_ERROR("failed to allocate %u rings", cores * cores);
+            return 1;
+        }
+        for(UINT i = 0; i < cores; i++)
+        {
+            if(ShardTableInit(&shardBench.core[i].table, capacity / cores))
+            {
+                return 1;
+            }
+        }
+    }
+    else if(StripedCacheInit(&shardBench.striped, cores * SHARD_BENCH_STRIPES_PER_CORE, capacity))
+    {
+        return 1;
+    }
+
+    for(UINT i = 0; i < cores; i++)
+    {
+        shardBench.core[i].random = 0x9e3779b9 * (i + 1);
+        threads[i] = CreateThread(NULL, 0, &ShardBenchThread, (LPVOID)(UINT_PTR)i, 0, NULL);
+        if(threads[i] == NULL)
+        {
+            LOG_ERROR("CreateThread failed (e=%d)", GetLastError());
+            return 1;
+        }
+    }
+    LARGE_INTEGER frequency, before;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&before);
+    shardBench.start = 1;
+    for(UINT i = 0; i < cores; i++)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    *outMillis = ElapsedMilliseconds(frequency, before);
+
+    UINT64 hits = 0, misses = 0, forwarded = 0;
+    for(UINT i = 0; i < cores; i++)
+    {
+        ShardBenchCore* core = &shardBench.core[i];
+        hits      += core->hits;
+        misses    += core->misses;
+        forwarded += core->forwarded;
+        if(sharded)
+        {
+            ShardTableFree(&core->table);
+        }
+    }
+    UINT64 total = (UINT64)cores * shardBench.calls;
+    double seconds = *outMillis / 1000;
+    LOG("%2u cores %-7s: %10.3f ms, %12.0f calls/s, %5.1f%% of GETs hit, %5.1f%% of calls forwarded",
+        cores, sharded ? "sharded" : "striped", *outMillis, total / seconds,
+        (hits + misses) ? 100.0 * hits / (hits + misses) : 0.0, 100.0 * forwarded / total);
+    if(sharded)
+    {
+        free(shardBench.rings);
+        shardBench.rings = NULL;
+    }
+    else
+    {
+        StripedCacheFree(&shardBench.striped);
+    }
+    free(shardBench.core);
+    free(threads);
+    if((UINT64)shardBench.handled != total)
+    {
+        LOG_ERROR("handled %llu of %llu calls", (UINT64)shardBench.handled, total);
+        return 1;
+    }
+    return 0;
+}
+
+int ShardBenchmark(int argc, char* argv[])
+{
+    static const UINT defaultCores[] = {4, 16, 64};
+    UINT cores = 0;
+    shardBench.handles = 1024 * 1024;
+    shardBench.calls   = 1024 * 1024;
+    for(int i = 2; i < argc; i++)
+    {
+        if(i + 1 >= argc)
+        {
+            LOG_ERROR("option '%s' needs a value", argv[i]);
+            return 1;
+        }
+        char* option = argv[i];
+        char* value = argv[++i];
+        if     (strcmp(option, "-cores"  ) == 0) cores              = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-handles") == 0) shardBench.handles = strtoul(value, NULL, 10);
+        else if(strcmp(option, "-calls"  ) == 0) shardBench.calls   = strtoul(value, NULL, 10);
+        else
+        {
+            LOG_ERROR("unknown option '%s'", option);
+            return 1;
+        }
+    }
+    if(shardBench.handles == 0 || shardBench.calls == 0)
+    {
+        LOG_ERROR("-handles and -calls must be at least 1");
+        return 1;
+    }
+
+    LOG("%u handles, %u calls from every core", shardBench.handles, shardBench.calls);
+    UINT runs = cores ? 1 : sizeof(defaultCores) / sizeof(defaultCores[0]);
+    for(UINT i = 0; i < runs; i++)
+    {
+        UINT runCores = cores ? cores : defaultCores[i];
+        double stripedMillis, shardedMillis;
+        if(ShardBenchRun(runCores, false, &stripedMillis) ||
+           ShardBenchRun(runCores, true , &shardedMillis))
+        {
+            return 1;
+        }
+        LOG("%2u cores sharded is %.2fx striped", runCores, stripedMillis / shardedMillis);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    //PerformanceTest(3, 1000000000);
+
+    if(argc == 3 && strcmp(argv[1], "readdir-bench") == 0)
+    {
+        return ReaddirBenchmark(argv[2]);
+    }
+    if(argc == 2 && strcmp(argv[1], "stats") == 0)
+    {
+        return StatsDump();
+    }
+    if(argc == 2 && strcmp(argv[1], "spans") == 0)
+    {
+        return SpansDump();
+    }
+    if(argc == 3 && strcmp(argv[1], "attr-replay") == 0)
+    {
+        return AttributeReplay(argv[2]);
+    }
+    if(argc >= 2 && strcmp(argv[1], "load") == 0)
+    {
+        return LoadGenerator(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "replay") == 0)
+    {
+        return ReplayTraceOverTcp(argc, argv);
+    }
+    if(argc >= 2 && strcmp(argv[1], "select-bench") == 0)
+    {
+        return SelectBenchmark(argc, argv);
+    }
+    if(argc >= 3 && strcmp(argv[1], "sparse-bench") == 0)
+    {
+        return SparseBenchmark(argc, argv);
+    }
+    if(argc >= 2 && strcmp(argv[1], "shard-bench") == 0)
+    {
+        return ShardBenchmark(argc, argv);
+    }
+    // The file tests overwrite the first FILE_TEST_SIZE bytes of the file
+    char* fileName = NULL;
+    if(argc == 3 && strcmp(argv[1], "-file") == 0)
+    {
+        fileName = argv[2];
+    }
+
+    Wsa wsa;
+    if(wsa.error)
+    {
+        LOG_ERROR("WSAStartup failed (returned %d)", wsa.error);
+        return 1;
+    }
+
+    int result = run(fileName);
+
+    if(result == TEST_SUCCESS)
+    {
+        printf("SUCCESS\r\n");
+        return 0;
+    }
+    else
+    {
+        printf("ERROR\r\n");
+        return 1; // fail
+    }
 }
\ No newline at end of file
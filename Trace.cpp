@@ -0,0 +1,162 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Common.h"
+#include "Trace.h"
+
+// Buffered by stdio, flushed when it fills up or a second after the last flush
+#define TRACE_WRITE_BUFFER_SIZE (1024*1024)
+#define TRACE_FLUSH_INTERVAL    1000 // milliseconds
+
+bool traceEnabled = false;
+
+static FILE* traceFile;
+static INT64 traceStart;
+static DWORD traceFlushTickCount;
+static LARGE_INTEGER traceFrequency;
+
+INT64 TraceClock()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static UINT64 TraceMicrosSince(INT64 start)
+{
+    if(traceFrequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&traceFrequency);
+    }
+    INT64 ticks = TraceClock() - start;
+    return (ticks <= 0) ? 0 : (UINT64)ticks * 1000000 / (UINT64)traceFrequency.QuadPart;
+}
+
+void TraceWait(INT64 start, UINT64 micros)
+{
+    while(true)
+    {
+        UINT64 elapsed = TraceMicrosSince(start);
+        if(elapsed >= micros)
+        {
+            return;
+        }
+        // Sleep is only accurate to a few milliseconds, spin for the rest
+        UINT64 remaining = micros - elapsed;
+        Sleep((remaining > 3000) ? (DWORD)(remaining / 1000) - 2 : 0);
+    }
+}
+
+int TraceStart(const char* path)
+{
+    traceFile = fopen(path, "wb");
+    if(!traceFile)
+    {
+        LOG_ERROR("[TRACE] can't open '%s' for writing", path);
+        return 1;
+    }
+    setvbuf(traceFile, NULL, _IOFBF, TRACE_WRITE_BUFFER_SIZE);
+    UINT header[2] = {TRACE_VERSION, 0};
+    if(fwrite(TRACE_MAGIC, 1, 8, traceFile) != 8 || fwrite(header, sizeof(header), 1, traceFile) != 1)
+    {
+        LOG_ERROR("[TRACE] writing '%s' failed", path);
+        fclose(traceFile);
+        return 1;
+    }
+    traceStart = TraceClock();
+    traceFlushTickCount = GetTickCount();
+    traceEnabled = true;
+    LOG("[TRACE] recording received records to '%s'", path);
+    return 0;
+}
+
+void TraceRecord(UINT connection, char* record, UINT length)
+{
+    TraceRecordHeader header;
+    header.time = TraceMicrosSince(traceStart);
+    header.connection = connection;
+    header.length = length;
+    if(fwrite(&header, sizeof(header), 1, traceFile) != 1 || fwrite(record, 1, length, traceFile) != length)
+    {
+        LOG_ERROR("[TRACE] writing the trace failed, tracing stopped");
+        fclose(traceFile);
+        traceEnabled = false;
+        return;
+    }
+    DWORD now = GetTickCount();
+    if(now - traceFlushTickCount >= TRACE_FLUSH_INTERVAL)
+    {
+        fflush(traceFile);
+        traceFlushTickCount = now;
+    }
+}
+
+int TraceReaderOpen(TraceReader* reader, const char* path)
+{
+    memset(reader, 0, sizeof(TraceReader));
+    reader->file = fopen(path, "rb");
+    if(!reader->file)
+    {
+        LOG_ERROR("[TRACE] can't open '%s'", path);
+        return 1;
+    }
+    char magic[8];
+    UINT header[2];
+    if(fread(magic, 1, 8, reader->file) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+       fread(header, sizeof(header), 1, reader->file) != 1)
+    {
+        LOG_ERROR("[TRACE] '%s' is not a trace", path);
+        fclose(reader->file);
+        return 1;
+    }
+    if(header[0] != TRACE_VERSION)
+    {
+        LOG_ERROR("[TRACE] '%s' is version %u (expected %u)", path, header[0], TRACE_VERSION);
+        fclose(reader->file);
+        return 1;
+    }
+    return 0;
+}
+
+int TraceReaderNext(TraceReader* reader, TraceRecordHeader* header)
+{
+    size_t read = fread(header, 1, sizeof(TraceRecordHeader), reader->file);
+    if(read == 0)
+    {
+        return 0;
+    }
+    if(read != sizeof(TraceRecordHeader) || header->length < 4 || header->length > TRACE_MAX_RECORD)
+    {
+        LOG_ERROR("[TRACE] bad record header");
+        return -1;
+    }
+    if(header->length > reader->capacity)
+    {
+        free(reader->record);
+        reader->record = (char*)malloc(header->length);
+        if(!reader->record)
+        {
+            reader->capacity = 0;
+            LOG_ERROR("[TRACE] out of memory for a %u byte record", header->length);
+            return -1;
+        }
+        reader->capacity = header->length;
+    }
+    if(fread(reader->record, 1, header->length, reader->file) != header->length)
+    {
+        LOG_ERROR("[TRACE] the trace ends in the middle of a record");
+        return -1;
+    }
+    return 1;
+}
+
+void TraceReaderClose(TraceReader* reader)
+{
+    fclose(reader->file);
+    free(reader->record);
+    reader->record = NULL;
+    reader->capacity = 0;
+}
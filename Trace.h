@@ -0,0 +1,70 @@
+#pragma once
+
+//
+// RPC Trace
+// --------------------------------------------------------
+// With the TraceFile setting every record the server receives is appended
+// to a trace file, along with when it arrived and which connection it
+// arrived on.  A trace can be replayed to turn a real workload into a
+// repeatable benchmark:
+//
+//   WindowsNfsServer <config-file> replay <trace-file> [fast]
+//       feeds every record into HandleRpcCommand in the server process, no
+//       sockets are involved and replies are dropped
+//   NfsTester replay <trace-file> [-server <ipv4-address>] [-fast]
+//       sends every record to a server over TCP, one connection for every
+//       connection in the trace
+//
+// Records are replayed at the pace they were recorded, or as fast as
+// possible with fast.  File handles are assigned in the order the server
+// first sees each path, so a trace should be replayed against a freshly
+// started server with the same shares as the one that recorded it.
+//
+// File format (numbers are little endian):
+//   header   "RPCTRACE", version (uint32), 0 (uint32)
+//   records  TraceRecordHeader, then the record including its record marker
+//
+#define TRACE_MAGIC   "RPCTRACE"
+#define TRACE_VERSION 1
+
+// Largest record a trace reader accepts
+#define TRACE_MAX_RECORD (64*1024*1024)
+
+struct TraceRecordHeader
+{
+    UINT64 time;     // microseconds since the trace started
+    UINT connection; // the id of the connection it was received on
+    UINT length;     // including the record marker
+};
+
+// True once TraceStart succeeds
+extern bool traceEnabled;
+
+// Returns: non-zero on error
+int TraceStart(const char* path);
+
+// Appends a record to the trace, the caller checks traceEnabled first
+// Note: only called from the select thread
+void TraceRecord(UINT connection, char* record, UINT length);
+
+struct TraceReader
+{
+    FILE* file;
+    char* record; // the last record that was read
+    UINT capacity;
+};
+
+// Returns: non-zero on error
+int TraceReaderOpen(TraceReader* reader, const char* path);
+
+// Reads the next record into reader->record
+// Returns: 1 if a record was read, 0 at the end of the trace, -1 on error
+int TraceReaderNext(TraceReader* reader, TraceRecordHeader* header);
+
+void TraceReaderClose(TraceReader* reader);
+
+// Returns: the current time for TraceWait
+INT64 TraceClock();
+
+// Waits until micros have passed since start (from TraceClock)
+void TraceWait(INT64 start, UINT64 micros);
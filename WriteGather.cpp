@@ -0,0 +1,196 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Common.h"
+#include "BufferPool.h"
+#include "WriteGather.h"
+
+static UINT gatherBufferSize;
+static UINT gatherMemoryLimit;
+static DWORD gatherDelay;
+static WriteGatherFlushed gatherFlushed;
+
+// Gathers holding data, oldest first
+static WriteGather* oldestGather = NULL;
+static WriteGather* newestGather = NULL;
+static UINT gatherMemoryUsed = 0;
+
+WriteGatherStats writeGatherStats;
+
+void WriteGatherInit(UINT bufferSize, UINT memoryLimit, DWORD delayMillis, WriteGatherFlushed flushed)
+{
+    gatherBufferSize = bufferSize;
+    gatherMemoryLimit = memoryLimit;
+    gatherDelay = delayMillis;
+    gatherFlushed = flushed;
+    LOG("[GATHER] %u byte buffers, %u bytes max, %u ms delay", bufferSize, memoryLimit, delayMillis);
+}
+
+WriteGather* WriteGatherCreate(HANDLE file, void* context)
+{
+    WriteGather* gather = (WriteGather*)malloc(sizeof(WriteGather));
+    if(gather)
+    {
+        memset(gather, 0, sizeof(WriteGather));
+        gather->file = file;
+        gather->context = context;
+    }
+    return gather;
+}
+
+DWORD WriteGatherFlush(WriteGather* gather)
+{
+    if(gather->length == 0)
+    {
+        return 0;
+    }
+
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset     = (DWORD)gather->offset;
+    overlapped.OffsetHigh = (DWORD)(gather->offset >> 32);
+    DWORD written;
+    DWORD error = 0;
+    if(!WriteFile(gather->file, gather->buffer, gather->length, &written, &overlapped))
+    {
+        error = GetLastError();
+        LOG_ERROR("[GATHER] WriteFile of %u bytes at %llu failed (e=%d)", gather->length,
+            (unsigned long long)gather->offset, error);
+        gather->error = error;
+    }
+    writeGatherStats.flushes++;
+    writeGatherStats.bytes += gather->length;
+    if(gatherFlushed)
+    {
+        gatherFlushed(gather->context, gather->offset, gather->length);
+    }
+
+    // Remove it from the list of gathers holding data
+    if(gather->olderGather)
+    {
+        gather->olderGather->newerGather = gather->newerGather;
+    }
+    else
+    {
+        oldestGather = gather->newerGather;
+    }
+    if(gather->newerGather)
+    {
+        gather->newerGather->olderGather = gather->olderGather;
+    }
+    else
+    {
+        newestGather = gather->olderGather;
+    }
+    gather->olderGather = NULL;
+    gather->newerGather = NULL;
+
+    BufferPoolFree(gather->buffer, gatherBufferSize);
+    gatherMemoryUsed -= gatherBufferSize;
+    gather->buffer = NULL;
+    gather->length = 0;
+    return error;
+}
+
+int WriteGatherAdd(WriteGather* gather, UINT64 offset, char* data, UINT count)
+{
+    if(gather->length > 0 &&
+       (offset != gather->offset + gather->length || gather->length + count > gatherBufferSize))
+    {
+        WriteGatherFlush(gather);
+    }
+    if(count >= gatherBufferSize)
+    {
+        return 1; // gathering it wouldn't save anything
+    }
+
+    if(gather->length == 0)
+    {
+        // Make room under the memory limit by writing out the oldest data
+        while(gatherMemoryUsed + gatherBufferSize > gatherMemoryLimit && oldestGather)
+        {
+            LOG_DEBUG("[GATHER] memory limit reached, writing the oldest gathered data");
+            WriteGatherFlush(oldestGather);
+        }
+        if(gatherMemoryUsed + gatherBufferSize > gatherMemoryLimit)
+        {
+            return 1;
+        }
+        gather->buffer = BufferPoolAlloc(gatherBufferSize);
+        if(!gather->buffer)
+        {
+            return 1;
+        }
+        gatherMemoryUsed += gatherBufferSize;
+        gather->offset = offset;
+        gather->startTickCount = GetTickCount();
+
+        gather->olderGather = newestGather;
+        gather->newerGather = NULL;
+        if(newestGather)
+        {
+            newestGather->newerGather = gather;
+        }
+        else
+        {
+            oldestGather = gather;
+        }
+        newestGather = gather;
+    }
+
+    memcpy(gather->buffer + gather->length, data, count);
+    gather->length += count;
+    writeGatherStats.writes++;
+
+    if(gather->length == gatherBufferSize)
+    {
+        WriteGatherFlush(gather);
+    }
+    return 0;
+}
+
+DWORD WriteGatherTakeError(WriteGather* gather)
+{
+    DWORD error = gather->error;
+    gather->error = 0;
+    return error;
+}
+
+bool WriteGatherPending()
+{
+    return oldestGather != NULL;
+}
+
+bool WriteGatherFlushExpired()
+{
+    DWORD now = GetTickCount();
+    // The list is oldest first, so stop at the first gather that hasn't expired
+    while(oldestGather && now - oldestGather->startTickCount >= gatherDelay)
+    {
+        WriteGatherFlush(oldestGather);
+    }
+    return oldestGather != NULL;
+}
+
+void WriteGatherFlushAll()
+{
+    while(oldestGather)
+    {
+        WriteGatherFlush(oldestGather);
+    }
+}
+
+void WriteGatherLogStats()
+{
+    if(writeGatherStats.flushes == 0)
+    {
+        return;
+    }
+    LOG("[GATHER] %llu writes in %llu WriteFile calls (%llu saved), average write %llu bytes",
+        writeGatherStats.writes, writeGatherStats.flushes,
+        writeGatherStats.writes - writeGatherStats.flushes,
+        writeGatherStats.bytes / writeGatherStats.flushes);
+}
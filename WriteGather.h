@@ -0,0 +1,81 @@
+#pragma once
+
+//
+// Write Gathering
+// --------------------------------------------------------
+// Clients usually send a large file as many sequential UNSTABLE writes of
+// 32-64 KB.  Instead of writing each one to the file as it arrives, the
+// writes for a file are copied into a gather buffer as long as each one
+// starts where the last one ended, and the whole range is written to the
+// file with a single WriteFile.
+//
+// Gathered data is written out when:
+//   - the next write for the file isn't contiguous or doesn't fit
+//   - the buffer is full
+//   - it has been held longer than the gather delay
+//   - another file needs a buffer and the memory limit is reached
+//   - the file is committed or its attributes are read
+//
+// Errors from writing gathered data are kept and reported by the next COMMIT.
+// Every time gathered data is written out (or fails to be) the flushed
+// callback is told its range, so anything that caches the file's data can
+// drop what the write changed.
+//
+// NOTE: the functions in this file are only called from the select thread
+//
+struct WriteGather
+{
+    HANDLE file;
+    char* buffer; // taken from the buffer pool while data is gathered, NULL otherwise
+    UINT64 offset;
+    UINT length;
+    DWORD startTickCount; // when the oldest gathered write arrived
+    DWORD error; // the last failed write, reported by the next COMMIT
+    void* context; // passed to the flushed callback
+    WriteGather* olderGather;
+    WriteGather* newerGather;
+};
+
+struct WriteGatherStats
+{
+    UINT64 writes;   // client writes that were gathered
+    UINT64 flushes;  // WriteFile calls for gathered data
+    UINT64 bytes;    // bytes written from gather buffers
+};
+extern WriteGatherStats writeGatherStats;
+
+// Called after the gathered data of length bytes at offset was written to
+// the file, or failed to be
+typedef void (*WriteGatherFlushed)(void* context, UINT64 offset, UINT length);
+
+// bufferSize must be a buffer pool size
+// flushed: NULL if nothing needs to know about flushes
+void WriteGatherInit(UINT bufferSize, UINT memoryLimit, DWORD delayMillis, WriteGatherFlushed flushed);
+
+// context: passed to the flushed callback for this file's flushes
+// Returns: a gather for file, NULL if out of memory
+WriteGather* WriteGatherCreate(HANDLE file, void* context);
+
+// Returns: 0 if the data was gathered, non-zero if the caller must write the
+//          data to the file itself (any data that was gathered before is
+//          written to the file first, so the caller's write lands after it)
+int WriteGatherAdd(WriteGather* gather, UINT64 offset, char* data, UINT count);
+
+// Writes any gathered data to the file
+// Returns: 0 on success, otherwise the error from WriteFile
+DWORD WriteGatherFlush(WriteGather* gather);
+
+// Returns: the error from the last failed write of gathered data (and
+//          clears it), 0 if none failed
+DWORD WriteGatherTakeError(WriteGather* gather);
+
+// Returns: true if any file has gathered data
+bool WriteGatherPending();
+
+// Writes the gathered data that has been held longer than the gather delay
+// Returns: true if any file still has gathered data
+bool WriteGatherFlushExpired();
+
+void WriteGatherFlushAll();
+
+void WriteGatherLogStats();
@@ -1,11 +1,14 @@
-@if not exist bin mkdir bin
-cl /Febin\WindowsNfsServer.exe /I. /D_MBCS /DLITTLE_ENDIAN ws2_32.lib SelectServer.cpp Rpc.cpp NfsServer.cpp Main.cpp
-@if errorlevel 1 goto BUILD_FAILED
-
-@echo BUILD SUCCESS
-@goto EXIT
-
-:BUILD_FAILED
-@echo BUILD FAILED
-
+@if not exist bin mkdir bin
+@rem "build debug" builds with the debug CRT, which counts heap calls made while handling calls
+@set FLAGS=
+@if "%1"=="debug" set FLAGS=/MTd /D_DEBUG /Zi
+cl /Febin\WindowsNfsServer.exe /I. /D_MBCS /DLITTLE_ENDIAN %FLAGS% ws2_32.lib advapi32.lib Log.cpp SelectServer.cpp Rpc.cpp BufferPool.cpp Arena.cpp Config.cpp DirEnum.cpp GroupCommit.cpp WriteGather.cpp BlockCache.cpp ReadAhead.cpp SparseMap.cpp IoPool.cpp Stats.cpp LoopMonitor.cpp Scheduler.cpp Span.cpp Trace.cpp NfsServer.cpp Main.cpp
+@if errorlevel 1 goto BUILD_FAILED
+
+@echo BUILD SUCCESS
+@goto EXIT
+
+:BUILD_FAILED
+@echo BUILD FAILED
+
 :EXIT
\ No newline at end of file
@@ -1,11 +1,11 @@
-@if not exist bin mkdir bin
-cl /Febin\NfsTester.exe /I. /Ox /D_MBCS /DLITTLE_ENDIAN ws2_32.lib Rpc.cpp Test.cpp
-@if errorlevel 1 goto BUILD_FAILED
-
-@echo BUILD SUCCESS
-@goto EXIT
-
-:BUILD_FAILED
-@echo BUILD FAILED
-
+@if not exist bin mkdir bin
+cl /Febin\NfsTester.exe /I. /Ox /D_MBCS /DLITTLE_ENDIAN ws2_32.lib advapi32.lib Log.cpp Rpc.cpp BufferPool.cpp DirEnum.cpp SparseMap.cpp Trace.cpp Stats.cpp LoopMonitor.cpp Scheduler.cpp ReadAhead.cpp WriteGather.cpp SelectServer.cpp Test.cpp
+@if errorlevel 1 goto BUILD_FAILED
+
+@echo BUILD SUCCESS
+@goto EXIT
+
+:BUILD_FAILED
+@echo BUILD FAILED
+
 :EXIT
\ No newline at end of file